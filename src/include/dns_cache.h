@@ -14,7 +14,8 @@
 #define MAX_SIZE 8000
 
 typedef struct dns_cache_entry_s {
-    // this is the domain(string)->expiry (timestamp + ttl, uint32_t) mapping
+    // this is the domain(string)->expiry (timestamp + ttl, uint32_t) mapping;
+    // the domains are interned (see intern.h)
     tree_t* domains;
 } dns_cache_entry_t;
 
@@ -0,0 +1,93 @@
+#ifndef SPIN_DOMTRIE_H
+#define SPIN_DOMTRIE_H 1
+
+/*
+ * Trie of domain names, by label from the right: www.example.com is
+ * stored under com, then example, then www. Everything under a given
+ * suffix is thus in one subtree, which makes it cheap to find or walk
+ * all names under, say, example.com.
+ *
+ * Every name in the trie has an item. A name starting with the label
+ * "*" is a wildcard: it is stored as an item of the name without that
+ * label, for everything below it (so *.example.com covers
+ * www.example.com and a.b.example.com, but not example.com itself).
+ *
+ * Names are in presentation format (as made by dns_dname2str()), with
+ * or without the trailing dot, and compared case-insensitively; the
+ * labels are interned (see intern.h). Names given back by the trie are
+ * in lower case, with the trailing dot.
+ */
+
+#include <stddef.h>
+
+#include "tree.h"
+
+// longest name, in presentation format, that fits in the trie
+#define DOMTRIE_MAX_NAME 1024
+
+typedef struct domtrie_node_s {
+    struct domtrie_node_s* parent;      // NULL for the root
+    const char* label;                  // interned, NULL for the root
+    // keyed by label, the data is a pointer to the child node; NULL if
+    // the node has no children
+    tree_t* children;
+    void* item;                         // item of the name itself
+    void* wildcard;                     // item of *.name
+    size_t count;                       // items in this subtree
+} domtrie_node_t;
+
+typedef struct {
+    domtrie_node_t root;
+} domtrie_t;
+
+/*
+ * Called for every name when walking the trie; the trie must not be
+ * changed during the walk
+ */
+typedef void (*domtrie_func)(const char* name, void* item, void* arg);
+
+domtrie_t* domtrie_create(void);
+void domtrie_destroy(domtrie_t* trie);
+
+/*
+ * Sets the item of name (which must not be NULL)
+ * Returns 1 if the name is new, 0 if its item was replaced, and -1 if
+ * the name is not valid
+ */
+int domtrie_add(domtrie_t* trie, const char* name, void* item);
+
+/*
+ * Removes name from the trie
+ * Returns its item, or NULL if it was not there
+ */
+void* domtrie_remove(domtrie_t* trie, const char* name);
+
+/*
+ * Returns the item of exactly this name, or NULL; wildcards are only
+ * found by their own name (*.example.com)
+ */
+void* domtrie_find(domtrie_t* trie, const char* name);
+
+/*
+ * Returns the item of the name if it is in the trie, or else that of
+ * the closest wildcard that covers it, or NULL if there is neither.
+ * This is a membership test for a list of names and wildcards, in a
+ * number of steps that depends only on the number of labels of name.
+ */
+void* domtrie_match(domtrie_t* trie, const char* name);
+
+/*
+ * Number of names under suffix: the suffix itself and everything below
+ * it, or, for a wildcard suffix, only what is below it. The count for
+ * "." is the size of the trie.
+ */
+size_t domtrie_count(domtrie_t* trie, const char* suffix);
+
+/*
+ * Calls func for every name that domtrie_count() counts, in
+ * alphabetical order of their reversed labels; returns the number of
+ * names
+ */
+size_t domtrie_walk(domtrie_t* trie, const char* suffix, domtrie_func func, void* arg);
+
+#endif // SPIN_DOMTRIE_H
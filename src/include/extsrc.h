@@ -26,17 +26,69 @@ uint8_t extsrc_af_from_wire(uint8_t);
  * MESSAGE TYPE-SPECIFIC #define'S AND STRUCTURES
  */
 
+/*
+ * Version of the wire format, sent in every message header; messages with
+ * another version are rejected
+ */
+#define EXTSRC_VERSION 2
+
 /*
  * Message types
+ *
+ * The payloads are packed: there is no padding, all integers are
+ * little-endian, and counters are varints (7 bits per byte, least
+ * significant group first, high bit set on all but the last byte).
+ * An address is a family byte (EXTSRC_AF_INET or EXTSRC_AF_INET6)
+ * followed by 4 or 16 bytes; a name is a length byte followed by that
+ * many bytes (no NUL terminator).
+ *
+ * The payloads of the record types 1 to 4 start with the time of the event
+ * (a varint, in microseconds since the epoch), e.g. the capture time of the
+ * packet it was derived from; EXTSRC_TIMESTAMP_NONE if the client does not
+ * know it, in which case spind uses the time of arrival.
+ */
+#define EXTSRC_TIMESTAMP_NONE 0
+
+/*
+ * Payload consists of (pkt_info_t): timestamp, family (1 byte), protocol
+ * (1), source address, destination address (same family, so without the
+ * family byte), source port (2), destination port (2), icmp_type (1), and
+ * the varints payload_size, packet_count and payload_offset
  */
-/* Payload consists of: pkt_info_t */
 #define EXTSRC_MSG_TYPE_PKT_INFO 1
-/* Payload consists of: struct dns_query_hdr followed by dns_pkt_info_t */
+/*
+ * Payload consists of: timestamp, the query source address (struct
+ * extsrc_dns_query_hdr), followed by a DNS record as below (without its
+ * timestamp)
+ */
 #define EXTSRC_MSG_TYPE_DNS_QUERY 2
-/* Payload consists of: dns_pkt_info_t */
+/*
+ * Payload consists of (dns_pkt_info_t): timestamp, address, ttl (varint),
+ * and the dname (a name, in DNS wire format)
+ */
 #define EXTSRC_MSG_TYPE_DNS_ANSWER 3
-/* Payload consists of: struct extsrc_arp_table_update */
+/*
+ * Payload consists of (struct extsrc_arp_table_update): timestamp, the mac
+ * (a name), and the IP address, followed by its netmask (1)
+ */
 #define EXTSRC_MSG_TYPE_ARP_TABLE_UPDATE 4
+/*
+ * Payload consists of: a sequence of complete messages (each with its own
+ * header) of any of the types above; batches cannot be nested
+ */
+#define EXTSRC_MSG_TYPE_BATCH 5
+/*
+ * Payload consists of: struct extsrc_ring_setup (see extsrc_ring.h), as is;
+ * only on the UNIX domain socket, with the file descriptors of the ring
+ * attached
+ */
+#define EXTSRC_MSG_TYPE_RING 6
+
+/*
+ * Maximum payload length of a single message, and of a batch message
+ */
+#define EXTSRC_MSG_MAX 1024
+#define EXTSRC_BATCH_MAX 16384
 
 /*
  * Additional information for the MSG_TYPE_DNS_QUERY message type.
@@ -65,13 +117,22 @@ struct extsrc_arp_table_update {
 /******************************************************************************/
 
 /*
- * Header that will be prepended to the payload.
+ * Header that will be prepended to the payload. On the wire, it takes
+ * EXTSRC_MSG_HDR_SIZE bytes: the type (1 byte), the version (1), two
+ * reserved bytes (0) and the length (4, little-endian). Use
+ * extsrc_hdr_write() and extsrc_hdr_read() to convert it.
  */
 struct extsrc_msg_hdr {
-    uint32_t type; /* Message type (see above) */
+    uint8_t type; /* Message type (see above) */
+    uint8_t version; /* EXTSRC_VERSION */
     uint32_t length; /* Length of the payload (i.e. without this header) */
 };
 
+#define EXTSRC_MSG_HDR_SIZE 8
+
+void extsrc_hdr_write(char *buf, uint8_t type, uint32_t length);
+void extsrc_hdr_read(const char *buf, struct extsrc_msg_hdr *hdr);
+
 /*
  * Structure that will be returned to callers of the extsrc_msg_create*()
  * functions. Can be freed with extsrc_msg_free();
@@ -94,19 +155,64 @@ struct extsrc_msg {
  *
  * Parameters (other functions):
  *  <parameters specific to the message type>
+ *  timestamp: time of the event in microseconds since the epoch, or
+ *   EXTSRC_TIMESTAMP_NONE.
  *
  * Generally, there is no need to use the extsrc_msg_create(); instead, the
  * function for a specific message type should be used.
  */
 struct extsrc_msg *extsrc_msg_create(char *payload, uint32_t payload_len,
     uint32_t msg_type);
-struct extsrc_msg *extsrc_msg_create_pkt_info(pkt_info_t *pkt);
+struct extsrc_msg *extsrc_msg_create_pkt_info(pkt_info_t *pkt,
+    uint64_t timestamp);
 struct extsrc_msg *extsrc_msg_create_dns_query(dns_pkt_info_t *dns_pkt,
-    int family, uint8_t *src_addr);
-struct extsrc_msg *extsrc_msg_create_dns_answer(dns_pkt_info_t *dns_pkt);
+    int family, uint8_t *src_addr, uint64_t timestamp);
+struct extsrc_msg *extsrc_msg_create_dns_answer(dns_pkt_info_t *dns_pkt,
+    uint64_t timestamp);
 struct extsrc_msg
-    *extsrc_msg_create_arp_table_update(struct extsrc_arp_table_update *up);
+    *extsrc_msg_create_arp_table_update(struct extsrc_arp_table_update *up,
+    uint64_t timestamp);
 
 void extsrc_msg_free(struct extsrc_msg *msg);
 
+/*
+ * The extsrc_msg_read_*() functions decode the payload of a message of the
+ * corresponding type. All fields of the result are set (unused bytes are
+ * zeroed), address families are converted back from their wire values, and
+ * names are NUL-terminated. The timestamp of the event is stored in
+ * *timestamp.
+ *
+ * Return 0 on success, or -1 if the payload is invalid.
+ */
+int extsrc_msg_read_pkt_info(const char *payload, uint32_t len,
+    pkt_info_t *pkt, uint64_t *timestamp);
+int extsrc_msg_read_dns_query(const char *payload, uint32_t len,
+    struct extsrc_dns_query_hdr *hdr, dns_pkt_info_t *dns_pkt,
+    uint64_t *timestamp);
+int extsrc_msg_read_dns_answer(const char *payload, uint32_t len,
+    dns_pkt_info_t *dns_pkt, uint64_t *timestamp);
+int extsrc_msg_read_arp_table_update(const char *payload, uint32_t len,
+    struct extsrc_arp_table_update *up, uint64_t *timestamp);
+
+/*
+ * Batches collect messages so that they can be sent to the socket as one
+ * EXTSRC_MSG_TYPE_BATCH message, instead of one by one.
+ */
+struct extsrc_batch {
+    char data[EXTSRC_MSG_HDR_SIZE + EXTSRC_BATCH_MAX];
+    size_t length; /* Length of the data in bytes, including the header */
+    unsigned int count; /* Number of messages in the batch */
+};
+
+/*
+ * Empties the batch
+ */
+void extsrc_batch_init(struct extsrc_batch *batch);
+
+/*
+ * Appends a copy of the message to the batch.
+ * Returns 0 on success, or -1 if the message does not fit in the batch.
+ */
+int extsrc_batch_add(struct extsrc_batch *batch, struct extsrc_msg *msg);
+
 #endif
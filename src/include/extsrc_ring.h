@@ -0,0 +1,150 @@
+#ifndef INCLUDE_EXTSRC_RING_H
+#define INCLUDE_EXTSRC_RING_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "extsrc.h"
+
+/*
+ * Shared-memory transport for extsrc messages
+ *
+ * A single-producer single-consumer ring of fixed-size slots in a shared
+ * memory object (memfd), shared between an extsrc client (the producer) and
+ * spind (the consumer). Every slot holds one message: the message header
+ * followed by the payload. Since there are no system calls per message,
+ * there is no need for batches.
+ *
+ * The producer creates the ring and passes its file descriptor, together
+ * with an eventfd, to spind in an EXTSRC_MSG_TYPE_RING message over the
+ * UNIX domain socket. The eventfd is only used for wakeups: before spind
+ * goes to sleep on an empty ring, it sets the waiting flag in the ring
+ * header, and the producer only signals the eventfd if that flag is set.
+ * As long as spind keeps up, the messages are handed over without any
+ * system calls at all.
+ *
+ * Only available on systems that have eventfd (HAVE_SYS_EVENTFD_H).
+ * The memfd is sealed, so that the producer cannot make it smaller
+ * while spind has it mapped; without memfd sealing, rings cannot be
+ * created, and spind does not accept them.
+ */
+
+#define EXTSRC_RING_MAGIC 0x5350524e /* "SPRN" */
+#define EXTSRC_RING_VERSION 1
+
+/*
+ * Size of a slot, including the message header; large enough for all
+ * message types except batches (which are never put in a ring).
+ */
+#define EXTSRC_RING_SLOT_SIZE 512
+/* Default number of slots (must be a power of two); 4 MiB in total */
+#define EXTSRC_RING_SLOTS 8192
+
+/*
+ * Header at the start of the shared memory. The producer and consumer
+ * positions are kept on separate cache lines.
+ */
+struct extsrc_ring_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    uint32_t slots;
+    int32_t producer_pid;
+    uint32_t closed; /* set by the producer when it stops */
+
+    /* Written by the producer only */
+    uint64_t head __attribute__((aligned(64))); /* slots published */
+    uint64_t dropped; /* messages that did not fit in the ring */
+
+    /* Written by the consumer (waiting also by the producer) */
+    uint64_t tail __attribute__((aligned(64))); /* slots consumed */
+    uint32_t waiting; /* consumer is waiting for the eventfd */
+} __attribute__((aligned(64)));
+
+/*
+ * Payload structure for the EXTSRC_MSG_TYPE_RING message type. The message
+ * carries the ring's memory fd and eventfd (in that order) as SCM_RIGHTS
+ * ancillary data.
+ */
+struct extsrc_ring_setup {
+    uint32_t version; /* EXTSRC_RING_VERSION */
+    uint32_t size; /* Size of the shared memory in bytes */
+};
+
+/*
+ * Process-local view of a ring
+ */
+struct extsrc_ring {
+    struct extsrc_ring_hdr *hdr;
+    char *slots;
+    size_t size; /* Size of the mapping */
+    uint32_t mask;
+    int mem_fd;
+    int event_fd;
+    /* Local copies of the positions, to avoid touching the other side's
+     * cache line for every message */
+    uint64_t head;
+    uint64_t tail;
+};
+
+/*
+ * Producer: creates a new ring with the given number of slots (a power of
+ * two). Returns NULL on failure, with errno set (ENOSYS if the system
+ * has no sealable memfds).
+ */
+struct extsrc_ring *extsrc_ring_create(uint32_t slots);
+
+/*
+ * Consumer: maps the ring that was received from a producer, and takes over
+ * both file descriptors (also on failure). size is the size the producer
+ * announced in its struct extsrc_ring_setup.
+ * Returns NULL if the ring is invalid or cannot be mapped, or if its
+ * memory is not sealed against shrinking.
+ */
+struct extsrc_ring *extsrc_ring_attach(int mem_fd, int event_fd, uint32_t size);
+
+/*
+ * Unmaps the ring and closes its file descriptors. When called by the
+ * producer, the ring is marked as closed and the consumer is woken up first.
+ */
+void extsrc_ring_destroy(struct extsrc_ring *ring, int producer);
+
+/*
+ * Producer: copies a message to the next free slot and publishes it.
+ * Returns 0 on success, or -1 with errno set to ENOBUFS if the ring is full
+ * or to EMSGSIZE if the message does not fit in a slot.
+ */
+int extsrc_ring_put(struct extsrc_ring *ring, struct extsrc_msg *msg);
+
+/*
+ * Producer: wakes up the consumer if it is waiting for new messages. Should
+ * be called after a number of messages have been put in the ring, and
+ * before waiting for the consumer when the ring is full.
+ */
+void extsrc_ring_wakeup(struct extsrc_ring *ring);
+
+/*
+ * Consumer: points *frame to the next message (header plus payload, at
+ * most slot_size bytes), without removing it from the ring.
+ * Returns 1 if there is a message, 0 if the ring is empty, and -1 if the
+ * ring is corrupt.
+ * The producer could still change the slot contents, so copy anything
+ * before validating it.
+ */
+int extsrc_ring_peek(struct extsrc_ring *ring, const char **frame);
+
+/*
+ * Consumer: removes the message returned by extsrc_ring_peek()
+ */
+void extsrc_ring_release(struct extsrc_ring *ring);
+
+/*
+ * Consumer: to be called when it stops reading from the ring. Resets the
+ * eventfd, and returns 1 if the ring is empty and the producer will signal
+ * the eventfd when it adds new messages. Returns 0 if there are still
+ * messages; the eventfd is then signalled right away, so that the consumer
+ * comes back for them.
+ */
+int extsrc_ring_idle(struct extsrc_ring *ring);
+
+#endif
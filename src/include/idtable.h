@@ -0,0 +1,72 @@
+#ifndef SPIN_IDTABLE_H
+#define SPIN_IDTABLE_H 1
+
+/*
+ * Table of items indexed by a small integer id, handed out by the
+ * table itself.
+ *
+ * The items are kept in a growable array of slots. An id is the slot
+ * number in its low IDTABLE_SLOT_BITS bits, and the generation of the
+ * slot above that; the generation is incremented whenever the slot is
+ * freed. A slot can thus be reused, while an id of an item that has
+ * been removed keeps referring to nothing (until the generation wraps,
+ * after IDTABLE_GENERATIONS reuses of that one slot). Freed slots are
+ * reused in the order they were freed, to make that take as long as
+ * possible.
+ *
+ * Ids are always greater than 0; the first ids handed out by a new
+ * table are 1, 2, 3, ...
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IDTABLE_SLOT_BITS   20
+#define IDTABLE_MAX_SLOTS   (1 << IDTABLE_SLOT_BITS)
+#define IDTABLE_GENERATIONS (1 << (31 - IDTABLE_SLOT_BITS))
+
+typedef struct {
+    void* item;                         // NULL if the slot is free
+    uint32_t generation;
+    uint32_t next_free;
+} idtable_slot_t;
+
+typedef struct {
+    idtable_slot_t* slots;
+    uint32_t allocated;
+    uint32_t used;                      // slots in use or on the free list
+    uint32_t free_head;                 // 0 if there are no free slots
+    uint32_t free_tail;
+    size_t size;                        // number of items
+} idtable_t;
+
+idtable_t* idtable_create(void);
+void idtable_destroy(idtable_t* table);
+
+/*
+ * Stores the item (which must not be NULL), and returns its new id,
+ * or 0 if the table is full
+ */
+int idtable_add(idtable_t* table, void* item);
+
+/*
+ * Returns the item with the given id, or NULL if there is none
+ */
+void* idtable_get(idtable_t* table, int id);
+
+/*
+ * Removes the item with the given id. Returns the item, or NULL if
+ * there was none.
+ */
+void* idtable_remove(idtable_t* table, int id);
+
+size_t idtable_size(idtable_t* table);
+
+/*
+ * Iterate over the ids of the items, in slot order: idtable_next()
+ * with id 0 gives the first id, and it returns 0 after the last one.
+ * The current item may be removed before asking for the next one.
+ */
+int idtable_next(idtable_t* table, int id);
+
+#endif // SPIN_IDTABLE_H
@@ -0,0 +1,61 @@
+#ifndef SPIN_INTERN_H
+#define SPIN_INTERN_H 1
+
+/*
+ * Interned domain names.
+ *
+ * The same domain name shows up in many places: in the domains of a
+ * node, in the domain index of the node cache, and in the dns cache
+ * entry of every address it resolved to. Instead of a separate copy in
+ * each, every distinct name is stored once, in a global table, and
+ * shared by reference count.
+ *
+ * Names are folded to lower case when they are interned, so two names
+ * that differ only in case give the same handle, and two handles are
+ * equal if and only if the pointers are. A handle is an ordinary
+ * NUL-terminated string, valid while there are references to it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tree.h"
+
+/*
+ * Returns the handle for str, adding it to the table if needed, and
+ * takes a reference to it
+ */
+const char* intern_str(const char* str);
+
+/*
+ * Returns the handle for str if it is interned, NULL if not; this does
+ * not take a reference
+ */
+const char* intern_find(const char* str);
+
+/*
+ * Takes another reference to, or releases a reference to, a handle
+ */
+const char* intern_ref(const char* handle);
+void intern_unref(const char* handle);
+
+/*
+ * The hash of the (case-folded) name, computed when it was interned
+ */
+uint32_t intern_hash(const char* handle);
+
+/*
+ * Number of distinct names in the table
+ */
+size_t intern_count(void);
+
+/*
+ * Creates a tree keyed by interned names: keys added to it with copy are
+ * interned (they need not be handles already), and released when they
+ * are removed. Lookups compare case-insensitively, and a handle is found
+ * with a single pointer compare once the search reaches it. The keys
+ * are ordered alphabetically.
+ */
+tree_t* intern_tree_create(void);
+
+#endif // SPIN_INTERN_H
@@ -0,0 +1,101 @@
+#ifndef SPIN_IPFEED_H
+#define SPIN_IPFEED_H 1
+
+/*
+ * Large, read-only sets of addresses and networks, such as the
+ * blocklists published as threat-intelligence feeds.
+ *
+ * A feed in text form (one address or address/netmask per line) is
+ * imported once into a compact index file: the entries are turned into
+ * address ranges, sorted, and overlapping or adjacent ranges are
+ * merged. IPv4 ranges are stored as pairs of uint32_t, IPv6 ranges as
+ * pairs of 128-bit values, each family in Eytzinger (breadth-first
+ * binary tree) order, so that a lookup is a branch-free walk down the
+ * array with the first levels sharing a few cache lines.
+ *
+ * The index file is used in place with mmap(); opening it costs no
+ * parsing or allocation, whatever the size of the feed. It is written
+ * in host byte order, and is not meant to be copied between machines.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+#define IPFEED_MAGIC        "SPINFEED"
+#define IPFEED_VERSION      1
+#define IPFEED_BYTE_ORDER   0x01020304
+
+typedef struct {
+    uint32_t end;
+    uint32_t start;
+} ipfeed_v4_range_t;
+
+typedef struct {
+    uint64_t end_hi;
+    uint64_t end_lo;
+    uint64_t start_hi;
+    uint64_t start_lo;
+} ipfeed_v6_range_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;                // IPFEED_BYTE_ORDER as written
+    uint64_t entries;                   // lines imported
+    uint64_t v4_count;                  // ranges
+    uint64_t v4_offset;
+    uint64_t v6_count;
+    uint64_t v6_offset;
+} ipfeed_header_t;
+
+typedef struct {
+    void* map;
+    size_t map_size;
+    size_t entries;
+    // Eytzinger order, 1-based: element 0 is unused, the children of
+    // element k are 2k and 2k + 1
+    const ipfeed_v4_range_t* v4;
+    size_t v4_count;
+    const ipfeed_v6_range_t* v6;
+    size_t v6_count;
+} ipfeed_t;
+
+/*
+ * Reads the feed in text form from textfile and writes its index to
+ * path (replacing it atomically). Empty lines, lines starting with '#'
+ * or ';', and anything after the address on a line are ignored; lines
+ * that do not start with an address are skipped.
+ * Returns the number of entries imported, or -1 on error.
+ */
+int ipfeed_import(const char* textfile, const char* path);
+
+/*
+ * Maps the index file at path. Returns NULL if it does not exist or is
+ * not a valid index (the latter is logged).
+ */
+ipfeed_t* ipfeed_open(const char* path);
+void ipfeed_close(ipfeed_t* feed);
+
+/*
+ * Returns 1 if the address (in ip_t format, see copy_ip_data()) falls
+ * within the feed, 0 if not
+ */
+int ipfeed_contains(ipfeed_t* feed, int family, const uint8_t* addr);
+
+/*
+ * Number of entries that were imported, and the number of prefixes
+ * (as passed to ipfeed_walk()) of the given family
+ */
+size_t ipfeed_entries(ipfeed_t* feed);
+size_t ipfeed_prefix_count(ipfeed_t* feed, int family);
+
+/*
+ * Calls func for the smallest set of prefixes that covers the ranges of
+ * the given family exactly, in order; for firewall rules and sets
+ */
+typedef void (*ipfeed_walk_func)(void* arg, const ip_t* prefix);
+void ipfeed_walk(ipfeed_t* feed, int family, ipfeed_walk_func func, void* arg);
+
+#endif // SPIN_IPFEED_H
@@ -5,21 +5,73 @@
  * Lowlevel functionality to manipulate lists of IP addresses
  */
 #include "spin_list.h"
+#include "iptrie.h"
+#include "journal.h"
+#include "ipfeed.h"
 
+/*
+ * Prefilter for lookups in a list, so that the usual answer (not on the
+ * list) does not need the trie. A bit is set for every IPv4 /16 that an
+ * entry overlaps, and for the (hashed) IPv6 /32 of every entry; an
+ * IPv6 network shorter than /32 makes every IPv6 lookup go to the trie.
+ * A clear bit means the address is certainly not on the list.
+ */
+#define IPL_FILTER_V4_BITS  65536
+#define IPL_FILTER_V6_BITS  16384
+
+struct ipl_filter {
+    uint64_t        v4[IPL_FILTER_V4_BITS / 64];
+    uint64_t        v6[IPL_FILTER_V6_BITS / 64];
+    int             v6_all;
+};
+
+/*
+ * A list holds single addresses as well as networks (address/netmask);
+ * an address is on the list if it falls within any of them, or within
+ * the imported feed of the list, if it has one (see ipfeed.h).
+ */
 struct list_info {
-    tree_t *        li_tree;                 // Tree of IP addresses
+    iptrie_t *      li_trie;                 // IP addresses and networks
     char *          li_listname;             // Name of list
-    int             li_modified;             // File should be written
+    int             li_modified;             // Journal should be synced
+    journal_t *     li_journal;              // Changes since the snapshot
+    ipfeed_t *      li_feed;                 // Imported feed, or NULL
+    struct ipl_filter li_filter;             // Updated on every change
 };
 
+/*
+ * The lists are kept in <directory>/<name>.list, with a journal of the
+ * changes since (see journal.h), and the index of the feed of the list
+ * in <directory>/<name>.feed
+ */
+#define IPL_DIRECTORY "/etc/spin"
+void ipl_set_directory(const char* directory);
+
 char* ipl_filename(struct list_info *lip);
+char* ipl_feed_filename(struct list_info *lip);
 void init_ipl(struct list_info *lip);
 void init_all_ipl(struct list_info *ipl_list_ar);
+void clean_ipl(struct list_info *lip);
 void clean_all_ipl();
 void add_ip_to_li(ip_t* ip, struct list_info *lip);
 void add_ip_tree_to_li(tree_t* tree, struct list_info *lip);
 void remove_ip_tree_from_li(tree_t *tree, struct list_info *lip);
 void remove_ip_from_li(ip_t* ip, struct list_info *lip);
+int ipl_sync(struct list_info *lip);
+
+/*
+ * Replaces the feed of the list by the one in the given text file.
+ * Returns the number of entries, or -1 on error, in which case the
+ * list keeps its old feed.
+ */
+int ipl_load_feed(struct list_info *lip, const char* textfile);
+/*
+ * Maps the feed of the list again, after its index was replaced by
+ * another process (with ipfeed_import()). Returns the number of
+ * entries, or -1 on error, in which case the list keeps its old feed.
+ */
+int ipl_reopen_feed(struct list_info *lip);
+void ipl_clear_feed(struct list_info *lip);
 int ip_in_li(ip_t* ip, struct list_info* lip);
 int ip_in_ignore_list(ip_t* ip);
 int addr_in_ignore_list(int family, uint8_t* addr);
@@ -0,0 +1,86 @@
+#ifndef SPIN_IPTRIE_H
+#define SPIN_IPTRIE_H 1
+
+/*
+ * Set of IP prefixes (CIDR networks and single addresses), with
+ * longest-prefix lookup.
+ *
+ * This is a path-compressed binary radix trie, one per address family.
+ * Every node holds a prefix; nodes that only exist to join two subtrees
+ * are not part of the set. Adding, removing and looking up take at most
+ * one step per bit of the prefix.
+ *
+ * Prefixes are stored with their host bits cleared. A netmask of 0 is
+ * taken to mean a single address (32 for IPv4, 128 for IPv6), as in
+ * the rest of SPIN.
+ */
+
+#include "util.h"
+
+typedef struct iptrie_node_s {
+    ip_t prefix;
+    int bits;                           // length of the prefix in addr
+    int in_set;                         // 0 for the joining nodes
+    struct iptrie_node_s* parent;
+    struct iptrie_node_s* child[2];
+} iptrie_node_t;
+
+typedef struct {
+    iptrie_node_t* root[2];             // IPv4, IPv6
+    size_t size;
+} iptrie_t;
+
+iptrie_t* iptrie_create(void);
+void iptrie_destroy(iptrie_t* trie);
+void iptrie_clear(iptrie_t* trie);
+
+/*
+ * Returns 1 if the prefix was added, 0 if it was already there
+ */
+int iptrie_add(iptrie_t* trie, const ip_t* prefix);
+
+/*
+ * Removes exactly the given prefix; addresses within it remain covered
+ * by any shorter prefix in the set.
+ * Returns 1 if the prefix was removed, 0 if it was not there
+ */
+int iptrie_remove(iptrie_t* trie, const ip_t* prefix);
+
+/*
+ * Returns the longest prefix in the set that covers the given address
+ * (which is in ip_t format, see copy_ip_data()), or NULL if there is
+ * none. If netmask is not 0, the address is a network itself, and only
+ * prefixes of at most that length match.
+ */
+const ip_t* iptrie_match(iptrie_t* trie, int family, const uint8_t* addr, int netmask);
+
+/*
+ * Returns 1 if the set contains exactly the given prefix
+ */
+int iptrie_contains(iptrie_t* trie, const ip_t* prefix);
+
+size_t iptrie_size(iptrie_t* trie);
+
+/*
+ * Iterate over the prefixes in the set: IPv4 before IPv6, then by
+ * address, a network before the prefixes within it
+ */
+iptrie_node_t* iptrie_first(iptrie_t* trie);
+iptrie_node_t* iptrie_next(iptrie_t* trie, iptrie_node_t* current);
+
+/*
+ * Stores the prefixes in the given file, one per line; single addresses
+ * are written without a netmask, networks as address/netmask.
+ * Returns 1 on success, 0 on failure.
+ */
+int iptrie_store(iptrie_t* trie, const char* filename);
+void iptrie_write(iptrie_t* trie, FILE* out);
+
+/*
+ * Adds the prefixes in the given file, in the format of iptrie_store().
+ * Returns the number of prefixes read, or -1 if the file could not be
+ * opened.
+ */
+int iptrie_read(iptrie_t* trie, const char* filename);
+
+#endif // SPIN_IPTRIE_H
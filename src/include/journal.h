@@ -0,0 +1,90 @@
+#ifndef SPIN_JOURNAL_H
+#define SPIN_JOURNAL_H 1
+
+/*
+ * Persistent storage for sets of entries (IP lists, nodepairs) that
+ * change one entry at a time.
+ *
+ * The set is stored in a snapshot file, one entry per line, with next
+ * to it a journal (<snapshot>.journal) of the changes since: a line
+ * "+ <entry>" for every addition and "- <entry>" for every removal.
+ * A change only appends a line to the journal; the journal is flushed
+ * to disk with journal_sync(), so that a number of changes share one
+ * fsync. When the journal has grown larger than the snapshot, it is
+ * compacted: the whole set is written to a temporary file, which is
+ * then renamed over the snapshot, after which the journal is emptied.
+ *
+ * A crash leaves at worst an incomplete last journal line, which is
+ * ignored, or (between the rename and the truncation) a journal that
+ * has already been included in the snapshot; replaying its changes
+ * again gives the same set.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Journals smaller than this are not compacted
+#define JOURNAL_COMPACT_MIN 4096
+
+typedef struct {
+    char* path;                 // snapshot
+    char* journal_path;
+    int fd;                     // journal, opened for appending
+    size_t journal_size;
+    size_t snapshot_size;
+    int unsynced;               // changes not yet flushed to disk
+} journal_t;
+
+/*
+ * Called for every entry of the snapshot (with add 1), and for every
+ * change in the journal, in order
+ */
+typedef void (*journal_apply_func)(void* arg, int add, const char* entry);
+
+/*
+ * Writes all entries of the set to out, one per line
+ */
+typedef void (*journal_write_func)(void* arg, FILE* out);
+
+/*
+ * Reads the snapshot and journal at path. Returns the number of lines
+ * applied, or -1 if neither file exists.
+ */
+int journal_replay(const char* path, journal_apply_func apply, void* arg);
+
+/*
+ * Opens the journal of the snapshot at path for appending, creating it
+ * if needed. Returns NULL (and logs an error) if it cannot be opened.
+ */
+journal_t* journal_open(const char* path);
+
+/*
+ * Syncs and closes the journal
+ */
+void journal_close(journal_t* journal);
+
+/*
+ * Appends a change to the journal. Returns 1 on success, 0 on failure.
+ */
+int journal_append(journal_t* journal, int add, const char* entry);
+
+/*
+ * Flushes the changes appended since the last sync to disk, and compacts
+ * the journal if it has become too large. write_func is only called for
+ * the compaction. Returns 1 on success, 0 on failure.
+ */
+int journal_sync(journal_t* journal, journal_write_func write_func, void* arg);
+
+/*
+ * Replaces the snapshot with the set as written by write_func, and empties
+ * the journal. Returns 1 on success, 0 on failure (in which case the
+ * snapshot and journal are left as they were).
+ */
+int journal_compact(journal_t* journal, journal_write_func write_func, void* arg);
+
+/*
+ * Removes the snapshot and journal at path
+ */
+void journal_remove(const char* path);
+
+#endif // SPIN_JOURNAL_H
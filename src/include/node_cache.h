@@ -2,9 +2,12 @@
 #define SPIN_NODE_CACHE_H 1
 
 #include "util.h"
+#include "domtrie.h"
+#include "idtable.h"
 #include "spin_list.h"
 #include "pkt_info.h"
 #include "tree.h"
+#include "twheel.h"
 #include "arp.h"
 #include "node_names.h"
 
@@ -15,8 +18,6 @@ typedef struct {
     int     dvf_packets;
     int     dvf_bytes;
     uint32_t dvf_lastseen;
-    int     dvf_idleperiods;
-    int     dvf_activelastperiod;
 } devflow_t;
 
 typedef struct {
@@ -31,14 +32,18 @@ typedef struct {
 typedef struct {
     tree_t *dv_flowtree;
     int dv_nflows;
+    // the keys of the flows, by the time they were last active (see
+    // spinhook_clean())
+    twheel_t *dv_expiry;
 } device_t;
 
-typedef struct {
+typedef struct node_s {
     int id;
     // note: ip's are in a sizeof(ip_t)-byte format (family + ip, padded with 12 zeroes in case of ipv4)
     // they are stored in the keys, data is empty
     tree_t* ips;
-    // domains in string format, stored in the tree keys, with data empty
+    // domains in string format, stored in the tree keys (interned, see
+    // intern.h), with data empty
     tree_t* domains;
     // can be null
     char* name;
@@ -56,6 +61,11 @@ typedef struct {
     // and references of flows
     uint32_t references;
     device_t* device;
+    // place in the list of the node cache, least recently seen first,
+    // and the last_seen it was put there with (see node_cache_evict())
+    struct node_s* lru_prev;
+    struct node_s* lru_next;
+    uint32_t lru_time;
 } node_t;
 
 #define is_blocked is_onlist[IPLIST_BLOCK]
@@ -96,18 +106,29 @@ void node_print(node_t* node);
 unsigned int node2json(node_t* node, buffer_t* json_buf);
  */
 
+// the default of the node_cache_max_nodes setting
 #define MAX_NODES 2048
 
 typedef struct {
-    // this tree holds the actual memory structure, indexed by their id
-    tree_t* nodes;
+    // this table holds the actual memory structure, indexed by their
+    // id (see idtable.h); it also hands out the ids
+    idtable_t* nodes;
     // this is a non-memory tree, indexed by the ip addresses
     // unused, TODO, HvS
     tree_t* ip_refs;
     tree_t* domain_refs;
+    // the same domains, by label from the right, with the node as item
+    domtrie_t* domain_trie;
+    // the ids of the nodes, by the time they were last seen (see
+    // node_cache_expire())
+    twheel_t* expiry;
+    // all nodes, least recently seen first
+    node_t* lru_first;
+    node_t* lru_last;
+    // estimate of the memory used by the nodes, with their addresses
+    // and domains, in bytes
+    size_t footprint;
     tree_t* mac_refs;
-    // keep a counter for new ids
-    int available_id;
     // arp cache for mac lookups
     arp_table_t* arp_table;
     // names list as read from config files
@@ -121,6 +142,7 @@ typedef void (*cleanfunc)(node_cache_t *, node_t*, void *);
 
 void node_callback_new(node_cache_t *node_cache, modfunc);
 void node_callback_devices(node_cache_t *node_cache, cleanfunc, void *);
+const char* node_callback_devices_page(node_cache_t *node_cache, const char* after, int limit, cleanfunc, void *);
 
 void node_cache_update_arp(node_cache_t *node_cache, uint32_t timestamp);
 void node_cache_print(node_cache_t* node_cache);
@@ -147,8 +169,31 @@ node_t* node_cache_find_by_ip(node_cache_t* node_cache, ip_t* ip);
  */
 node_t* node_cache_find_by_domain(node_cache_t* node_cache, char* dname);
 node_t* node_cache_find_by_mac(node_cache_t* node_cache, char* macaddr);
+
+typedef void (*domainfunc)(node_cache_t *, node_t*, const char* domain, void *);
+
+/*
+ * Calls func for every domain under suffix (example.com. or
+ * *.example.com., see domtrie.h), with the node it belongs to; a node
+ * with several domains under suffix is passed once for each of them.
+ * Returns the number of domains.
+ */
+size_t node_cache_walk_domains(node_cache_t* node_cache, const char* suffix, domainfunc func, void* arg);
+/*
+ * Number of domains under suffix, without walking them
+ */
+size_t node_cache_count_domains(node_cache_t* node_cache, const char* suffix);
 node_t* node_cache_find_by_id(node_cache_t* node_cache, int node_id);
 
+/*
+ * Iterate over all nodes in the cache, in the order of the internal
+ * table (not that of the ids). To remove the current node, get the
+ * next one first.
+ */
+node_t* node_cache_first(node_cache_t* node_cache);
+node_t* node_cache_next(node_cache_t* node_cache, node_t* current);
+size_t node_cache_size(node_cache_t* node_cache);
+
 /**
  * Remove all entries from the node cache that have a last_seen value
  * that is smaller than the 'older_than' argument
@@ -157,6 +202,33 @@ node_t* node_cache_find_by_id(node_cache_t* node_cache, int node_id);
  */
 void node_cache_clean(node_cache_t* node_cache, uint32_t older_than);
 
+/*
+ * Does the same as node_cache_clean(), without walking the whole cache:
+ * only the nodes that were last seen before older_than when they were
+ * last looked at are looked at again. A node that is old enough, but is
+ * kept because it is a device or in use, is looked at again
+ * NODE_CACHE_RECHECK seconds later.
+ * If budget is not 0, at most that many nodes are looked at; the rest
+ * is done in the next call.
+ * Returns the number of nodes removed.
+ */
+#define NODE_CACHE_RECHECK 60
+size_t node_cache_expire(node_cache_t* node_cache, uint32_t older_than, size_t budget);
+
+/*
+ * Removes nodes until there are no more than max_nodes left (if that
+ * is not 0), least recently seen first. Only nodes that
+ * node_cache_clean() would remove are removed (no devices, and no
+ * nodes that are in use), so there may be more left; the ones that
+ * are kept go to the back of the list.
+ * If budget is not 0, at most that many nodes are looked at, so that
+ * a cache that is mostly in use is not walked as a whole; the next call
+ * goes on where this one stopped.
+ * Returns the number of nodes removed.
+ */
+size_t node_cache_evict(node_cache_t* node_cache, size_t max_nodes, size_t budget);
+size_t node_cache_footprint(node_cache_t* node_cache);
+
 /* convert pkt_info data to json using node information from the given node cache */
 
 
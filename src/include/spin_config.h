@@ -37,6 +37,9 @@ char *spinconfig_iptable_debug();
 // The time (in seconds) that node_cache entries
 // are kept after they have last been seen
 int spinconfig_node_cache_retain_time();
+// The number of nodes above which the least recently
+// seen ones are removed from the node_cache (0 for no limit)
+int spinconfig_node_cache_max_nodes();
 int spinconfig_dots_enabled();
 int spinconfig_dots_log_only();
 char *spinconfig_spinweb_pid_file();
@@ -45,4 +48,12 @@ int spinconfig_spinweb_port();
 char* spinconfig_spinweb_tls_certificate_file();
 char* spinconfig_spinweb_tls_key_file();
 char* spinconfig_spinweb_password_file();
+// Number of threads in the spinweb thread pool; 0 for a thread per
+// connection
+int spinconfig_spinweb_threads();
+int spinconfig_spinweb_max_connections();
+// Idle time (in seconds) after which spinweb closes a connection
+int spinconfig_spinweb_connection_timeout();
+// Network interface spinweb captures device traffic on; empty for all
+char* spinconfig_spinweb_capture_interface();
 #endif // SPIN_CONFIG_H
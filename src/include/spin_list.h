@@ -16,6 +16,11 @@
  *          but want one specific device to be able to contact it,
  *          you add the device's ips to 'allow'.
  *
+ * Each list may hold networks (e.g. 192.0.2.0/24 or 2001:db8::/48) as
+ * well as single addresses; an address is on a list if any entry
+ * covers it. The list files in /etc/spin have one entry per line, with
+ * a journal of the recent changes next to them (see journal.h).
+ *
  * Low-level functionality, such as manipulation of lists themselves,
  * is in ipl.[ch]. Please not that modifying these lists may require
  * some calls to the node_cache as well, since it has some information
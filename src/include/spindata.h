@@ -3,10 +3,17 @@
 #include "spindata_type.h"
 #include "node_cache.h"
 #include "tree.h"
+#include "iptrie.h"
+
+// Number of items in a page if the caller does not specify a limit,
+// and the maximum number of items in a single page
+#define SPIN_DATA_PAGE_DEFAULT  100
+#define SPIN_DATA_PAGE_MAX      1000
 
 spin_data spin_data_nodes_merged(int node1, int node2);
 spin_data spin_data_node_deleted(int node);
 spin_data spin_data_ipar(tree_t *iptree);
+spin_data spin_data_iptrie(iptrie_t *trie);
 spin_data spin_data_node(node_t* node);
 spin_data spin_data_pkt_info(node_cache_t* node_cache, pkt_info_t* pkt_info);
 spin_data spin_data_dns_query_pkt_info(node_cache_t* node_cache, dns_pkt_info_t* dns_pkt_info);
@@ -15,4 +22,6 @@ spin_data spin_data_create_traffic(node_cache_t* node_cache, flow_list_t* flow_l
 spin_data spin_data_nodepairtree(tree_t* tree);
 spin_data spin_data_devicelist(node_cache_t *node_cache);
 spin_data spin_data_flowlist(node_t *node);
+spin_data spin_data_devicelist_page(node_cache_t *node_cache, const char *after, int limit);
+spin_data spin_data_flowlist_page(node_t *node, const char *after, int limit);
 #endif
@@ -18,6 +18,9 @@ typedef struct tree_entry_s {
 typedef struct {
     tree_entry_t* root;
     int (*cmp_func)(size_t key_a_size, const void* key_a, size_t key_b_size, const void* key_b);
+    // see tree_set_key_funcs()
+    void* (*key_copy)(const void* key, size_t key_size);
+    void (*key_free)(void* key);
 } tree_t;
 
 tree_entry_t* tree_entry_create(size_t key_size, void* key, size_t data_size, void* data, int copy);
@@ -25,8 +28,17 @@ void tree_entry_destroy(tree_entry_t* tree_entry, int destroy_children);
 
 tree_t* tree_create(int (*cmp_func)(size_t key_a_size, const void* key_a, size_t key_b_size, const void* key_b));
 void tree_destroy(tree_t* tree);
+/*
+ * By default, tree_add() with copy makes a malloc'd copy of the key, which
+ * is freed with the entry. A tree whose keys are shared (such as interned
+ * strings, see intern.h) can replace both; key_copy is then called instead
+ * of the copy, and key_free for every key when its entry is removed, also
+ * for keys that were added without copy.
+ */
+void tree_set_key_funcs(tree_t* tree, void* (*key_copy)(const void* key, size_t key_size), void (*key_free)(void* key));
 int tree_add(tree_t* tree, size_t key_size, void* key, size_t data_size, void* data, int copy);
 tree_entry_t* tree_find(tree_t* tree, size_t key_size, const void* key);
+tree_entry_t* tree_find_next(tree_t* tree, size_t key_size, const void* key);
 void tree_remove_entry(tree_t* tree, tree_entry_t* entry);
 void tree_remove(tree_t* tree, size_t key_size, void* key);
 tree_entry_t* tree_first(tree_t* tree);
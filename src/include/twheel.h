@@ -0,0 +1,80 @@
+#ifndef SPIN_TWHEEL_H
+#define SPIN_TWHEEL_H 1
+
+/*
+ * Hierarchical timing wheel.
+ *
+ * Entries are a time (in seconds, like the timestamps of the rest of
+ * spin) and a fixed amount of data, copied into the wheel. Advancing
+ * the wheel to a given time passes every entry whose time has come to
+ * a function, and removes it; only those entries are looked at.
+ *
+ * There are TWHEEL_LEVELS levels of TWHEEL_SLOTS slots; a slot of level
+ * 0 holds the entries of one second, one of level 1 those of
+ * TWHEEL_SLOTS seconds, and so on. Entries move down a level when the
+ * wheel gets close enough to their time. Entries further away than the
+ * last level covers (about 194 days) are fine, they are moved along
+ * until they fit.
+ *
+ * Entries cannot be removed before their time. A user that needs to
+ * change the time of an entry leaves it, checks whether it is still
+ * valid when it comes out, and adds it again with the new time if
+ * needed.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TWHEEL_LEVELS       4
+#define TWHEEL_SLOT_BITS    6
+#define TWHEEL_SLOTS        (1 << TWHEEL_SLOT_BITS)
+
+typedef struct {
+    char* entries;
+    size_t count;
+    size_t allocated;
+} twheel_slot_t;
+
+typedef struct {
+    size_t entry_size;
+    size_t data_size;
+    // the time up to which the wheel has advanced
+    uint32_t now;
+    // number of entries, in the slots and in due
+    size_t size;
+    size_t level_size[TWHEEL_LEVELS];
+    twheel_slot_t slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+    // entries whose time has come, that were not passed on yet because
+    // of the budget of twheel_advance(); the next is at due_pos
+    twheel_slot_t due;
+    size_t due_pos;
+} twheel_t;
+
+/*
+ * Called for an entry whose time has come, with the time it was added
+ * with and its data (which is only valid during the call). This may add
+ * entries to the wheel.
+ */
+typedef void (*twheel_func)(uint32_t time, void* data, void* arg);
+
+twheel_t* twheel_create(size_t data_size);
+void twheel_destroy(twheel_t* wheel);
+
+/*
+ * Adds an entry; data is data_size bytes long. An entry whose time has
+ * already passed comes out at the next second the wheel advances to.
+ */
+void twheel_add(twheel_t* wheel, uint32_t time, const void* data);
+
+/*
+ * Advances the wheel to now, second by second, and calls func for every
+ * entry with a time up to and including it.
+ * If budget is not 0, at most that many entries are passed to func; the
+ * rest come out first in the next call.
+ * Returns the number of entries passed to func.
+ */
+size_t twheel_advance(twheel_t* wheel, uint32_t now, twheel_func func, void* arg, size_t budget);
+
+size_t twheel_size(twheel_t* wheel);
+
+#endif // SPIN_TWHEEL_H
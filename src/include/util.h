@@ -27,6 +27,12 @@ typedef struct {
 
 int spin_pton(ip_t* dest, const char* ip);
 size_t spin_ntop(char* dest, ip_t* ip, size_t dest_size);
+/*
+ * As spin_ntop, but with "/netmask" appended if the netmask is
+ * shorter than a single address
+ */
+#define SPIN_PREFIXSTRLEN (INET6_ADDRSTRLEN + 4)
+size_t spin_ntop_prefix(char* dest, ip_t* ip, size_t dest_size);
 
 typedef struct {
     char* data;
@@ -61,10 +67,6 @@ int buffer_ok(buffer_t* buffer);
  * Returns 1 on success, 0 on failure.
  */
 int store_ip_tree(tree_t* tree, const char* filename);
-/*
- * Same for nodepair
- */
-int store_nodepair_tree(tree_t* tree, const char* filename);
 
 /*
  * Read the given filename, which should consist of one IP string
@@ -2,13 +2,14 @@
 #include <time.h>
 
 #include "dns_cache.h"
+#include "intern.h"
 #include "spin_log.h"
 
 
 dns_cache_entry_t*
 dns_cache_entry_create() {
     dns_cache_entry_t* entry = (dns_cache_entry_t*) malloc(sizeof(dns_cache_entry_t));
-    entry->domains = tree_create(cmp_domains);
+    entry->domains = intern_tree_create();
     return entry;
 }
 
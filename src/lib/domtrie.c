@@ -0,0 +1,328 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "domtrie.h"
+#include "intern.h"
+
+// a name in presentation format has at most 127 labels
+#define DOMTRIE_MAX_LABELS 128
+
+typedef struct {
+    char buf[DOMTRIE_MAX_NAME];
+    char* labels[DOMTRIE_MAX_LABELS];   // from left to right
+    int nlabels;
+    int wildcard;
+} parsed_name_t;
+
+/*
+ * Splits name into its labels, in place in result->buf
+ * Returns 0 on success, -1 if the name is too long
+ */
+static int
+parse_name(const char* name, parsed_name_t* result) {
+    size_t len = strlen(name);
+    char* p;
+    char* start;
+
+    // leave room for the "*." and the trailing dot of domtrie_walk()
+    if (len + 2 >= DOMTRIE_MAX_NAME) {
+        return -1;
+    }
+    memcpy(result->buf, name, len + 1);
+    result->nlabels = 0;
+    result->wildcard = 0;
+
+    p = result->buf;
+    while (*p != '\0') {
+        start = p;
+        while (*p != '\0' && *p != '.') {
+            // an escaped dot is part of the label
+            if (*p == '\\' && p[1] != '\0') {
+                p++;
+            }
+            p++;
+        }
+        if (*p == '.') {
+            *p++ = '\0';
+        }
+        // empty labels (such as the root, or that of the trailing dot)
+        // are skipped
+        if (*start != '\0') {
+            if (result->nlabels == DOMTRIE_MAX_LABELS) {
+                return -1;
+            }
+            result->labels[result->nlabels++] = start;
+        }
+    }
+
+    if (result->nlabels > 0 && strcmp(result->labels[0], "*") == 0) {
+        result->wildcard = 1;
+        result->nlabels--;
+        memmove(result->labels, result->labels + 1, result->nlabels * sizeof(char*));
+    }
+    return 0;
+}
+
+static domtrie_node_t*
+child_find(domtrie_node_t* node, const char* label) {
+    tree_entry_t* entry;
+
+    if (node->children == NULL) {
+        return NULL;
+    }
+    entry = tree_find(node->children, strlen(label) + 1, label);
+    return entry == NULL ? NULL : * ((domtrie_node_t**) entry->data);
+}
+
+static domtrie_node_t*
+child_add(domtrie_node_t* node, const char* label) {
+    domtrie_node_t* child = (domtrie_node_t*) calloc(1, sizeof(domtrie_node_t));
+
+    child->parent = node;
+    child->label = intern_str(label);
+    if (node->children == NULL) {
+        node->children = intern_tree_create();
+    }
+    tree_add(node->children, strlen(child->label) + 1, (void*) child->label, sizeof(child), &child, 1);
+    return child;
+}
+
+static void
+node_free(domtrie_node_t* node) {
+    tree_entry_t* cur;
+
+    if (node->children != NULL) {
+        for (cur = tree_first(node->children); cur != NULL; cur = tree_next(cur)) {
+            node_free(* ((domtrie_node_t**) cur->data));
+        }
+        tree_destroy(node->children);
+    }
+    if (node->parent != NULL) {
+        intern_unref(node->label);
+        free(node);
+    }
+}
+
+/*
+ * Returns the node of the parsed name; if create is set, the nodes on
+ * the way are added when they are not there yet, otherwise NULL is
+ * returned
+ */
+static domtrie_node_t*
+descend(domtrie_t* trie, parsed_name_t* name, int create) {
+    domtrie_node_t* cur = &trie->root;
+    domtrie_node_t* child;
+    int i;
+
+    for (i = name->nlabels - 1; i >= 0; i--) {
+        child = child_find(cur, name->labels[i]);
+        if (child == NULL) {
+            if (!create) {
+                return NULL;
+            }
+            child = child_add(cur, name->labels[i]);
+        }
+        cur = child;
+    }
+    return cur;
+}
+
+static void
+update_count(domtrie_node_t* node, int delta) {
+    for (; node != NULL; node = node->parent) {
+        node->count += delta;
+    }
+}
+
+domtrie_t*
+domtrie_create(void) {
+    return (domtrie_t*) calloc(1, sizeof(domtrie_t));
+}
+
+void
+domtrie_destroy(domtrie_t* trie) {
+    node_free(&trie->root);
+    free(trie);
+}
+
+int
+domtrie_add(domtrie_t* trie, const char* name, void* item) {
+    parsed_name_t parsed;
+    domtrie_node_t* node;
+    void** slot;
+
+    if (parse_name(name, &parsed) != 0) {
+        return -1;
+    }
+    node = descend(trie, &parsed, 1);
+    slot = parsed.wildcard ? &node->wildcard : &node->item;
+    if (*slot != NULL) {
+        *slot = item;
+        return 0;
+    }
+    *slot = item;
+    update_count(node, 1);
+    return 1;
+}
+
+void*
+domtrie_remove(domtrie_t* trie, const char* name) {
+    parsed_name_t parsed;
+    domtrie_node_t* node;
+    domtrie_node_t* parent;
+    void** slot;
+    void* item;
+
+    if (parse_name(name, &parsed) != 0) {
+        return NULL;
+    }
+    node = descend(trie, &parsed, 0);
+    if (node == NULL) {
+        return NULL;
+    }
+    slot = parsed.wildcard ? &node->wildcard : &node->item;
+    item = *slot;
+    if (item == NULL) {
+        return NULL;
+    }
+    *slot = NULL;
+    update_count(node, -1);
+
+    // remove the nodes that have nothing left below them
+    while (node->parent != NULL && node->count == 0) {
+        parent = node->parent;
+        tree_remove(parent->children, strlen(node->label) + 1, (void*) node->label);
+        if (tree_empty(parent->children)) {
+            tree_destroy(parent->children);
+            parent->children = NULL;
+        }
+        intern_unref(node->label);
+        free(node);
+        node = parent;
+    }
+    return item;
+}
+
+void*
+domtrie_find(domtrie_t* trie, const char* name) {
+    parsed_name_t parsed;
+    domtrie_node_t* node;
+
+    if (parse_name(name, &parsed) != 0) {
+        return NULL;
+    }
+    node = descend(trie, &parsed, 0);
+    if (node == NULL) {
+        return NULL;
+    }
+    return parsed.wildcard ? node->wildcard : node->item;
+}
+
+void*
+domtrie_match(domtrie_t* trie, const char* name) {
+    parsed_name_t parsed;
+    domtrie_node_t* cur = &trie->root;
+    domtrie_node_t* child;
+    void* wildcard = NULL;
+    int i;
+
+    if (parse_name(name, &parsed) != 0) {
+        return NULL;
+    }
+    for (i = parsed.nlabels - 1; i >= 0; i--) {
+        // the wildcard of this node covers everything below it
+        if (cur->wildcard != NULL) {
+            wildcard = cur->wildcard;
+        }
+        child = child_find(cur, parsed.labels[i]);
+        if (child == NULL) {
+            return wildcard;
+        }
+        cur = child;
+    }
+    if (parsed.wildcard) {
+        return cur->wildcard != NULL ? cur->wildcard : wildcard;
+    }
+    return cur->item != NULL ? cur->item : wildcard;
+}
+
+size_t
+domtrie_count(domtrie_t* trie, const char* suffix) {
+    parsed_name_t parsed;
+    domtrie_node_t* node;
+
+    if (parse_name(suffix, &parsed) != 0) {
+        return 0;
+    }
+    node = descend(trie, &parsed, 0);
+    if (node == NULL) {
+        return 0;
+    }
+    if (parsed.wildcard && node->item != NULL) {
+        return node->count - 1;
+    }
+    return node->count;
+}
+
+/*
+ * Writes the name of node to buf, which is DOMTRIE_MAX_NAME long
+ */
+static void
+node_name(domtrie_node_t* node, int wildcard, char* buf) {
+    size_t pos = 0;
+    size_t len;
+
+    if (wildcard) {
+        buf[pos++] = '*';
+        buf[pos++] = '.';
+    }
+    for (; node->parent != NULL; node = node->parent) {
+        len = strlen(node->label);
+        memcpy(buf + pos, node->label, len);
+        pos += len;
+        buf[pos++] = '.';
+    }
+    if (pos == 0) {
+        buf[pos++] = '.';
+    }
+    buf[pos] = '\0';
+}
+
+static size_t
+walk_node(domtrie_node_t* node, int with_item, domtrie_func func, void* arg, char* buf) {
+    tree_entry_t* cur;
+    size_t count = 0;
+
+    if (with_item && node->item != NULL) {
+        node_name(node, 0, buf);
+        func(buf, node->item, arg);
+        count++;
+    }
+    if (node->wildcard != NULL) {
+        node_name(node, 1, buf);
+        func(buf, node->wildcard, arg);
+        count++;
+    }
+    if (node->children != NULL) {
+        for (cur = tree_first(node->children); cur != NULL; cur = tree_next(cur)) {
+            count += walk_node(* ((domtrie_node_t**) cur->data), 1, func, arg, buf);
+        }
+    }
+    return count;
+}
+
+size_t
+domtrie_walk(domtrie_t* trie, const char* suffix, domtrie_func func, void* arg) {
+    parsed_name_t parsed;
+    domtrie_node_t* node;
+    char buf[DOMTRIE_MAX_NAME];
+
+    if (parse_name(suffix, &parsed) != 0) {
+        return 0;
+    }
+    node = descend(trie, &parsed, 0);
+    if (node == NULL) {
+        return 0;
+    }
+    return walk_node(node, !parsed.wildcard, func, arg, buf);
+}
@@ -31,91 +31,431 @@ extsrc_af_from_wire(uint8_t x)
     }
 }
 
-static void *
-extsrc_msg_payload(struct extsrc_msg *msg)
+/******************************************************************************/
+
+/*
+ * Encoding: messages are built in a buffer that is large enough for the
+ * largest possible payload of their type
+ */
+struct extsrc_writer {
+    char *p;
+};
+
+static void
+put_u8(struct extsrc_writer *w, uint8_t v)
+{
+    *w->p++ = (char)v;
+}
+
+static void
+put_le16(struct extsrc_writer *w, uint16_t v)
+{
+    put_u8(w, v & 0xff);
+    put_u8(w, v >> 8);
+}
+
+static void
+put_varint(struct extsrc_writer *w, uint64_t v)
+{
+    while (v >= 0x80) {
+        put_u8(w, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    put_u8(w, v);
+}
+
+static void
+put_bytes(struct extsrc_writer *w, const void *data, size_t len)
+{
+    memcpy(w->p, data, len);
+    w->p += len;
+}
+
+/* Address without the family byte; IPv4 addresses are in the last 4 bytes */
+static void
+put_addr(struct extsrc_writer *w, uint8_t family, const uint8_t *addr)
+{
+    if (family == AF_INET) {
+        put_bytes(w, addr + 12, 4);
+    } else {
+        put_bytes(w, addr, 16);
+    }
+}
+
+static void
+put_name(struct extsrc_writer *w, const char *name, size_t max)
+{
+    size_t len = strnlen(name, max);
+
+    if (len > 255) {
+        len = 255;
+    }
+    put_u8(w, len);
+    put_bytes(w, name, len);
+}
+
+/* Upper bounds of the encoded sizes */
+#define MAX_VARINT 10
+#define MAX_ADDR 16
+#define MAX_NAME (1 + 255)
+#define MAX_PKT_INFO (1 + 1 + 2 * MAX_ADDR + 2 + 2 + 1 + 4 * MAX_VARINT)
+#define MAX_DNS (1 + MAX_ADDR + MAX_VARINT + MAX_NAME)
+
+/*
+ * Decoding: every read checks the remaining length; after an error, the
+ * reader is marked as failed and all further reads return zeroes
+ */
+struct extsrc_reader {
+    const unsigned char *p;
+    size_t left;
+    int error;
+};
+
+static int
+get_check(struct extsrc_reader *r, size_t len)
+{
+    if (r->error || r->left < len) {
+        r->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static uint8_t
+get_u8(struct extsrc_reader *r)
+{
+    if (get_check(r, 1) != 0) {
+        return 0;
+    }
+    r->left--;
+    return *r->p++;
+}
+
+static uint16_t
+get_le16(struct extsrc_reader *r)
+{
+    uint16_t v = get_u8(r);
+
+    return v | (uint16_t)get_u8(r) << 8;
+}
+
+static uint64_t
+get_varint(struct extsrc_reader *r)
+{
+    uint64_t v = 0;
+    unsigned int shift;
+    uint8_t b;
+
+    for (shift = 0; shift < 64; shift += 7) {
+        b = get_u8(r);
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return v;
+        }
+    }
+    /* too long */
+    r->error = 1;
+    return 0;
+}
+
+/* A varint that must fit in max */
+static uint64_t
+get_varint_max(struct extsrc_reader *r, uint64_t max)
+{
+    uint64_t v = get_varint(r);
+
+    if (v > max) {
+        r->error = 1;
+        return 0;
+    }
+    return v;
+}
+
+static void
+get_bytes(struct extsrc_reader *r, void *data, size_t len)
+{
+    if (get_check(r, len) != 0) {
+        return;
+    }
+    memcpy(data, r->p, len);
+    r->p += len;
+    r->left -= len;
+}
+
+/* Returns the (host) address family, or 0 if it is invalid */
+static uint8_t
+get_family(struct extsrc_reader *r)
+{
+    uint8_t family = get_u8(r);
+
+    if (family == EXTSRC_AF_INET) {
+        return AF_INET;
+    }
+    if (family == EXTSRC_AF_INET6) {
+        return AF_INET6;
+    }
+    r->error = 1;
+    return 0;
+}
+
+static void
+get_addr(struct extsrc_reader *r, uint8_t family, uint8_t *addr)
+{
+    memset(addr, 0, 16);
+    if (family == AF_INET) {
+        get_bytes(r, addr + 12, 4);
+    } else {
+        get_bytes(r, addr, 16);
+    }
+}
+
+/* Reads a name into buf (of size max), NUL-terminated */
+static void
+get_name(struct extsrc_reader *r, char *buf, size_t max)
+{
+    uint8_t len = get_u8(r);
+
+    if (len >= max) {
+        r->error = 1;
+        return;
+    }
+    get_bytes(r, buf, len);
+    buf[len] = '\0';
+}
+
+static void
+extsrc_reader_init(struct extsrc_reader *r, const char *payload, uint32_t len)
 {
-    return msg->data + sizeof(struct extsrc_msg_hdr);
+    r->p = (const unsigned char *)payload;
+    r->left = len;
+    r->error = 0;
+}
+
+/* Returns 0 if everything was read without errors */
+static int
+extsrc_reader_done(struct extsrc_reader *r)
+{
+    return r->error || r->left != 0 ? -1 : 0;
 }
 
 /******************************************************************************/
 
-struct extsrc_msg *
-extsrc_msg_create(char *payload, uint32_t payload_len, uint32_t msg_type)
+void
+extsrc_hdr_write(char *buf, uint8_t type, uint32_t length)
 {
-    struct extsrc_msg *msg;
-    struct extsrc_msg_hdr hdr;
+    unsigned char *p = (unsigned char *)buf;
+
+    p[0] = type;
+    p[1] = EXTSRC_VERSION;
+    p[2] = 0;
+    p[3] = 0;
+    p[4] = length & 0xff;
+    p[5] = (length >> 8) & 0xff;
+    p[6] = (length >> 16) & 0xff;
+    p[7] = length >> 24;
+}
 
-    hdr.type = msg_type;
-    hdr.length = payload_len;
+void
+extsrc_hdr_read(const char *buf, struct extsrc_msg_hdr *hdr)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    hdr->type = p[0];
+    hdr->version = p[1];
+    hdr->length = p[4] | (uint32_t)p[5] << 8 | (uint32_t)p[6] << 16 |
+        (uint32_t)p[7] << 24;
+}
+
+/*
+ * Allocates a message with room for max bytes of payload, and points the
+ * writer to the start of the payload
+ */
+static struct extsrc_msg *
+extsrc_msg_alloc(size_t max, struct extsrc_writer *w)
+{
+    struct extsrc_msg *msg;
 
     msg = malloc(sizeof(struct extsrc_msg));
     if (!msg) {
         err(1, "malloc");
     }
-
-    msg->length = sizeof(hdr) + payload_len;
-    msg->data = malloc(msg->length);
+    msg->data = malloc(EXTSRC_MSG_HDR_SIZE + max);
     if (!msg->data) {
         err(1, "malloc");
     }
+    w->p = msg->data + EXTSRC_MSG_HDR_SIZE;
+    return msg;
+}
 
-    memcpy(msg->data, &hdr, sizeof(hdr));
-    memcpy(msg->data + sizeof(hdr), payload, payload_len);
-
+/*
+ * Writes the header, now that the payload is complete
+ */
+static struct extsrc_msg *
+extsrc_msg_finish(struct extsrc_msg *msg, struct extsrc_writer *w,
+    uint8_t msg_type)
+{
+    msg->length = w->p - msg->data;
+    extsrc_hdr_write(msg->data, msg_type, msg->length - EXTSRC_MSG_HDR_SIZE);
     return msg;
 }
 
 struct extsrc_msg *
-extsrc_msg_create_pkt_info(pkt_info_t *pkt)
+extsrc_msg_create(char *payload, uint32_t payload_len, uint32_t msg_type)
 {
-    struct extsrc_msg *res = extsrc_msg_create((char *)pkt, sizeof(*pkt),
-        EXTSRC_MSG_TYPE_PKT_INFO);
+    struct extsrc_msg *msg;
+    struct extsrc_writer w;
 
-    ((pkt_info_t *)extsrc_msg_payload(res))->family = extsrc_af_to_wire(pkt->family);
+    msg = extsrc_msg_alloc(payload_len, &w);
+    put_bytes(&w, payload, payload_len);
+    return extsrc_msg_finish(msg, &w, msg_type);
+}
 
-    return res;
+struct extsrc_msg *
+extsrc_msg_create_pkt_info(pkt_info_t *pkt, uint64_t timestamp)
+{
+    struct extsrc_msg *msg;
+    struct extsrc_writer w;
+
+    msg = extsrc_msg_alloc(MAX_PKT_INFO, &w);
+    put_varint(&w, timestamp);
+    put_u8(&w, extsrc_af_to_wire(pkt->family));
+    put_u8(&w, pkt->protocol);
+    put_addr(&w, pkt->family, pkt->src_addr);
+    put_addr(&w, pkt->family, pkt->dest_addr);
+    put_le16(&w, pkt->src_port);
+    put_le16(&w, pkt->dest_port);
+    put_u8(&w, pkt->icmp_type);
+    put_varint(&w, pkt->payload_size);
+    put_varint(&w, pkt->packet_count);
+    put_varint(&w, pkt->payload_offset);
+    return extsrc_msg_finish(msg, &w, EXTSRC_MSG_TYPE_PKT_INFO);
+}
+
+static void
+put_dns_pkt_info(struct extsrc_writer *w, dns_pkt_info_t *dns_pkt)
+{
+    put_u8(w, extsrc_af_to_wire(dns_pkt->family));
+    put_addr(w, dns_pkt->family, dns_pkt->ip);
+    put_varint(w, dns_pkt->ttl);
+    put_name(w, dns_pkt->dname, sizeof(dns_pkt->dname));
 }
 
 struct extsrc_msg *
 extsrc_msg_create_dns_query(dns_pkt_info_t *dns_pkt, int family,
-    uint8_t *src_addr)
+    uint8_t *src_addr, uint64_t timestamp)
 {
-    struct extsrc_dns_query_hdr hdr;
-    char *buf;
-    size_t buf_len;
     struct extsrc_msg *msg;
+    struct extsrc_writer w;
 
-    hdr.family = family;
-    memcpy(hdr.src_addr, src_addr, sizeof(hdr.src_addr));
+    msg = extsrc_msg_alloc(MAX_VARINT + 1 + MAX_ADDR + MAX_DNS, &w);
+    put_varint(&w, timestamp);
+    put_u8(&w, extsrc_af_to_wire(family));
+    put_addr(&w, family, src_addr);
+    put_dns_pkt_info(&w, dns_pkt);
+    return extsrc_msg_finish(msg, &w, EXTSRC_MSG_TYPE_DNS_QUERY);
+}
 
-    buf_len = sizeof(hdr) + sizeof(*dns_pkt);
-    buf = malloc(buf_len);
-    if (!buf) {
-        err(1, "malloc");
-    }
+struct extsrc_msg *
+extsrc_msg_create_dns_answer(dns_pkt_info_t *dns_pkt, uint64_t timestamp)
+{
+    struct extsrc_msg *msg;
+    struct extsrc_writer w;
 
-    memcpy(buf, &hdr, sizeof(hdr));
-    memcpy(buf + sizeof(hdr), dns_pkt, sizeof(*dns_pkt));
+    msg = extsrc_msg_alloc(MAX_VARINT + MAX_DNS, &w);
+    put_varint(&w, timestamp);
+    put_dns_pkt_info(&w, dns_pkt);
+    return extsrc_msg_finish(msg, &w, EXTSRC_MSG_TYPE_DNS_ANSWER);
+}
 
-    msg = extsrc_msg_create(buf, buf_len, EXTSRC_MSG_TYPE_DNS_QUERY);
+struct extsrc_msg *
+extsrc_msg_create_arp_table_update(struct extsrc_arp_table_update *up,
+    uint64_t timestamp)
+{
+    struct extsrc_msg *msg;
+    struct extsrc_writer w;
 
-    free(buf);
+    msg = extsrc_msg_alloc(MAX_VARINT + MAX_NAME + 1 + MAX_ADDR + 1, &w);
+    put_varint(&w, timestamp);
+    put_name(&w, up->mac, sizeof(up->mac));
+    put_u8(&w, extsrc_af_to_wire(up->ip.family));
+    put_addr(&w, up->ip.family, up->ip.addr);
+    put_u8(&w, up->ip.netmask);
+    return extsrc_msg_finish(msg, &w, EXTSRC_MSG_TYPE_ARP_TABLE_UPDATE);
+}
 
-    return msg;
+int
+extsrc_msg_read_pkt_info(const char *payload, uint32_t len, pkt_info_t *pkt,
+    uint64_t *timestamp)
+{
+    struct extsrc_reader r;
+
+    extsrc_reader_init(&r, payload, len);
+    memset(pkt, 0, sizeof(*pkt));
+    *timestamp = get_varint(&r);
+    pkt->family = get_family(&r);
+    pkt->protocol = get_u8(&r);
+    get_addr(&r, pkt->family, pkt->src_addr);
+    get_addr(&r, pkt->family, pkt->dest_addr);
+    pkt->src_port = get_le16(&r);
+    pkt->dest_port = get_le16(&r);
+    pkt->icmp_type = get_u8(&r);
+    pkt->payload_size = get_varint(&r);
+    pkt->packet_count = get_varint(&r);
+    pkt->payload_offset = get_varint_max(&r, UINT16_MAX);
+    return extsrc_reader_done(&r);
 }
 
-struct extsrc_msg *
-extsrc_msg_create_dns_answer(dns_pkt_info_t *dns_pkt)
+static void
+get_dns_pkt_info(struct extsrc_reader *r, dns_pkt_info_t *dns_pkt)
 {
-    return extsrc_msg_create((char *)dns_pkt, sizeof(*dns_pkt),
-        EXTSRC_MSG_TYPE_DNS_ANSWER);
+    memset(dns_pkt, 0, sizeof(*dns_pkt));
+    dns_pkt->family = get_family(r);
+    get_addr(r, dns_pkt->family, dns_pkt->ip);
+    dns_pkt->ttl = get_varint_max(r, UINT32_MAX);
+    get_name(r, dns_pkt->dname, sizeof(dns_pkt->dname));
 }
 
-struct extsrc_msg *
-extsrc_msg_create_arp_table_update(struct extsrc_arp_table_update *up)
+int
+extsrc_msg_read_dns_query(const char *payload, uint32_t len,
+    struct extsrc_dns_query_hdr *hdr, dns_pkt_info_t *dns_pkt,
+    uint64_t *timestamp)
+{
+    struct extsrc_reader r;
+
+    extsrc_reader_init(&r, payload, len);
+    *timestamp = get_varint(&r);
+    hdr->family = get_family(&r);
+    get_addr(&r, hdr->family, hdr->src_addr);
+    get_dns_pkt_info(&r, dns_pkt);
+    return extsrc_reader_done(&r);
+}
+
+int
+extsrc_msg_read_dns_answer(const char *payload, uint32_t len,
+    dns_pkt_info_t *dns_pkt, uint64_t *timestamp)
 {
-    return extsrc_msg_create((char *)up, sizeof(*up),
-        EXTSRC_MSG_TYPE_ARP_TABLE_UPDATE);
+    struct extsrc_reader r;
+
+    extsrc_reader_init(&r, payload, len);
+    *timestamp = get_varint(&r);
+    get_dns_pkt_info(&r, dns_pkt);
+    return extsrc_reader_done(&r);
+}
+
+int
+extsrc_msg_read_arp_table_update(const char *payload, uint32_t len,
+    struct extsrc_arp_table_update *up, uint64_t *timestamp)
+{
+    struct extsrc_reader r;
+
+    extsrc_reader_init(&r, payload, len);
+    memset(up, 0, sizeof(*up));
+    *timestamp = get_varint(&r);
+    get_name(&r, up->mac, sizeof(up->mac));
+    up->ip.family = get_family(&r);
+    get_addr(&r, up->ip.family, up->ip.addr);
+    up->ip.netmask = get_u8(&r);
+    return extsrc_reader_done(&r);
 }
 
 void
@@ -124,3 +464,29 @@ extsrc_msg_free(struct extsrc_msg *msg)
     free(msg->data);
     free(msg);
 }
+
+/******************************************************************************/
+
+void
+extsrc_batch_init(struct extsrc_batch *batch)
+{
+    extsrc_hdr_write(batch->data, EXTSRC_MSG_TYPE_BATCH, 0);
+    batch->length = EXTSRC_MSG_HDR_SIZE;
+    batch->count = 0;
+}
+
+int
+extsrc_batch_add(struct extsrc_batch *batch, struct extsrc_msg *msg)
+{
+    if (batch->length + msg->length > sizeof(batch->data)) {
+        return -1;
+    }
+    memcpy(batch->data + batch->length, msg->data, msg->length);
+    batch->length += msg->length;
+    batch->count++;
+
+    extsrc_hdr_write(batch->data, EXTSRC_MSG_TYPE_BATCH,
+        batch->length - EXTSRC_MSG_HDR_SIZE);
+
+    return 0;
+}
@@ -0,0 +1,280 @@
+#include "config.h"
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1 /* for memfd_create() */
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extsrc_ring.h"
+
+/*
+ * spind maps the memory of a ring it got from another process; if that
+ * process could make it smaller afterwards, spind would get a SIGBUS
+ * on its next read. Rings are only used with a memfd that is sealed
+ * against that, so not on systems without sealing.
+ */
+#if defined(HAVE_MEMFD_CREATE) && defined(F_ADD_SEALS)
+#define EXTSRC_RING_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+#endif
+
+static size_t
+extsrc_ring_size(uint32_t slots)
+{
+    return sizeof(struct extsrc_ring_hdr) + (size_t)slots * EXTSRC_RING_SLOT_SIZE;
+}
+
+static int
+extsrc_ring_memfd(void)
+{
+#ifdef EXTSRC_RING_SEALS
+    return memfd_create("spin-extsrc-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Returns 1 if the size of the memory behind fd cannot be changed */
+static int
+extsrc_ring_sealed(int fd)
+{
+#ifdef EXTSRC_RING_SEALS
+    int seals = fcntl(fd, F_GET_SEALS);
+
+    return seals != -1 && (seals & F_SEAL_SHRINK) != 0;
+#else
+    return 0;
+#endif
+}
+
+static struct extsrc_ring *
+extsrc_ring_map(int mem_fd, int event_fd, size_t size)
+{
+    struct extsrc_ring *ring;
+    void *mem;
+
+    ring = malloc(sizeof(struct extsrc_ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if (mem == MAP_FAILED) {
+        free(ring);
+        return NULL;
+    }
+    ring->hdr = (struct extsrc_ring_hdr *)mem;
+    ring->slots = (char *)mem + sizeof(struct extsrc_ring_hdr);
+    ring->size = size;
+    ring->mem_fd = mem_fd;
+    ring->event_fd = event_fd;
+    return ring;
+}
+
+struct extsrc_ring *
+extsrc_ring_create(uint32_t slots)
+{
+    struct extsrc_ring *ring;
+    struct extsrc_ring_hdr *hdr;
+    size_t size = extsrc_ring_size(slots);
+    int mem_fd, event_fd;
+    int save_errno;
+
+    if (slots == 0 || (slots & (slots - 1)) != 0 || size > UINT32_MAX) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    mem_fd = extsrc_ring_memfd();
+    if (mem_fd == -1) {
+        return NULL;
+    }
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        goto fail;
+    }
+    if (ftruncate(mem_fd, size) == -1) {
+        goto fail;
+    }
+#ifdef EXTSRC_RING_SEALS
+    if (fcntl(mem_fd, F_ADD_SEALS, EXTSRC_RING_SEALS) == -1) {
+        goto fail;
+    }
+#endif
+    ring = extsrc_ring_map(mem_fd, event_fd, size);
+    if (ring == NULL) {
+        goto fail;
+    }
+
+    /* The memory is zeroed, so only the constant fields need to be set */
+    hdr = ring->hdr;
+    hdr->magic = EXTSRC_RING_MAGIC;
+    hdr->version = EXTSRC_RING_VERSION;
+    hdr->slot_size = EXTSRC_RING_SLOT_SIZE;
+    hdr->slots = slots;
+    hdr->producer_pid = getpid();
+    ring->mask = slots - 1;
+    ring->head = 0;
+    ring->tail = 0;
+
+    return ring;
+
+fail:
+    save_errno = errno;
+    close(mem_fd);
+    if (event_fd != -1) {
+        close(event_fd);
+    }
+    errno = save_errno;
+    return NULL;
+}
+
+struct extsrc_ring *
+extsrc_ring_attach(int mem_fd, int event_fd, uint32_t size)
+{
+    struct extsrc_ring *ring;
+    struct extsrc_ring_hdr *hdr;
+    struct stat st;
+
+    if (size < sizeof(struct extsrc_ring_hdr) || !extsrc_ring_sealed(mem_fd) ||
+        fstat(mem_fd, &st) == -1 || st.st_size < (off_t)size) {
+        goto fail;
+    }
+    ring = extsrc_ring_map(mem_fd, event_fd, size);
+    if (ring == NULL) {
+        goto fail;
+    }
+
+    /*
+     * The header is checked once; the consumer keeps using its own copies
+     * of the slot count and size, so the producer cannot make it read
+     * outside of the mapping later on.
+     */
+    hdr = ring->hdr;
+    if (hdr->magic != EXTSRC_RING_MAGIC ||
+        hdr->version != EXTSRC_RING_VERSION ||
+        hdr->slot_size != EXTSRC_RING_SLOT_SIZE || hdr->slots == 0 ||
+        (hdr->slots & (hdr->slots - 1)) != 0 ||
+        hdr->slots > (size - sizeof(struct extsrc_ring_hdr)) / EXTSRC_RING_SLOT_SIZE) {
+        extsrc_ring_destroy(ring, 0);
+        return NULL;
+    }
+    ring->mask = hdr->slots - 1;
+    ring->tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    ring->head = ring->tail;
+
+    return ring;
+
+fail:
+    close(mem_fd);
+    close(event_fd);
+    return NULL;
+}
+
+void
+extsrc_ring_destroy(struct extsrc_ring *ring, int producer)
+{
+    if (producer) {
+        __atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&ring->hdr->waiting, 1, __ATOMIC_SEQ_CST);
+        extsrc_ring_wakeup(ring);
+    }
+    munmap(ring->hdr, ring->size);
+    close(ring->mem_fd);
+    close(ring->event_fd);
+    free(ring);
+}
+
+int
+extsrc_ring_put(struct extsrc_ring *ring, struct extsrc_msg *msg)
+{
+    uint64_t tail;
+
+    if (msg->length > EXTSRC_RING_SLOT_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    /* ring->tail is only a cached value here; reread it when needed */
+    if (ring->head - ring->tail > ring->mask) {
+        tail = __atomic_load_n(&ring->hdr->tail, __ATOMIC_ACQUIRE);
+        if (ring->head - tail > ring->mask) {
+            errno = ENOBUFS;
+            return -1;
+        }
+        ring->tail = tail;
+    }
+
+    memcpy(ring->slots + (ring->head & ring->mask) * EXTSRC_RING_SLOT_SIZE,
+        msg->data, msg->length);
+    ring->head++;
+    __atomic_store_n(&ring->hdr->head, ring->head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void
+extsrc_ring_wakeup(struct extsrc_ring *ring)
+{
+    /*
+     * Pairs with the fence in extsrc_ring_idle(): either the consumer
+     * sees the new head, or we see its waiting flag.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->hdr->waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->hdr->waiting, 0, __ATOMIC_SEQ_CST)) {
+        (void)eventfd_write(ring->event_fd, 1);
+    }
+}
+
+int
+extsrc_ring_peek(struct extsrc_ring *ring, const char **frame)
+{
+    /* ring->head is only a cached value here; reread it when needed */
+    if (ring->tail == ring->head) {
+        ring->head = __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE);
+        if (ring->head - ring->tail > (uint64_t)ring->mask + 1) {
+            return -1;
+        }
+        if (ring->tail == ring->head) {
+            return 0;
+        }
+    }
+    *frame = ring->slots + (ring->tail & ring->mask) * EXTSRC_RING_SLOT_SIZE;
+    return 1;
+}
+
+void
+extsrc_ring_release(struct extsrc_ring *ring)
+{
+    ring->tail++;
+    __atomic_store_n(&ring->hdr->tail, ring->tail, __ATOMIC_RELEASE);
+}
+
+int
+extsrc_ring_idle(struct extsrc_ring *ring)
+{
+    eventfd_t value;
+
+    (void)eventfd_read(ring->event_fd, &value);
+
+    __atomic_store_n(&ring->hdr->waiting, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->hdr->head, __ATOMIC_SEQ_CST) == ring->tail) {
+        return 1;
+    }
+    __atomic_store_n(&ring->hdr->waiting, 0, __ATOMIC_RELAXED);
+    (void)eventfd_write(ring->event_fd, 1);
+    return 0;
+}
+
+#endif /* HAVE_SYS_EVENTFD_H */
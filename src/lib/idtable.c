@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "idtable.h"
+
+#define IDTABLE_INITIAL_SLOTS 64
+#define SLOT_MASK (IDTABLE_MAX_SLOTS - 1)
+
+static inline int
+make_id(uint32_t slot, uint32_t generation) {
+    return (int) ((generation << IDTABLE_SLOT_BITS) | slot);
+}
+
+static inline idtable_slot_t*
+find_slot(idtable_t* table, int id) {
+    uint32_t slot = (uint32_t) id & SLOT_MASK;
+    idtable_slot_t* result;
+
+    if (id <= 0 || slot >= table->used) {
+        return NULL;
+    }
+    result = &table->slots[slot];
+    if (result->item == NULL || result->generation != (uint32_t) id >> IDTABLE_SLOT_BITS) {
+        return NULL;
+    }
+    return result;
+}
+
+idtable_t*
+idtable_create(void) {
+    idtable_t* table = (idtable_t*) malloc(sizeof(idtable_t));
+
+    table->allocated = IDTABLE_INITIAL_SLOTS;
+    table->slots = (idtable_slot_t*) calloc(table->allocated, sizeof(idtable_slot_t));
+    // slot 0 is never used, so that no id is 0
+    table->used = 1;
+    table->free_head = 0;
+    table->free_tail = 0;
+    table->size = 0;
+    return table;
+}
+
+void
+idtable_destroy(idtable_t* table) {
+    free(table->slots);
+    free(table);
+}
+
+int
+idtable_add(idtable_t* table, void* item) {
+    uint32_t slot;
+
+    if (table->free_head != 0) {
+        slot = table->free_head;
+        table->free_head = table->slots[slot].next_free;
+        if (table->free_head == 0) {
+            table->free_tail = 0;
+        }
+    } else {
+        if (table->used == IDTABLE_MAX_SLOTS) {
+            return 0;
+        }
+        if (table->used == table->allocated) {
+            table->allocated *= 2;
+            table->slots = (idtable_slot_t*) realloc(table->slots, table->allocated * sizeof(idtable_slot_t));
+            memset(table->slots + table->used, 0, (table->allocated - table->used) * sizeof(idtable_slot_t));
+        }
+        slot = table->used++;
+    }
+    table->slots[slot].item = item;
+    table->slots[slot].next_free = 0;
+    table->size++;
+    return make_id(slot, table->slots[slot].generation);
+}
+
+void*
+idtable_get(idtable_t* table, int id) {
+    idtable_slot_t* slot = find_slot(table, id);
+
+    return slot == NULL ? NULL : slot->item;
+}
+
+void*
+idtable_remove(idtable_t* table, int id) {
+    idtable_slot_t* slot = find_slot(table, id);
+    uint32_t index;
+    void* item;
+
+    if (slot == NULL) {
+        return NULL;
+    }
+    item = slot->item;
+    slot->item = NULL;
+    slot->generation = (slot->generation + 1) % IDTABLE_GENERATIONS;
+
+    index = (uint32_t) id & SLOT_MASK;
+    if (table->free_tail != 0) {
+        table->slots[table->free_tail].next_free = index;
+    } else {
+        table->free_head = index;
+    }
+    table->free_tail = index;
+    table->size--;
+    return item;
+}
+
+size_t
+idtable_size(idtable_t* table) {
+    return table->size;
+}
+
+int
+idtable_next(idtable_t* table, int id) {
+    uint32_t slot = id <= 0 ? 1 : ((uint32_t) id & SLOT_MASK) + 1;
+
+    for (; slot < table->used; slot++) {
+        if (table->slots[slot].item != NULL) {
+            return make_id(slot, table->slots[slot].generation);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "intern.h"
+
+#define INTERN_INITIAL_BUCKETS 1024
+
+typedef struct intern_entry_s {
+    struct intern_entry_s* next;        // in the bucket
+    uint32_t hash;
+    uint32_t refs;
+    size_t len;
+    char str[];
+} intern_entry_t;
+
+static intern_entry_t** buckets;
+static size_t nbuckets;
+static size_t count;
+
+static inline intern_entry_t*
+entry_of(const char* handle) {
+    return (intern_entry_t*) (handle - offsetof(intern_entry_t, str));
+}
+
+static inline char
+fold(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+// FNV-1a of the folded name
+static uint32_t
+hash_folded(const char* str, size_t* len) {
+    uint32_t hash = 2166136261u;
+    const char* p;
+
+    for (p = str; *p != '\0'; p++) {
+        hash = (hash ^ (uint8_t) fold(*p)) * 16777619u;
+    }
+    *len = p - str;
+    return hash;
+}
+
+static intern_entry_t*
+lookup(const char* str, uint32_t hash, size_t len) {
+    intern_entry_t* entry;
+
+    if (buckets == NULL) {
+        return NULL;
+    }
+    for (entry = buckets[hash & (nbuckets - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->len == len && strncasecmp(entry->str, str, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void
+grow(void) {
+    intern_entry_t** old = buckets;
+    size_t old_nbuckets = nbuckets;
+    intern_entry_t* entry;
+    intern_entry_t* next;
+    size_t i;
+
+    nbuckets = old == NULL ? INTERN_INITIAL_BUCKETS : 2 * nbuckets;
+    buckets = (intern_entry_t**) calloc(nbuckets, sizeof(intern_entry_t*));
+    for (i = 0; i < old_nbuckets; i++) {
+        for (entry = old[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (nbuckets - 1)];
+            buckets[entry->hash & (nbuckets - 1)] = entry;
+        }
+    }
+    free(old);
+}
+
+const char*
+intern_str(const char* str) {
+    intern_entry_t* entry;
+    uint32_t hash;
+    size_t len, i;
+
+    hash = hash_folded(str, &len);
+    entry = lookup(str, hash, len);
+    if (entry != NULL) {
+        entry->refs++;
+        return entry->str;
+    }
+
+    if (count >= nbuckets) {
+        grow();
+    }
+    entry = (intern_entry_t*) malloc(sizeof(intern_entry_t) + len + 1);
+    entry->hash = hash;
+    entry->refs = 1;
+    entry->len = len;
+    for (i = 0; i <= len; i++) {
+        entry->str[i] = fold(str[i]);
+    }
+    entry->next = buckets[hash & (nbuckets - 1)];
+    buckets[hash & (nbuckets - 1)] = entry;
+    count++;
+    return entry->str;
+}
+
+const char*
+intern_find(const char* str) {
+    intern_entry_t* entry;
+    uint32_t hash;
+    size_t len;
+
+    hash = hash_folded(str, &len);
+    entry = lookup(str, hash, len);
+    return entry == NULL ? NULL : entry->str;
+}
+
+const char*
+intern_ref(const char* handle) {
+    entry_of(handle)->refs++;
+    return handle;
+}
+
+void
+intern_unref(const char* handle) {
+    intern_entry_t* entry = entry_of(handle);
+    intern_entry_t** prev;
+
+    if (--entry->refs > 0) {
+        return;
+    }
+    prev = &buckets[entry->hash & (nbuckets - 1)];
+    while (*prev != entry) {
+        prev = &(*prev)->next;
+    }
+    *prev = entry->next;
+    free(entry);
+    count--;
+}
+
+uint32_t
+intern_hash(const char* handle) {
+    return entry_of(handle)->hash;
+}
+
+size_t
+intern_count(void) {
+    return count;
+}
+
+static int
+cmp_interned(size_t size_a, const void* a, size_t size_b, const void* b) {
+    int result;
+
+    if (a == b) {
+        return 0;
+    }
+    result = strcasecmp((const char*) a, (const char*) b);
+    return result < 0 ? -1 : result > 0;
+}
+
+static void*
+tree_key_copy(const void* key, size_t key_size) {
+    return (void*) intern_str((const char*) key);
+}
+
+static void
+tree_key_free(void* key) {
+    intern_unref((const char*) key);
+}
+
+tree_t*
+intern_tree_create(void) {
+    tree_t* tree = tree_create(cmp_interned);
+
+    tree_set_key_funcs(tree, tree_key_copy, tree_key_free);
+    return tree;
+}
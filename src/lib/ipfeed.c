@@ -0,0 +1,575 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipfeed.h"
+#include "spin_log.h"
+
+#define IPFEED_TMP_SUFFIX ".tmp"
+#define IPFEED_LINE_MAX 256
+#define IPFEED_ALIGN 64                 // a cache line
+
+// 128-bit values, for IPv6 addresses and for walking either family
+typedef struct {
+    uint64_t hi;
+    uint64_t lo;
+} u128_t;
+
+static inline uint64_t
+load_be64(const uint8_t* p) {
+    uint64_t result = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        result = (result << 8) | p[i];
+    }
+    return result;
+}
+
+static inline void
+store_be64(uint8_t* p, uint64_t value) {
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        p[i] = value & 0xff;
+        value >>= 8;
+    }
+}
+
+static inline uint32_t
+load_v4(const uint8_t* addr) {
+    return ((uint32_t) addr[12] << 24) | (addr[13] << 16) | (addr[14] << 8) | addr[15];
+}
+
+static inline int
+u128_lt(u128_t a, u128_t b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+// The value with the lowest bits bits set
+static inline u128_t
+u128_mask(int bits) {
+    u128_t result;
+
+    if (bits >= 128) {
+        result.hi = result.lo = ~0ULL;
+    } else if (bits >= 64) {
+        result.hi = bits == 64 ? 0 : (1ULL << (bits - 64)) - 1;
+        result.lo = ~0ULL;
+    } else {
+        result.hi = 0;
+        result.lo = bits == 0 ? 0 : (1ULL << bits) - 1;
+    }
+    return result;
+}
+
+static inline int
+u128_ctz(u128_t a) {
+    if (a.lo != 0) {
+        return __builtin_ctzll(a.lo);
+    }
+    return a.hi != 0 ? 64 + __builtin_ctzll(a.hi) : 128;
+}
+
+/*
+ * Import
+ */
+
+typedef struct {
+    ipfeed_v4_range_t* v4;
+    size_t v4_count;
+    size_t v4_size;
+    ipfeed_v6_range_t* v6;
+    size_t v6_count;
+    size_t v6_size;
+} ranges_t;
+
+static void
+ranges_add_v4(ranges_t* ranges, uint32_t start, uint32_t end) {
+    if (ranges->v4_count == ranges->v4_size) {
+        ranges->v4_size = ranges->v4_size ? 2 * ranges->v4_size : 1024;
+        ranges->v4 = realloc(ranges->v4, ranges->v4_size * sizeof(ipfeed_v4_range_t));
+    }
+    ranges->v4[ranges->v4_count].start = start;
+    ranges->v4[ranges->v4_count].end = end;
+    ranges->v4_count++;
+}
+
+static void
+ranges_add_v6(ranges_t* ranges, u128_t start, u128_t end) {
+    ipfeed_v6_range_t* range;
+
+    if (ranges->v6_count == ranges->v6_size) {
+        ranges->v6_size = ranges->v6_size ? 2 * ranges->v6_size : 1024;
+        ranges->v6 = realloc(ranges->v6, ranges->v6_size * sizeof(ipfeed_v6_range_t));
+    }
+    range = &ranges->v6[ranges->v6_count++];
+    range->start_hi = start.hi;
+    range->start_lo = start.lo;
+    range->end_hi = end.hi;
+    range->end_lo = end.lo;
+}
+
+/*
+ * Parses one line of a feed and adds its range. Returns 1 if an entry
+ * was added, 0 for an empty or comment line, -1 for an invalid line.
+ */
+static int
+parse_line(ranges_t* ranges, char* line) {
+    char* p = line;
+    char* slash;
+    char* end;
+    uint8_t addr[16];
+    int family, bits, netmask;
+    long value;
+    u128_t start, host;
+
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == '\0' || *p == '\n' || *p == '\r' || *p == '#' || *p == ';') {
+        return 0;
+    }
+    // the address ends at the first character that cannot be part of it
+    end = p + strspn(p, "0123456789abcdefABCDEF:./");
+    *end = '\0';
+
+    family = strchr(p, ':') != NULL ? AF_INET6 : AF_INET;
+    bits = family == AF_INET ? 32 : 128;
+    netmask = bits;
+    slash = strchr(p, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+        value = strtol(slash + 1, &end, 10);
+        // a /0 would be the whole address space, and is surely a mistake
+        if (*end != '\0' || end == slash + 1 || value < 1 || value > bits) {
+            return -1;
+        }
+        netmask = value;
+    }
+    if (inet_pton(family, p, addr) != 1) {
+        return -1;
+    }
+
+    if (family == AF_INET) {
+        uint32_t v4 = ((uint32_t) addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | addr[3];
+        uint32_t v4_host = netmask == 32 ? 0 : 0xffffffffU >> netmask;
+
+        ranges_add_v4(ranges, v4 & ~v4_host, v4 | v4_host);
+    } else {
+        host = u128_mask(128 - netmask);
+        start.hi = load_be64(addr) & ~host.hi;
+        start.lo = load_be64(addr + 8) & ~host.lo;
+        host.hi |= start.hi;
+        host.lo |= start.lo;
+        ranges_add_v6(ranges, start, host);
+    }
+    return 1;
+}
+
+static int
+cmp_v4_range(const void* a, const void* b) {
+    const ipfeed_v4_range_t* ra = a;
+    const ipfeed_v4_range_t* rb = b;
+
+    if (ra->start != rb->start) {
+        return ra->start < rb->start ? -1 : 1;
+    }
+    return 0;
+}
+
+static int
+cmp_v6_range(const void* a, const void* b) {
+    const ipfeed_v6_range_t* ra = a;
+    const ipfeed_v6_range_t* rb = b;
+
+    if (ra->start_hi != rb->start_hi) {
+        return ra->start_hi < rb->start_hi ? -1 : 1;
+    }
+    if (ra->start_lo != rb->start_lo) {
+        return ra->start_lo < rb->start_lo ? -1 : 1;
+    }
+    return 0;
+}
+
+// Sorts the ranges and merges the ones that overlap or touch
+static size_t
+merge_v4(ipfeed_v4_range_t* r, size_t count) {
+    size_t i, n = 0;
+
+    if (count == 0) {
+        return 0;
+    }
+    qsort(r, count, sizeof(*r), cmp_v4_range);
+    for (i = 1; i < count; i++) {
+        if (r[n].end == 0xffffffffU || r[i].start <= r[n].end + 1) {
+            if (r[i].end > r[n].end) {
+                r[n].end = r[i].end;
+            }
+        } else {
+            r[++n] = r[i];
+        }
+    }
+    return n + 1;
+}
+
+static size_t
+merge_v6(ipfeed_v6_range_t* r, size_t count) {
+    size_t i, n = 0;
+    u128_t next, end;
+
+    if (count == 0) {
+        return 0;
+    }
+    qsort(r, count, sizeof(*r), cmp_v6_range);
+    for (i = 1; i < count; i++) {
+        // next is the first address after range n
+        next.lo = r[n].end_lo + 1;
+        next.hi = r[n].end_hi + (next.lo == 0);
+        end.hi = r[i].end_hi;
+        end.lo = r[i].end_lo;
+        if ((next.hi == 0 && next.lo == 0) ||
+            !u128_lt(next, (u128_t) { r[i].start_hi, r[i].start_lo })) {
+            if (u128_lt((u128_t) { r[n].end_hi, r[n].end_lo }, end)) {
+                r[n].end_hi = end.hi;
+                r[n].end_lo = end.lo;
+            }
+        } else {
+            r[++n] = r[i];
+        }
+    }
+    return n + 1;
+}
+
+// Puts the sorted array in Eytzinger order, starting at index 1
+static size_t
+eytzinger(const char* sorted, char* out, size_t size, size_t i, size_t k, size_t count) {
+    if (k <= count) {
+        i = eytzinger(sorted, out, size, i, 2 * k, count);
+        memcpy(out + k * size, sorted + i * size, size);
+        i = eytzinger(sorted, out, size, i + 1, 2 * k + 1, count);
+    }
+    return i;
+}
+
+static int
+write_padding(FILE* out, long offset) {
+    while (ftell(out) < offset) {
+        if (fputc(0, out) == EOF) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int
+write_array(FILE* out, const void* sorted, size_t size, size_t count, long offset) {
+    char* array = calloc(count + 1, size);
+    int ok;
+
+    eytzinger(sorted, array, size, 0, 1, count);
+    ok = write_padding(out, offset) && fwrite(array, size, count + 1, out) == count + 1;
+    free(array);
+    return ok;
+}
+
+static long
+align(long offset) {
+    return (offset + IPFEED_ALIGN - 1) & ~(long) (IPFEED_ALIGN - 1);
+}
+
+static int
+write_index(const char* path, ranges_t* ranges, size_t entries) {
+    size_t len = strlen(path);
+    char* tmp_path = malloc(len + sizeof(IPFEED_TMP_SUFFIX));
+    ipfeed_header_t header;
+    FILE* out;
+    int ok;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IPFEED_MAGIC, sizeof(header.magic));
+    header.version = IPFEED_VERSION;
+    header.byte_order = IPFEED_BYTE_ORDER;
+    header.entries = entries;
+    header.v4_count = ranges->v4_count;
+    header.v4_offset = align(sizeof(header));
+    header.v6_count = ranges->v6_count;
+    header.v6_offset = align(header.v4_offset + (ranges->v4_count + 1) * sizeof(ipfeed_v4_range_t));
+
+    memcpy(tmp_path, path, len);
+    strcpy(tmp_path + len, IPFEED_TMP_SUFFIX);
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        spin_log(LOG_ERR, "Cannot create %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return 0;
+    }
+    ok = fwrite(&header, sizeof(header), 1, out) == 1 &&
+         write_array(out, ranges->v4, sizeof(ipfeed_v4_range_t), ranges->v4_count, header.v4_offset) &&
+         write_array(out, ranges->v6, sizeof(ipfeed_v6_range_t), ranges->v6_count, header.v6_offset);
+    ok = ok && fflush(out) == 0 && fsync(fileno(out)) == 0;
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(tmp_path, path) != 0) {
+        spin_log(LOG_ERR, "Cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        free(tmp_path);
+        return 0;
+    }
+    free(tmp_path);
+    return 1;
+}
+
+int
+ipfeed_import(const char* textfile, const char* path) {
+    ranges_t ranges;
+    char line[IPFEED_LINE_MAX];
+    FILE* in;
+    int entries = 0, invalid = 0, result;
+
+    in = fopen(textfile, "r");
+    if (in == NULL) {
+        spin_log(LOG_ERR, "Cannot open %s: %s\n", textfile, strerror(errno));
+        return -1;
+    }
+    memset(&ranges, 0, sizeof(ranges));
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (strchr(line, '\n') == NULL && !feof(in)) {
+            // too long, skip the rest of the line; the start may still
+            // be a valid address
+            int c;
+            while ((c = getc(in)) != EOF && c != '\n');
+        }
+        result = parse_line(&ranges, line);
+        if (result > 0) {
+            entries++;
+        } else if (result < 0) {
+            invalid++;
+        }
+    }
+    fclose(in);
+    if (invalid > 0) {
+        spin_log(LOG_WARNING, "Skipped %d invalid lines in %s\n", invalid, textfile);
+    }
+
+    ranges.v4_count = merge_v4(ranges.v4, ranges.v4_count);
+    ranges.v6_count = merge_v6(ranges.v6, ranges.v6_count);
+    if (!write_index(path, &ranges, entries)) {
+        entries = -1;
+    }
+    spin_log(LOG_DEBUG, "Feed %s: %d entries, %zu IPv4 and %zu IPv6 ranges\n",
+             textfile, entries, ranges.v4_count, ranges.v6_count);
+    free(ranges.v4);
+    free(ranges.v6);
+    return entries;
+}
+
+/*
+ * Lookup
+ */
+
+// Checks that count elements of size bytes fit at offset
+static int
+array_fits(uint64_t offset, uint64_t count, size_t size, size_t map_size) {
+    return offset % sizeof(uint64_t) == 0 && offset <= map_size &&
+           count < (map_size - offset) / size;
+}
+
+ipfeed_t*
+ipfeed_open(const char* path) {
+    ipfeed_t* feed;
+    const ipfeed_header_t* header;
+    struct stat st;
+    void* map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            spin_log(LOG_ERR, "Cannot open %s: %s\n", path, strerror(errno));
+        }
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ipfeed_header_t)) {
+        spin_log(LOG_ERR, "Feed index %s is truncated\n", path);
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        spin_log(LOG_ERR, "Cannot map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    header = (const ipfeed_header_t*) map;
+    if (memcmp(header->magic, IPFEED_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != IPFEED_VERSION ||
+        header->byte_order != IPFEED_BYTE_ORDER ||
+        !array_fits(header->v4_offset, header->v4_count, sizeof(ipfeed_v4_range_t), st.st_size) ||
+        !array_fits(header->v6_offset, header->v6_count, sizeof(ipfeed_v6_range_t), st.st_size)) {
+        spin_log(LOG_ERR, "%s is not a valid feed index\n", path);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    feed = (ipfeed_t*) malloc(sizeof(ipfeed_t));
+    feed->map = map;
+    feed->map_size = st.st_size;
+    feed->entries = header->entries;
+    feed->v4 = (const ipfeed_v4_range_t*) ((const char*) map + header->v4_offset);
+    feed->v4_count = header->v4_count;
+    feed->v6 = (const ipfeed_v6_range_t*) ((const char*) map + header->v6_offset);
+    feed->v6_count = header->v6_count;
+    return feed;
+}
+
+void
+ipfeed_close(ipfeed_t* feed) {
+    if (feed == NULL) {
+        return;
+    }
+    munmap(feed->map, feed->map_size);
+    free(feed);
+}
+
+/*
+ * Find the range with the lowest end not below the address: going down
+ * the tree, k ends up one past a leaf, with a 1 bit for every step to
+ * the right; the answer is where the last step to the left was taken.
+ * The ranges do not overlap, so the address is in the feed if and only
+ * if it lies within that range.
+ */
+int
+ipfeed_contains(ipfeed_t* feed, int family, const uint8_t* addr) {
+    size_t k = 1;
+
+    if (feed == NULL) {
+        return 0;
+    }
+    if (family == AF_INET) {
+        const ipfeed_v4_range_t* a = feed->v4;
+        uint32_t x = load_v4(addr);
+
+        while (k <= feed->v4_count) {
+            // the 8 elements three levels down share one cache line
+            __builtin_prefetch(a + 8 * k);
+            k = 2 * k + (a[k].end < x);
+        }
+        k >>= __builtin_ffsll(~(unsigned long long) k);
+        return k != 0 && a[k].start <= x;
+    } else {
+        const ipfeed_v6_range_t* a = feed->v6;
+        uint64_t hi = load_be64(addr), lo = load_be64(addr + 8);
+
+        while (k <= feed->v6_count) {
+            k = 2 * k + (a[k].end_hi < hi || (a[k].end_hi == hi && a[k].end_lo < lo));
+        }
+        k >>= __builtin_ffsll(~(unsigned long long) k);
+        return k != 0 && (a[k].start_hi < hi || (a[k].start_hi == hi && a[k].start_lo <= lo));
+    }
+}
+
+size_t
+ipfeed_entries(ipfeed_t* feed) {
+    return feed == NULL ? 0 : feed->entries;
+}
+
+/*
+ * Walk
+ */
+
+/*
+ * Splits the range start-end into prefixes: every time the largest
+ * block that is aligned at start and does not go past end
+ */
+static void
+walk_range(u128_t start, u128_t end, int family, int bits, ipfeed_walk_func func, void* arg) {
+    uint8_t addr[16];
+    u128_t mask, last;
+    ip_t prefix;
+    int k;
+
+    for (;;) {
+        k = u128_ctz(start);
+        // no /0, see copy_ip_data()
+        if (k > bits - 1) {
+            k = bits - 1;
+        }
+        for (;;) {
+            mask = u128_mask(k);
+            last.hi = start.hi | mask.hi;
+            last.lo = start.lo | mask.lo;
+            if (!u128_lt(end, last)) {
+                break;
+            }
+            k--;
+        }
+
+        memset(addr, 0, sizeof(addr));
+        if (family == AF_INET) {
+            addr[12] = start.lo >> 24;
+            addr[13] = start.lo >> 16;
+            addr[14] = start.lo >> 8;
+            addr[15] = start.lo;
+        } else {
+            store_be64(addr, start.hi);
+            store_be64(addr + 8, start.lo);
+        }
+        copy_ip_data(&prefix, family, bits - k, addr);
+        func(arg, &prefix);
+
+        if (last.hi == end.hi && last.lo == end.lo) {
+            break;
+        }
+        start.lo = last.lo + 1;
+        start.hi = last.hi + (start.lo == 0);
+    }
+}
+
+// Visits the ranges in sorted order, from the Eytzinger layout
+static void
+walk_tree(ipfeed_t* feed, int family, size_t k, ipfeed_walk_func func, void* arg) {
+    u128_t start, end;
+
+    if (k > (family == AF_INET ? feed->v4_count : feed->v6_count)) {
+        return;
+    }
+    walk_tree(feed, family, 2 * k, func, arg);
+    if (family == AF_INET) {
+        start = (u128_t) { 0, feed->v4[k].start };
+        end = (u128_t) { 0, feed->v4[k].end };
+        walk_range(start, end, AF_INET, 32, func, arg);
+    } else {
+        start = (u128_t) { feed->v6[k].start_hi, feed->v6[k].start_lo };
+        end = (u128_t) { feed->v6[k].end_hi, feed->v6[k].end_lo };
+        walk_range(start, end, AF_INET6, 128, func, arg);
+    }
+    walk_tree(feed, family, 2 * k + 1, func, arg);
+}
+
+void
+ipfeed_walk(ipfeed_t* feed, int family, ipfeed_walk_func func, void* arg) {
+    if (feed != NULL) {
+        walk_tree(feed, family, 1, func, arg);
+    }
+}
+
+static void
+count_prefix(void* arg, const ip_t* prefix) {
+    (*(size_t*) arg)++;
+}
+
+size_t
+ipfeed_prefix_count(ipfeed_t* feed, int family) {
+    size_t count = 0;
+
+    ipfeed_walk(feed, family, count_prefix, &count);
+    return count;
+}
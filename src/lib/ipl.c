@@ -1,3 +1,5 @@
+#include <unistd.h>
+
 #include "ipl.h"
 #include "spin_log.h"
 
@@ -7,23 +9,153 @@ static struct list_info* ipl_list_ar;
 #define ipl_ignore ipl_list_ar[IPLIST_IGNORE]
 #define ipl_allow ipl_list_ar[IPLIST_ALLOW]
 
+/*
+ * The prefilter, see ipl.h. Adding an entry sets its bits; after a
+ * removal, the filter is rebuilt from the remaining entries.
+ */
+static inline uint32_t
+filter_v6_bit(const uint8_t* addr) {
+    uint32_t slash32 = ((uint32_t) addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | addr[3];
+
+    return (slash32 * 2654435761u) >> (32 - 14);
+}
+
+static void
+filter_add(struct ipl_filter *filter, const ip_t* ip) {
+    uint32_t first, count, i;
+
+    if (ip->family == AF_INET) {
+        first = (ip->addr[12] << 8) | ip->addr[13];
+        count = 1;
+        if (ip->netmask > 0 && ip->netmask < 16) {
+            // host bits are not necessarily cleared here
+            count = 1 << (16 - ip->netmask);
+            first &= ~(count - 1);
+        }
+        for (i = first; i < first + count; i++) {
+            filter->v4[i >> 6] |= 1ULL << (i & 63);
+        }
+    } else if (ip->family == AF_INET6) {
+        if (ip->netmask > 0 && ip->netmask < 32) {
+            filter->v6_all = 1;
+        } else {
+            i = filter_v6_bit(ip->addr);
+            filter->v6[i >> 6] |= 1ULL << (i & 63);
+        }
+    }
+}
+
+static void
+filter_rebuild(struct list_info *lip) {
+    iptrie_node_t* cur;
+
+    memset(&lip->li_filter, 0, sizeof(lip->li_filter));
+    cur = iptrie_first(lip->li_trie);
+    while (cur != NULL) {
+        filter_add(&lip->li_filter, &cur->prefix);
+        cur = iptrie_next(lip->li_trie, cur);
+    }
+}
+
+// Returns 0 if the address is certainly not on the list
+static inline int
+filter_may_contain(struct ipl_filter *filter, int family, const uint8_t* addr) {
+    uint32_t i;
+
+    if (family == AF_INET) {
+        i = (addr[12] << 8) | addr[13];
+        return (filter->v4[i >> 6] >> (i & 63)) & 1;
+    }
+    if (filter->v6_all) {
+        return 1;
+    }
+    i = filter_v6_bit(addr);
+    return (filter->v6[i >> 6] >> (i & 63)) & 1;
+}
+
+static const char* ipl_directory = IPL_DIRECTORY;
+
+void
+ipl_set_directory(const char* directory) {
+    ipl_directory = directory;
+}
+
 // Make name of shadow file
 char*
 ipl_filename(struct list_info *lip) {
-    static char listname[30];
+    static char listname[256];
 
-    sprintf(listname, "/etc/spin/%s.list", lip->li_listname);
+    snprintf(listname, sizeof(listname), "%s/%s.list", ipl_directory, lip->li_listname);
     return listname;
 }
 
+char*
+ipl_feed_filename(struct list_info *lip) {
+    static char feedname[256];
+
+    snprintf(feedname, sizeof(feedname), "%s/%s.feed", ipl_directory, lip->li_listname);
+    return feedname;
+}
+
+static void
+ipl_apply(void* arg, int add, const char* entry) {
+    struct list_info *lip = (struct list_info *) arg;
+    ip_t ip;
+
+    if (!spin_pton(&ip, entry)) {
+        return;
+    }
+    if (add) {
+        iptrie_add(lip->li_trie, &ip);
+    } else {
+        iptrie_remove(lip->li_trie, &ip);
+    }
+}
+
+static void
+ipl_write(void* arg, FILE* out) {
+    struct list_info *lip = (struct list_info *) arg;
+
+    iptrie_write(lip->li_trie, out);
+}
+
+static void
+ipl_journal(struct list_info *lip, int add, ip_t* ip) {
+    char ip_str[SPIN_PREFIXSTRLEN];
+
+    lip->li_modified++;
+    if (lip->li_journal == NULL) {
+        return;
+    }
+    spin_ntop_prefix(ip_str, ip, sizeof(ip_str));
+    journal_append(lip->li_journal, add, ip_str);
+}
+
 void init_ipl(struct list_info *lip) {
     int cnt;
     char *fname;
 
-    lip->li_tree = tree_create(cmp_ips);
+    lip->li_trie = iptrie_create();
     fname = ipl_filename(lip);
-    cnt = read_ip_tree(lip->li_tree, fname);
+    cnt = journal_replay(fname, ipl_apply, lip);
+    filter_rebuild(lip);
+    lip->li_journal = journal_open(fname);
+    lip->li_modified = 0;
     spin_log(LOG_DEBUG, "File %s, read %d entries\n", fname, cnt);
+    lip->li_feed = ipfeed_open(ipl_feed_filename(lip));
+    if (lip->li_feed != NULL) {
+        spin_log(LOG_DEBUG, "Feed of %s, %zu entries\n", lip->li_listname, ipfeed_entries(lip->li_feed));
+    }
+}
+
+void clean_ipl(struct list_info *lip) {
+
+    journal_close(lip->li_journal);
+    lip->li_journal = NULL;
+    iptrie_destroy(lip->li_trie);
+    lip->li_trie = NULL;
+    ipfeed_close(lip->li_feed);
+    lip->li_feed = NULL;
 }
 
 void init_all_ipl(struct list_info *ipl_list_ar_a) {
@@ -44,8 +176,50 @@ void clean_all_ipl() {
 
     for (i=0; i<N_IPLIST; i++) {
         lip = &ipl_list_ar[i];
-        tree_destroy(lip->li_tree);
+        clean_ipl(lip);
+    }
+}
+
+// Flush the changes to the list to disk
+int
+ipl_sync(struct list_info *lip) {
+
+    if (lip->li_journal == NULL) {
+        return 0;
+    }
+    return journal_sync(lip->li_journal, ipl_write, lip);
+}
+
+int
+ipl_load_feed(struct list_info *lip, const char* textfile) {
+    int cnt;
+
+    cnt = ipfeed_import(textfile, ipl_feed_filename(lip));
+    if (cnt < 0) {
+        return -1;
     }
+    return ipl_reopen_feed(lip) < 0 ? -1 : cnt;
+}
+
+int
+ipl_reopen_feed(struct list_info *lip) {
+    ipfeed_t *feed;
+
+    feed = ipfeed_open(ipl_feed_filename(lip));
+    if (feed == NULL) {
+        return -1;
+    }
+    ipfeed_close(lip->li_feed);
+    lip->li_feed = feed;
+    return ipfeed_entries(feed);
+}
+
+void
+ipl_clear_feed(struct list_info *lip) {
+
+    ipfeed_close(lip->li_feed);
+    lip->li_feed = NULL;
+    unlink(ipl_feed_filename(lip));
 }
 
 void
@@ -56,15 +230,16 @@ add_ip_tree_to_li(tree_t* tree, struct list_info *lip) {
         return;
     cur = tree_first(tree);
     while(cur != NULL) {
-        tree_add(lip->li_tree, cur->key_size, cur->key, cur->data_size, cur->data, 1);
+        add_ip_to_li(cur->key, lip);
         cur = tree_next(cur);
     }
-    lip->li_modified++;
 }
 
 void add_ip_to_li(ip_t* ip, struct list_info *lip) {
-    tree_add(lip->li_tree, sizeof(ip_t), ip, 0, 0, 1);
-    lip->li_modified++;
+    if (iptrie_add(lip->li_trie, ip)) {
+        filter_add(&lip->li_filter, ip);
+        ipl_journal(lip, 1, ip);
+    }
 }
 
 
@@ -77,21 +252,33 @@ remove_ip_tree_from_li(tree_t *tree, struct list_info *lip) {
     }
     cur = tree_first(tree);
     while(cur != NULL) {
-        tree_remove(lip->li_tree, cur->key_size, cur->key);
+        if (iptrie_remove(lip->li_trie, cur->key)) {
+            ipl_journal(lip, 0, cur->key);
+        }
         cur = tree_next(cur);
     }
-    lip->li_modified++;
+    filter_rebuild(lip);
 }
 
 void remove_ip_from_li(ip_t* ip, struct list_info *lip) {
 
-    tree_remove(lip->li_tree, sizeof(ip_t), ip);
-    lip->li_modified++;
+    if (iptrie_remove(lip->li_trie, ip)) {
+        filter_rebuild(lip);
+        ipl_journal(lip, 0, ip);
+    }
 }
 
+// An address is on the list if it falls within one of its networks;
+// a network only if it falls entirely within one
 int ip_in_li(ip_t* ip, struct list_info* lip) {
 
-    return tree_find(lip->li_tree, sizeof(ip_t), ip) != NULL;
+    if (filter_may_contain(&lip->li_filter, ip->family, ip->addr) &&
+        iptrie_match(lip->li_trie, ip->family, ip->addr, ip->netmask) != NULL) {
+        return 1;
+    }
+    // only addresses are looked up in the feed
+    return (ip->netmask == 0 || ip->netmask == (ip->family == AF_INET ? 32 : 128)) &&
+           ipfeed_contains(lip->li_feed, ip->family, ip->addr);
 }
 
 int ip_in_ignore_list(ip_t* ip) {
@@ -99,11 +286,12 @@ int ip_in_ignore_list(ip_t* ip) {
     return ip_in_li(ip, &ipl_list_ar[IPLIST_IGNORE]);
 }
 
-// hmz, we probably want to refactor ip_t/the tree list
-// into something that requires less data copying
+// Called twice for every flow; the filter answers almost all of them
 int addr_in_ignore_list(int family, uint8_t* addr) {
-    ip_t ip;
 
-    copy_ip_data(&ip, family, 0, addr);
-    return ip_in_ignore_list(&ip);
+    if (filter_may_contain(&ipl_ignore.li_filter, family, addr) &&
+        iptrie_match(ipl_ignore.li_trie, family, addr, 0) != NULL) {
+        return 1;
+    }
+    return ipfeed_contains(ipl_ignore.li_feed, family, addr);
 }
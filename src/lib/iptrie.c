@@ -0,0 +1,388 @@
+#include <assert.h>
+
+#include "iptrie.h"
+
+/*
+ * All prefixes are kept as 128-bit keys in the ip_t addr layout, so an
+ * IPv4 /24 has 96 + 24 bits. The 96 leading zero bits are shared by all
+ * IPv4 prefixes and are skipped by the path compression.
+ */
+
+static int
+family_index(int family) {
+    switch (family) {
+    case AF_INET:
+        return 0;
+    case AF_INET6:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+static int
+prefix_bits(int family, int netmask) {
+    int max = family == AF_INET ? 32 : 128;
+
+    if (netmask <= 0 || netmask > max) {
+        netmask = max;
+    }
+    return family == AF_INET ? netmask + 96 : netmask;
+}
+
+// IPv4 addresses should have 12 zero bytes in front, but make sure
+static void
+make_key(uint8_t* key, int family, const uint8_t* addr) {
+    if (family == AF_INET) {
+        memset(key, 0, 12);
+        memcpy(key + 12, addr + 12, 4);
+    } else {
+        memcpy(key, addr, 16);
+    }
+}
+
+static int
+bit_at(const uint8_t* addr, int bit) {
+    return (addr[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
+
+// Number of leading bits a and b have in common, at most limit
+static int
+common_bits(const uint8_t* a, const uint8_t* b, int limit) {
+    int i, bits = 0;
+    uint8_t diff;
+
+    for (i = 0; i < 16 && bits < limit; i++) {
+        diff = a[i] ^ b[i];
+        if (diff != 0) {
+            while ((diff & 0x80) == 0) {
+                diff <<= 1;
+                bits++;
+            }
+            break;
+        }
+        bits += 8;
+    }
+    return bits < limit ? bits : limit;
+}
+
+static int
+prefix_matches(const iptrie_node_t* node, const uint8_t* addr) {
+    return common_bits(node->prefix.addr, addr, node->bits) == node->bits;
+}
+
+static iptrie_node_t*
+node_create(int family, const uint8_t* addr, int bits, iptrie_node_t* parent) {
+    iptrie_node_t* node = (iptrie_node_t*) malloc(sizeof(iptrie_node_t));
+    int i;
+
+    node->prefix.family = family;
+    node->prefix.netmask = family == AF_INET ? bits - 96 : bits;
+    node->bits = bits;
+    for (i = 0; i < 16; i++) {
+        if (bits >= 8) {
+            node->prefix.addr[i] = addr[i];
+            bits -= 8;
+        } else {
+            node->prefix.addr[i] = addr[i] & ~(0xff >> bits);
+            bits = 0;
+        }
+    }
+    node->in_set = 0;
+    node->parent = parent;
+    node->child[0] = NULL;
+    node->child[1] = NULL;
+    return node;
+}
+
+static void
+node_destroy(iptrie_node_t* node) {
+    if (node == NULL) {
+        return;
+    }
+    node_destroy(node->child[0]);
+    node_destroy(node->child[1]);
+    free(node);
+}
+
+// The pointer that refers to node: the root or a child of its parent
+static iptrie_node_t**
+node_link(iptrie_t* trie, iptrie_node_t* node) {
+    if (node->parent == NULL) {
+        return &trie->root[family_index(node->prefix.family)];
+    }
+    return &node->parent->child[node->parent->child[1] == node];
+}
+
+iptrie_t*
+iptrie_create(void) {
+    iptrie_t* trie = (iptrie_t*) malloc(sizeof(iptrie_t));
+
+    trie->root[0] = NULL;
+    trie->root[1] = NULL;
+    trie->size = 0;
+    return trie;
+}
+
+void
+iptrie_clear(iptrie_t* trie) {
+    node_destroy(trie->root[0]);
+    node_destroy(trie->root[1]);
+    trie->root[0] = NULL;
+    trie->root[1] = NULL;
+    trie->size = 0;
+}
+
+void
+iptrie_destroy(iptrie_t* trie) {
+    if (trie == NULL) {
+        return;
+    }
+    iptrie_clear(trie);
+    free(trie);
+}
+
+int
+iptrie_add(iptrie_t* trie, const ip_t* prefix) {
+    int fi = family_index(prefix->family);
+    int bits, common;
+    iptrie_node_t** link;
+    iptrie_node_t* node;
+    iptrie_node_t* parent = NULL;
+    iptrie_node_t* added;
+    iptrie_node_t* join;
+    uint8_t key[16];
+
+    if (fi < 0) {
+        return 0;
+    }
+    bits = prefix_bits(prefix->family, prefix->netmask);
+    make_key(key, prefix->family, prefix->addr);
+
+    link = &trie->root[fi];
+    while ((node = *link) != NULL) {
+        common = common_bits(node->prefix.addr, key,
+                             node->bits < bits ? node->bits : bits);
+        if (common < node->bits) {
+            // The new prefix branches off above node
+            added = node_create(prefix->family, key, bits, parent);
+            added->in_set = 1;
+            if (common == bits) {
+                // and node falls within it
+                added->child[bit_at(node->prefix.addr, bits)] = node;
+                node->parent = added;
+                *link = added;
+            } else {
+                join = node_create(prefix->family, key, common, parent);
+                join->child[bit_at(node->prefix.addr, common)] = node;
+                join->child[bit_at(key, common)] = added;
+                node->parent = join;
+                added->parent = join;
+                *link = join;
+            }
+            trie->size++;
+            return 1;
+        }
+        if (node->bits == bits) {
+            if (node->in_set) {
+                return 0;
+            }
+            node->in_set = 1;
+            trie->size++;
+            return 1;
+        }
+        parent = node;
+        link = &node->child[bit_at(key, node->bits)];
+    }
+
+    added = node_create(prefix->family, key, bits, parent);
+    added->in_set = 1;
+    *link = added;
+    trie->size++;
+    return 1;
+}
+
+static iptrie_node_t*
+find_exact(iptrie_t* trie, const ip_t* prefix) {
+    int fi = family_index(prefix->family);
+    int bits;
+    iptrie_node_t* node;
+    uint8_t key[16];
+
+    if (fi < 0) {
+        return NULL;
+    }
+    bits = prefix_bits(prefix->family, prefix->netmask);
+    make_key(key, prefix->family, prefix->addr);
+    node = trie->root[fi];
+    while (node != NULL && node->bits <= bits && prefix_matches(node, key)) {
+        if (node->bits == bits) {
+            return node;
+        }
+        node = node->child[bit_at(key, node->bits)];
+    }
+    return NULL;
+}
+
+int
+iptrie_remove(iptrie_t* trie, const ip_t* prefix) {
+    iptrie_node_t* node = find_exact(trie, prefix);
+    iptrie_node_t* child;
+    iptrie_node_t* parent;
+
+    if (node == NULL || !node->in_set) {
+        return 0;
+    }
+    node->in_set = 0;
+    trie->size--;
+
+    // Nodes outside the set are only kept while they join two subtrees
+    while (node != NULL && !node->in_set &&
+           (node->child[0] == NULL || node->child[1] == NULL)) {
+        child = node->child[0] != NULL ? node->child[0] : node->child[1];
+        parent = node->parent;
+        *node_link(trie, node) = child;
+        free(node);
+        if (child != NULL) {
+            child->parent = parent;
+            break;
+        }
+        node = parent;
+    }
+    return 1;
+}
+
+int
+iptrie_contains(iptrie_t* trie, const ip_t* prefix) {
+    iptrie_node_t* node = find_exact(trie, prefix);
+
+    return node != NULL && node->in_set;
+}
+
+const ip_t*
+iptrie_match(iptrie_t* trie, int family, const uint8_t* addr, int netmask) {
+    int fi = family_index(family);
+    int bits;
+    iptrie_node_t* node;
+    iptrie_node_t* best = NULL;
+    uint8_t key[16];
+
+    if (fi < 0) {
+        return NULL;
+    }
+    bits = prefix_bits(family, netmask);
+    make_key(key, family, addr);
+    node = trie->root[fi];
+    while (node != NULL && node->bits <= bits && prefix_matches(node, key)) {
+        if (node->in_set) {
+            best = node;
+        }
+        if (node->bits == bits) {
+            break;
+        }
+        node = node->child[bit_at(key, node->bits)];
+    }
+    return best != NULL ? &best->prefix : NULL;
+}
+
+size_t
+iptrie_size(iptrie_t* trie) {
+    return trie->size;
+}
+
+// Pre-order successor of node within its family
+static iptrie_node_t*
+node_next(iptrie_node_t* node) {
+    if (node->child[0] != NULL) {
+        return node->child[0];
+    }
+    if (node->child[1] != NULL) {
+        return node->child[1];
+    }
+    while (node->parent != NULL) {
+        if (node == node->parent->child[0] && node->parent->child[1] != NULL) {
+            return node->parent->child[1];
+        }
+        node = node->parent;
+    }
+    return NULL;
+}
+
+static iptrie_node_t*
+next_in_set(iptrie_t* trie, iptrie_node_t* node, int fi) {
+    while (fi < 2) {
+        while (node != NULL) {
+            if (node->in_set) {
+                return node;
+            }
+            node = node_next(node);
+        }
+        fi++;
+        if (fi < 2) {
+            node = trie->root[fi];
+        }
+    }
+    return NULL;
+}
+
+iptrie_node_t*
+iptrie_first(iptrie_t* trie) {
+    return next_in_set(trie, trie->root[0], 0);
+}
+
+iptrie_node_t*
+iptrie_next(iptrie_t* trie, iptrie_node_t* current) {
+    assert(current != NULL);
+    return next_in_set(trie, node_next(current),
+                       family_index(current->prefix.family));
+}
+
+void
+iptrie_write(iptrie_t* trie, FILE* out) {
+    iptrie_node_t* cur;
+    char ip_str[SPIN_PREFIXSTRLEN];
+
+    cur = iptrie_first(trie);
+    while (cur != NULL) {
+        spin_ntop_prefix(ip_str, &cur->prefix, sizeof(ip_str));
+        fprintf(out, "%s\n", ip_str);
+        cur = iptrie_next(trie, cur);
+    }
+}
+
+int
+iptrie_store(iptrie_t* trie, const char* filename) {
+    FILE* out = fopen(filename, "w");
+    if (out == NULL) {
+        return 0;
+    }
+    iptrie_write(trie, out);
+    fclose(out);
+    return 1;
+}
+
+#define IPTRIE_LINE_MAX 1024
+int
+iptrie_read(iptrie_t* trie, const char* filename) {
+    int count = 0;
+    char line[IPTRIE_LINE_MAX];
+    char* nl;
+    ip_t ip;
+
+    FILE* in = fopen(filename, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        nl = strchr(line, '\n');
+        if (nl != NULL) {
+            *nl = '\0';
+            if (spin_pton(&ip, line)) {
+                iptrie_add(trie, &ip);
+                count++;
+            }
+        }
+    }
+    fclose(in);
+    return count;
+}
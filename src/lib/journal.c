@@ -0,0 +1,254 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "spin_log.h"
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_TMP_SUFFIX ".tmp"
+#define JOURNAL_LINE_MAX 1024
+
+static char*
+path_with_suffix(const char* path, const char* suffix) {
+    size_t len = strlen(path);
+    char* result = malloc(len + strlen(suffix) + 1);
+
+    memcpy(result, path, len);
+    strcpy(result + len, suffix);
+    return result;
+}
+
+/*
+ * Reads the lines of a snapshot or journal; in a journal, an incomplete
+ * last line is the remainder of an interrupted write and is skipped
+ */
+static int
+replay_file(FILE* in, int is_journal, journal_apply_func apply, void* arg) {
+    char line[JOURNAL_LINE_MAX];
+    char* nl;
+    int count = 0;
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        nl = strchr(line, '\n');
+        if (nl != NULL) {
+            *nl = '\0';
+        } else if (is_journal || !feof(in)) {
+            // incomplete, or too long: skip the rest of the line
+            while (nl == NULL && fgets(line, sizeof(line), in) != NULL) {
+                nl = strchr(line, '\n');
+            }
+            continue;
+        }
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (!is_journal) {
+            apply(arg, 1, line);
+        } else if ((line[0] == '+' || line[0] == '-') && line[1] == ' ') {
+            apply(arg, line[0] == '+', line + 2);
+        } else {
+            continue;
+        }
+        count++;
+    }
+    return count;
+}
+
+int
+journal_replay(const char* path, journal_apply_func apply, void* arg) {
+    char* journal_path = path_with_suffix(path, JOURNAL_SUFFIX);
+    FILE* in;
+    int count = -1;
+
+    in = fopen(path, "r");
+    if (in != NULL) {
+        count = replay_file(in, 0, apply, arg);
+        fclose(in);
+    }
+    in = fopen(journal_path, "r");
+    if (in != NULL) {
+        count = (count < 0 ? 0 : count) + replay_file(in, 1, apply, arg);
+        fclose(in);
+    }
+    free(journal_path);
+    return count;
+}
+
+// Length of the journal up to and including its last complete line
+static off_t
+journal_valid_size(const char* journal_path) {
+    FILE* in = fopen(journal_path, "r");
+    off_t size = 0, valid = 0;
+    int c;
+
+    if (in == NULL) {
+        return 0;
+    }
+    while ((c = getc(in)) != EOF) {
+        size++;
+        if (c == '\n') {
+            valid = size;
+        }
+    }
+    fclose(in);
+    return valid;
+}
+
+journal_t*
+journal_open(const char* path) {
+    journal_t* journal;
+    struct stat st;
+    off_t valid;
+
+    journal = (journal_t*) malloc(sizeof(journal_t));
+    journal->path = strdup(path);
+    journal->journal_path = path_with_suffix(path, JOURNAL_SUFFIX);
+    journal->unsynced = 0;
+
+    valid = journal_valid_size(journal->journal_path);
+    journal->fd = open(journal->journal_path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (journal->fd < 0) {
+        spin_log(LOG_ERR, "Cannot open %s: %s\n", journal->journal_path, strerror(errno));
+        free(journal->journal_path);
+        free(journal->path);
+        free(journal);
+        return NULL;
+    }
+    // drop an interrupted write, so that the next change starts on a new line
+    if (fstat(journal->fd, &st) == 0 && st.st_size > valid) {
+        if (ftruncate(journal->fd, valid) != 0) {
+            spin_log(LOG_WARNING, "Cannot truncate %s: %s\n", journal->journal_path, strerror(errno));
+        }
+    }
+    journal->journal_size = valid;
+    journal->snapshot_size = stat(path, &st) == 0 ? st.st_size : 0;
+    return journal;
+}
+
+void
+journal_close(journal_t* journal) {
+    if (journal == NULL) {
+        return;
+    }
+    if (journal->unsynced) {
+        fsync(journal->fd);
+    }
+    close(journal->fd);
+    free(journal->journal_path);
+    free(journal->path);
+    free(journal);
+}
+
+int
+journal_append(journal_t* journal, int add, const char* entry) {
+    char line[JOURNAL_LINE_MAX];
+    int len;
+    ssize_t written;
+
+    len = snprintf(line, sizeof(line), "%c %s\n", add ? '+' : '-', entry);
+    if (len < 0 || (size_t) len >= sizeof(line)) {
+        spin_log(LOG_ERR, "Entry too long for %s\n", journal->journal_path);
+        return 0;
+    }
+    // a single write, so that a crash leaves at most this line incomplete
+    written = write(journal->fd, line, len);
+    if (written != len) {
+        spin_log(LOG_ERR, "Cannot write to %s: %s\n", journal->journal_path,
+                 written < 0 ? strerror(errno) : "short write");
+        return 0;
+    }
+    journal->journal_size += len;
+    journal->unsynced++;
+    return 1;
+}
+
+int
+journal_sync(journal_t* journal, journal_write_func write_func, void* arg) {
+    if (journal->unsynced) {
+        if (fsync(journal->fd) != 0) {
+            spin_log(LOG_ERR, "Cannot sync %s: %s\n", journal->journal_path, strerror(errno));
+            return 0;
+        }
+        journal->unsynced = 0;
+    }
+    if (journal->journal_size > JOURNAL_COMPACT_MIN &&
+        journal->journal_size > journal->snapshot_size) {
+        return journal_compact(journal, write_func, arg);
+    }
+    return 1;
+}
+
+// Makes the rename of a file in the directory of path permanent
+static void
+sync_directory(const char* path) {
+    char* dir = strdup(path);
+    char* slash = strrchr(dir, '/');
+    int fd;
+
+    if (slash == dir) {
+        slash[1] = '\0';
+    } else if (slash != NULL) {
+        *slash = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+int
+journal_compact(journal_t* journal, journal_write_func write_func, void* arg) {
+    char* tmp_path = path_with_suffix(journal->path, JOURNAL_TMP_SUFFIX);
+    FILE* out;
+    long size;
+    int ok;
+
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        spin_log(LOG_ERR, "Cannot create %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return 0;
+    }
+    write_func(arg, out);
+    ok = fflush(out) == 0 && !ferror(out) && fsync(fileno(out)) == 0;
+    size = ftell(out);
+    ok = fclose(out) == 0 && ok;
+    if (!ok || rename(tmp_path, journal->path) != 0) {
+        spin_log(LOG_ERR, "Cannot write %s: %s\n", journal->path, strerror(errno));
+        unlink(tmp_path);
+        free(tmp_path);
+        return 0;
+    }
+    free(tmp_path);
+    sync_directory(journal->path);
+    journal->snapshot_size = size;
+
+    // The snapshot now includes the journal; replaying it again would
+    // not change anything, so a crash before this point is harmless
+    if (ftruncate(journal->fd, 0) != 0 || fsync(journal->fd) != 0) {
+        spin_log(LOG_ERR, "Cannot empty %s: %s\n", journal->journal_path, strerror(errno));
+        return 0;
+    }
+    journal->journal_size = 0;
+    journal->unsynced = 0;
+    return 1;
+}
+
+void
+journal_remove(const char* path) {
+    char* journal_path = path_with_suffix(path, JOURNAL_SUFFIX);
+
+    unlink(path);
+    unlink(journal_path);
+    free(journal_path);
+}
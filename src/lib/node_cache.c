@@ -1,6 +1,7 @@
 
 #include <assert.h>
 
+#include "intern.h"
 #include "spinhook.h"
 #include "spin_log.h"
 #include "statistics.h"
@@ -8,6 +9,14 @@
 STAT_MODULE(node_cache)
 
 STAT_COUNTER(nodes, nodes, STAT_TOTAL);
+STAT_COUNTER(footprint, footprint, STAT_TOTAL);
+
+// rough sizes of a node in the cache, and of each of its addresses and
+// domains, counting the entries in both the node and the cache
+#define NODE_FOOTPRINT      (sizeof(node_t) + 2 * sizeof(tree_t))
+#define IP_FOOTPRINT        (2 * (sizeof(tree_entry_t) + sizeof(ip_t)) + sizeof(node_t*))
+#define DOMAIN_FOOTPRINT(domain) \
+    (2 * sizeof(tree_entry_t) + sizeof(node_t*) + sizeof(domtrie_node_t) + strlen(domain) + 1)
 
 #undef NEWMERGEDEBUG
 
@@ -19,7 +28,7 @@ node_create(int id) {
     node_t* node = (node_t*) malloc(sizeof(node_t));
     node->id = id;
     node->ips = tree_create(cmp_ips);
-    node->domains = tree_create(cmp_domains);
+    node->domains = intern_tree_create();
     node->name = NULL;
     node->mac = NULL;
     for (i=0;i<N_IPLIST;i++) {
@@ -30,6 +39,9 @@ node_create(int id) {
     node->persistent = 0;
     node->references = 0;
     node->device = NULL;
+    node->lru_prev = NULL;
+    node->lru_next = NULL;
+    node->lru_time = 0;
     return node;
 }
 
@@ -56,6 +68,7 @@ node_destroy(node_t* node) {
         if (node->device->dv_flowtree) {
             tree_destroy(node->device->dv_flowtree);
         }
+        twheel_destroy(node->device->dv_expiry);
         free(node->device);
         node->device = NULL;
     }
@@ -63,10 +76,17 @@ node_destroy(node_t* node) {
     free(node);
 }
 
-void
+static void
+footprint_add(node_cache_t *node_cache, long size) {
+    node_cache->footprint += size;
+    STAT_VALUE(footprint, size);
+}
+
+// Returns 0 if key was there already (and now refers to node)
+int
 cache_tree_add_keytonode(tree_t *totree, node_t* node, size_t key_len, void* key_data) {
 
-    tree_add(totree, key_len, key_data, sizeof(node), (void *) &node , 1);
+    return tree_add(totree, key_len, key_data, sizeof(node), (void *) &node , 1);
 }
 
 void
@@ -74,7 +94,9 @@ cache_tree_add_ip(node_cache_t *node_cache, node_t* node, ip_t* ip) {
     STAT_COUNTER(ctr, cache-tree-add-ip, STAT_TOTAL);
 
     STAT_VALUE(ctr, 1);
-    cache_tree_add_keytonode(node_cache->ip_refs, node, sizeof(ip_t),  ip);
+    if (cache_tree_add_keytonode(node_cache->ip_refs, node, sizeof(ip_t),  ip)) {
+        footprint_add(node_cache, IP_FOOTPRINT);
+    }
 }
 
 void
@@ -84,6 +106,9 @@ cache_tree_remove_ip(node_cache_t *node_cache, ip_t* ip) {
 
     STAT_VALUE(ctr, 1);
     cur = tree_find(node_cache->ip_refs, sizeof(ip_t), ip);
+    if (cur != NULL) {
+        footprint_add(node_cache, -(long) IP_FOOTPRINT);
+    }
     tree_remove_entry(node_cache->ip_refs, cur);
 }
 
@@ -220,7 +245,10 @@ cache_tree_add_domain(node_cache_t *node_cache, node_t* node, char* domain) {
     STAT_COUNTER(ctr, cache-tree-add-domain, STAT_TOTAL);
 
     STAT_VALUE(ctr, 1);
-    cache_tree_add_keytonode(node_cache->domain_refs, node, strlen(domain) + 1, domain);
+    if (cache_tree_add_keytonode(node_cache->domain_refs, node, strlen(domain) + 1, domain)) {
+        footprint_add(node_cache, DOMAIN_FOOTPRINT(domain));
+    }
+    domtrie_add(node_cache->domain_trie, domain, node);
 }
 
 void
@@ -230,7 +258,11 @@ cache_tree_remove_domain(node_cache_t *node_cache, char* domain) {
 
     STAT_VALUE(ctr, 1);
     cur = tree_find(node_cache->domain_refs, strlen(domain) + 1, domain);
+    if (cur != NULL) {
+        footprint_add(node_cache, -(long) DOMAIN_FOOTPRINT(domain));
+    }
     tree_remove_entry(node_cache->domain_refs, cur);
+    domtrie_remove(node_cache->domain_trie, domain);
 }
 
 void
@@ -425,20 +457,18 @@ node_print(node_t* node) {
 }
 
 void node_callback_new(node_cache_t* node_cache, modfunc mf) {
-    tree_entry_t* cur = tree_first(node_cache->nodes);
-    node_t* node;
+    node_t* node = node_cache_first(node_cache);
     int nfound;
     STAT_COUNTER(ctr, publish-new, STAT_TOTAL);
 
     nfound = 0;
-    while (cur != NULL) {
-        node = (node_t*)cur->data;
+    while (node != NULL) {
         if (node->modified) {
             (*mf)(node);
             nfound++;
             node->modified = 0;
         }
-        cur = tree_next(cur);
+        node = node_cache_next(node_cache, node);
     }
     STAT_VALUE(ctr, nfound);
 }
@@ -464,6 +494,46 @@ void node_callback_devices(node_cache_t* node_cache, cleanfunc mf, void * ap) {
     STAT_VALUE(ctr, nfound);
 }
 
+/*
+ * Same as node_callback_devices(), but only for at most limit devices,
+ * starting with the first device whose MAC address sorts after the
+ * given one (or at the start if after is NULL or empty).
+ *
+ * Returns the MAC address of the last device passed to the callback if
+ * there are more devices left, NULL otherwise. The returned string is
+ * owned by the node cache and only valid until it is modified.
+ */
+const char*
+node_callback_devices_page(node_cache_t* node_cache, const char* after, int limit, cleanfunc mf, void * ap) {
+    tree_entry_t* cur;
+    node_t* node;
+    int nfound;
+    STAT_COUNTER(ctr, publish-device-page, STAT_TOTAL);
+
+    if (after == NULL || *after == '\0') {
+        cur = tree_first(node_cache->mac_refs);
+    } else {
+        cur = tree_find_next(node_cache->mac_refs, strlen(after) + 1, after);
+    }
+    nfound = 0;
+    while (cur != NULL && nfound < limit) {
+        node = * ((node_t**) cur->data);
+        if (!node->device) {
+            node_cache_update_arp(node_cache, 0);
+        }
+        assert(node->device);
+        (*mf)(node_cache, node, ap);
+        nfound++;
+        if (nfound == limit && tree_next(cur) != NULL) {
+            STAT_VALUE(ctr, nfound);
+            return (const char*) cur->key;
+        }
+        cur = tree_next(cur);
+    }
+    STAT_VALUE(ctr, nfound);
+    return NULL;
+}
+
 /*
  * Create and destroy node_cache
  *
@@ -472,13 +542,16 @@ void node_callback_devices(node_cache_t* node_cache, cleanfunc mf, void * ap) {
 node_cache_t*
 node_cache_create(enum arp_table_backend backend) {
     node_cache_t* node_cache = (node_cache_t*)malloc(sizeof(node_cache_t));
-    node_cache->nodes = tree_create(cmp_ints);
+    node_cache->nodes = idtable_create();
 
     node_cache->ip_refs = tree_create(cmp_ips);
-    node_cache->domain_refs = tree_create(cmp_strs);
+    node_cache->domain_refs = intern_tree_create();
+    node_cache->domain_trie = domtrie_create();
+    node_cache->expiry = twheel_create(sizeof(int));
     node_cache->mac_refs = tree_create(cmp_strs);
-
-    node_cache->available_id = 1;
+    node_cache->lru_first = NULL;
+    node_cache->lru_last = NULL;
+    node_cache->footprint = 0;
 
     node_cache->arp_table = arp_table_create(backend);
     node_cache->names = node_names_create();
@@ -491,17 +564,19 @@ node_cache_create(enum arp_table_backend backend) {
 
 void
 node_cache_destroy(node_cache_t* node_cache) {
-    node_t* cur_node;
-    tree_entry_t* cur = tree_first(node_cache->nodes);
-    while (cur != NULL) {
-        cur_node = (node_t*)cur->data;
+    node_t* cur_node = node_cache_first(node_cache);
+    node_t* next;
+
+    while (cur_node != NULL) {
+        next = node_cache_next(node_cache, cur_node);
         node_destroy(cur_node);
-        cur->data = NULL;
-        cur = tree_next(cur);
+        cur_node = next;
     }
-    tree_destroy(node_cache->nodes);
+    idtable_destroy(node_cache->nodes);
     tree_destroy(node_cache->ip_refs);
     tree_destroy(node_cache->domain_refs);
+    domtrie_destroy(node_cache->domain_trie);
+    twheel_destroy(node_cache->expiry);
     tree_destroy(node_cache->mac_refs);
     arp_table_destroy(node_cache->arp_table);
     node_names_destroy(node_cache->names);
@@ -510,13 +585,12 @@ node_cache_destroy(node_cache_t* node_cache) {
 
 void
 node_cache_print(node_cache_t* node_cache) {
-    tree_entry_t* cur = tree_first(node_cache->nodes);
-    node_t* cur_node;
+    node_t* cur_node = node_cache_first(node_cache);
+
     spin_log(LOG_DEBUG, "[node cache]\n");
-    while (cur != NULL) {
-        cur_node = (node_t*) cur->data;
+    while (cur_node != NULL) {
         node_print(cur_node);
-        cur = tree_next(cur);
+        cur_node = node_cache_next(node_cache, cur_node);
     }
     spin_log(LOG_DEBUG, "[end of node cache]\n");
 
@@ -542,16 +616,13 @@ node_t* node_cache_find_by_mac(node_cache_t* node_cache, char* macaddr) {
 int node_cache_find_all_by_mac(node_t* result[10], node_cache_t* node_cache, char* macaddr) {
     int count = 0;
     node_t *node;
-    tree_entry_t *leaf;
 
-    leaf = tree_first(node_cache->nodes);
-    while (leaf != NULL) {
-        //node = * ((node_t**) leaf->data);
-        node = (node_t*) leaf->data;
+    node = node_cache_first(node_cache);
+    while (node != NULL) {
         if (node->mac != NULL && strcmp(macaddr, node->mac) == 0) {
             result[count++] = node;
         }
-        leaf = tree_next(leaf);
+        node = node_cache_next(node_cache, node);
     }
 
     spin_log(LOG_DEBUG, "Found %d nodes with mac %s\n", count, macaddr);
@@ -579,7 +650,9 @@ node_t* node_cache_find_by_domain(node_cache_t* node_cache, char* dname) {
     tree_entry_t *leaf;
     STAT_COUNTER(ctr, find-by-domain, STAT_TOTAL);
 
-    leaf = tree_find(node_cache->domain_refs, strlen(dname) + 1, dname);
+    // a name that is not interned is nowhere
+    dname = (char*) intern_find(dname);
+    leaf = dname == NULL ? NULL : tree_find(node_cache->domain_refs, strlen(dname) + 1, dname);
     if (leaf != NULL) {
         node = * ((node_t**) leaf->data);
         STAT_VALUE(ctr, 1);
@@ -590,14 +663,50 @@ node_t* node_cache_find_by_domain(node_cache_t* node_cache, char* dname) {
     return NULL;
 }
 
+struct walk_domains_arg {
+    node_cache_t* node_cache;
+    domainfunc func;
+    void* arg;
+};
+
+static void
+walk_domains_func(const char* name, void* item, void* arg) {
+    struct walk_domains_arg* wa = (struct walk_domains_arg*) arg;
+
+    wa->func(wa->node_cache, (node_t*) item, name, wa->arg);
+}
+
+size_t node_cache_walk_domains(node_cache_t* node_cache, const char* suffix, domainfunc func, void* arg) {
+    struct walk_domains_arg wa;
+    size_t count;
+    STAT_COUNTER(ctr, walk-domains, STAT_TOTAL);
+
+    wa.node_cache = node_cache;
+    wa.func = func;
+    wa.arg = arg;
+    count = domtrie_walk(node_cache->domain_trie, suffix, walk_domains_func, &wa);
+    STAT_VALUE(ctr, count);
+    return count;
+}
+
+size_t node_cache_count_domains(node_cache_t* node_cache, const char* suffix) {
+    return domtrie_count(node_cache->domain_trie, suffix);
+}
+
 node_t* node_cache_find_by_id(node_cache_t* node_cache, int node_id) {
-    int my_id = node_id;
-    tree_entry_t* cur = tree_find(node_cache->nodes, sizeof(node_id), &my_id);
-    if (cur == NULL) {
-        return NULL;
-    } else {
-        return (node_t*)cur->data;
-    }
+    return (node_t*) idtable_get(node_cache->nodes, node_id);
+}
+
+node_t* node_cache_first(node_cache_t* node_cache) {
+    return node_cache_find_by_id(node_cache, idtable_next(node_cache->nodes, 0));
+}
+
+node_t* node_cache_next(node_cache_t* node_cache, node_t* current) {
+    return node_cache_find_by_id(node_cache, idtable_next(node_cache->nodes, current->id));
+}
+
+size_t node_cache_size(node_cache_t* node_cache) {
+    return idtable_size(node_cache->nodes);
 }
 
 static void
@@ -628,47 +737,191 @@ node_clean(node_cache_t *node_cache, node_t *node) {
     }
 }
 
+static void
+lru_append(node_cache_t *node_cache, node_t *node) {
+    node->lru_prev = node_cache->lru_last;
+    node->lru_next = NULL;
+    if (node_cache->lru_last != NULL) {
+        node_cache->lru_last->lru_next = node;
+    } else {
+        node_cache->lru_first = node;
+    }
+    node_cache->lru_last = node;
+}
+
+static void
+lru_unlink(node_cache_t *node_cache, node_t *node) {
+    if (node->lru_prev != NULL) {
+        node->lru_prev->lru_next = node->lru_next;
+    } else {
+        node_cache->lru_first = node->lru_next;
+    }
+    if (node->lru_next != NULL) {
+        node->lru_next->lru_prev = node->lru_prev;
+    } else {
+        node_cache->lru_last = node->lru_prev;
+    }
+    node->lru_prev = NULL;
+    node->lru_next = NULL;
+}
+
+// Takes the node out of the table and the lru list; its addresses and
+// domains are up to the caller
+static void
+node_unlist(node_cache_t *node_cache, node_t *node) {
+    idtable_remove(node_cache->nodes, node->id);
+    lru_unlink(node_cache, node);
+    footprint_add(node_cache, -(long) NODE_FOOTPRINT);
+}
+
+static void
+node_delete(node_cache_t *node_cache, node_t *node) {
+    spinhook_nodedeleted(node_cache, node);
+
+    node_clean(node_cache, node);
+    node_unlist(node_cache, node);
+    node_destroy(node);
+}
+
 void node_cache_clean(node_cache_t* node_cache, uint32_t older_than) {
-    tree_entry_t* cur = tree_first(node_cache->nodes);
-    tree_entry_t* next;
-    node_t* node;
+    node_t* node = node_cache_first(node_cache);
+    node_t* next;
     size_t deleted = 0;
     STAT_COUNTER(nretained, old-retained, STAT_TOTAL);
 
     spin_log(LOG_DEBUG, "[cache] clean up cache, timestamp %u\n", older_than);
-    while (cur != NULL) {
-        node = (node_t*)cur->data;
-        next = tree_next(cur);
+    while (node != NULL) {
+        next = node_cache_next(node_cache, node);
         if (node->last_seen < older_than) {
             if (!node->device && !node->references && !node->persistent) {
-                spinhook_nodedeleted(node_cache, node);
-
-                node_clean(node_cache, node);
-                node_destroy(node);
-                cur->data = NULL;
-                tree_remove_entry(node_cache->nodes, cur);
+                node_delete(node_cache, node);
                 deleted++;
                 STAT_VALUE(nretained, 1);
             } else {
                 STAT_VALUE(nretained, 0);
             }
         }
-        cur = next;
+        node = next;
     }
-    spin_log(LOG_DEBUG, "[node_cache] Removed %zu entries older than %u, size now %u\n", deleted, older_than, tree_size(node_cache->nodes));
+    spin_log(LOG_DEBUG, "[node_cache] Removed %zu entries older than %u, size now %zu\n", deleted, older_than, node_cache_size(node_cache));
 
     cache_tree_print(node_cache);
 }
 
+struct expire_arg {
+    node_cache_t* node_cache;
+    uint32_t older_than;
+    size_t deleted;
+};
 
+static void
+node_expire(uint32_t time, void* data, void* arg) {
+    struct expire_arg* ea = (struct expire_arg*) arg;
+    int id = * (int*) data;
+    node_t* node = node_cache_find_by_id(ea->node_cache, id);
+    STAT_COUNTER(nretained, expire-retained, STAT_TOTAL);
+
+    if (node == NULL) {
+        // removed or merged into another node in the meantime
+        return;
+    }
+    if (node->last_seen >= ea->older_than) {
+        // seen since; look again once that is old enough
+        twheel_add(ea->node_cache->expiry, node->last_seen, &id);
+        return;
+    }
+    if (node->device || node->references || node->persistent) {
+        twheel_add(ea->node_cache->expiry, ea->older_than + NODE_CACHE_RECHECK, &id);
+        STAT_VALUE(nretained, 0);
+        return;
+    }
+    node_delete(ea->node_cache, node);
+    ea->deleted++;
+    STAT_VALUE(nretained, 1);
+}
+
+size_t node_cache_expire(node_cache_t* node_cache, uint32_t older_than, size_t budget) {
+    struct expire_arg ea;
+    size_t done;
+    STAT_COUNTER(ctr, expire-checked, STAT_TOTAL);
+
+    if (older_than == 0) {
+        return 0;
+    }
+    ea.node_cache = node_cache;
+    ea.older_than = older_than;
+    ea.deleted = 0;
+    // the nodes last seen before older_than
+    done = twheel_advance(node_cache->expiry, older_than - 1, node_expire, &ea, budget);
+    STAT_VALUE(ctr, done);
+    if (ea.deleted > 0) {
+        spin_log(LOG_DEBUG, "[node_cache] Expired %zu of %zu nodes older than %u, size now %zu\n", ea.deleted, done, older_than, node_cache_size(node_cache));
+    }
+    return ea.deleted;
+}
+
+size_t
+node_cache_evict(node_cache_t* node_cache, size_t max_nodes, size_t budget) {
+    node_t* node;
+    size_t size = node_cache_size(node_cache);
+    size_t kept = 0;
+    size_t evicted = 0;
+    size_t looked = 0;
+    STAT_COUNTER(ctr, evicted, STAT_TOTAL);
+
+    if (max_nodes == 0) {
+        return 0;
+    }
+    // stop when all nodes that are left must be kept
+    while (size - evicted > max_nodes && kept < size - evicted) {
+        if (budget != 0 && looked == budget) {
+            break;
+        }
+        looked++;
+        node = node_cache->lru_first;
+        if (node->last_seen > node->lru_time) {
+            // seen since it was put in the list; to its place at the back
+            node->lru_time = node->last_seen;
+            lru_unlink(node_cache, node);
+            lru_append(node_cache, node);
+            continue;
+        }
+        if (node->device || node->references || node->persistent) {
+            lru_unlink(node_cache, node);
+            lru_append(node_cache, node);
+            kept++;
+            continue;
+        }
+        node_delete(node_cache, node);
+        evicted++;
+    }
+    STAT_VALUE(ctr, evicted);
+    if (evicted > 0) {
+        spin_log(LOG_DEBUG, "[node_cache] Evicted %zu nodes, size now %zu (%zu bytes)\n", evicted, node_cache_size(node_cache), node_cache->footprint);
+    }
+    return evicted;
+}
+
+size_t
+node_cache_footprint(node_cache_t* node_cache) {
+    return node_cache->footprint;
+}
+
+// Stores the node in the table, which gives it its id
 static int
-node_cache_get_new_id(node_cache_t* node_cache) {
+node_cache_get_new_id(node_cache_t* node_cache, node_t* node) {
     int nextid;
     STAT_COUNTER(nnodes, number-nodes, STAT_MAX);
 
-    // just incremental for now
-    nextid = node_cache->available_id++;
-    STAT_VALUE(nnodes, node_cache->available_id);
+    nextid = idtable_add(node_cache->nodes, node);
+    // a million nodes at the same time would have run out of memory
+    // long before
+    assert(nextid != 0);
+    twheel_add(node_cache->expiry, node->last_seen, &nextid);
+    node->lru_time = node->last_seen;
+    lru_append(node_cache, node);
+    footprint_add(node_cache, NODE_FOOTPRINT);
+    STAT_VALUE(nnodes, node_cache_size(node_cache));
 
     return nextid;
 }
@@ -947,13 +1200,13 @@ makedevice(node_t *node) {
     dev = (device_t *) malloc(sizeof(device_t));
     dev->dv_flowtree = tree_create(cmp_flow_keys);
     dev->dv_nflows = 0;
+    dev->dv_expiry = twheel_create(sizeof(devflow_key_t));
     node->device = dev;
 }
 
 void
 merge_nodes(node_cache_t *node_cache, node_t* src_node, node_t* dest_node) {
     int thisid;
-    tree_entry_t *thisleaf;
 
     if (src_node->device && dest_node->device) {
         spin_log(LOG_ERR, "Merge two devices!!! %p to %p\n", src_node, dest_node);
@@ -965,15 +1218,10 @@ merge_nodes(node_cache_t *node_cache, node_t* src_node, node_t* dest_node) {
     node_merge(node_cache, dest_node, src_node);
     if (thisid != 0) {
         spinhook_nodesmerged(node_cache, dest_node, src_node);
+        // Existing nodes must be taken out of the table
+        node_unlist(node_cache, src_node);
     }
     node_destroy(src_node);
-    if (thisid != 0) {
-        // Existing nodes must be taken out of tree
-        thisleaf = tree_find(node_cache->nodes, sizeof(thisid), &thisid);
-        // set data to 0, else it will be freed again
-        thisleaf->data = NULL;
-        tree_remove_entry(node_cache->nodes, thisleaf);
-    }
 }
 
 int
@@ -982,7 +1230,7 @@ node_cache_add_node(node_cache_t *node_cache, node_t *node) {
     int i, nnodes_to_merge;
     tree_entry_t *leaf, *newleaf;
     node_t *existing_node, *dest_node;
-    int new_id, *new_id_mem;
+    int new_id;
     STAT_COUNTER(ctr, nodes-to-merge, STAT_MAX);
 
     assert(node->id == 0);
@@ -1049,13 +1297,9 @@ node_cache_add_node(node_cache_t *node_cache, node_t *node) {
     }
 
     // ok no shared elements at all, add as a new node
-    new_id = node_cache_get_new_id(node_cache);
-    new_id_mem = (int*) malloc(sizeof(new_id));
-    memcpy(new_id_mem, &new_id, sizeof(new_id));
+    new_id = node_cache_get_new_id(node_cache, node);
     node->id = new_id;
 
-    tree_add(node_cache->nodes, sizeof(new_id), new_id_mem, sizeof(node_t), node, 0);
-
     /*
      * Add cache tree entries for previous node 0
      */
@@ -25,6 +25,7 @@ enum configs {
     IPTABLE_PLACE_BLOCK,
     IPTABLE_DEBUG,
     NODE_CACHE_RETAIN_TIME,
+    NODE_CACHE_MAX_NODES,
     DOTS_ENABLED,   // Enable DOTS handler functionality
     DOTS_LOG_ONLY, // Only LOG DOTS mitigation request matches (do not block them)
     SPINWEB_PID_FILE,
@@ -33,6 +34,10 @@ enum configs {
     SPINWEB_TLS_CERTIFICATE_FILE,
     SPINWEB_TLS_KEY_FILE,
     SPINWEB_PASSWORD_FILE,
+    SPINWEB_THREADS,
+    SPINWEB_MAX_CONNECTIONS,
+    SPINWEB_CONNECTION_TIMEOUT,
+    SPINWEB_CAPTURE_INTERFACE,
 };
 
 struct conf_item {
@@ -78,6 +83,8 @@ struct conf_item {
             { "iptable_debug",           "/tmp/block_commands", 0   },
     [NODE_CACHE_RETAIN_TIME] =
             { "node_cache_retain_time",     "1800",             0   },
+    [NODE_CACHE_MAX_NODES] =
+            { "node_cache_max_nodes",       "2048",             0   },
     [DOTS_ENABLED] =
             { "dots_enabled",               "0",                0   },
     [DOTS_LOG_ONLY] =
@@ -94,6 +101,14 @@ struct conf_item {
             { "spinweb_tls_key_file",         "",               0   },
     [SPINWEB_PASSWORD_FILE] =
             { "spinweb_password_file",        "",               0   },
+    [SPINWEB_THREADS] =
+            { "spinweb_threads",              "0",              0   },
+    [SPINWEB_MAX_CONNECTIONS] =
+            { "spinweb_max_connections",      "64",             0   },
+    [SPINWEB_CONNECTION_TIMEOUT] =
+            { "spinweb_connection_timeout",   "300",            0   },
+    [SPINWEB_CAPTURE_INTERFACE] =
+            { "spinweb_capture_interface",    "br-lan",         0   },
  { 0, 0, 0 }
 };
 
@@ -229,6 +244,10 @@ int spinconfig_node_cache_retain_time() {
     return(spi_int(NODE_CACHE_RETAIN_TIME));
 }
 
+int spinconfig_node_cache_max_nodes() {
+    return(spi_int(NODE_CACHE_MAX_NODES));
+}
+
 int spinconfig_dots_enabled() {
     return(spi_int(DOTS_ENABLED));
 }
@@ -262,6 +281,22 @@ char* spinconfig_spinweb_password_file() {
     return(spi_str(SPINWEB_PASSWORD_FILE));
 }
 
+int spinconfig_spinweb_threads() {
+    return(spi_int(SPINWEB_THREADS));
+}
+
+int spinconfig_spinweb_max_connections() {
+    return(spi_int(SPINWEB_MAX_CONNECTIONS));
+}
+
+int spinconfig_spinweb_connection_timeout() {
+    return(spi_int(SPINWEB_CONNECTION_TIMEOUT));
+}
+
+char* spinconfig_spinweb_capture_interface() {
+    return(spi_str(SPINWEB_CAPTURE_INTERFACE));
+}
+
 void spinconfig_print_defaults() {
     struct conf_item* ci;
     int i = 0;
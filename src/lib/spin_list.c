@@ -7,9 +7,9 @@
  * BLOCK, IGNORE, ALLOW
  */
 struct list_info ipl_list_ar[N_IPLIST] = {
-    { 0, "block",   0 },
-    { 0, "ignore",  0 },
-    { 0, "allow",   0 },
+    { .li_listname = "block" },
+    { .li_listname = "ignore" },
+    { .li_listname = "allow" },
 };
 
 struct list_info* get_spin_iplists() {
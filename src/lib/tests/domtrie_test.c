@@ -0,0 +1,189 @@
+#include "domtrie.h"
+#include "intern.h"
+
+#include "test_helper.h"
+
+static int items[10];
+
+typedef struct {
+    char names[10][64];
+    int count;
+} walk_result_t;
+
+static void
+collect(const char* name, void* item, void* arg) {
+    walk_result_t* result = (walk_result_t*) arg;
+
+    assert(result->count < 10);
+    strcpy(result->names[result->count++], name);
+}
+
+static void
+check_walk(domtrie_t* trie, const char* suffix, const char** expected, int count) {
+    walk_result_t result;
+    int i;
+
+    result.count = 0;
+    assert(domtrie_walk(trie, suffix, collect, &result) == (size_t) count);
+    assertf(result.count == count, "walk of %s gave %d names, expected %d", suffix, result.count, count);
+    for (i = 0; i < count; i++) {
+        assertf(strcmp(result.names[i], expected[i]) == 0, "name %d of %s is %s, expected %s", i, suffix, result.names[i], expected[i]);
+    }
+    assert(domtrie_count(trie, suffix) == (size_t) count);
+}
+
+void
+test_domtrie_add_find() {
+    domtrie_t* trie = domtrie_create();
+
+    assert(domtrie_find(trie, "example.com.") == NULL);
+    assert(domtrie_count(trie, ".") == 0);
+
+    assert(domtrie_add(trie, "www.example.com.", &items[0]) == 1);
+    assert(domtrie_add(trie, "example.com.", &items[1]) == 1);
+    assert(domtrie_add(trie, "www.example.net.", &items[2]) == 1);
+    // with or without the trailing dot, in any case
+    assert(domtrie_add(trie, "WWW.Example.com", &items[3]) == 0);
+    assert(domtrie_count(trie, ".") == 3);
+
+    assert(domtrie_find(trie, "www.example.com.") == &items[3]);
+    assert(domtrie_find(trie, "Example.COM") == &items[1]);
+    assert(domtrie_find(trie, "www.example.net.") == &items[2]);
+    // example.net is only there as a suffix
+    assert(domtrie_find(trie, "example.net.") == NULL);
+    assert(domtrie_find(trie, "com.") == NULL);
+    assert(domtrie_find(trie, "a.www.example.com.") == NULL);
+    assert(domtrie_find(trie, "*.example.com.") == NULL);
+
+    // escaped dots are part of the label
+    assert(domtrie_add(trie, "a\\.b.example.com.", &items[4]) == 1);
+    assert(domtrie_find(trie, "b.example.com.") == NULL);
+    assert(domtrie_find(trie, "a\\.b.example.com") == &items[4]);
+
+    domtrie_destroy(trie);
+    assert(intern_count() == 0);
+}
+
+void
+test_domtrie_remove() {
+    domtrie_t* trie = domtrie_create();
+
+    domtrie_add(trie, "www.example.com.", &items[0]);
+    domtrie_add(trie, "mail.example.com.", &items[1]);
+    domtrie_add(trie, "example.org.", &items[2]);
+
+    assert(domtrie_remove(trie, "example.com.") == NULL);
+    assert(domtrie_remove(trie, "foo.example.com.") == NULL);
+    assert(domtrie_remove(trie, "www.example.com.") == &items[0]);
+    assert(domtrie_remove(trie, "www.example.com.") == NULL);
+    assert(domtrie_find(trie, "mail.example.com.") == &items[1]);
+    assert(domtrie_count(trie, "example.com.") == 1);
+    assert(domtrie_count(trie, ".") == 2);
+
+    assert(domtrie_remove(trie, "mail.example.com.") == &items[1]);
+    // the empty nodes are gone, only org and example remain
+    assert(trie->root.children != NULL);
+    assert(tree_size(trie->root.children) == 1);
+    assert(intern_count() == 2);
+
+    assert(domtrie_remove(trie, "Example.Org") == &items[2]);
+    assert(trie->root.children == NULL);
+    assert(trie->root.count == 0);
+    assert(intern_count() == 0);
+
+    domtrie_destroy(trie);
+}
+
+void
+test_domtrie_walk() {
+    domtrie_t* trie = domtrie_create();
+
+    domtrie_add(trie, "www.example.com.", &items[0]);
+    domtrie_add(trie, "example.com.", &items[1]);
+    domtrie_add(trie, "a.b.example.com.", &items[2]);
+    domtrie_add(trie, "example.net.", &items[3]);
+    domtrie_add(trie, "notexample.com.", &items[4]);
+
+    check_walk(trie, "example.com.", (const char*[]) {
+        "example.com.", "a.b.example.com.", "www.example.com."
+    }, 3);
+    check_walk(trie, "*.example.com", (const char*[]) {
+        "a.b.example.com.", "www.example.com."
+    }, 2);
+    check_walk(trie, "b.example.com.", (const char*[]) { "a.b.example.com." }, 1);
+    check_walk(trie, "com.", (const char*[]) {
+        "example.com.", "a.b.example.com.", "www.example.com.", "notexample.com."
+    }, 4);
+    check_walk(trie, "c.example.com.", NULL, 0);
+    check_walk(trie, "org.", NULL, 0);
+    assert(domtrie_count(trie, ".") == 5);
+    assert(domtrie_count(trie, "") == 5);
+
+    domtrie_destroy(trie);
+}
+
+void
+test_domtrie_wildcard() {
+    domtrie_t* trie = domtrie_create();
+
+    assert(domtrie_add(trie, "*.example.com.", &items[0]) == 1);
+    assert(domtrie_add(trie, "*.b.example.com.", &items[1]) == 1);
+    assert(domtrie_add(trie, "c.b.example.com.", &items[2]) == 1);
+    assert(domtrie_add(trie, "*.example.com", &items[3]) == 0);
+
+    // the wildcard does not cover the name itself
+    assert(domtrie_match(trie, "example.com.") == NULL);
+    assert(domtrie_match(trie, "www.example.com.") == &items[3]);
+    assert(domtrie_match(trie, "x.y.example.com.") == &items[3]);
+    assert(domtrie_match(trie, "b.example.com.") == &items[3]);
+    // the closest wildcard
+    assert(domtrie_match(trie, "a.b.example.com.") == &items[1]);
+    // the name itself over the wildcard
+    assert(domtrie_match(trie, "c.b.example.com.") == &items[2]);
+    assert(domtrie_match(trie, "d.c.b.example.com.") == &items[1]);
+    assert(domtrie_match(trie, "example.net.") == NULL);
+    assert(domtrie_match(trie, "*.b.example.com.") == &items[1]);
+
+    // wildcards are only found by their own name
+    assert(domtrie_find(trie, "www.example.com.") == NULL);
+    assert(domtrie_find(trie, "*.example.com.") == &items[3]);
+
+    check_walk(trie, "example.com.", (const char*[]) {
+        "*.example.com.", "*.b.example.com.", "c.b.example.com."
+    }, 3);
+
+    assert(domtrie_remove(trie, "*.example.com.") == &items[3]);
+    assert(domtrie_match(trie, "www.example.com.") == NULL);
+    assert(domtrie_match(trie, "a.b.example.com.") == &items[1]);
+
+    // a wildcard for everything
+    domtrie_add(trie, "*", &items[4]);
+    assert(domtrie_match(trie, "www.example.com.") == &items[4]);
+    assert(domtrie_match(trie, ".") == NULL);
+
+    domtrie_destroy(trie);
+    assert(intern_count() == 0);
+}
+
+void
+test_domtrie_invalid() {
+    domtrie_t* trie = domtrie_create();
+    char name[DOMTRIE_MAX_NAME + 10];
+
+    memset(name, 'a', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    assert(domtrie_add(trie, name, &items[0]) == -1);
+    assert(domtrie_find(trie, name) == NULL);
+    assert(domtrie_count(trie, ".") == 0);
+
+    domtrie_destroy(trie);
+}
+
+int main(int argc, char** argv) {
+    test_domtrie_add_find();
+    test_domtrie_remove();
+    test_domtrie_walk();
+    test_domtrie_wildcard();
+    test_domtrie_invalid();
+    return 0;
+}
@@ -0,0 +1,168 @@
+
+#include "extsrc.h"
+
+#include "test_helper.h"
+
+#include <arpa/inet.h>
+
+static void
+check_hdr(struct extsrc_msg *msg, uint8_t type)
+{
+    struct extsrc_msg_hdr hdr;
+
+    extsrc_hdr_read(msg->data, &hdr);
+    assertf(hdr.type == type, "type %u, expected %u", hdr.type, type);
+    assertf(hdr.version == EXTSRC_VERSION, "version %u", hdr.version);
+    assertf(hdr.length == msg->length - EXTSRC_MSG_HDR_SIZE,
+            "length %u, expected %zu", hdr.length, msg->length - EXTSRC_MSG_HDR_SIZE);
+}
+
+void test_hdr() {
+    char buf[EXTSRC_MSG_HDR_SIZE];
+    struct extsrc_msg_hdr hdr;
+    unsigned char expected[] = { 5, EXTSRC_VERSION, 0, 0, 0x04, 0x03, 0x02, 0x01 };
+
+    extsrc_hdr_write(buf, EXTSRC_MSG_TYPE_BATCH, 0x01020304);
+    // the header is little-endian, whatever the host byte order
+    assert(memcmp(buf, expected, sizeof(expected)) == 0);
+    extsrc_hdr_read(buf, &hdr);
+    assert(hdr.type == EXTSRC_MSG_TYPE_BATCH);
+    assert(hdr.version == EXTSRC_VERSION);
+    assert(hdr.length == 0x01020304);
+}
+
+void test_pkt_info() {
+    pkt_info_t pkt, result;
+    uint64_t timestamp;
+    struct extsrc_msg* msg;
+
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.family = AF_INET;
+    pkt.protocol = 17;
+    inet_pton(AF_INET, "192.0.2.1", pkt.src_addr + 12);
+    inet_pton(AF_INET, "198.51.100.2", pkt.dest_addr + 12);
+    pkt.src_port = 53;
+    pkt.dest_port = 40000;
+    pkt.payload_size = 1234567890123ULL;
+    pkt.packet_count = 1;
+    pkt.payload_offset = 28;
+
+    msg = extsrc_msg_create_pkt_info(&pkt, EXTSRC_TIMESTAMP_NONE);
+    check_hdr(msg, EXTSRC_MSG_TYPE_PKT_INFO);
+    // timestamp + 2 fixed + 2 * 4 addresses + 5 fixed + varints (6 + 1 + 1)
+    assertf(msg->length == EXTSRC_MSG_HDR_SIZE + 24, "length %zu", msg->length);
+
+    assert(extsrc_msg_read_pkt_info(msg->data + EXTSRC_MSG_HDR_SIZE,
+                                    msg->length - EXTSRC_MSG_HDR_SIZE, &result, &timestamp) == 0);
+    assert(memcmp(&pkt, &result, sizeof(pkt)) == 0);
+    assert(timestamp == EXTSRC_TIMESTAMP_NONE);
+
+    // truncated or with trailing data
+    assert(extsrc_msg_read_pkt_info(msg->data + EXTSRC_MSG_HDR_SIZE,
+                                    msg->length - EXTSRC_MSG_HDR_SIZE - 1, &result, &timestamp) == -1);
+    assert(extsrc_msg_read_pkt_info(msg->data + EXTSRC_MSG_HDR_SIZE,
+                                    msg->length - EXTSRC_MSG_HDR_SIZE + 1, &result, &timestamp) == -1);
+    // unknown address family
+    msg->data[EXTSRC_MSG_HDR_SIZE + 1] = AF_INET;
+    assert(extsrc_msg_read_pkt_info(msg->data + EXTSRC_MSG_HDR_SIZE,
+                                    msg->length - EXTSRC_MSG_HDR_SIZE, &result, &timestamp) == -1);
+    extsrc_msg_free(msg);
+
+    pkt.family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8::1", pkt.src_addr);
+    inet_pton(AF_INET6, "2001:db8::2", pkt.dest_addr);
+    // 2021-01-01 00:00:00.123456 UTC
+    msg = extsrc_msg_create_pkt_info(&pkt, 1609459200123456ULL);
+    assert(extsrc_msg_read_pkt_info(msg->data + EXTSRC_MSG_HDR_SIZE,
+                                    msg->length - EXTSRC_MSG_HDR_SIZE, &result, &timestamp) == 0);
+    assert(memcmp(&pkt, &result, sizeof(pkt)) == 0);
+    assertf(timestamp == 1609459200123456ULL, "timestamp %llu", (unsigned long long)timestamp);
+    extsrc_msg_free(msg);
+}
+
+void test_dns() {
+    // www.test.nl
+    uint8_t dname[] = { 0x03, 0x77, 0x77, 0x77, 0x04, 0x74, 0x65,
+                        0x73, 0x74, 0x02, 0x6e, 0x6c, 0x00 };
+    dns_pkt_info_t dns_pkt, result;
+    struct extsrc_dns_query_hdr query_hdr;
+    uint8_t src_addr[16];
+    uint64_t timestamp;
+    struct extsrc_msg* msg;
+
+    memset(&dns_pkt, 0, sizeof(dns_pkt));
+    dns_pkt.family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.3", dns_pkt.ip + 12);
+    dns_pkt.ttl = 3600;
+    memcpy(dns_pkt.dname, dname, sizeof(dname));
+
+    msg = extsrc_msg_create_dns_answer(&dns_pkt, 1);
+    check_hdr(msg, EXTSRC_MSG_TYPE_DNS_ANSWER);
+    // much smaller than the dns_pkt_info_t itself
+    assertf(msg->length == EXTSRC_MSG_HDR_SIZE + 1 + 1 + 4 + 2 + 1 + 12, "length %zu", msg->length);
+    assert(extsrc_msg_read_dns_answer(msg->data + EXTSRC_MSG_HDR_SIZE,
+                                      msg->length - EXTSRC_MSG_HDR_SIZE, &result, &timestamp) == 0);
+    assert(memcmp(&dns_pkt, &result, sizeof(dns_pkt)) == 0);
+    assert(timestamp == 1);
+    extsrc_msg_free(msg);
+
+    memset(src_addr, 0, sizeof(src_addr));
+    inet_pton(AF_INET, "192.168.1.10", src_addr + 12);
+    msg = extsrc_msg_create_dns_query(&dns_pkt, AF_INET, src_addr, 1609459200000000ULL);
+    check_hdr(msg, EXTSRC_MSG_TYPE_DNS_QUERY);
+    assert(extsrc_msg_read_dns_query(msg->data + EXTSRC_MSG_HDR_SIZE,
+                                     msg->length - EXTSRC_MSG_HDR_SIZE,
+                                     &query_hdr, &result, &timestamp) == 0);
+    assert(timestamp == 1609459200000000ULL);
+    assert(query_hdr.family == AF_INET);
+    assert(memcmp(query_hdr.src_addr, src_addr, sizeof(src_addr)) == 0);
+    assert(memcmp(&dns_pkt, &result, sizeof(dns_pkt)) == 0);
+    extsrc_msg_free(msg);
+}
+
+void test_arp_table_update() {
+    struct extsrc_arp_table_update up, result;
+    uint64_t timestamp;
+    struct extsrc_msg* msg;
+
+    memset(&up, 0, sizeof(up));
+    strcpy(up.mac, "aa:bb:cc:dd:ee:ff");
+    assert(spin_pton(&up.ip, "2001:db8::5"));
+
+    msg = extsrc_msg_create_arp_table_update(&up, EXTSRC_TIMESTAMP_NONE);
+    check_hdr(msg, EXTSRC_MSG_TYPE_ARP_TABLE_UPDATE);
+    assert(extsrc_msg_read_arp_table_update(msg->data + EXTSRC_MSG_HDR_SIZE,
+                                            msg->length - EXTSRC_MSG_HDR_SIZE, &result, &timestamp) == 0);
+    assert(memcmp(&up, &result, sizeof(up)) == 0);
+
+    // a mac that does not fit
+    msg->data[EXTSRC_MSG_HDR_SIZE + 1] = 18;
+    assert(extsrc_msg_read_arp_table_update(msg->data + EXTSRC_MSG_HDR_SIZE,
+                                            msg->length - EXTSRC_MSG_HDR_SIZE, &result, &timestamp) == -1);
+    extsrc_msg_free(msg);
+}
+
+void test_varint_limits() {
+    // timestamp, family, protocol, addresses, ports, icmp_type, then an
+    // overlong varint
+    char payload[1 + 1 + 1 + 8 + 4 + 1 + 11];
+    pkt_info_t result;
+    uint64_t timestamp;
+
+    memset(payload, 0, sizeof(payload));
+    payload[1] = EXTSRC_AF_INET;
+    memset(payload + 16, 0xff, 11);
+    assert(extsrc_msg_read_pkt_info(payload, sizeof(payload), &result, &timestamp) == -1);
+    // an overlong timestamp
+    memset(payload, 0xff, 11);
+    assert(extsrc_msg_read_pkt_info(payload, sizeof(payload), &result, &timestamp) == -1);
+}
+
+int main(int argc, char** argv) {
+    test_hdr();
+    test_pkt_info();
+    test_dns();
+    test_arp_table_update();
+    test_varint_limits();
+    return 0;
+}
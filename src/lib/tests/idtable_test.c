@@ -0,0 +1,155 @@
+#include "idtable.h"
+
+#include "test_helper.h"
+
+#include <stdlib.h>
+
+static int items[1000];
+
+static void
+check_iteration(idtable_t* table, int* expected, size_t count) {
+    size_t i = 0;
+    int id;
+
+    for (id = idtable_next(table, 0); id != 0; id = idtable_next(table, id)) {
+        assertf(i < count, "more ids than the %zu expected", count);
+        assertf(id == expected[i], "id %zu is %d, expected %d", i, id, expected[i]);
+        i++;
+    }
+    assertf(i == count, "iterated over %zu ids, expected %zu", i, count);
+}
+
+void
+test_idtable_add_remove() {
+    idtable_t* table = idtable_create();
+    int ids[5];
+    int i;
+
+    assert(idtable_size(table) == 0);
+    assert(idtable_next(table, 0) == 0);
+    assert(idtable_get(table, 0) == NULL);
+    assert(idtable_get(table, 1) == NULL);
+    assert(idtable_get(table, -1) == NULL);
+
+    for (i = 0; i < 5; i++) {
+        ids[i] = idtable_add(table, &items[i]);
+        // the same ids as a plain counter would give
+        assertf(ids[i] == i + 1, "id %d, expected %d", ids[i], i + 1);
+    }
+    assert(idtable_size(table) == 5);
+    for (i = 0; i < 5; i++) {
+        assert(idtable_get(table, ids[i]) == &items[i]);
+    }
+    check_iteration(table, ids, 5);
+
+    assert(idtable_remove(table, ids[1]) == &items[1]);
+    assert(idtable_remove(table, ids[1]) == NULL);
+    assert(idtable_get(table, ids[1]) == NULL);
+    assert(idtable_size(table) == 4);
+    check_iteration(table, (int[]) { ids[0], ids[2], ids[3], ids[4] }, 4);
+
+    // the slot is reused with a new generation; the old id stays invalid
+    i = idtable_add(table, &items[5]);
+    assert(i != ids[1]);
+    assert((i & (IDTABLE_MAX_SLOTS - 1)) == ids[1]);
+    assert(idtable_get(table, i) == &items[5]);
+    assert(idtable_get(table, ids[1]) == NULL);
+    assert(idtable_remove(table, ids[1]) == NULL);
+    assert(idtable_size(table) == 5);
+
+    idtable_destroy(table);
+}
+
+// freed slots are reused in the order they were freed
+void
+test_idtable_reuse_order() {
+    idtable_t* table = idtable_create();
+    int ids[4];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        ids[i] = idtable_add(table, &items[i]);
+    }
+    idtable_remove(table, ids[2]);
+    idtable_remove(table, ids[0]);
+    idtable_remove(table, ids[3]);
+    assert((idtable_add(table, &items[10]) & (IDTABLE_MAX_SLOTS - 1)) == ids[2]);
+    assert((idtable_add(table, &items[11]) & (IDTABLE_MAX_SLOTS - 1)) == ids[0]);
+    assert((idtable_add(table, &items[12]) & (IDTABLE_MAX_SLOTS - 1)) == ids[3]);
+    // no more free slots
+    assert(idtable_add(table, &items[13]) == 5);
+
+    idtable_destroy(table);
+}
+
+// removing the current item while iterating
+void
+test_idtable_iterate_remove() {
+    idtable_t* table = idtable_create();
+    int id, next;
+    size_t count = 0;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        idtable_add(table, &items[i]);
+    }
+    for (id = idtable_next(table, 0); id != 0; id = next) {
+        next = idtable_next(table, id);
+        if (((int*) idtable_get(table, id) - items) % 2 == 0) {
+            idtable_remove(table, id);
+        }
+    }
+    assert(idtable_size(table) == 500);
+    for (id = idtable_next(table, 0); id != 0; id = idtable_next(table, id)) {
+        assert(((int*) idtable_get(table, id) - items) % 2 == 1);
+        count++;
+    }
+    assert(count == 500);
+
+    idtable_destroy(table);
+}
+
+// compare with a plain array of the live ids
+void
+test_idtable_random() {
+    idtable_t* table = idtable_create();
+    int live[1000];
+    int* item_of[1000];
+    size_t nlive = 0;
+    int k, i, id;
+
+    srandom(42);
+    for (k = 0; k < 100000; k++) {
+        if (nlive < 1000 && (nlive == 0 || random() % 3 != 0)) {
+            id = idtable_add(table, &items[nlive]);
+            assert(id > 0);
+            for (i = 0; i < (int) nlive; i++) {
+                assert(live[i] != id);
+            }
+            live[nlive] = id;
+            item_of[nlive] = &items[nlive];
+            nlive++;
+        } else {
+            i = random() % nlive;
+            assert(idtable_remove(table, live[i]) == item_of[i]);
+            assert(idtable_get(table, live[i]) == NULL);
+            nlive--;
+            live[i] = live[nlive];
+            item_of[i] = item_of[nlive];
+        }
+        assert(idtable_size(table) == nlive);
+    }
+    for (i = 0; i < (int) nlive; i++) {
+        assert(idtable_get(table, live[i]) == item_of[i]);
+    }
+
+    idtable_destroy(table);
+}
+
+int main(int argc, char** argv) {
+    test_idtable_add_remove();
+    test_idtable_reuse_order();
+    test_idtable_iterate_remove();
+    test_idtable_random();
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "intern.h"
+
+#include "test_helper.h"
+
+void
+test_intern_str() {
+    const char* a;
+    const char* b;
+    const char* c;
+
+    assert(intern_count() == 0);
+    assert(intern_find("example.com") == NULL);
+
+    a = intern_str("example.com");
+    b = intern_str("Example.COM");
+    c = intern_str("example.net");
+    // names are folded, and equal names give the same handle
+    assert(a == b);
+    assert(a != c);
+    assert(strcmp(a, "example.com") == 0);
+    assert(intern_find("EXAMPLE.com") == a);
+    assert(intern_hash(a) == intern_hash(b));
+    assert(intern_count() == 2);
+
+    // the name stays until the last reference is released
+    intern_unref(a);
+    assert(intern_find("example.com") == a);
+    assert(intern_ref(a) == a);
+    intern_unref(a);
+    intern_unref(b);
+    assert(intern_find("example.com") == NULL);
+    assert(intern_count() == 1);
+    intern_unref(c);
+    assert(intern_count() == 0);
+}
+
+// enough names to make the table grow a few times
+void
+test_intern_many() {
+    const char* handles[10000];
+    char name[64];
+    int i;
+
+    for (i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "host%d.Example.ORG", i);
+        handles[i] = intern_str(name);
+    }
+    assert(intern_count() == 10000);
+    for (i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "HOST%d.example.org", i);
+        assertf(intern_find(name) == handles[i], "%s not found", name);
+    }
+    for (i = 0; i < 10000; i++) {
+        intern_unref(handles[i]);
+    }
+    assert(intern_count() == 0);
+}
+
+void
+test_intern_tree() {
+    tree_t* tree1 = intern_tree_create();
+    tree_t* tree2 = intern_tree_create();
+    tree_entry_t* cur;
+    const char* expected[] = { "a.example", "b.example", "c.example" };
+    int i;
+
+    tree_add(tree1, 10, "B.example", 0, NULL, 1);
+    tree_add(tree1, 10, "c.example", 0, NULL, 1);
+    tree_add(tree1, 10, "a.example", 0, NULL, 1);
+    assert(tree_add(tree1, 10, "b.EXAMPLE", 0, NULL, 1) == 0);
+    assert(tree_size(tree1) == 3);
+    assert(intern_count() == 3);
+
+    // the keys are the handles, in alphabetical order
+    i = 0;
+    for (cur = tree_first(tree1); cur != NULL; cur = tree_next(cur)) {
+        assert(strcmp(cur->key, expected[i]) == 0);
+        assert(cur->key == intern_find(expected[i]));
+        i++;
+    }
+    assert(i == 3);
+
+    // found by name or by handle
+    assert(tree_find(tree1, 10, "C.Example") != NULL);
+    assert(tree_find(tree1, 10, intern_find("c.example")) != NULL);
+    assert(tree_find(tree1, 10, "d.example") == NULL);
+
+    // shared between trees
+    tree_add(tree2, 10, (void*) intern_find("a.example"), 0, NULL, 1);
+    assert(intern_count() == 3);
+    tree_remove(tree1, 10, "a.example");
+    assert(intern_find("a.example") != NULL);
+    tree_destroy(tree2);
+    assert(intern_find("a.example") == NULL);
+
+    tree_destroy(tree1);
+    assert(intern_count() == 0);
+}
+
+int main(int argc, char** argv) {
+    test_intern_str();
+    test_intern_many();
+    test_intern_tree();
+    return 0;
+}
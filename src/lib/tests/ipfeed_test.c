@@ -0,0 +1,251 @@
+#include "ipfeed.h"
+
+#include "test_helper.h"
+
+#include <unistd.h>
+
+static ip_t
+ip(const char* str) {
+    ip_t result;
+
+    assertf(spin_pton(&result, str), "bad address in test: %s", str);
+    return result;
+}
+
+static void
+write_file(const char* path, const char* data) {
+    FILE* out = fopen(path, "w");
+
+    assert(out != NULL);
+    fputs(data, out);
+    fclose(out);
+}
+
+static void
+contains_helper(ipfeed_t* feed, const char* str, int expected) {
+    ip_t addr = ip(str);
+    int result = ipfeed_contains(feed, addr.family, addr.addr);
+
+    assertf(result == expected, "lookup of %s returned %d, expected %d", str, result, expected);
+}
+
+typedef struct {
+    const char** expected;
+    size_t count;
+    size_t i;
+} walk_check_t;
+
+static void
+walk_helper(void* arg, const ip_t* prefix) {
+    walk_check_t* check = (walk_check_t*) arg;
+    char str[SPIN_PREFIXSTRLEN];
+
+    assertf(check->i < check->count, "more prefixes than the %zu expected", check->count);
+    spin_ntop_prefix(str, (ip_t*) prefix, sizeof(str));
+    assertf(strcmp(str, check->expected[check->i]) == 0, "prefix %zu is %s, expected %s",
+            check->i, str, check->expected[check->i]);
+    check->i++;
+}
+
+static void
+check_walk(ipfeed_t* feed, int family, const char** expected, size_t count) {
+    walk_check_t check = { expected, count, 0 };
+
+    ipfeed_walk(feed, family, walk_helper, &check);
+    assertf(check.i == count, "walked over %zu prefixes, expected %zu", check.i, count);
+    assert(ipfeed_prefix_count(feed, family) == count);
+}
+
+void
+test_ipfeed_import(const char* dir) {
+    char text[256], path[256];
+    ipfeed_t* feed;
+    const char* expected_v4[] = {
+        "10.0.0.0/8",
+        "192.0.2.0/24",
+        "198.51.100.7",
+        "203.0.113.0/31",
+        "203.0.113.2",
+    };
+    const char* expected_v6[] = {
+        "2001:db8::/32",
+        "2001:db9::1",
+    };
+
+    snprintf(text, sizeof(text), "%s/feed.txt", dir);
+    snprintf(path, sizeof(path), "%s/block.feed", dir);
+
+    assert(ipfeed_open(path) == NULL);
+    assert(ipfeed_import(text, path) == -1);
+
+    write_file(text,
+               "; Spamhaus DROP style\n"
+               "# and shell style comments\n"
+               "\n"
+               "192.0.2.128/25 ; SBL1\n"
+               "192.0.2.0/25\n"
+               "  198.51.100.7\n"
+               "10.1.2.3/8\n"
+               "10.20.0.0/16\n"
+               "203.0.113.0\t# comment\n"
+               "203.0.113.1\n"
+               "203.0.113.2\n"
+               "2001:db8::/32\n"
+               "2001:db8:1::/48\n"
+               "2001:db9::1\n"
+               "not an address\n"
+               "192.0.2.1/33\n"
+               "0.0.0.0/0\n"
+               "192.0.2.1/\n");
+    assert(ipfeed_import(text, path) == 11);
+
+    feed = ipfeed_open(path);
+    assert(feed != NULL);
+    assert(ipfeed_entries(feed) == 11);
+    // merged, and overlapping ranges absorbed
+    assert(feed->v4_count == 4);
+    assert(feed->v6_count == 2);
+
+    contains_helper(feed, "192.0.2.0", 1);
+    contains_helper(feed, "192.0.2.255", 1);
+    contains_helper(feed, "192.0.3.0", 0);
+    contains_helper(feed, "192.0.1.255", 0);
+    contains_helper(feed, "10.255.255.255", 1);
+    contains_helper(feed, "11.0.0.0", 0);
+    contains_helper(feed, "198.51.100.7", 1);
+    contains_helper(feed, "198.51.100.8", 0);
+    contains_helper(feed, "203.0.113.2", 1);
+    contains_helper(feed, "203.0.113.3", 0);
+    contains_helper(feed, "0.0.0.0", 0);
+    contains_helper(feed, "255.255.255.255", 0);
+    contains_helper(feed, "2001:db8:ffff::1", 1);
+    contains_helper(feed, "2001:db9::1", 1);
+    contains_helper(feed, "2001:db9::2", 0);
+    contains_helper(feed, "::1", 0);
+    // the families are separate
+    contains_helper(feed, "::a00:1", 0);
+
+    check_walk(feed, AF_INET, expected_v4, sizeof(expected_v4) / sizeof(expected_v4[0]));
+    check_walk(feed, AF_INET6, expected_v6, sizeof(expected_v6) / sizeof(expected_v6[0]));
+    ipfeed_close(feed);
+
+    // an empty feed
+    write_file(text, "# nothing\n");
+    assert(ipfeed_import(text, path) == 0);
+    feed = ipfeed_open(path);
+    assert(feed != NULL);
+    contains_helper(feed, "192.0.2.1", 0);
+    contains_helper(feed, "2001:db8::1", 0);
+    assert(ipfeed_prefix_count(feed, AF_INET) == 0);
+    ipfeed_close(feed);
+
+    // not an index
+    write_file(path, "192.0.2.1\n");
+    assert(ipfeed_open(path) == NULL);
+
+    unlink(text);
+    unlink(path);
+}
+
+// the ends of the address space, where the arithmetic could overflow
+void
+test_ipfeed_edges(const char* dir) {
+    char text[256], path[256];
+    ipfeed_t* feed;
+    const char* expected_v4[] = { "0.0.0.0/1", "128.0.0.0/1" };
+    const char* expected_v6[] = { "::/1", "8000::/1" };
+
+    snprintf(text, sizeof(text), "%s/feed.txt", dir);
+    snprintf(path, sizeof(path), "%s/edges.feed", dir);
+
+    write_file(text, "0.0.0.0/1\n255.255.255.255\n128.0.0.0/2\n192.0.0.0/2\n"
+                     "::/1\nffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff\n8000::/1\n");
+    assert(ipfeed_import(text, path) == 7);
+    feed = ipfeed_open(path);
+    assert(feed != NULL);
+    assert(feed->v4_count == 1);
+    assert(feed->v6_count == 1);
+    contains_helper(feed, "0.0.0.0", 1);
+    contains_helper(feed, "255.255.255.255", 1);
+    contains_helper(feed, "::", 1);
+    contains_helper(feed, "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", 1);
+    check_walk(feed, AF_INET, expected_v4, 2);
+    check_walk(feed, AF_INET6, expected_v6, 2);
+    ipfeed_close(feed);
+
+    unlink(text);
+    unlink(path);
+}
+
+static void
+random_v4(ip_t* ip, int netmask) {
+    copy_ip_data(ip, AF_INET, netmask, (uint8_t[16]) { 0 });
+    ip->addr[12] = 192 + random() % 2;
+    ip->addr[13] = random() % 4;
+    ip->addr[14] = random() % 256;
+    ip->addr[15] = random() % 256;
+}
+
+static void
+count_walk(void* arg, const ip_t* prefix) {
+    ipfeed_t* feed = (ipfeed_t*) arg;
+
+    // every prefix lies within the feed
+    assert(ipfeed_contains(feed, prefix->family, prefix->addr));
+}
+
+// compare with a plain search through all prefixes with ip_in_net()
+void
+test_ipfeed_random(const char* dir) {
+    char text[256], path[256];
+    char str[SPIN_PREFIXSTRLEN];
+    ip_t prefixes[1000];
+    ip_t addr;
+    ipfeed_t* feed;
+    FILE* out;
+    int i, k, expected;
+
+    snprintf(text, sizeof(text), "%s/feed.txt", dir);
+    snprintf(path, sizeof(path), "%s/random.feed", dir);
+
+    srandom(42);
+    out = fopen(text, "w");
+    assert(out != NULL);
+    for (i = 0; i < 1000; i++) {
+        random_v4(&prefixes[i], 12 + random() % 21);
+        spin_ntop_prefix(str, &prefixes[i], sizeof(str));
+        fprintf(out, "%s\n", str);
+    }
+    fclose(out);
+    assert(ipfeed_import(text, path) == 1000);
+    feed = ipfeed_open(path);
+    assert(feed != NULL);
+
+    for (k = 0; k < 20000; k++) {
+        random_v4(&addr, 0);
+        expected = 0;
+        for (i = 0; i < 1000 && !expected; i++) {
+            expected = ip_in_net(&addr, &prefixes[i]);
+        }
+        assert(ipfeed_contains(feed, AF_INET, addr.addr) == expected);
+    }
+    for (i = 0; i < 1000; i++) {
+        assert(ipfeed_contains(feed, AF_INET, prefixes[i].addr));
+    }
+    ipfeed_walk(feed, AF_INET, count_walk, feed);
+    ipfeed_close(feed);
+
+    unlink(text);
+    unlink(path);
+}
+
+int main(int argc, char** argv) {
+    char dir[] = "/tmp/spin_ipfeed_test_XXXXXX";
+
+    assert(mkdtemp(dir) != NULL);
+    test_ipfeed_import(dir);
+    test_ipfeed_edges(dir);
+    test_ipfeed_random(dir);
+    rmdir(dir);
+    return 0;
+}
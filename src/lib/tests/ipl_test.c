@@ -0,0 +1,207 @@
+#include "ipl.h"
+
+#include "test_helper.h"
+
+#include <unistd.h>
+
+static struct list_info lists[N_IPLIST] = {
+    { .li_listname = "block" },
+    { .li_listname = "ignore" },
+    { .li_listname = "allow" },
+};
+
+static ip_t
+ip(const char* str) {
+    ip_t result;
+
+    assertf(spin_pton(&result, str), "bad address in test: %s", str);
+    return result;
+}
+
+static void
+check_ignored(const char* str, int expected) {
+    ip_t addr = ip(str);
+    int result = addr_in_ignore_list(addr.family, addr.addr);
+
+    assertf(result == expected, "%s ignored: %d, expected %d", str, result, expected);
+    result = ip_in_ignore_list(&addr);
+    assertf(result == expected, "%s in ignore list: %d, expected %d", str, result, expected);
+}
+
+static void
+add_ignore(const char* str) {
+    ip_t prefix = ip(str);
+
+    add_ip_to_li(&prefix, &lists[IPLIST_IGNORE]);
+}
+
+static void
+remove_ignore(const char* str) {
+    ip_t prefix = ip(str);
+
+    remove_ip_from_li(&prefix, &lists[IPLIST_IGNORE]);
+}
+
+static int
+filter_empty(struct ipl_filter* filter) {
+    size_t i;
+
+    for (i = 0; i < IPL_FILTER_V4_BITS / 64; i++) {
+        if (filter->v4[i] != 0) {
+            return 0;
+        }
+    }
+    for (i = 0; i < IPL_FILTER_V6_BITS / 64; i++) {
+        if (filter->v6[i] != 0) {
+            return 0;
+        }
+    }
+    return !filter->v6_all;
+}
+
+void
+test_ignore_list() {
+    assert(filter_empty(&lists[IPLIST_IGNORE].li_filter));
+    check_ignored("192.0.2.1", 0);
+    check_ignored("2001:db8::1", 0);
+
+    add_ignore("192.0.2.1");
+    add_ignore("10.0.0.0/8");
+    add_ignore("2001:db8:1::/48");
+    check_ignored("192.0.2.1", 1);
+    check_ignored("192.0.2.2", 0);
+    check_ignored("10.200.0.1", 1);
+    check_ignored("11.0.0.1", 0);
+    check_ignored("2001:db8:1::1", 1);
+    check_ignored("2001:db8:2::1", 0);
+    assert(!lists[IPLIST_IGNORE].li_filter.v6_all);
+    // the other lists are not affected
+    assert(filter_empty(&lists[IPLIST_BLOCK].li_filter));
+
+    // a network shorter than the IPv6 part of the filter
+    add_ignore("2001:d00::/24");
+    assert(lists[IPLIST_IGNORE].li_filter.v6_all);
+    check_ignored("2001:dff::1", 1);
+    check_ignored("2001:e00::1", 0);
+
+    remove_ignore("2001:d00::/24");
+    assert(!lists[IPLIST_IGNORE].li_filter.v6_all);
+    check_ignored("2001:dff::1", 0);
+    check_ignored("2001:db8:1::1", 1);
+
+    remove_ignore("10.0.0.0/8");
+    check_ignored("10.200.0.1", 0);
+    remove_ignore("192.0.2.1");
+    remove_ignore("2001:db8:1::/48");
+    assert(filter_empty(&lists[IPLIST_IGNORE].li_filter));
+}
+
+static void
+random_v4(ip_t* ip) {
+    uint32_t r = random();
+
+    ip->addr[12] = r >> 24;
+    ip->addr[13] = r >> 16;
+    ip->addr[14] = r >> 8;
+    ip->addr[15] = r;
+}
+
+// the filter may say yes too often, but never no when the trie says yes
+void
+test_filter_random() {
+    struct list_info* lip = &lists[IPLIST_BLOCK];
+    ip_t prefix, addr;
+    int i, in_trie;
+
+    srandom(43);
+    for (i = 0; i < 200; i++) {
+        copy_ip_data(&prefix, AF_INET, 4 + random() % 29, (uint8_t[16]) { 0 });
+        random_v4(&prefix);
+        add_ip_to_li(&prefix, lip);
+        if (i % 4 == 0) {
+            remove_ip_from_li(&prefix, lip);
+        }
+    }
+    for (i = 0; i < 100000; i++) {
+        copy_ip_data(&addr, AF_INET, 0, (uint8_t[16]) { 0 });
+        random_v4(&addr);
+        in_trie = iptrie_match(lip->li_trie, AF_INET, addr.addr, 0) != NULL;
+        assert(ip_in_li(&addr, lip) == in_trie);
+    }
+}
+
+// the changes are journalled, and read back by the next init
+void
+test_persistence() {
+    add_ignore("192.0.2.1");
+    add_ignore("192.0.2.0/24");
+    add_ignore("2001:db8::/32");
+    remove_ignore("192.0.2.1");
+    assert(ipl_sync(&lists[IPLIST_IGNORE]));
+
+    clean_all_ipl();
+    init_all_ipl(lists);
+    check_ignored("192.0.2.1", 1);
+    check_ignored("192.0.3.1", 0);
+    check_ignored("2001:db8::1", 1);
+    assert(iptrie_size(lists[IPLIST_IGNORE].li_trie) == 2);
+    // the filter is rebuilt when reading
+    assert(!filter_empty(&lists[IPLIST_IGNORE].li_filter));
+}
+
+// a feed adds to the list, and is mapped again by the next init
+void
+test_feed(const char* dir) {
+    char text[256];
+    FILE* out;
+
+    snprintf(text, sizeof(text), "%s/feed.txt", dir);
+    out = fopen(text, "w");
+    assert(out != NULL);
+    fprintf(out, "198.51.100.0/24\n2001:db9::1\n");
+    fclose(out);
+
+    check_ignored("198.51.100.1", 0);
+    assert(ipl_load_feed(&lists[IPLIST_IGNORE], text) == 2);
+    unlink(text);
+    check_ignored("198.51.100.1", 1);
+    check_ignored("2001:db9::1", 1);
+    check_ignored("2001:db9::2", 0);
+    // the entries of the list itself still count
+    check_ignored("192.0.2.1", 1);
+
+    clean_all_ipl();
+    init_all_ipl(lists);
+    check_ignored("198.51.100.1", 1);
+    assert(lists[IPLIST_BLOCK].li_feed == NULL);
+
+    assert(ipl_load_feed(&lists[IPLIST_IGNORE], text) == -1);
+    check_ignored("198.51.100.1", 1);
+
+    ipl_clear_feed(&lists[IPLIST_IGNORE]);
+    check_ignored("198.51.100.1", 0);
+    check_ignored("192.0.2.1", 1);
+    clean_all_ipl();
+    init_all_ipl(lists);
+    assert(lists[IPLIST_IGNORE].li_feed == NULL);
+}
+
+int main(int argc, char** argv) {
+    char dir[] = "/tmp/spin_ipl_test_XXXXXX";
+    int i;
+
+    assert(mkdtemp(dir) != NULL);
+    ipl_set_directory(dir);
+    init_all_ipl(lists);
+    test_ignore_list();
+    test_filter_random();
+    test_persistence();
+    test_feed(dir);
+    clean_all_ipl();
+
+    for (i = 0; i < N_IPLIST; i++) {
+        journal_remove(ipl_filename(&lists[i]));
+    }
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,265 @@
+#include "iptrie.h"
+
+#include "test_helper.h"
+
+#include <unistd.h>
+
+static ip_t
+ip(const char* str) {
+    ip_t result;
+
+    assertf(spin_pton(&result, str), "bad address in test: %s", str);
+    return result;
+}
+
+static void
+add_helper(iptrie_t* trie, const char* str, int expected) {
+    ip_t prefix = ip(str);
+    int result = iptrie_add(trie, &prefix);
+
+    assertf(result == expected, "adding %s returned %d, expected %d", str, result, expected);
+}
+
+static void
+remove_helper(iptrie_t* trie, const char* str, int expected) {
+    ip_t prefix = ip(str);
+    int result = iptrie_remove(trie, &prefix);
+
+    assertf(result == expected, "removing %s returned %d, expected %d", str, result, expected);
+}
+
+// expected is the matching prefix as a string, or NULL for no match
+static void
+match_helper(iptrie_t* trie, const char* str, const char* expected) {
+    ip_t addr = ip(str);
+    const ip_t* result = iptrie_match(trie, addr.family, addr.addr, addr.netmask);
+    char result_str[SPIN_PREFIXSTRLEN];
+
+    if (expected == NULL) {
+        if (result != NULL) {
+            spin_ntop_prefix(result_str, (ip_t*) result, sizeof(result_str));
+        }
+        assertf(result == NULL, "%s matched %s, expected no match", str, result_str);
+        return;
+    }
+    assertf(result != NULL, "%s did not match, expected %s", str, expected);
+    spin_ntop_prefix(result_str, (ip_t*) result, sizeof(result_str));
+    assertf(strcmp(result_str, expected) == 0, "%s matched %s, expected %s", str, result_str, expected);
+}
+
+static void
+check_order(iptrie_t* trie, const char** expected, size_t count) {
+    iptrie_node_t* cur;
+    char str[SPIN_PREFIXSTRLEN];
+    size_t i = 0;
+
+    assertf(iptrie_size(trie) == count, "trie has %zu prefixes, expected %zu", iptrie_size(trie), count);
+    for (cur = iptrie_first(trie); cur != NULL; cur = iptrie_next(trie, cur)) {
+        assertf(i < count, "more prefixes than the %zu expected", count);
+        spin_ntop_prefix(str, &cur->prefix, sizeof(str));
+        assertf(strcmp(str, expected[i]) == 0, "prefix %zu is %s, expected %s", i, str, expected[i]);
+        i++;
+    }
+    assertf(i == count, "iterated over %zu prefixes, expected %zu", i, count);
+}
+
+void
+test_iptrie_longest_match() {
+    iptrie_t* trie = iptrie_create();
+
+    add_helper(trie, "192.0.2.0/24", 1);
+    add_helper(trie, "192.0.2.128/25", 1);
+    add_helper(trie, "192.0.2.200", 1);
+    add_helper(trie, "10.0.0.0/8", 1);
+    add_helper(trie, "2001:db8::/32", 1);
+    add_helper(trie, "2001:db8:1::/48", 1);
+    add_helper(trie, "192.0.2.0/24", 0);
+    // host bits are cleared
+    add_helper(trie, "10.1.2.3/8", 0);
+
+    match_helper(trie, "192.0.2.1", "192.0.2.0/24");
+    match_helper(trie, "192.0.2.129", "192.0.2.128/25");
+    match_helper(trie, "192.0.2.200", "192.0.2.200");
+    match_helper(trie, "192.0.3.1", NULL);
+    match_helper(trie, "10.255.255.255", "10.0.0.0/8");
+    match_helper(trie, "11.0.0.0", NULL);
+    match_helper(trie, "2001:db8:1:2::1", "2001:db8:1::/48");
+    match_helper(trie, "2001:db8:2::1", "2001:db8::/32");
+    match_helper(trie, "2001:db9::1", NULL);
+    // the families are separate, even where the address bytes agree
+    match_helper(trie, "::c000:201", NULL);
+    // a network only matches a prefix it falls within entirely
+    match_helper(trie, "192.0.2.128/25", "192.0.2.128/25");
+    match_helper(trie, "192.0.2.0/23", NULL);
+    match_helper(trie, "10.1.0.0/16", "10.0.0.0/8");
+
+    iptrie_destroy(trie);
+}
+
+void
+test_iptrie_remove() {
+    iptrie_t* trie = iptrie_create();
+
+    add_helper(trie, "192.0.2.0/24", 1);
+    add_helper(trie, "192.0.2.1", 1);
+    add_helper(trie, "192.0.2.2", 1);
+    add_helper(trie, "192.0.2.64/26", 1);
+
+    remove_helper(trie, "192.0.2.3", 0);
+    remove_helper(trie, "192.0.2.0/25", 0);
+
+    // removing an address within a network leaves the network
+    remove_helper(trie, "192.0.2.1", 1);
+    match_helper(trie, "192.0.2.1", "192.0.2.0/24");
+    remove_helper(trie, "192.0.2.1", 0);
+
+    // removing the network leaves the addresses within it
+    remove_helper(trie, "192.0.2.0/24", 1);
+    match_helper(trie, "192.0.2.1", NULL);
+    match_helper(trie, "192.0.2.2", "192.0.2.2");
+    match_helper(trie, "192.0.2.65", "192.0.2.64/26");
+
+    remove_helper(trie, "192.0.2.2", 1);
+    remove_helper(trie, "192.0.2.64/26", 1);
+    assert(iptrie_size(trie) == 0);
+    assert(iptrie_first(trie) == NULL);
+    // no joining nodes are left behind
+    assert(trie->root[0] == NULL);
+
+    add_helper(trie, "192.0.2.1", 1);
+    match_helper(trie, "192.0.2.1", "192.0.2.1");
+
+    iptrie_destroy(trie);
+}
+
+void
+test_iptrie_iterate() {
+    iptrie_t* trie = iptrie_create();
+    const char* expected[] = {
+        "10.0.0.0/8",
+        "10.1.0.0/16",
+        "192.0.2.1",
+        "192.0.2.2",
+        "::1",
+        "2001:db8::/32",
+        "2001:db8::1",
+    };
+
+    assert(iptrie_first(trie) == NULL);
+    add_helper(trie, "2001:db8::1", 1);
+    add_helper(trie, "192.0.2.2", 1);
+    add_helper(trie, "10.1.0.0/16", 1);
+    add_helper(trie, "::1", 1);
+    add_helper(trie, "192.0.2.1", 1);
+    add_helper(trie, "2001:db8::/32", 1);
+    add_helper(trie, "10.0.0.0/8", 1);
+
+    check_order(trie, expected, sizeof(expected) / sizeof(expected[0]));
+
+    iptrie_clear(trie);
+    assert(iptrie_size(trie) == 0);
+    assert(iptrie_first(trie) == NULL);
+    iptrie_destroy(trie);
+}
+
+// compare with a plain search through all prefixes with ip_in_net()
+void
+test_iptrie_random() {
+    iptrie_t* trie = iptrie_create();
+    ip_t prefixes[500];
+    ip_t addr;
+    const ip_t* result;
+    ip_t* best;
+    int i, k;
+
+    srandom(42);
+    for (i = 0; i < 500; i++) {
+        // few distinct values, so that the prefixes nest and overlap
+        copy_ip_data(&prefixes[i], AF_INET, 8 + random() % 25, (uint8_t[16]) { 0 });
+        prefixes[i].addr[12] = 192 + random() % 2;
+        prefixes[i].addr[13] = random() % 4;
+        prefixes[i].addr[14] = random() % 256;
+        prefixes[i].addr[15] = random() % 256;
+        iptrie_add(trie, &prefixes[i]);
+    }
+    // remove some of them again
+    for (i = 0; i < 500; i += 3) {
+        iptrie_remove(trie, &prefixes[i]);
+    }
+
+    for (k = 0; k < 5000; k++) {
+        copy_ip_data(&addr, AF_INET, 0, (uint8_t[16]) { 0 });
+        addr.addr[12] = 192 + random() % 2;
+        addr.addr[13] = random() % 4;
+        addr.addr[14] = random() % 256;
+        addr.addr[15] = random() % 256;
+
+        best = NULL;
+        for (i = 0; i < 500; i++) {
+            if (!iptrie_contains(trie, &prefixes[i]) || !ip_in_net(&addr, &prefixes[i])) {
+                continue;
+            }
+            if (best == NULL || prefixes[i].netmask > best->netmask) {
+                best = &prefixes[i];
+            }
+        }
+        result = iptrie_match(trie, AF_INET, addr.addr, 0);
+        if (best == NULL) {
+            assert(result == NULL);
+        } else {
+            assert(result != NULL);
+            assert(result->netmask == best->netmask);
+            assert(ip_in_net(&addr, (ip_t*) result));
+        }
+    }
+
+    iptrie_destroy(trie);
+}
+
+// note; if this test fails it may leave a tmp file around
+void
+test_iptrie_read_write() {
+    iptrie_t* trie = iptrie_create();
+    char tmpfile[] = "/tmp/spin_iptrie_test_XXXXXX";
+    const char* expected[] = {
+        "192.0.2.0/24",
+        "192.0.2.1",
+        "2001:db8::/48",
+        "2001:db8::1",
+    };
+    FILE* out;
+
+    int fd = mkstemp(tmpfile);
+    assert(fd >= 0);
+    close(fd);
+    unlink(tmpfile);
+
+    assert(iptrie_read(trie, tmpfile) < 0);
+
+    // the format of the older lists, with only addresses, and one
+    // invalid line
+    out = fopen(tmpfile, "w");
+    assert(out != NULL);
+    fprintf(out, "192.0.2.1\n2001:db8::1\nnot an address\n192.0.2.0/24\n2001:db8::/48\n");
+    fclose(out);
+
+    assert(iptrie_read(trie, tmpfile) == 4);
+    check_order(trie, expected, 4);
+
+    assert(iptrie_store(trie, tmpfile));
+    iptrie_clear(trie);
+    assert(iptrie_read(trie, tmpfile) == 4);
+    check_order(trie, expected, 4);
+
+    unlink(tmpfile);
+    iptrie_destroy(trie);
+}
+
+int main(int argc, char** argv) {
+    test_iptrie_longest_match();
+    test_iptrie_remove();
+    test_iptrie_iterate();
+    test_iptrie_random();
+    test_iptrie_read_write();
+    return 0;
+}
@@ -0,0 +1,152 @@
+#include "journal.h"
+#include "tree.h"
+#include "util.h"
+
+#include "test_helper.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// the set is a tree of strings
+static void
+apply_helper(void* arg, int add, const char* entry) {
+    tree_t* set = (tree_t*) arg;
+
+    if (add) {
+        tree_add(set, strlen(entry) + 1, (void*) entry, 0, NULL, 1);
+    } else {
+        tree_remove(set, strlen(entry) + 1, (void*) entry);
+    }
+}
+
+static void
+write_helper(void* arg, FILE* out) {
+    tree_t* set = (tree_t*) arg;
+    tree_entry_t* cur;
+
+    for (cur = tree_first(set); cur != NULL; cur = tree_next(cur)) {
+        fprintf(out, "%s\n", (char*) cur->key);
+    }
+}
+
+static void
+set_add(tree_t* set, journal_t* journal, const char* entry, int add) {
+    apply_helper(set, add, entry);
+    assert(journal_append(journal, add, entry));
+}
+
+// replays path and compares the result with expected
+static void
+check_replay(const char* path, tree_t* expected) {
+    tree_t* set = tree_create(cmp_strs);
+    tree_entry_t* a;
+    tree_entry_t* b;
+
+    assert(journal_replay(path, apply_helper, set) >= 0);
+    assertf(tree_size(set) == tree_size(expected), "replay has %d entries, expected %d", tree_size(set), tree_size(expected));
+    a = tree_first(set);
+    b = tree_first(expected);
+    while (a != NULL) {
+        assertf(strcmp(a->key, b->key) == 0, "replay has %s, expected %s", (char*) a->key, (char*) b->key);
+        a = tree_next(a);
+        b = tree_next(b);
+    }
+    tree_destroy(set);
+}
+
+static size_t
+file_size(const char* path) {
+    struct stat st;
+
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+static void
+append_raw(const char* path, const char* data) {
+    FILE* out = fopen(path, "a");
+
+    assert(out != NULL);
+    fputs(data, out);
+    fclose(out);
+}
+
+void
+test_journal(const char* dir) {
+    char path[256], journal_path[256];
+    tree_t* set = tree_create(cmp_strs);
+    tree_t* dummy = tree_create(cmp_strs);
+    journal_t* journal;
+    char entry[32];
+    int i;
+
+    snprintf(path, sizeof(path), "%s/test.list", dir);
+    snprintf(journal_path, sizeof(journal_path), "%s/test.list.journal", dir);
+
+    assert(journal_replay(path, apply_helper, dummy) == -1);
+
+    // only a journal
+    journal = journal_open(path);
+    assert(journal != NULL);
+    set_add(set, journal, "192.0.2.1", 1);
+    set_add(set, journal, "192.0.2.2", 1);
+    set_add(set, journal, "192.0.2.1", 0);
+    set_add(set, journal, "10.0.0.0/8", 1);
+    assert(journal_sync(journal, write_helper, set));
+    // too small to be compacted
+    assert(file_size(path) == 0);
+    check_replay(path, set);
+    journal_close(journal);
+    check_replay(path, set);
+
+    // an interrupted write is ignored, and dropped when opening
+    append_raw(journal_path, "+ 192.0.2.3");
+    check_replay(path, set);
+    journal = journal_open(path);
+    assert(journal != NULL);
+    set_add(set, journal, "192.0.2.4", 1);
+    check_replay(path, set);
+
+    // compaction
+    for (i = 0; i < 500; i++) {
+        snprintf(entry, sizeof(entry), "198.51.100.%d", i % 256);
+        set_add(set, journal, entry, i < 256);
+    }
+    assert(file_size(journal_path) > JOURNAL_COMPACT_MIN);
+    assert(journal_sync(journal, write_helper, set));
+    assert(file_size(journal_path) == 0);
+    assert(file_size(path) > 0);
+    check_replay(path, set);
+
+    // changes after the compaction go to the journal again
+    set_add(set, journal, "192.0.2.2", 0);
+    check_replay(path, set);
+    journal_close(journal);
+    check_replay(path, set);
+
+    // a journal that was already compacted into the snapshot (a crash
+    // between the two) does not change the set
+    journal = journal_open(path);
+    set_add(set, journal, "192.0.2.5", 1);
+    set_add(set, journal, "192.0.2.6", 1);
+    set_add(set, journal, "192.0.2.5", 0);
+    set_add(set, journal, "10.0.0.0/8", 0);
+    assert(journal_compact(journal, write_helper, set));
+    journal_close(journal);
+    append_raw(journal_path, "+ 192.0.2.5\n+ 192.0.2.6\n- 192.0.2.5\n- 10.0.0.0/8\n");
+    check_replay(path, set);
+
+    journal_remove(path);
+    assert(journal_replay(path, apply_helper, dummy) == -1);
+
+    tree_destroy(set);
+    tree_destroy(dummy);
+}
+
+int main(int argc, char** argv) {
+    char dir[] = "/tmp/spin_journal_test_XXXXXX";
+
+    assert(mkdtemp(dir) != NULL);
+    test_journal(dir);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,564 @@
+/*
+ * Microbenchmarks for the core data structures of libspin
+ *
+ * Every benchmark fills a structure with n entries and then measures one
+ * or more operations on it, for n = 1k, 10k, 100k and 1M. The time and
+ * the number of allocations per operation are written to stdout as JSON,
+ * so that the results of releases can be compared, and operations whose
+ * cost grows with the size of the structure stand out.
+ *
+ * Usage: libspin_bench [-b budget] [-m max-size] [benchmark ...]
+ *
+ * A benchmark is not run at the next size if, going by the time it took
+ * at the previous size, that would take more than budget seconds (60 by
+ * default) even if it scaled linearly; such sizes are reported as
+ * skipped.
+ */
+
+#include "dns_cache.h"
+#include "node_cache.h"
+#include "spin_log.h"
+#include "spinhook.h"
+#include "tree.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_BUDGET 60
+#define MAX_OPS 5
+
+/*
+ * Allocations are counted by taking over malloc(); this is only done
+ * with the GNU C library, which exports the real functions
+ */
+#ifdef __GLIBC__
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long allocations;
+
+void*
+malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void*
+calloc(size_t nmemb, size_t size) {
+    allocations++;
+    return __libc_calloc(nmemb, size);
+}
+
+void*
+realloc(void* ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+#define COUNT_ALLOCATIONS 1
+#else
+static unsigned long allocations;
+#define COUNT_ALLOCATIONS 0
+#endif
+
+/* node_cache calls these in spind */
+void
+spinhook_nodedeleted(node_cache_t* node_cache, node_t* node) {
+}
+
+void
+spinhook_nodesmerged(node_cache_t* node_cache, node_t* dest_node, node_t* src_node) {
+}
+
+typedef struct {
+    const char* name;
+    void (*run)(size_t n);
+    // the operations it reports, for skipped sizes
+    const char* ops[MAX_OPS];
+} benchmark_t;
+
+typedef struct {
+    struct timespec start;
+    unsigned long allocations;
+} measurement_t;
+
+static int first_result = 1;
+
+static double
+elapsed_since(const struct timespec* start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+print_result_start(const char* op, size_t n) {
+    printf("%s\n    { \"op\": \"%s\", \"size\": %zu, ", first_result ? "" : ",", op, n);
+    first_result = 0;
+}
+
+static void
+measure_start(measurement_t* m) {
+    m->allocations = allocations;
+    clock_gettime(CLOCK_MONOTONIC, &m->start);
+}
+
+static void
+measure_stop(measurement_t* m, const char* op, size_t n, size_t ops) {
+    double elapsed = elapsed_since(&m->start);
+    unsigned long allocs = allocations - m->allocations;
+
+    print_result_start(op, n);
+    printf("\"ops\": %zu, \"ns_per_op\": %.1f", ops, elapsed * 1e9 / ops);
+    if (COUNT_ALLOCATIONS) {
+        printf(", \"allocs_per_op\": %.2f", (double)allocs / ops);
+    }
+    printf(" }");
+    fflush(stdout);
+}
+
+/*
+ * Inputs; entry i of a benchmark always gets the same key, so that runs
+ * can be compared. Keys are used in a shuffled order.
+ */
+static uint32_t*
+shuffled(size_t n) {
+    uint32_t* keys = malloc(n * sizeof(uint32_t));
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    uint32_t tmp;
+    size_t i, j;
+
+    for (i = 0; i < n; i++) {
+        keys[i] = i;
+    }
+    for (i = n - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        j = state % (i + 1);
+        tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+    return keys;
+}
+
+// 10.0.0.0/8 for i < 2^24, 11.0.0.0/8 after that
+static void
+set_addr(uint8_t* addr, uint32_t i) {
+    memset(addr, 0, 16);
+    addr[12] = 10 + (i >> 24);
+    addr[13] = (i >> 16) & 0xff;
+    addr[14] = (i >> 8) & 0xff;
+    addr[15] = i & 0xff;
+}
+
+static void
+set_ip(ip_t* ip, uint32_t i) {
+    memset(ip, 0, sizeof(ip_t));
+    ip->family = AF_INET;
+    ip->netmask = 32;
+    set_addr(ip->addr, i);
+}
+
+// remote address i talks to local device i % 64
+static void
+set_pkt_info(pkt_info_t* pkt_info, uint32_t i) {
+    memset(pkt_info, 0, sizeof(pkt_info_t));
+    pkt_info->family = AF_INET;
+    pkt_info->protocol = 6;
+    set_addr(pkt_info->src_addr, i % 64);
+    set_addr(pkt_info->dest_addr, 64 + i);
+    pkt_info->src_port = 1024 + i % 60000;
+    pkt_info->dest_port = 443;
+    pkt_info->payload_size = 1000;
+    pkt_info->packet_count = 1;
+}
+
+// name i in wire format: "\x04h123\x07example\x00"
+static void
+set_dns_pkt_info(dns_pkt_info_t* dns_pkt, uint32_t i, uint32_t addr) {
+    int len;
+
+    memset(dns_pkt, 0, sizeof(dns_pkt_info_t));
+    dns_pkt->family = AF_INET;
+    set_addr(dns_pkt->ip, addr);
+    dns_pkt->ttl = 300;
+    len = sprintf(dns_pkt->dname + 1, "h%u", i);
+    dns_pkt->dname[0] = len;
+    sprintf(dns_pkt->dname + 1 + len, "%cexample", 7);
+}
+
+static void
+bench_tree(size_t n) {
+    uint32_t* keys = shuffled(n);
+    tree_t* tree = tree_create(cmp_ints);
+    tree_entry_t* cur;
+    measurement_t m;
+    size_t i, count;
+
+    measure_start(&m);
+    for (i = 0; i < n; i++) {
+        tree_add(tree, sizeof(uint32_t), &keys[i], sizeof(uint32_t), &keys[i], 1);
+    }
+    measure_stop(&m, "tree_add", n, n);
+
+    measure_start(&m);
+    for (i = 0; i < n; i++) {
+        if (tree_find(tree, sizeof(uint32_t), &keys[i]) == NULL) {
+            fprintf(stderr, "tree_find: key %u not found\n", keys[i]);
+            exit(1);
+        }
+    }
+    measure_stop(&m, "tree_find", n, n);
+
+    measure_start(&m);
+    count = 0;
+    for (cur = tree_first(tree); cur != NULL; cur = tree_next(cur)) {
+        count++;
+    }
+    measure_stop(&m, "tree_iterate", n, count);
+
+    measure_start(&m);
+    for (i = 0; i < n; i++) {
+        tree_remove(tree, sizeof(uint32_t), &keys[i]);
+    }
+    measure_stop(&m, "tree_remove", n, n);
+
+    tree_destroy(tree);
+    free(keys);
+}
+
+static void
+count_domain(node_cache_t* node_cache, node_t* node, const char* domain, void* arg) {
+    (*(size_t*) arg)++;
+}
+
+static void
+bench_node_cache(size_t n) {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    uint32_t* keys = shuffled(n);
+    pkt_info_t pkt_info;
+    dns_pkt_info_t dns_pkt;
+    measurement_t m;
+    size_t i, count = 0;
+
+    // creates the nodes of n remote addresses (and 64 local ones)
+    measure_start(&m);
+    for (i = 0; i < n; i++) {
+        set_pkt_info(&pkt_info, keys[i]);
+        node_cache_add_pkt_info(node_cache, &pkt_info, 1000);
+    }
+    measure_stop(&m, "node_cache_add_pkt_info", n, n);
+
+    // adds a name to every remote node
+    measure_start(&m);
+    for (i = 0; i < n; i++) {
+        set_dns_pkt_info(&dns_pkt, keys[i], 64 + keys[i]);
+        node_cache_add_dns_info(node_cache, &dns_pkt, 1000);
+    }
+    measure_stop(&m, "node_cache_add_dns_info", n, n);
+
+    // the ids are handed out from 1 up
+    measure_start(&m);
+    for (i = 0; i < n; i++) {
+        if (node_cache_find_by_id(node_cache, 1 + keys[i]) == NULL) {
+            fprintf(stderr, "node_cache_find_by_id: node %u not found\n", 1 + keys[i]);
+            exit(1);
+        }
+    }
+    measure_stop(&m, "node_cache_find_by_id", n, n);
+
+    // all names are under example.
+    measure_start(&m);
+    if (node_cache_walk_domains(node_cache, "example.", count_domain, &count) != n || count != n) {
+        fprintf(stderr, "node_cache_walk_domains: %zu names, expected %zu\n", count, n);
+        exit(1);
+    }
+    measure_stop(&m, "node_cache_walk_domains", n, n);
+
+    // everything is old enough to go
+    measure_start(&m);
+    node_cache_clean(node_cache, 2000);
+    measure_stop(&m, "node_cache_clean", n, n);
+
+    node_cache_destroy(node_cache);
+    free(keys);
+}
+
+static void
+bench_merge_nodes(size_t n) {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t* node;
+    node_t* src_node;
+    node_t* dest_node;
+    ip_t ip;
+    measurement_t m;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        set_ip(&ip, i);
+        node = node_create(0);
+        node_set_modified(node, 1000);
+        node_add_ip(node, &ip);
+        node_cache_add_node(node_cache, node);
+    }
+
+    // merge node 2i + 1 into node 2i
+    measure_start(&m);
+    for (i = 0; i + 1 < n; i += 2) {
+        set_ip(&ip, i);
+        dest_node = node_cache_find_by_ip(node_cache, &ip);
+        set_ip(&ip, i + 1);
+        src_node = node_cache_find_by_ip(node_cache, &ip);
+        merge_nodes(node_cache, src_node, dest_node);
+    }
+    measure_stop(&m, "merge_nodes", n, n / 2);
+
+    node_cache_destroy(node_cache);
+}
+
+// nodes last seen over 1000 seconds, expired a second at a time
+static void
+bench_node_expire(size_t n) {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t* node;
+    ip_t ip;
+    measurement_t m;
+    size_t i, deleted = 0;
+    uint32_t t;
+
+    for (i = 0; i < n; i++) {
+        set_ip(&ip, i);
+        node = node_create(0);
+        node_set_modified(node, 1000 + i % 1000);
+        node_add_ip(node, &ip);
+        node_cache_add_node(node_cache, node);
+    }
+
+    measure_start(&m);
+    for (t = 1001; t <= 2000; t++) {
+        deleted += node_cache_expire(node_cache, t, 0);
+    }
+    measure_stop(&m, "node_cache_expire", n, n);
+    if (deleted != n) {
+        fprintf(stderr, "node_cache_expire: %zu nodes removed, expected %zu\n", deleted, n);
+        exit(1);
+    }
+
+    node_cache_destroy(node_cache);
+}
+
+// nodes added in order, of which every other one is seen again, evicted
+// down to a quarter
+static void
+bench_node_evict(size_t n) {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t* node;
+    ip_t ip;
+    measurement_t m;
+    size_t i, evicted;
+
+    for (i = 0; i < n; i++) {
+        set_ip(&ip, i);
+        node = node_create(0);
+        node_set_modified(node, 1000 + i);
+        node_add_ip(node, &ip);
+        node_cache_add_node(node_cache, node);
+    }
+    for (i = 0; i < n; i += 2) {
+        set_ip(&ip, i);
+        node_set_modified(node_cache_find_by_ip(node_cache, &ip), 1000 + n + i);
+    }
+
+    measure_start(&m);
+    evicted = node_cache_evict(node_cache, n / 4, 0);
+    measure_stop(&m, "node_cache_evict", n, evicted);
+    if (node_cache_size(node_cache) != n / 4) {
+        fprintf(stderr, "node_cache_evict: %zu nodes left, expected %zu\n", node_cache_size(node_cache), n / 4);
+        exit(1);
+    }
+
+    node_cache_destroy(node_cache);
+}
+
+static void
+bench_dns_cache(size_t n) {
+    dns_cache_t* dns_cache = dns_cache_create();
+    uint32_t* keys = shuffled(n);
+    dns_pkt_info_t dns_pkt;
+    measurement_t m;
+    size_t i;
+
+    // two names per address
+    measure_start(&m);
+    for (i = 0; i < n; i++) {
+        set_dns_pkt_info(&dns_pkt, keys[i], keys[i] / 2);
+        dns_cache_add(dns_cache, &dns_pkt, 1000);
+    }
+    measure_stop(&m, "dns_cache_add", n, n);
+
+    // long expired
+    measure_start(&m);
+    dns_cache_clean(dns_cache, 0);
+    measure_stop(&m, "dns_cache_clean", n, n);
+
+    dns_cache_destroy(dns_cache);
+    free(keys);
+}
+
+static void
+bench_flow_list(size_t n) {
+    flow_list_t* flow_list = flow_list_create(1000);
+    uint32_t* keys = shuffled(n);
+    pkt_info_t pkt_info;
+    measurement_t m;
+    size_t i;
+
+    // every flow is seen twice
+    measure_start(&m);
+    for (i = 0; i < 2 * n; i++) {
+        set_pkt_info(&pkt_info, keys[i % n]);
+        flow_list_add_pktinfo(flow_list, &pkt_info);
+    }
+    measure_stop(&m, "flow_list_add_pktinfo", n, 2 * n);
+
+    measure_start(&m);
+    flow_list_clear(flow_list, 1001);
+    measure_stop(&m, "flow_list_clear", n, n);
+
+    flow_list_destroy(flow_list);
+    free(keys);
+}
+
+static void
+bench_arp(size_t n) {
+    arp_table_t* arp_table = arp_table_create(ARP_TABLE_VIRTUAL);
+    uint32_t* keys = shuffled(n);
+    char mac[18];
+    ip_t ip;
+    measurement_t m;
+    size_t i;
+
+    measure_start(&m);
+    for (i = 0; i < n; i++) {
+        set_ip(&ip, keys[i]);
+        snprintf(mac, sizeof(mac), "02:00:00:%02x:%02x:%02x",
+                 (keys[i] >> 16) & 0xff, (keys[i] >> 8) & 0xff, keys[i] & 0xff);
+        arp_table_add(arp_table, &ip, mac);
+    }
+    measure_stop(&m, "arp_table_add", n, n);
+
+    measure_start(&m);
+    for (i = 0; i < n; i++) {
+        set_ip(&ip, keys[i]);
+        if (arp_table_find_by_ip(arp_table, &ip) == NULL) {
+            fprintf(stderr, "arp_table_find_by_ip: entry %u not found\n", keys[i]);
+            exit(1);
+        }
+    }
+    measure_stop(&m, "arp_table_find_by_ip", n, n);
+
+    arp_table_destroy(arp_table);
+    free(keys);
+}
+
+static const benchmark_t benchmarks[] = {
+    { "tree", bench_tree, { "tree_add", "tree_find", "tree_iterate", "tree_remove" } },
+    { "node_cache", bench_node_cache, { "node_cache_add_pkt_info", "node_cache_add_dns_info", "node_cache_find_by_id", "node_cache_walk_domains", "node_cache_clean" } },
+    { "merge_nodes", bench_merge_nodes, { "merge_nodes" } },
+    { "node_expire", bench_node_expire, { "node_cache_expire" } },
+    { "node_evict", bench_node_evict, { "node_cache_evict" } },
+    { "dns_cache", bench_dns_cache, { "dns_cache_add", "dns_cache_clean" } },
+    { "flow_list", bench_flow_list, { "flow_list_add_pktinfo", "flow_list_clear" } },
+    { "arp", bench_arp, { "arp_table_add", "arp_table_find_by_ip" } },
+};
+#define N_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static const size_t sizes[] = { 1000, 10000, 100000, 1000000 };
+#define N_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static int
+selected(const char* name, int argc, char** argv) {
+    int i;
+
+    if (argc == 0) {
+        return 1;
+    }
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void
+run_benchmark(const benchmark_t* b, double budget, size_t max_size) {
+    struct timespec start;
+    double elapsed = 0;
+    size_t i, j, prev = 0;
+
+    for (i = 0; i < N_SIZES && sizes[i] <= max_size; i++) {
+        if (prev && elapsed * sizes[i] / prev > budget) {
+            for (j = 0; j < MAX_OPS && b->ops[j] != NULL; j++) {
+                print_result_start(b->ops[j], sizes[i]);
+                printf("\"skipped\": true }");
+            }
+            continue;
+        }
+        fprintf(stderr, "%s: %zu entries\n", b->name, sizes[i]);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        b->run(sizes[i]);
+        elapsed = elapsed_since(&start);
+        prev = sizes[i];
+    }
+}
+
+int
+main(int argc, char** argv) {
+    double budget = DEFAULT_BUDGET;
+    size_t max_size = sizes[N_SIZES - 1];
+    size_t i;
+    int c;
+
+    while ((c = getopt(argc, argv, "b:m:")) != -1) {
+        switch (c) {
+        case 'b':
+            budget = atof(optarg);
+            break;
+        case 'm':
+            max_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b budget] [-m max-size] [benchmark ...]\n", argv[0]);
+            return 1;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    // keep the logging of the library out of the measurements
+    spin_log_init(0, 0, NULL, 0, "libspin_bench");
+
+    printf("{\n  \"optimized\": %s,\n  \"allocations_counted\": %s,\n  \"results\": [",
+#ifdef __OPTIMIZE__
+           "true",
+#else
+           "false",
+#endif
+           COUNT_ALLOCATIONS ? "true" : "false");
+    for (i = 0; i < N_BENCHMARKS; i++) {
+        if (selected(benchmarks[i].name, argc, argv)) {
+            run_benchmark(&benchmarks[i], budget, max_size);
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    return 0;
+}
@@ -156,7 +156,7 @@ test_node_cache_add_1() {
     node_cache_add_dns_info(node_cache, &info1, 12345);
     node_cache_add_dns_info(node_cache, &info2, 12345);
     node_cache_add_dns_info(node_cache, &info3, 12345);
-    assert(tree_size(node_cache->nodes) == 1);
+    assert(node_cache_size(node_cache) == 1);
 
     node_cache_destroy(node_cache);
     node_cache = node_cache_create(ARP_TABLE_LINUX);
@@ -164,11 +164,11 @@ test_node_cache_add_1() {
     node_cache_add_dns_info(node_cache, &info1, 12345);
     node_cache_add_dns_info(node_cache, &info3, 12345);
     // 1 and 3 share no data
-    assert(tree_size(node_cache->nodes) == 2);
+    assert(node_cache_size(node_cache) == 2);
 
     // adding 2 now should merge 3 into it as well
     node_cache_add_dns_info(node_cache, &info2, 12345);
-    assert(tree_size(node_cache->nodes) == 1);
+    assert(node_cache_size(node_cache) == 1);
 
     node_cache_destroy(node_cache);
 }
@@ -179,7 +179,7 @@ test_node_cache_add_2() {
     pkt_info_t pkt_info;
     sample_pkt_info_1(&pkt_info);
     node_cache_add_pkt_info(node_cache, &pkt_info, 12345);
-    assert(tree_size(node_cache->nodes) == 2);
+    assert(node_cache_size(node_cache) == 2);
 
     node_cache_destroy(node_cache);
 }
@@ -323,6 +323,425 @@ main(int argc, char** argv) {
 }
 #endif
 
+/*
+ * The tests above are kept for reference; the ones below test the
+ * node cache as it is now
+ */
+#include "node_cache.h"
+#include "util.h"
+
+#include "test_helper.h"
+
+#include <stdlib.h>
+
+// node_cache calls these in spind
+void
+spinhook_nodedeleted(node_cache_t* node_cache, node_t* node) {
+}
+
+void
+spinhook_nodesmerged(node_cache_t* node_cache, node_t* dest_node, node_t* src_node) {
+}
+
+static ip_t
+sample_ip(int n) {
+    char str[INET6_ADDRSTRLEN];
+    ip_t ip;
+
+    snprintf(str, sizeof(str), "192.0.2.%d", n);
+    assert(spin_pton(&ip, str));
+    return ip;
+}
+
+// Adds a node with addresses 192.0.2.ip1 (and .ip2 if that is not 0)
+// and the domain (if not NULL); returns the node it ended up in
+static node_t*
+add_node(node_cache_t* node_cache, int ip1, int ip2, const char* domain, uint32_t last_seen) {
+    node_t* node = node_create(0);
+    ip_t ip;
+
+    ip = sample_ip(ip1);
+    node_add_ip(node, &ip);
+    if (ip2 != 0) {
+        ip = sample_ip(ip2);
+        node_add_ip(node, &ip);
+    }
+    if (domain != NULL) {
+        node_add_domain(node, (char*) domain);
+    }
+    node_set_modified(node, last_seen);
+    node_cache_add_node(node_cache, node);
+    ip = sample_ip(ip1);
+    return node_cache_find_by_ip(node_cache, &ip);
+}
+
+typedef struct {
+    char names[10][64];
+    node_t* nodes[10];
+    int count;
+} walk_result_t;
+
+static void
+collect(node_cache_t* node_cache, node_t* node, const char* domain, void* arg) {
+    walk_result_t* result = (walk_result_t*) arg;
+
+    assert(result->count < 10);
+    strcpy(result->names[result->count], domain);
+    result->nodes[result->count++] = node;
+}
+
+// expected are the names and the nodes they belong to, in walk order
+static void
+check_walk(node_cache_t* node_cache, const char* suffix, const char** names, node_t** nodes, int count) {
+    walk_result_t result;
+    int i;
+
+    result.count = 0;
+    assert(node_cache_walk_domains(node_cache, suffix, collect, &result) == (size_t) count);
+    assertf(result.count == count, "walk of %s gave %d domains, expected %d", suffix, result.count, count);
+    for (i = 0; i < count; i++) {
+        assertf(strcmp(result.names[i], names[i]) == 0, "domain %d of %s is %s, expected %s", i, suffix, result.names[i], names[i]);
+        assertf(result.nodes[i] == nodes[i], "domain %s has node %d, expected %d", names[i], result.nodes[i]->id, nodes[i]->id);
+    }
+    assert(node_cache_count_domains(node_cache, suffix) == (size_t) count);
+}
+
+void
+test_node_cache_domains() {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t *www, *apex, *net, *ab, *merged;
+    int ab_id;
+
+    www = add_node(node_cache, 1, 0, "www.example.com.", 100);
+    apex = add_node(node_cache, 2, 0, "example.com.", 100);
+    net = add_node(node_cache, 3, 0, "example.net.", 100);
+    ab = add_node(node_cache, 4, 0, "a.b.example.com.", 100);
+    ab_id = ab->id;
+
+    check_walk(node_cache, "example.com.", (const char*[]) {
+        "example.com.", "a.b.example.com.", "www.example.com."
+    }, (node_t*[]) { apex, ab, www }, 3);
+    check_walk(node_cache, "*.example.com.", (const char*[]) {
+        "a.b.example.com.", "www.example.com."
+    }, (node_t*[]) { ab, www }, 2);
+    check_walk(node_cache, "net.", (const char*[]) { "example.net." }, (node_t*[]) { net }, 1);
+
+    // shares an address with www and one with a.b: all three are merged
+    // into www, which has the lowest id, and the domains go with them
+    merged = add_node(node_cache, 1, 4, "mail.example.com.", 200);
+    assert(merged == www);
+    assert(node_cache_find_by_id(node_cache, ab_id) == NULL);
+    assert(node_cache_size(node_cache) == 3);
+    check_walk(node_cache, "example.com.", (const char*[]) {
+        "example.com.", "a.b.example.com.", "mail.example.com.", "www.example.com."
+    }, (node_t*[]) { apex, www, www, www }, 4);
+    check_walk(node_cache, "*.example.com.", (const char*[]) {
+        "a.b.example.com.", "mail.example.com.", "www.example.com."
+    }, (node_t*[]) { www, www, www }, 3);
+
+    // the nodes last seen at 100 are removed, with their domains
+    node_cache_clean(node_cache, 150);
+    assert(node_cache_size(node_cache) == 1);
+    check_walk(node_cache, "example.com.", (const char*[]) {
+        "a.b.example.com.", "mail.example.com.", "www.example.com."
+    }, (node_t*[]) { www, www, www }, 3);
+    check_walk(node_cache, "*.example.com.", (const char*[]) {
+        "a.b.example.com.", "mail.example.com.", "www.example.com."
+    }, (node_t*[]) { www, www, www }, 3);
+    check_walk(node_cache, "net.", NULL, NULL, 0);
+
+    node_cache_clean(node_cache, 250);
+    check_walk(node_cache, "example.com.", NULL, NULL, 0);
+    assert(node_cache_count_domains(node_cache, ".") == 0);
+
+    node_cache_destroy(node_cache);
+}
+
+// Adds a node with address 192.0.2.ip and a mac address, which makes
+// it a device
+static node_t*
+add_device(node_cache_t* node_cache, int ip1, uint32_t last_seen) {
+    node_t* node = node_create(0);
+    char mac[18];
+    ip_t ip;
+
+    ip = sample_ip(ip1);
+    node_add_ip(node, &ip);
+    snprintf(mac, sizeof(mac), "02:00:00:00:00:%02x", ip1);
+    node_set_mac(node, mac);
+    node_set_modified(node, last_seen);
+    node_cache_add_node(node_cache, node);
+    node = node_cache_find_by_ip(node_cache, &ip);
+    assert(node->device != NULL);
+    return node;
+}
+
+void
+test_node_cache_expire() {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t *old, *seen;
+    int old_id, seen_id;
+
+    old = add_node(node_cache, 1, 0, NULL, 100);
+    seen = add_node(node_cache, 2, 0, NULL, 100);
+    old_id = old->id;
+    seen_id = seen->id;
+    assert(node_cache_expire(node_cache, 0, 0) == 0);
+    assert(node_cache_expire(node_cache, 100, 0) == 0);
+    assert(node_cache_size(node_cache) == 2);
+
+    // seen again; it is put back in the wheel instead of removed
+    assert(add_node(node_cache, 2, 0, NULL, 200) == seen);
+    assert(node_cache_expire(node_cache, 150, 0) == 1);
+    assert(node_cache_find_by_id(node_cache, old_id) == NULL);
+    assert(node_cache_find_by_id(node_cache, seen_id) == seen);
+    assert(twheel_size(node_cache->expiry) == 1);
+
+    assert(node_cache_expire(node_cache, 200, 0) == 0);
+    assert(node_cache_expire(node_cache, 201, 0) == 1);
+    assert(node_cache_size(node_cache) == 0);
+    assert(twheel_size(node_cache->expiry) == 0);
+
+    node_cache_destroy(node_cache);
+}
+
+void
+test_node_cache_expire_kept() {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t *device, *referenced, *persistent;
+    int referenced_id, persistent_id;
+
+    device = add_device(node_cache, 1, 100);
+    referenced = add_node(node_cache, 2, 0, NULL, 100);
+    referenced->references = 1;
+    referenced_id = referenced->id;
+    persistent = add_node(node_cache, 3, 0, NULL, 100);
+    persistent->persistent = 1;
+    persistent_id = persistent->id;
+
+    assert(node_cache_expire(node_cache, 150, 0) == 0);
+    assert(node_cache_size(node_cache) == 3);
+    assert(twheel_size(node_cache->expiry) == 3);
+
+    // no longer in use, but only looked at again NODE_CACHE_RECHECK
+    // seconds after they were kept
+    referenced->references = 0;
+    persistent->persistent = 0;
+    assert(node_cache_expire(node_cache, 150 + NODE_CACHE_RECHECK, 0) == 0);
+    assert(node_cache_size(node_cache) == 3);
+    assert(node_cache_expire(node_cache, 150 + NODE_CACHE_RECHECK + 1, 0) == 2);
+    assert(node_cache_find_by_id(node_cache, referenced_id) == NULL);
+    assert(node_cache_find_by_id(node_cache, persistent_id) == NULL);
+
+    // a device is never removed, and keeps being looked at again
+    assert(node_cache_size(node_cache) == 1);
+    assert(node_cache_first(node_cache) == device);
+    assert(twheel_size(node_cache->expiry) == 1);
+    assert(node_cache_expire(node_cache, 1000, 0) == 0);
+    assert(twheel_size(node_cache->expiry) == 1);
+
+    node_cache_destroy(node_cache);
+}
+
+void
+test_node_cache_expire_merged() {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t *dest, *src;
+    int src_id;
+
+    dest = add_node(node_cache, 1, 0, NULL, 100);
+    src = add_node(node_cache, 2, 0, NULL, 100);
+    src_id = src->id;
+    assert(twheel_size(node_cache->expiry) == 2);
+
+    // src is merged into dest; its id stays in the wheel until then
+    assert(add_node(node_cache, 1, 2, NULL, 200) == dest);
+    assert(node_cache_find_by_id(node_cache, src_id) == NULL);
+    assert(twheel_size(node_cache->expiry) == 2);
+
+    // the entry of src is dropped, that of dest put back for 200
+    assert(node_cache_expire(node_cache, 150, 0) == 0);
+    assert(node_cache_size(node_cache) == 1);
+    assert(twheel_size(node_cache->expiry) == 1);
+
+    // a new node may get the id of src; the old entry was not for it
+    src = add_node(node_cache, 3, 0, NULL, 300);
+    assert(node_cache_expire(node_cache, 250, 0) == 1);
+    assert(node_cache_size(node_cache) == 1);
+    assert(node_cache_first(node_cache) == src);
+
+    node_cache_destroy(node_cache);
+}
+
+void
+test_node_cache_expire_budget() {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t* kept;
+    int i;
+
+    // the oldest one is kept
+    kept = add_node(node_cache, 1, 0, NULL, 101);
+    kept->persistent = 1;
+    for (i = 2; i <= 10; i++) {
+        add_node(node_cache, i, 0, NULL, 100 + i);
+    }
+
+    // the budget is for the nodes looked at, kept or not; the rest is
+    // done in the next calls
+    assert(node_cache_expire(node_cache, 200, 4) == 3);
+    assert(node_cache_size(node_cache) == 7);
+    assert(node_cache_expire(node_cache, 200, 4) == 4);
+    assert(node_cache_size(node_cache) == 3);
+    assert(node_cache_expire(node_cache, 200, 4) == 2);
+    assert(node_cache_size(node_cache) == 1);
+    assert(node_cache_expire(node_cache, 200, 4) == 0);
+    assert(node_cache_first(node_cache) == kept);
+
+    node_cache_destroy(node_cache);
+}
+
+// expected is the lru list, least recently seen first
+static void
+check_lru(node_cache_t* node_cache, node_t** nodes, int count) {
+    node_t* node;
+    int i;
+
+    node = node_cache->lru_first;
+    for (i = 0; i < count; i++) {
+        assertf(node == nodes[i], "node %d in the lru list is %d, expected %d", i, node ? node->id : 0, nodes[i]->id);
+        assert(node->lru_prev == (i == 0 ? NULL : nodes[i - 1]));
+        node = node->lru_next;
+    }
+    assert(node == NULL);
+    assert(node_cache->lru_last == (count == 0 ? NULL : nodes[count - 1]));
+    assert(node_cache_size(node_cache) == (size_t) count);
+}
+
+void
+test_node_cache_evict() {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t* nodes[6];
+    int i;
+
+    assert(node_cache_footprint(node_cache) == 0);
+    for (i = 0; i < 6; i++) {
+        nodes[i] = add_node(node_cache, i + 1, 0, i == 0 ? "example.com." : NULL, 101 + i);
+    }
+    check_lru(node_cache, nodes, 6);
+    assert(node_cache_footprint(node_cache) > 0);
+    assert(node_cache_evict(node_cache, 0, 0) == 0);
+    assert(node_cache_evict(node_cache, 6, 0) == 0);
+
+    // seen again: it only moves to the back when eviction gets to it
+    assert(add_node(node_cache, 2, 0, NULL, 200) == nodes[1]);
+    check_lru(node_cache, nodes, 6);
+
+    assert(node_cache_evict(node_cache, 3, 0) == 3);
+    check_lru(node_cache, (node_t*[]) { nodes[4], nodes[5], nodes[1] }, 3);
+    assert(node_cache_evict(node_cache, 1, 0) == 2);
+    check_lru(node_cache, (node_t*[]) { nodes[1] }, 1);
+
+    node_cache_clean(node_cache, 1000);
+    check_lru(node_cache, NULL, 0);
+    assert(node_cache_footprint(node_cache) == 0);
+
+    node_cache_destroy(node_cache);
+}
+
+void
+test_node_cache_evict_kept() {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t *device, *referenced, *persistent;
+
+    device = add_device(node_cache, 1, 101);
+    referenced = add_node(node_cache, 2, 0, NULL, 102);
+    referenced->references = 1;
+    add_node(node_cache, 3, 0, NULL, 103);
+    persistent = add_node(node_cache, 4, 0, NULL, 104);
+    persistent->persistent = 1;
+    add_node(node_cache, 5, 0, NULL, 105);
+
+    // the rest must be kept; this stops instead of going round
+    assert(node_cache_evict(node_cache, 1, 0) == 2);
+    check_lru(node_cache, (node_t*[]) { device, referenced, persistent }, 3);
+    assert(node_cache_evict(node_cache, 1, 0) == 0);
+    check_lru(node_cache, (node_t*[]) { device, referenced, persistent }, 3);
+
+    persistent->persistent = 0;
+    assert(node_cache_evict(node_cache, 1, 0) == 1);
+    check_lru(node_cache, (node_t*[]) { device, referenced }, 2);
+
+    node_cache_destroy(node_cache);
+}
+
+void
+test_node_cache_evict_merged() {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t *first, *middle, *last, *device;
+
+    first = add_node(node_cache, 1, 0, NULL, 101);
+    middle = add_node(node_cache, 2, 0, NULL, 102);
+    device = add_device(node_cache, 3, 103);
+    last = add_node(node_cache, 4, 0, NULL, 104);
+    check_lru(node_cache, (node_t*[]) { first, middle, device, last }, 4);
+
+    // nodes are merged into the device; the ones merged away are taken
+    // out of the list, wherever they are
+    assert(add_node(node_cache, 2, 3, NULL, 105) == device);
+    check_lru(node_cache, (node_t*[]) { first, device, last }, 3);
+    assert(add_node(node_cache, 4, 3, NULL, 106) == device);
+    check_lru(node_cache, (node_t*[]) { first, device }, 2);
+    assert(add_node(node_cache, 1, 3, NULL, 107) == device);
+    check_lru(node_cache, (node_t*[]) { device }, 1);
+
+    assert(node_cache_evict(node_cache, 1, 0) == 0);
+    node_cache_destroy(node_cache);
+}
+
+void
+test_node_cache_evict_budget() {
+    node_cache_t* node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
+    node_t* nodes[100];
+    int i;
+
+    // the 90 oldest are in use, like remote nodes with device flows
+    for (i = 0; i < 100; i++) {
+        nodes[i] = add_node(node_cache, i + 1, 0, NULL, 101 + i);
+        if (i < 90) {
+            nodes[i]->references = 1;
+        }
+    }
+
+    // each call looks at no more than the budget, and the ones it kept
+    // go to the back; the next call goes on with the rest
+    for (i = 0; i < 4; i++) {
+        assert(node_cache_evict(node_cache, 10, 20) == 0);
+        assert(node_cache->lru_first == nodes[20 * (i + 1)]);
+        assert(node_cache->lru_last == nodes[20 * (i + 1) - 1]);
+    }
+    assert(node_cache_evict(node_cache, 10, 20) == 10);
+    assert(node_cache_size(node_cache) == 90);
+    assert(node_cache->lru_first == nodes[0]);
+    assert(node_cache->lru_last == nodes[89]);
+
+    // all that is left is in use
+    assert(node_cache_evict(node_cache, 10, 20) == 0);
+    assert(node_cache->lru_first == nodes[20]);
+    assert(node_cache_evict(node_cache, 10, 0) == 0);
+    assert(node_cache->lru_first == nodes[20]);
+
+    node_cache_destroy(node_cache);
+}
+
 int main(int argc, char** argv) {
+    test_node_cache_domains();
+    test_node_cache_expire();
+    test_node_cache_expire_kept();
+    test_node_cache_expire_merged();
+    test_node_cache_expire_budget();
+    test_node_cache_evict();
+    test_node_cache_evict_kept();
+    test_node_cache_evict_merged();
+    test_node_cache_evict_budget();
     return 0;
 }
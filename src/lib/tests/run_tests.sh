@@ -21,4 +21,13 @@ gcov node_names_test-node_names.c
 gcov arp_test-arp.c
 gcov util_test-util.c
 gcov dns_cache_test-dns_cache.c
+gcov extsrc_test-extsrc.c
+gcov iptrie_test-iptrie.c
+gcov ipl_test-ipl.c
+gcov journal_test-journal.c
+gcov ipfeed_test-ipfeed.c
+gcov idtable_test-idtable.c
+gcov intern_test-intern.c
+gcov domtrie_test-domtrie.c
+gcov twheel_test-twheel.c
 rm *.gcda *.gcno
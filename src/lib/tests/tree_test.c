@@ -240,6 +240,47 @@ test_find() {
     tree_destroy(tree);
 }
 
+static inline void
+find_next(tree_t* tree, int key, int expected) {
+    tree_entry_t* entry = tree_find_next(tree, sizeof(key), &key);
+    assert(entry != NULL);
+    assert(*(int*)entry->key == expected);
+}
+
+static inline void
+find_next_none(tree_t* tree, int key) {
+    assert(tree_find_next(tree, sizeof(key), &key) == NULL);
+}
+
+void
+test_find_next() {
+    tree_t* tree = tree_create(int_cmp);
+
+    find_next_none(tree, 1);
+
+    do_int_add(tree, 10);
+    do_int_add(tree, 20);
+    do_int_add(tree, 30);
+    do_int_add(tree, 40);
+    do_int_add(tree, 50);
+
+    find_next(tree, -1, 10);
+    find_next(tree, 10, 20);
+    find_next(tree, 15, 20);
+    find_next(tree, 29, 30);
+    find_next(tree, 30, 40);
+    find_next(tree, 49, 50);
+    find_next_none(tree, 50);
+    find_next_none(tree, 123);
+
+    // resuming from a removed key continues with its successor
+    do_int_remove(tree, 30);
+    find_next(tree, 30, 40);
+    find_next(tree, 20, 40);
+
+    tree_destroy(tree);
+}
+
 void
 test_remove_find() {
     tree_t* tree = tree_create(int_cmp);
@@ -501,6 +542,7 @@ int main(int argc, char** argv) {
     test_add_3();
     test_add_4();
     test_find();
+    test_find_next();
     test_first();
     test_remove_find();
     test_remove_1();
@@ -0,0 +1,222 @@
+#include "twheel.h"
+
+#include "test_helper.h"
+
+#include <stdlib.h>
+
+typedef struct {
+    uint32_t time;
+    int id;
+} item_t;
+
+typedef struct {
+    twheel_t* wheel;
+    uint32_t now;
+    int fired[1000];
+    int count;
+} fired_t;
+
+static void
+record(uint32_t time, void* data, void* arg) {
+    fired_t* fired = (fired_t*) arg;
+    item_t* item = (item_t*) data;
+
+    assertf(item->time == time, "entry %d has time %u, expected %u", item->id, time, item->time);
+    assertf(time <= fired->now, "entry %d with time %u came out at %u", item->id, time, fired->now);
+    assert(fired->count < 1000);
+    fired->fired[fired->count++] = item->id;
+}
+
+static void
+add(twheel_t* wheel, uint32_t time, int id) {
+    item_t item;
+
+    item.time = time;
+    item.id = id;
+    twheel_add(wheel, time, &item);
+}
+
+static size_t
+advance(twheel_t* wheel, fired_t* fired, uint32_t now, size_t budget) {
+    fired->now = now;
+    fired->count = 0;
+    return twheel_advance(wheel, now, record, fired, budget);
+}
+
+void
+test_twheel_basic() {
+    twheel_t* wheel = twheel_create(sizeof(item_t));
+    fired_t fired;
+
+    // an empty wheel jumps to the time it is advanced to
+    assert(advance(wheel, &fired, 1000000, 0) == 0);
+    assert(wheel->now == 1000000);
+
+    add(wheel, 1000010, 1);
+    add(wheel, 1000005, 2);
+    add(wheel, 1000100, 3);
+    add(wheel, 1005000, 4);
+    add(wheel, 1000005, 5);
+    assert(twheel_size(wheel) == 5);
+
+    assert(advance(wheel, &fired, 1000004, 0) == 0);
+    assert(advance(wheel, &fired, 1000005, 0) == 2);
+    assert(fired.fired[0] == 2 && fired.fired[1] == 5);
+    assert(advance(wheel, &fired, 1000099, 0) == 1);
+    assert(fired.fired[0] == 1);
+    assert(advance(wheel, &fired, 1004999, 0) == 1);
+    assert(fired.fired[0] == 3);
+    assert(twheel_size(wheel) == 1);
+    assert(advance(wheel, &fired, 1005000, 0) == 1);
+    assert(fired.fired[0] == 4);
+    assert(twheel_size(wheel) == 0);
+
+    // times that have passed come out at the next second
+    add(wheel, 10, 6);
+    add(wheel, 1005000, 7);
+    assert(advance(wheel, &fired, 1005000, 0) == 0);
+    assert(advance(wheel, &fired, 1005001, 0) == 2);
+
+    twheel_destroy(wheel);
+}
+
+void
+test_twheel_far() {
+    twheel_t* wheel = twheel_create(sizeof(item_t));
+    fired_t fired;
+    uint32_t start = 1500000000;
+
+    advance(wheel, &fired, start, 0);
+    // further than the wheel covers
+    add(wheel, start + 300 * 86400, 1);
+    add(wheel, start + 100 * 86400, 2);
+    add(wheel, start + 86400, 3);
+    assert(advance(wheel, &fired, start + 86399, 0) == 0);
+    assert(advance(wheel, &fired, start + 86400, 0) == 1);
+    assert(fired.fired[0] == 3);
+    assert(advance(wheel, &fired, start + 100 * 86400 - 1, 0) == 0);
+    assert(advance(wheel, &fired, start + 299 * 86400, 0) == 1);
+    assert(fired.fired[0] == 2);
+    assert(advance(wheel, &fired, start + 300 * 86400 - 1, 0) == 0);
+    assert(advance(wheel, &fired, start + 300 * 86400, 0) == 1);
+    assert(fired.fired[0] == 1);
+
+    // a wheel that was never advanced
+    twheel_destroy(wheel);
+    wheel = twheel_create(sizeof(item_t));
+    add(wheel, start, 4);
+    assert(advance(wheel, &fired, start - 1, 0) == 0);
+    assert(advance(wheel, &fired, start, 0) == 1);
+
+    twheel_destroy(wheel);
+}
+
+void
+test_twheel_budget() {
+    twheel_t* wheel = twheel_create(sizeof(item_t));
+    fired_t fired;
+    int i;
+
+    advance(wheel, &fired, 1000, 0);
+    for (i = 0; i < 10; i++) {
+        add(wheel, 1001 + i % 2, i);
+    }
+    assert(advance(wheel, &fired, 2000, 4) == 4);
+    assert(twheel_size(wheel) == 6);
+    assert(advance(wheel, &fired, 2000, 4) == 4);
+    assert(advance(wheel, &fired, 2000, 4) == 2);
+    assert(twheel_size(wheel) == 0);
+
+    // the ones left over come out first
+    for (i = 0; i < 10; i++) {
+        add(wheel, 2001, i);
+    }
+    assert(advance(wheel, &fired, 2001, 8) == 8);
+    add(wheel, 2002, 10);
+    assert(advance(wheel, &fired, 2002, 0) == 3);
+    assert(fired.fired[2] == 10);
+
+    twheel_destroy(wheel);
+}
+
+static void
+readd(uint32_t time, void* data, void* arg) {
+    fired_t* fired = (fired_t*) arg;
+    item_t* item = (item_t*) data;
+
+    fired->fired[fired->count++] = item->id;
+    if (item->id < 5) {
+        add(fired->wheel, time + 100, item->id + 1);
+    }
+}
+
+void
+test_twheel_readd() {
+    twheel_t* wheel = twheel_create(sizeof(item_t));
+    fired_t fired;
+
+    fired.wheel = wheel;
+    fired.count = 0;
+    twheel_advance(wheel, 1000, readd, &fired, 0);
+    add(wheel, 1000, 0);
+    assert(twheel_advance(wheel, 1350, readd, &fired, 0) == 4);
+    assert(twheel_size(wheel) == 1);
+    assert(twheel_advance(wheel, 2000, readd, &fired, 0) == 2);
+    assert(fired.count == 6);
+    assert(fired.fired[5] == 5);
+    assert(twheel_size(wheel) == 0);
+
+    twheel_destroy(wheel);
+}
+
+// compare with a plain list of times
+void
+test_twheel_random() {
+    twheel_t* wheel = twheel_create(sizeof(item_t));
+    fired_t fired;
+    uint32_t times[1000];
+    uint32_t added_at[1000];
+    int done[1000];
+    uint32_t now = 2000000000;
+    int nitems = 0;
+    int k, i, expected;
+
+    srandom(4);
+    advance(wheel, &fired, now, 0);
+    for (k = 0; k < 2000; k++) {
+        if (nitems < 1000 && random() % 2 == 0) {
+            times[nitems] = now - 10 + random() % (random() % 4 == 0 ? 200000 : 300);
+            added_at[nitems] = now;
+            done[nitems] = 0;
+            add(wheel, times[nitems], nitems);
+            nitems++;
+        }
+        now += random() % (random() % 10 == 0 ? 5000 : 20);
+        advance(wheel, &fired, now, 0);
+        for (i = 0; i < fired.count; i++) {
+            assert(!done[fired.fired[i]]);
+            done[fired.fired[i]] = 1;
+        }
+        expected = 0;
+        for (i = 0; i < nitems; i++) {
+            if (times[i] <= now && (added_at[i] < now)) {
+                assertf(done[i], "entry %d with time %u not out at %u", i, times[i], now);
+                expected++;
+            } else {
+                assertf(!done[i], "entry %d with time %u out at %u", i, times[i], now);
+            }
+        }
+        assert(twheel_size(wheel) == (size_t) (nitems - expected));
+    }
+
+    twheel_destroy(wheel);
+}
+
+int main(int argc, char** argv) {
+    test_twheel_basic();
+    test_twheel_far();
+    test_twheel_budget();
+    test_twheel_readd();
+    test_twheel_random();
+    return 0;
+}
@@ -4,13 +4,18 @@
 #include "spin_log.h"
 #include "tree.h"
 
-tree_entry_t*
-tree_entry_create(size_t key_size, void* key, size_t data_size, void* data, int copy) {
+// The entry functions with the tree, for its key functions (if any)
+static tree_entry_t*
+entry_create(tree_t* tree, size_t key_size, void* key, size_t data_size, void* data, int copy) {
     tree_entry_t* tree_entry = (tree_entry_t*) malloc(sizeof(tree_entry_t));
 
     if (copy) {
-        tree_entry->key = malloc(key_size);
-        memcpy(tree_entry->key, key, key_size);
+        if (tree != NULL && tree->key_copy != NULL) {
+            tree_entry->key = tree->key_copy(key, key_size);
+        } else {
+            tree_entry->key = malloc(key_size);
+            memcpy(tree_entry->key, key, key_size);
+        }
         tree_entry->data = malloc(data_size);
         memcpy(tree_entry->data, data, data_size);
     } else {
@@ -27,33 +32,54 @@ tree_entry_create(size_t key_size, void* key, size_t data_size, void* data, int
     return tree_entry;
 }
 
-void tree_entry_destroy(tree_entry_t* tree_entry, int destroy_children) {
+static void
+entry_destroy(tree_t* tree, tree_entry_t* tree_entry, int destroy_children) {
     if (tree_entry == NULL) {
         return;
     }
 
     if (destroy_children) {
-        tree_entry_destroy(tree_entry->left, 1);
-        tree_entry_destroy(tree_entry->right, 1);
+        entry_destroy(tree, tree_entry->left, 1);
+        entry_destroy(tree, tree_entry->right, 1);
     }
 
-    free(tree_entry->key);
+    if (tree != NULL && tree->key_free != NULL) {
+        tree->key_free(tree_entry->key);
+    } else {
+        free(tree_entry->key);
+    }
     free(tree_entry->data);
     free(tree_entry);
 }
 
+tree_entry_t*
+tree_entry_create(size_t key_size, void* key, size_t data_size, void* data, int copy) {
+    return entry_create(NULL, key_size, key, data_size, data, copy);
+}
+
+void tree_entry_destroy(tree_entry_t* tree_entry, int destroy_children) {
+    entry_destroy(NULL, tree_entry, destroy_children);
+}
+
 tree_t* tree_create(int (*cmp_func)(size_t key_a_size, const void* key_a, size_t key_b_size, const void* key_b)) {
     tree_t* tree = (tree_t*) malloc(sizeof(tree_t));
     tree->root = NULL;
     tree->cmp_func = cmp_func;
+    tree->key_copy = NULL;
+    tree->key_free = NULL;
     return tree;
 }
 
+void tree_set_key_funcs(tree_t* tree, void* (*key_copy)(const void* key, size_t key_size), void (*key_free)(void* key)) {
+    tree->key_copy = key_copy;
+    tree->key_free = key_free;
+}
+
 void tree_destroy(tree_t* tree) {
     if (tree == NULL) {
         return;
     }
-    tree_entry_destroy(tree->root, 1);
+    entry_destroy(tree, tree->root, 1);
     free(tree);
 }
 
@@ -67,7 +93,7 @@ int tree_add(tree_t* tree, size_t key_size, void* key, size_t data_size, void* d
     int c;
 
     if (tree->root == NULL) {
-        tree->root = tree_entry_create(key_size, key, data_size, data, copy);
+        tree->root = entry_create(tree, key_size, key, data_size, data, copy);
         return 1;
     }
     current = tree->root;
@@ -91,7 +117,7 @@ int tree_add(tree_t* tree, size_t key_size, void* key, size_t data_size, void* d
             parent = current;
             current = current->left;
             if (current == NULL) {
-                parent->left = tree_entry_create(key_size, key, data_size, data, copy);
+                parent->left = entry_create(tree, key_size, key, data_size, data, copy);
                 parent->left->parent = parent;
                 current = parent->left;
                 current_parent = current->parent;
@@ -111,7 +137,7 @@ int tree_add(tree_t* tree, size_t key_size, void* key, size_t data_size, void* d
             parent = current;
             current = current->right;
             if (current == NULL) {
-                parent->right = tree_entry_create(key_size, key, data_size, data, copy);
+                parent->right = entry_create(tree, key_size, key, data_size, data, copy);
                 parent->right->parent = parent;
                 current = parent->right;
                 current_parent = current->parent;
@@ -157,6 +183,30 @@ tree_entry_t* tree_find(tree_t* tree, size_t key_size, const void* key) {
     return NULL;
 }
 
+/*
+ * Returns the first entry with a key that is strictly larger than the
+ * given key, or NULL if there is none. The key itself does not need
+ * to be present in the tree; this is used to resume a walk over the
+ * tree from a cursor that may have been removed in the meantime.
+ */
+tree_entry_t* tree_find_next(tree_t* tree, size_t key_size, const void* key) {
+    tree_entry_t* current;
+    tree_entry_t* result = NULL;
+    int c;
+
+    current = tree->root;
+    while (current != NULL) {
+        c = tree->cmp_func(key_size, key, current->key_size, current->key);
+        if (c < 0) {
+            result = current;
+            current = current->left;
+        } else {
+            current = current->right;
+        }
+    }
+    return result;
+}
+
 static inline void
 elv(tree_entry_t* e) {
 
@@ -222,7 +272,7 @@ void tree_remove_entry(tree_t* tree, tree_entry_t* el) {
         } else {
             tree->root = NULL;
         }
-        tree_entry_destroy(el, 0);
+        entry_destroy(tree, el, 0);
         if (tree->root != NULL) {
             tree->root = tree_entry_balance(tree->root);
         }
@@ -236,7 +286,7 @@ void tree_remove_entry(tree_t* tree, tree_entry_t* el) {
             } else {
                 el->parent->right = NULL;
             }
-            tree_entry_destroy(el, 0);
+            entry_destroy(tree, el, 0);
         } else if (el->right == NULL) {
             // left not null
             if (is_left) {
@@ -248,7 +298,7 @@ void tree_remove_entry(tree_t* tree, tree_entry_t* el) {
                 el->parent->right = el->left;
                 el->left->parent = el->parent;
             }
-            tree_entry_destroy(el, 0);
+            entry_destroy(tree, el, 0);
         } else if (el->left == NULL) {
             // right not null
             if (is_left) {
@@ -258,7 +308,7 @@ void tree_remove_entry(tree_t* tree, tree_entry_t* el) {
                 el->parent->right = el->right;
                 el->right->parent = el->parent;
             }
-            tree_entry_destroy(el, 0);
+            entry_destroy(tree, el, 0);
         } else {
             // neither are null;
             // replace element to remove with the smallest of its
@@ -282,7 +332,7 @@ void tree_remove_entry(tree_t* tree, tree_entry_t* el) {
             } else {
                 tmp->parent->right = tmp;
             }
-            tree_entry_destroy(el, 0);
+            entry_destroy(tree, el, 0);
         }
         (void)btmp;
         while (btmp != NULL) {
@@ -493,6 +543,6 @@ tree_print(tree_t* tree, void(*print_func)(size_t size, void*key)) {
 
 void
 tree_clear(tree_t* tree) {
-    tree_entry_destroy(tree->root, 1);
+    entry_destroy(tree, tree->root, 1);
     tree->root = NULL;
 }
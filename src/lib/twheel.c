@@ -0,0 +1,174 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "twheel.h"
+
+// an entry is its time, padded to 8 bytes, followed by the data
+#define ENTRY_HEADER 8
+
+#define SLOT_MASK (TWHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(level) (TWHEEL_SLOT_BITS * (level))
+// the range of times the wheel covers
+#define WHEEL_SPAN ((uint32_t) 1 << LEVEL_SHIFT(TWHEEL_LEVELS))
+
+static inline uint32_t
+entry_time(const char* entry) {
+    uint32_t time;
+
+    memcpy(&time, entry, sizeof(time));
+    return time;
+}
+
+static void
+slot_append(twheel_t* wheel, twheel_slot_t* slot, const char* entry) {
+    if (slot->count == slot->allocated) {
+        slot->allocated = slot->allocated == 0 ? 4 : 2 * slot->allocated;
+        slot->entries = (char*) realloc(slot->entries, slot->allocated * wheel->entry_size);
+    }
+    memcpy(slot->entries + slot->count * wheel->entry_size, entry, wheel->entry_size);
+    slot->count++;
+}
+
+/*
+ * Puts the entry in the slot for its time, but not before at_least
+ */
+static void
+place(twheel_t* wheel, const char* entry, uint32_t at_least) {
+    uint32_t at = entry_time(entry);
+    uint32_t delta;
+    int level;
+
+    if (at < at_least) {
+        at = at_least;
+    }
+    delta = at - wheel->now;
+    for (level = 0; level < TWHEEL_LEVELS - 1; level++) {
+        if (delta < (uint32_t) 1 << LEVEL_SHIFT(level + 1)) {
+            break;
+        }
+    }
+    if (level == TWHEEL_LEVELS - 1 && delta >= WHEEL_SPAN) {
+        // it gets to the right slot in steps
+        at = wheel->now + WHEEL_SPAN - 1;
+    }
+    slot_append(wheel, &wheel->slots[level][(at >> LEVEL_SHIFT(level)) & SLOT_MASK], entry);
+    wheel->level_size[level]++;
+}
+
+/*
+ * Moves the entries of the higher levels that are now close enough one
+ * or more levels down; called when the wheel has advanced to a new
+ * second
+ */
+static void
+cascade(twheel_t* wheel) {
+    twheel_slot_t* slot;
+    size_t i;
+    int level;
+
+    for (level = 1; level < TWHEEL_LEVELS; level++) {
+        if ((wheel->now & (((uint32_t) 1 << LEVEL_SHIFT(level)) - 1)) != 0) {
+            break;
+        }
+        slot = &wheel->slots[level][(wheel->now >> LEVEL_SHIFT(level)) & SLOT_MASK];
+        // none of these end up in the same slot again
+        for (i = 0; i < slot->count; i++) {
+            place(wheel, slot->entries + i * wheel->entry_size, wheel->now);
+        }
+        wheel->level_size[level] -= slot->count;
+        slot->count = 0;
+    }
+}
+
+twheel_t*
+twheel_create(size_t data_size) {
+    twheel_t* wheel = (twheel_t*) calloc(1, sizeof(twheel_t));
+
+    wheel->data_size = data_size;
+    wheel->entry_size = ENTRY_HEADER + ((data_size + 7) & ~((size_t) 7));
+    return wheel;
+}
+
+void
+twheel_destroy(twheel_t* wheel) {
+    int level, i;
+
+    for (level = 0; level < TWHEEL_LEVELS; level++) {
+        for (i = 0; i < TWHEEL_SLOTS; i++) {
+            free(wheel->slots[level][i].entries);
+        }
+    }
+    free(wheel->due.entries);
+    free(wheel);
+}
+
+void
+twheel_add(twheel_t* wheel, uint32_t time, const void* data) {
+    char entry[wheel->entry_size];
+
+    memset(entry, 0, wheel->entry_size);
+    memcpy(entry, &time, sizeof(time));
+    memcpy(entry + ENTRY_HEADER, data, wheel->data_size);
+    // the slot of the current second has been emptied already
+    place(wheel, entry, wheel->now + 1);
+    wheel->size++;
+}
+
+size_t
+twheel_advance(twheel_t* wheel, uint32_t now, twheel_func func, void* arg, size_t budget) {
+    twheel_slot_t* slot;
+    twheel_slot_t tmp;
+    char* entry;
+    size_t done = 0;
+    uint32_t next;
+    int level;
+
+    for (;;) {
+        while (wheel->due_pos < wheel->due.count) {
+            if (budget != 0 && done == budget) {
+                return done;
+            }
+            entry = wheel->due.entries + wheel->due_pos * wheel->entry_size;
+            wheel->due_pos++;
+            wheel->size--;
+            func(entry_time(entry), entry + ENTRY_HEADER, arg);
+            done++;
+        }
+        wheel->due.count = 0;
+        wheel->due_pos = 0;
+
+        if (wheel->now >= now) {
+            return done;
+        }
+        if (wheel->size == 0) {
+            wheel->now = now;
+            return done;
+        }
+        // nothing happens until the next cascade of the lowest level
+        // that has entries
+        for (level = 0; wheel->level_size[level] == 0; level++);
+        if (level > 0) {
+            next = wheel->now | (((uint32_t) 1 << LEVEL_SHIFT(level)) - 1);
+            wheel->now = next < now ? next : now;
+            if (wheel->now == now) {
+                return done;
+            }
+        }
+
+        wheel->now++;
+        cascade(wheel);
+        slot = &wheel->slots[0][wheel->now & SLOT_MASK];
+        if (slot->count > 0) {
+            // swap the buffers, so that both keep their memory
+            tmp = wheel->due;
+            wheel->due = *slot;
+            *slot = tmp;
+            wheel->level_size[0] -= wheel->due.count;
+        }
+    }
+}
+
+size_t
+twheel_size(twheel_t* wheel) {
+    return wheel->size;
+}
@@ -225,6 +225,17 @@ spin_ntop(char* dest, ip_t* ip, size_t size) {
     }
 }
 
+size_t
+spin_ntop_prefix(char* dest, ip_t* ip, size_t size) {
+    size_t len = spin_ntop(dest, ip, size);
+    int max = ip->family == AF_INET ? 32 : 128;
+
+    if (ip->netmask > 0 && ip->netmask < max && len < size) {
+        len += snprintf(dest + len, size - len, "/%d", ip->netmask);
+    }
+    return len;
+}
+
 buffer_t* buffer_create(size_t size) {
     buffer_t* buf = malloc(sizeof(buffer_t));
     buf->data = malloc(size);
@@ -347,24 +358,6 @@ int store_ip_tree(tree_t* tree, const char* filename) {
     return 1;
 }
 
-int store_nodepair_tree(tree_t* tree, const char* filename) {
-    tree_entry_t* cur;
-    int *np;
-
-    FILE* out = fopen(filename, "w");
-    if (out == NULL) {
-        return 0;
-    }
-    cur = tree_first(tree);
-    while (cur != NULL) {
-        np = (int *) cur->key;
-        fprintf(out, "%d %d\n", np[0], np[1]);
-        cur = tree_next(cur);
-    }
-    fclose(out);
-    return 1;
-}
-
 #define SPIN_UTIL_LINE_MAX 1024
 int read_ip_tree(tree_t* dest, const char* filename) {
     int count = 0;
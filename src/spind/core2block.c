@@ -1,11 +1,13 @@
 
 #include "config.h"
+#include "ipl.h"
 #include "nfqroutines.h"
 #include "spin_config.h"
 #include "spind.h"
 #include "spin_log.h"
 #include "statistics.h"
 #include <errno.h>
+#include <unistd.h>
 
 #define MAXSTR 1024
 
@@ -41,7 +43,7 @@ setup_debug() {
  */
 static int ignore_system_errors;
 
-static void
+static int
 iptab_system(char *s) {
     int result;
     STAT_COUNTER(ctr, system, STAT_TOTAL);
@@ -55,6 +57,7 @@ iptab_system(char *s) {
         char *resstr = result ? " -> ERROR" : " -> OK";
         fprintf(logfile, "%s%s\n", s, ignore_system_errors ? "" : resstr);
     }
+    return result;
 }
 
 #define IDT_MAKE        0
@@ -259,20 +262,145 @@ static char *tables[] = { SpinCheck, SpinLog, SpinBlock };
 // Entry point
 void c2b_changelist(void* arg, int iplist, int addrem, ip_t *ip_addr) {
     int ipv6 = 0;
-    char ip_str[INET6_ADDRSTRLEN];
+    char ip_str[SPIN_PREFIXSTRLEN];
     STAT_COUNTER(ctr, changelist, STAT_TOTAL);
 
-    // IP v4 or 6, decode address
+    // IP v4 or 6, decode address (or network)
     if (ip_addr->family != AF_INET) {
         ipv6 = 1;
     }
-    spin_ntop(ip_str, ip_addr, INET6_ADDRSTRLEN);
+    spin_ntop_prefix(ip_str, ip_addr, SPIN_PREFIXSTRLEN);
     spin_log(LOG_DEBUG, "Change list %d %d %d %s\n", iplist, addrem, ipv6, ip_str);
 
     STAT_VALUE(ctr, 1);
     c2b_do_rule(tables[iplist], ipv6, addrem, ip_str, targets[iplist]);
 }
 
+/*
+ * Feeds (see ipfeed.h) are far too large for a rule per address. Each
+ * list with a feed gets an ipset of networks per address family, and
+ * a rule for each direction that matches against it.
+ *
+ * To replace the contents, a new set is filled and swapped with the
+ * live one, all in one "ipset restore", so the rules never see a
+ * partially filled set. The swap also brings along the maxelem of the
+ * new set, which is sized to the feed.
+ */
+static int feed_rules[N_IPLIST];
+
+static char *
+feed_set_name(int iplist, int v6) {
+    static char namebuf[32];
+
+    snprintf(namebuf, sizeof(namebuf), "SpinFeed%d%s", iplist, v6 ? "V6" : "V4");
+    return namebuf;
+}
+
+struct feed_restore {
+    FILE *      fr_out;
+    char *      fr_name;
+};
+
+static void
+feed_set_add(void* arg, const ip_t* prefix) {
+    struct feed_restore *fr = (struct feed_restore *) arg;
+    char ip_str[SPIN_PREFIXSTRLEN];
+
+    spin_ntop_prefix(ip_str, (ip_t*) prefix, sizeof(ip_str));
+    fprintf(fr->fr_out, "add %s-new %s\n", fr->fr_name, ip_str);
+}
+
+static int
+feed_restore(int iplist, int v6, ipfeed_t *feed, int create) {
+    char tmpfile[] = "/tmp/spin_feed_XXXXXX";
+    char str[MAXSTR];
+    char *name = feed_set_name(iplist, v6);
+    struct feed_restore fr;
+    size_t count;
+    FILE* out;
+    int fd, result;
+
+    count = ipfeed_prefix_count(feed, v6 ? AF_INET6 : AF_INET);
+    // maxelem must fit the feed; the default is 65536
+    if (count < 65536) {
+        count = 65536;
+    }
+
+    fd = mkstemp(tmpfile);
+    if (fd < 0 || (out = fdopen(fd, "w")) == NULL) {
+        spin_log(LOG_ERR, "Cannot create %s: %s\n", tmpfile, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpfile);
+        }
+        return -1;
+    }
+    if (create) {
+        fprintf(out, "create %s hash:net family %s\n", name, v6 ? "inet6" : "inet");
+    }
+    fprintf(out, "create %s-new hash:net family %s maxelem %zu\n", name, v6 ? "inet6" : "inet", count);
+    fr.fr_out = out;
+    fr.fr_name = name;
+    ipfeed_walk(feed, v6 ? AF_INET6 : AF_INET, feed_set_add, &fr);
+    fprintf(out, "swap %s-new %s\n", name, name);
+    fprintf(out, "destroy %s-new\n", name);
+    fclose(out);
+
+    // a -new set left behind by an earlier failure would stop the restore
+    ignore_system_errors = 1;
+    sprintf(str, "ipset -q destroy %s-new", name);
+    iptab_system(str);
+    ignore_system_errors = 0;
+
+    sprintf(str, "ipset restore < %s", tmpfile);
+    result = iptab_system(str);
+    unlink(tmpfile);
+    return result == 0 ? 0 : -1;
+}
+
+// Entry point; only fills the sets, so it can be run in another process
+int c2b_loadfeed(int iplist, ipfeed_t *feed) {
+    int v6, loaded = 0;
+    STAT_COUNTER(ctr, feed-sync, STAT_TOTAL);
+
+    STAT_VALUE(ctr, 1);
+    for (v6 = 0; v6 < 2; v6++) {
+        // the sets (and rules) are made the first time, setup_tables()
+        // removed any old ones
+        if (feed_restore(iplist, v6, feed, !(feed_rules[iplist] & (1 << v6))) < 0) {
+            spin_log(LOG_ERR, "Cannot load the feed of list %d into ipset %s\n", iplist, feed_set_name(iplist, v6));
+            continue;
+        }
+        loaded |= 1 << v6;
+    }
+    return loaded;
+}
+
+// Entry point
+void c2b_feedrules(int iplist, int loaded) {
+    char str[MAXSTR];
+    int v6, i;
+    static char *sd[] = { "src", "dst" };
+
+    for (v6 = 0; v6 < 2; v6++) {
+        if (!(loaded & (1 << v6)) || (feed_rules[iplist] & (1 << v6))) {
+            continue;
+        }
+        for (i = 0; i < 2; i++) {
+            sprintf(str, "%s -I %s -m set --match-set %s %s -j %s",
+                iptables_command[v6], tables[iplist],
+                feed_set_name(iplist, v6), sd[i], targets[iplist]);
+            iptab_system(str);
+        }
+        feed_rules[iplist] |= 1 << v6;
+    }
+}
+
+// Entry point; feed may be NULL, which empties the sets
+void c2b_syncfeed(int iplist, ipfeed_t *feed) {
+    c2b_feedrules(iplist, c2b_loadfeed(iplist, feed));
+}
+
 void c2b_node_persistent_start(int nodenum) {
 
     // Make the Ipv4 and Ipv6 ipsets for this node
@@ -342,6 +470,7 @@ int init_core2block(int passive_mode) {
     static int all_lists[N_IPLIST] = { 1, 1, 1 };
     int nflog_dns_group, queue_block;
     int place_block;
+    int i;
 
     g_passive_mode = passive_mode;
 
@@ -355,6 +484,13 @@ int init_core2block(int passive_mode) {
     setup_debug();
     setup_tables(nflog_dns_group, queue_block, place_block);
 
+    // The feeds were mapped by init_ipl(), but their sets are gone now
+    for (i = 0; i < N_IPLIST; i++) {
+        if (get_spin_iplist(i)->li_feed != NULL) {
+            c2b_syncfeed(i, get_spin_iplist(i)->li_feed);
+        }
+    }
+
     spin_register("core2block", c2b_changelist, (void *) 0, all_lists);
     return 0;
 }
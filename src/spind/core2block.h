@@ -2,12 +2,23 @@
 #define SPIN_CORE2BLOCK_H 1
 
 #include "util.h"
+#include "ipfeed.h"
 #include "node_cache.h"
 
 int init_core2block(int passive_mode);
 void cleanup_core2block();
 
 void c2b_changelist(void* arg, int iplist, int add, ip_t *ip_addr);
+void c2b_syncfeed(int iplist, ipfeed_t *feed);
+/*
+ * c2b_syncfeed() in two steps: c2b_loadfeed() fills the ipsets of the
+ * list (making them if needed), and can be run in a child process; it
+ * returns the families (1 << v6) whose set was filled. c2b_feedrules()
+ * then adds the firewall rules for those sets, if they are not there
+ * yet.
+ */
+int c2b_loadfeed(int iplist, ipfeed_t *feed);
+void c2b_feedrules(int iplist, int loaded);
 void c2b_node_persistent_start(int nodenum);
 void c2b_node_persistent_end(int nodenum);
 void c2b_node_ipaddress(int nodenum, ip_t *ip_addr);
@@ -6,6 +6,7 @@
 #include "ipl.h"
 #include "mainloop.h"
 #include "process_pkt_info.h"
+#include "spinclock.h"
 #include "spind.h"
 #include "spin_log.h"
 #include "statistics.h"
@@ -95,8 +96,7 @@ static int conntrack_cb(const struct nlmsghdr *nlh, void *data)
     struct nf_conntrack *ct;
     pkt_info_t pkt_info;
     cb_data_t* cb_data = (cb_data_t*) data;
-    // TODO: remove time() calls, use the single one at caller
-    uint32_t now = time(NULL);
+    uint32_t now = spin_clock_now();
     STAT_COUNTER(ctr, callback, STAT_TOTAL);
 
     STAT_VALUE(ctr, 1);
@@ -187,7 +187,7 @@ static void core2conntrack_callback(void *arg, int data, int timeout) {
 
 int init_core2conntrack(node_cache_t* node_cache, int local_mode, trafficfunc hook) {
     cb_data_g = (cb_data_t*)malloc(sizeof(cb_data_t));
-    cb_data_g->flow_list = flow_list_create(time(NULL));
+    cb_data_g->flow_list = flow_list_create(spin_clock_now());
     cb_data_g->node_cache = node_cache;
     cb_data_g->local_mode = local_mode;
     cb_data_g->traffic_hook = hook;
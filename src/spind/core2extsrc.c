@@ -1,18 +1,29 @@
+#include "config.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <signal.h>
 #include <time.h>
 
 #include "core2extsrc.h"
 #include "dnshooks.h"
 #include "extsrc.h"
+#include "extsrc_ring.h"
 #include "mainloop.h"
 #include "process_pkt_info.h"
+#include "spinclock.h"
 #include "spind.h"
+#include "spindata_type.h"
 #include "spin_log.h"
+#include "statistics.h"
+
+STAT_MODULE(extsrc)
 
 
 static node_cache_t *node_cache;
@@ -22,11 +33,70 @@ static char *extsrc_socket_path;
 
 static flow_list_t *flow_list;
 
+/*
+ * State per socket: the listening socket for TCP, and otherwise the
+ * datagram socket, a connected TCP client or a shared memory ring (whose
+ * fd is the eventfd of the ring).
+ */
 struct wf_extsrc_arg {
     int fd;
+    int stream; /* 1 for TCP connections, 0 for datagram sockets */
+    struct extsrc_ring *ring; /* NULL if this is not a ring */
+    /*
+     * Data that has been received but not processed yet. For stream
+     * sockets, this holds the start of a frame that was only partially
+     * received; for datagram sockets, the last datagram.
+     */
+    char *buf;
+    size_t buf_len;
+
+    /*
+     * Client description and statistics; for datagram sockets, these
+     * cover all clients that send to the socket.
+     *  messages: messages processed
+     *  bytes: bytes received
+     *  dropped: frames that were (partially) discarded
+     *  malformed: invalid frames or messages
+     */
+    char name[INET6_ADDRSTRLEN + sizeof("[]:65535")];
+    time_t connected;
+    unsigned long messages;
+    unsigned long long bytes;
+    unsigned long dropped;
+    unsigned long malformed;
+
+    struct wf_extsrc_arg *next;
 };
 
-#define EXTSRC_MAX 1024 /* XXX */
+/* All sockets that receive messages, see extsrc_clients_json() */
+static struct wf_extsrc_arg *extsrc_clients = NULL;
+static int extsrc_client_count = 0;
+
+/* A frame is a message header followed by at most this much data */
+#define EXTSRC_BUF_SIZE (EXTSRC_MSG_HDR_SIZE + EXTSRC_BATCH_MAX)
+
+/*
+ * Every client gets its turn in every mainloop iteration, but may only
+ * use this many recv() calls and bytes (at most one frame more for
+ * datagrams), so that a busy client cannot starve the other clients
+ * or the rest of spind; anything left is read on the next iteration
+ */
+#define EXTSRC_READS_PER_WAKEUP 16
+#define EXTSRC_BYTES_PER_WAKEUP (64 * 1024)
+
+/*
+ * Rings have no per-message system calls, so they can be given a larger
+ * share; the ring is also checked this often (in ms) for a producer that
+ * went away without closing it
+ */
+#define EXTSRC_RING_MSGS_PER_WAKEUP 1024
+#define EXTSRC_RING_CHECK_INTERVAL 1000
+
+/* Maximum number of simultaneous TCP and ring clients */
+#define EXTSRC_MAX_CLIENTS 16
+#define EXTSRC_LISTEN_BACKLOG 16
+/* Maximum number of connections accepted per mainloop wakeup */
+#define EXTSRC_ACCEPTS_PER_WAKEUP 8
 
 /* #define EXTSRC_DEBUG */
 
@@ -36,13 +106,18 @@ struct wf_extsrc_arg {
  */
 #define EXTSRC_TCP
 
+#ifdef EXTSRC_TCP
+static int extsrc_listen_fd = -1;
+#endif
+
 /*
  * Note: when processing a message received from the socket, it is important
  * to:
- * (1) verify that the payload has the expected size. This is done in
- * wf_extsrc().
+ * (1) verify that the payload is valid. This is done when it is decoded,
+ * by the extsrc_msg_read_*() functions in process_msg().
  * (2) sanitize input. For instance, in the case of a string, make sure it is
- * NUL-terminated. This is done in each of the process_*() functions.
+ * NUL-terminated. The decoders take care of the strings; anything else is
+ * done in each of the process_*() functions.
  */
 
 static void
@@ -54,16 +129,11 @@ process_pkt_info_extsrc(pkt_info_t *pkt_info)
      * Sanitize input: not necessary.
      */
 
-     /*
-      * XXX
-      */
-    pkt_info->family = extsrc_af_from_wire(pkt_info->family);
-
     /*
-     * We could potentially send a timestamp through the socket and use
-     * that here, too.
+     * The clock has already been advanced to the time of this message in
+     * replay mode; see process_msg().
      */
-    now = time(NULL);
+    now = spin_clock_now();
 
     /*
      * Here we mirror what conntrack_cb() is doing with the flow_list and
@@ -104,9 +174,8 @@ process_device_info(struct extsrc_arp_table_update *up)
 #endif
 
     /*
-     * Sanitize input.
+     * Sanitize input: not necessary, the mac is NUL-terminated.
      */
-    up->mac[sizeof(up->mac) - 1] = 0;
 
     arp_table_add(node_cache->arp_table, &up->ip, up->mac);
 
@@ -119,142 +188,694 @@ process_device_info(struct extsrc_arp_table_update *up)
 #endif
 }
 
-static void
-wf_extsrc(void *arg, int data, int timeout)
+/*
+ * Decodes and processes a single (non-batch) message. The payload can be at
+ * any offset in the receive buffer (or in a ring slot); the decoders copy
+ * everything into properly aligned structures.
+ *
+ * Returns 0 on success, -1 if the message is invalid.
+ */
+static int
+process_msg(uint32_t type, const char *payload, uint32_t len)
+{
+    pkt_info_t pkt_info;
+    struct extsrc_dns_query_hdr query_hdr;
+    dns_pkt_info_t dns_pkt;
+    struct extsrc_arp_table_update up;
+    uint64_t timestamp;
+    int result;
+
+    switch (type) {
+    case EXTSRC_MSG_TYPE_PKT_INFO:
+        result = extsrc_msg_read_pkt_info(payload, len, &pkt_info, &timestamp);
+        if (result == 0) {
+            spin_clock_event(timestamp);
+            process_pkt_info_extsrc(&pkt_info);
+        }
+        break;
+
+    case EXTSRC_MSG_TYPE_DNS_QUERY:
+        result = extsrc_msg_read_dns_query(payload, len, &query_hdr, &dns_pkt,
+            &timestamp);
+        if (result == 0) {
+            spin_clock_event(timestamp);
+            process_dns_query(&query_hdr, &dns_pkt);
+        }
+        break;
+
+    case EXTSRC_MSG_TYPE_DNS_ANSWER:
+        result = extsrc_msg_read_dns_answer(payload, len, &dns_pkt, &timestamp);
+        if (result == 0) {
+            spin_clock_event(timestamp);
+            process_dns_answer(&dns_pkt);
+        }
+        break;
+
+    case EXTSRC_MSG_TYPE_ARP_TABLE_UPDATE:
+        result = extsrc_msg_read_arp_table_update(payload, len, &up,
+            &timestamp);
+        if (result == 0) {
+            spin_clock_event(timestamp);
+            process_device_info(&up);
+        }
+        break;
+
+    default:
+        spin_log(LOG_WARNING, "%s: unknown message type\n", __func__);
+        return -1;
+    }
+
+    if (result != 0) {
+        spin_log(LOG_WARNING, "%s: invalid message of type %u\n", __func__,
+            type);
+    }
+    return result;
+}
+
+/*
+ * Processes all messages in the payload of a batch message
+ *
+ * Returns 0 on success, -1 if the batch is invalid; the messages
+ * before the invalid part have been processed in that case.
+ */
+static int
+process_batch(struct wf_extsrc_arg *conn, const char *payload, uint32_t len)
 {
     struct extsrc_msg_hdr hdr;
-    void *msg = NULL;
-    int fd = ((struct wf_extsrc_arg *)arg)->fd;
+    uint32_t pos = 0;
+
+    while (pos < len) {
+        if (len - pos < EXTSRC_MSG_HDR_SIZE) {
+            spin_log(LOG_WARNING, "%s: truncated message in batch\n", __func__);
+            return -1;
+        }
+        extsrc_hdr_read(payload + pos, &hdr);
+        pos += EXTSRC_MSG_HDR_SIZE;
+        if (hdr.version != EXTSRC_VERSION || hdr.type == EXTSRC_MSG_TYPE_BATCH ||
+            hdr.length == 0 || hdr.length > EXTSRC_MSG_MAX || hdr.length > len - pos) {
+            spin_log(LOG_WARNING, "%s: invalid message in batch\n", __func__);
+            return -1;
+        }
+        /* the boundaries are fine, so just skip an invalid message */
+        if (process_msg(hdr.type, payload + pos, hdr.length) == 0) {
+            conn->messages++;
+        } else {
+            conn->malformed++;
+        }
+        pos += hdr.length;
+    }
+
+    return 0;
+}
 
-    spin_log(LOG_DEBUG, "wf_extsrc\n");
+/*
+ * Checks the header of a frame; returns 0 if it is acceptable
+ */
+static int
+check_hdr(struct extsrc_msg_hdr *hdr)
+{
+    uint32_t max = EXTSRC_MSG_MAX;
 
-    if (recv(fd, &hdr, sizeof(hdr), MSG_PEEK) != sizeof(hdr)) {
-        spin_log(LOG_WARNING, "%s: recv: %s\n", __func__, strerror(errno));
-        goto fail;
+    if (hdr->version != EXTSRC_VERSION) {
+        spin_log(LOG_WARNING, "%s: unsupported version %u\n", __func__,
+            hdr->version);
+        return -1;
+    }
+    if (hdr->type == EXTSRC_MSG_TYPE_BATCH) {
+        max = EXTSRC_BATCH_MAX;
+    }
+    if (hdr->length == 0 || hdr->length > max) {
+        spin_log(LOG_WARNING, "%s: hdr.length %u invalid\n", __func__,
+            hdr->length);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Processes a frame; returns -1 if the frame boundaries of the stream
+ * can no longer be trusted
+ */
+static int
+process_frame(struct wf_extsrc_arg *conn, struct extsrc_msg_hdr *hdr, const char *payload)
+{
+    STAT_COUNTER(messages, messages, STAT_TOTAL);
+    STAT_COUNTER(malformed, malformed, STAT_TOTAL);
+    unsigned long messages = conn->messages;
+    unsigned long malformed = conn->malformed;
+    int result = 0;
+
+    if (hdr->type == EXTSRC_MSG_TYPE_BATCH) {
+        if (process_batch(conn, payload, hdr->length) != 0) {
+            conn->malformed++;
+            conn->dropped++;
+            result = -1;
+        }
+    } else if (process_msg(hdr->type, payload, hdr->length) == 0) {
+        conn->messages++;
+    } else {
+        conn->malformed++;
     }
 
-    if (hdr.length == 0 || hdr.length > EXTSRC_MAX) {
-        spin_log(LOG_WARNING, "%s: hdr.length %d invalid\n", __func__,
-            hdr.length);
-        goto fail;
+    STAT_VALUE(messages, conn->messages - messages);
+    STAT_VALUE(malformed, conn->malformed - malformed);
+    return result;
+}
+
+/*
+ * Returns a new wf_extsrc_arg for the given fd, added to the list of
+ * clients, or NULL if out of memory
+ */
+static struct wf_extsrc_arg *
+extsrc_conn_create(int fd, int stream, const char *name)
+{
+    struct wf_extsrc_arg *conn;
+
+    conn = malloc(sizeof(struct wf_extsrc_arg));
+    if (conn == NULL) {
+        return NULL;
     }
-    ssize_t len = sizeof(hdr) + hdr.length;
-    msg = malloc(len);
-    if (msg == NULL) {
-        /*
-         * Usually I would shut down the program when a malloc failure
-         * occurs but in this case, let's continue. This failure can be
-         * dealt with in a contained fashion (just close the socket and
-         * move on).
-         */
-        spin_log(LOG_WARNING, "%s: malloc: %s\n", __func__, strerror(errno));
-        goto fail;
+    conn->fd = fd;
+    conn->stream = stream;
+    conn->ring = NULL;
+    conn->buf_len = 0;
+    conn->buf = malloc(EXTSRC_BUF_SIZE);
+    if (conn->buf == NULL) {
+        free(conn);
+        return NULL;
     }
+    snprintf(conn->name, sizeof(conn->name), "%s", name);
+    conn->connected = time(NULL);
+    conn->messages = 0;
+    conn->bytes = 0;
+    conn->dropped = 0;
+    conn->malformed = 0;
+
+    conn->next = extsrc_clients;
+    extsrc_clients = conn;
+    return conn;
+}
 
-    if (read(fd, msg, len) != len) {
-        spin_log(LOG_WARNING, "%s: read: %s\n", __func__, strerror(errno));
-        goto fail;
+/*
+ * Removes a connection that was never registered with the mainloop
+ */
+static void
+extsrc_conn_destroy(struct wf_extsrc_arg *conn)
+{
+    struct wf_extsrc_arg **cur;
+
+    for (cur = &extsrc_clients; *cur != NULL; cur = &(*cur)->next) {
+        if (*cur == conn) {
+            *cur = conn->next;
+            break;
+        }
     }
+    free(conn->buf);
+    free(conn);
+}
 
-    switch (hdr.type) {
-    case EXTSRC_MSG_TYPE_PKT_INFO:
-        if (len != sizeof(struct extsrc_msg_hdr) + sizeof(pkt_info_t)) {
-            spin_log(LOG_WARNING, "%s: incorrect message size\n", __func__);
-            goto fail;
+static void
+extsrc_conn_close(struct wf_extsrc_arg *conn)
+{
+    STAT_COUNTER(clients, clients, STAT_MAX);
+    struct wf_extsrc_arg **cur;
+
+    for (cur = &extsrc_clients; *cur != NULL; cur = &(*cur)->next) {
+        if (*cur == conn) {
+            *cur = conn->next;
+            break;
         }
+    }
+    if (conn->stream || conn->ring != NULL) {
+        extsrc_client_count--;
+        STAT_VALUE(clients, extsrc_client_count);
+    }
 
-        process_pkt_info_extsrc((pkt_info_t *)
-	    (msg + sizeof(struct extsrc_msg_hdr)));
-        break;
+    spin_log(LOG_INFO, "extsrc client %s disconnected: %lu messages, %llu bytes, %lu dropped, %lu malformed\n",
+        conn->name, conn->messages, conn->bytes, conn->dropped, conn->malformed);
+    mainloop_unregister(conn->fd);
+    if (conn->ring != NULL) {
+#ifdef HAVE_SYS_EVENTFD_H
+        /* this also closes conn->fd */
+        extsrc_ring_destroy(conn->ring, 0);
+#endif
+    } else {
+        close(conn->fd);
+    }
+    free(conn->buf);
+    free(conn);
+}
 
-    case EXTSRC_MSG_TYPE_DNS_QUERY:
-        if (len != sizeof(struct extsrc_msg_hdr) +
-            sizeof(struct extsrc_dns_query_hdr) + sizeof(dns_pkt_info_t)) {
-            spin_log(LOG_WARNING, "%s: incorrect message size\n", __func__);
-            goto fail;
+/*
+ * Processes all complete frames in the receive buffer of a stream
+ * connection, and moves what is left (the start of the next frame) to
+ * the front of the buffer
+ *
+ * Returns 0 on success, -1 if the client sent something invalid
+ */
+static int
+extsrc_process_frames(struct wf_extsrc_arg *conn)
+{
+    struct extsrc_msg_hdr hdr;
+    size_t pos = 0;
+    int result = 0;
+
+    while (conn->buf_len - pos >= EXTSRC_MSG_HDR_SIZE) {
+        extsrc_hdr_read(conn->buf + pos, &hdr);
+        if (check_hdr(&hdr) != 0) {
+            conn->malformed++;
+            result = -1;
+            break;
         }
+        if (conn->buf_len - pos < EXTSRC_MSG_HDR_SIZE + hdr.length) {
+            /* wait for the rest */
+            break;
+        }
+        if (process_frame(conn, &hdr, conn->buf + pos + EXTSRC_MSG_HDR_SIZE) != 0) {
+            result = -1;
+            break;
+        }
+        pos += EXTSRC_MSG_HDR_SIZE + hdr.length;
+    }
 
-        process_dns_query((struct extsrc_dns_query_hdr *)
-            (msg + sizeof(struct extsrc_msg_hdr)),
-            (dns_pkt_info_t *)(msg + sizeof(struct extsrc_msg_hdr) +
-            sizeof(struct extsrc_dns_query_hdr)));
-        break;
+    if (pos > 0) {
+        memmove(conn->buf, conn->buf + pos, conn->buf_len - pos);
+        conn->buf_len -= pos;
+    }
+    return result;
+}
 
-    case EXTSRC_MSG_TYPE_DNS_ANSWER:
-        if (len != sizeof(struct extsrc_msg_hdr) + sizeof(dns_pkt_info_t)) {
-            spin_log(LOG_WARNING, "%s: incorrect message size\n", __func__);
+static void
+wf_extsrc_stream(struct wf_extsrc_arg *conn)
+{
+    STAT_COUNTER(bytes, bytes, STAT_TOTAL);
+    size_t budget = EXTSRC_BYTES_PER_WAKEUP;
+    size_t space;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < EXTSRC_READS_PER_WAKEUP && budget > 0; i++) {
+        space = EXTSRC_BUF_SIZE - conn->buf_len;
+        if (space > budget) {
+            space = budget;
+        }
+        n = recv(conn->fd, conn->buf + conn->buf_len, space, MSG_DONTWAIT);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+            spin_log(LOG_WARNING, "%s: recv: %s\n", __func__, strerror(errno));
             goto fail;
         }
+        if (n == 0) {
+            if (conn->buf_len > 0) {
+                /* incomplete last frame */
+                conn->dropped++;
+            }
+            extsrc_conn_close(conn);
+            return;
+        }
+        conn->buf_len += n;
+        conn->bytes += n;
+        budget -= n;
+        STAT_VALUE(bytes, n);
 
-        process_dns_answer((dns_pkt_info_t *)(msg +
-            sizeof(struct extsrc_msg_hdr)));
-        break;
-
-    case EXTSRC_MSG_TYPE_ARP_TABLE_UPDATE:
-        if (len != sizeof(struct extsrc_msg_hdr) +
-	    sizeof(struct extsrc_arp_table_update)) {
-            spin_log(LOG_WARNING, "%s: incorrect message size\n", __func__);
+        if (extsrc_process_frames(conn) != 0) {
             goto fail;
         }
+    }
+    return;
 
-        process_device_info((struct extsrc_arp_table_update *)(msg +
-            sizeof(struct extsrc_msg_hdr)));
-        break;
+fail:
+    /*
+     * When a client sends something we did not expect, we can no
+     * longer find the frame boundaries, so close the connection.
+     */
+    spin_log(LOG_WARNING, "closing core2extsrc connection from %s\n", conn->name);
+    if (conn->buf_len > 0) {
+        conn->dropped++;
+    }
+    extsrc_conn_close(conn);
+}
 
-    default:
-        spin_log(LOG_WARNING, "%s: unknown message type\n", __func__);
-        goto fail;
+/*
+ * Collects the file descriptors passed with a datagram (at most max; any
+ * others are closed). Returns the number of file descriptors.
+ */
+static int
+extsrc_received_fds(struct msghdr *mh, int *fds, int max)
+{
+    struct cmsghdr *cmsg;
+    int n = 0;
+    int *cfds;
+    size_t i, count;
+
+    for (cmsg = CMSG_FIRSTHDR(mh); cmsg != NULL; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        cfds = (int *)CMSG_DATA(cmsg);
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; i++) {
+            if (n < max) {
+                fds[n++] = cfds[i];
+            } else {
+                close(cfds[i]);
+            }
+        }
     }
+    return n;
+}
 
-    goto out;
+static void
+extsrc_close_fds(int *fds, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+}
+
+static void wf_extsrc(void *arg, int data, int timeout);
+
+/* Called by the mainloop when poll() reports an error on the fd */
+static void
+cf_extsrc(void *arg)
+{
+    extsrc_conn_close((struct wf_extsrc_arg *)arg);
+}
+
+/*
+ * Starts reading from the ring that a client passed in an
+ * EXTSRC_MSG_TYPE_RING message; takes over the file descriptors
+ */
+static void
+extsrc_ring_open(const char *payload, uint32_t len, int *fds, int nfds)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    STAT_COUNTER(clients, clients, STAT_MAX);
+    struct extsrc_ring_setup setup;
+    struct extsrc_ring *ring;
+    struct wf_extsrc_arg *conn;
+    char name[INET6_ADDRSTRLEN + sizeof("[]:65535")];
+
+    if (len != sizeof(setup) || nfds != 2) {
+        spin_log(LOG_WARNING, "%s: invalid ring setup message\n", __func__);
+        extsrc_close_fds(fds, nfds);
+        return;
+    }
+    memcpy(&setup, payload, sizeof(setup));
+    if (setup.version != EXTSRC_RING_VERSION) {
+        spin_log(LOG_WARNING, "%s: unsupported ring version %u\n", __func__,
+            setup.version);
+        extsrc_close_fds(fds, nfds);
+        return;
+    }
+    if (extsrc_client_count >= EXTSRC_MAX_CLIENTS) {
+        spin_log(LOG_WARNING, "%s: too many extsrc clients, rejecting ring\n",
+            __func__);
+        extsrc_close_fds(fds, nfds);
+        return;
+    }
+
+    ring = extsrc_ring_attach(fds[0], fds[1], setup.size);
+    if (ring == NULL) {
+        spin_log(LOG_WARNING, "%s: invalid ring\n", __func__);
+        return;
+    }
+    snprintf(name, sizeof(name), "ring (pid %d)", (int)ring->hdr->producer_pid);
+    conn = extsrc_conn_create(ring->event_fd, 0, name);
+    if (conn == NULL) {
+        spin_log(LOG_WARNING, "malloc: %s", strerror(errno));
+        extsrc_ring_destroy(ring, 0);
+        return;
+    }
+    conn->ring = ring;
+    if (mainloop_register("external-source-ring", wf_extsrc, (void *) conn,
+        ring->event_fd, EXTSRC_RING_CHECK_INTERVAL, 0) == 1) {
+        spin_log(LOG_WARNING, "%s: can't serve extsrc client %s\n", __func__,
+            name);
+        extsrc_conn_destroy(conn);
+        extsrc_ring_destroy(ring, 0);
+        return;
+    }
+    mainloop_set_closefunc(ring->event_fd, cf_extsrc);
+    extsrc_client_count++;
+    STAT_VALUE(clients, extsrc_client_count);
+    spin_log(LOG_INFO, "extsrc client %s connected\n", name);
+
+    /* Anything already in the ring is picked up on the next iteration */
+    (void)extsrc_ring_idle(ring);
+#else
+    spin_log(LOG_WARNING, "%s: shared memory rings are not supported\n",
+        __func__);
+    extsrc_close_fds(fds, nfds);
+#endif
+}
+
+static void
+wf_extsrc_dgram(struct wf_extsrc_arg *conn)
+{
+    STAT_COUNTER(bytes, bytes, STAT_TOTAL);
+    struct extsrc_msg_hdr hdr;
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    int fds[2];
+    int nfds;
+    size_t budget = EXTSRC_BYTES_PER_WAKEUP;
+    ssize_t n;
+    int i;
+
+    /*
+     * Every datagram holds exactly one frame; on the UNIX domain socket,
+     * it can come with file descriptors (for EXTSRC_MSG_TYPE_RING)
+     */
+    for (i = 0; i < EXTSRC_READS_PER_WAKEUP && budget > 0; i++) {
+        memset(&mh, 0, sizeof(mh));
+        iov.iov_base = conn->buf;
+        iov.iov_len = EXTSRC_BUF_SIZE;
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        n = recvmsg(conn->fd, &mh, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                spin_log(LOG_WARNING, "%s: recvmsg: %s\n", __func__,
+                    strerror(errno));
+            }
+            return;
+        }
+        nfds = extsrc_received_fds(&mh, fds, 2);
+        conn->buf_len = n;
+        conn->bytes += n;
+        budget -= (size_t)n < budget ? (size_t)n : budget;
+        STAT_VALUE(bytes, n);
+
+        /*
+         * Other clients may be using the same socket, so just drop
+         * anything invalid.
+         */
+        if ((size_t)n < EXTSRC_MSG_HDR_SIZE) {
+            spin_log(LOG_WARNING, "%s: short datagram dropped\n", __func__);
+            conn->malformed++;
+            conn->dropped++;
+            extsrc_close_fds(fds, nfds);
+            continue;
+        }
+        extsrc_hdr_read(conn->buf, &hdr);
+        if (check_hdr(&hdr) != 0 || hdr.length != n - EXTSRC_MSG_HDR_SIZE) {
+            spin_log(LOG_WARNING, "%s: invalid datagram dropped\n", __func__);
+            conn->malformed++;
+            conn->dropped++;
+            extsrc_close_fds(fds, nfds);
+            continue;
+        }
+        if (hdr.type == EXTSRC_MSG_TYPE_RING) {
+            extsrc_ring_open(conn->buf + EXTSRC_MSG_HDR_SIZE, hdr.length, fds, nfds);
+            continue;
+        }
+        extsrc_close_fds(fds, nfds);
+        (void)process_frame(conn, &hdr, conn->buf + EXTSRC_MSG_HDR_SIZE);
+    }
+}
+
+#ifdef HAVE_SYS_EVENTFD_H
+static void
+wf_extsrc_ring(struct wf_extsrc_arg *conn, int timeout)
+{
+    STAT_COUNTER(bytes, bytes, STAT_TOTAL);
+    struct extsrc_ring *ring = conn->ring;
+    struct extsrc_msg_hdr hdr;
+    const char *frame;
+    unsigned long long bytes = 0;
+    uint32_t closed;
+    int i;
+    int r = 0;
 
-fail:
     /*
-     * When a client sends something we did not expect, we ruin the party
-     * for everybody and close the socket. At least for now.
+     * The messages are processed straight from the shared memory; the
+     * producer may be overwriting a slot, so the header is decoded (and
+     * so is the payload, in process_msg()) before anything is checked
      */
-    spin_log(LOG_WARNING, "closing core2extsrc fd\n");
-    close(fd);
-    fd = fd * -1; // XXX or another way to make mainloop stop using this fd
+    for (i = 0; i < EXTSRC_RING_MSGS_PER_WAKEUP; i++) {
+        r = extsrc_ring_peek(ring, &frame);
+        if (r != 1) {
+            break;
+        }
+        extsrc_hdr_read(frame, &hdr);
+        if (hdr.version != EXTSRC_VERSION || hdr.type == EXTSRC_MSG_TYPE_BATCH ||
+            hdr.type == EXTSRC_MSG_TYPE_RING || hdr.length == 0 ||
+            hdr.length > EXTSRC_RING_SLOT_SIZE - EXTSRC_MSG_HDR_SIZE) {
+            conn->malformed++;
+        } else {
+            (void)process_frame(conn, &hdr, frame + EXTSRC_MSG_HDR_SIZE);
+            bytes += EXTSRC_MSG_HDR_SIZE + hdr.length;
+        }
+        extsrc_ring_release(ring);
+    }
+    conn->bytes += bytes;
+    conn->dropped = __atomic_load_n(&ring->hdr->dropped, __ATOMIC_RELAXED);
+    STAT_VALUE(bytes, bytes);
+
+    if (r == -1) {
+        spin_log(LOG_WARNING, "%s: ring of %s is corrupt\n", __func__, conn->name);
+        conn->malformed++;
+        extsrc_conn_close(conn);
+        return;
+    }
 
-out:
-    free(msg);
+    /*
+     * Go to sleep if the ring is empty. Read the closed flag first: the
+     * producer sets it after its last message, so if the ring is still
+     * empty after that, it is done.
+     */
+    closed = __atomic_load_n(&ring->hdr->closed, __ATOMIC_ACQUIRE);
+    if (extsrc_ring_idle(ring) == 1 && (closed || (timeout &&
+        kill(ring->hdr->producer_pid, 0) == -1 && errno == ESRCH))) {
+        extsrc_conn_close(conn);
+    }
 }
+#endif
 
-#ifdef EXTSRC_TCP
 static void
-wf_extsrc_accept(void *arg, int data, int timeout)
+wf_extsrc(void *arg, int data, int timeout)
 {
-    struct wf_extsrc_arg *wf_arg = NULL;
-    struct sockaddr addr;
-    socklen_t addrlen = sizeof(addr);
-    int fd = ((struct wf_extsrc_arg *)arg)->fd;
+    struct wf_extsrc_arg *conn = (struct wf_extsrc_arg *)arg;
 
-    int cfd = accept(fd, &addr, &addrlen);
-    if (cfd == -1) {
-        spin_log(LOG_WARNING, "accept: %s\n", strerror(errno));
-        goto bad;
+    if (conn->stream) {
+        wf_extsrc_stream(conn);
+#ifdef HAVE_SYS_EVENTFD_H
+    } else if (conn->ring != NULL) {
+        wf_extsrc_ring(conn, timeout);
+#endif
+    } else {
+        wf_extsrc_dgram(conn);
     }
+}
 
-    wf_arg = malloc(sizeof(struct wf_extsrc_arg));
-    if (!wf_arg) {
-        spin_log(LOG_WARNING, "malloc: %s", strerror(errno));
-        goto bad;
+spin_data
+extsrc_clients_json(void)
+{
+    struct wf_extsrc_arg *conn;
+    cJSON *result = cJSON_CreateArray();
+    cJSON *client;
+
+    for (conn = extsrc_clients; conn != NULL; conn = conn->next) {
+        client = cJSON_CreateObject();
+        cJSON_AddStringToObject(client, "name", conn->name);
+        cJSON_AddStringToObject(client, "type",
+            conn->stream ? "stream" : conn->ring != NULL ? "ring" : "datagram");
+        cJSON_AddNumberToObject(client, "connected", conn->connected);
+        cJSON_AddNumberToObject(client, "messages", conn->messages);
+        cJSON_AddNumberToObject(client, "bytes", conn->bytes);
+        cJSON_AddNumberToObject(client, "dropped", conn->dropped);
+        cJSON_AddNumberToObject(client, "malformed", conn->malformed);
+        cJSON_AddItemToArray(result, client);
     }
-    wf_arg->fd = cfd;
+    return result;
+}
 
-    if (mainloop_register("external-source-tcp", wf_extsrc, (void *) wf_arg, cfd,
-        0, 0) == 1) {
-        spin_log(LOG_WARNING, "mainloop_register returned failure\n");
-        goto bad;
+#ifdef EXTSRC_TCP
+static void
+addr_to_name(struct sockaddr_storage *addr, char *name, size_t name_len)
+{
+    char host[INET6_ADDRSTRLEN];
+    int port = 0;
+
+    host[0] = '\0';
+    if (addr->ss_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+        inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+        port = ntohs(sin->sin_port);
+    } else if (addr->ss_family == AF_INET6) {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+        inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+        port = ntohs(sin6->sin6_port);
     }
+    snprintf(name, name_len, "[%s]:%d", host, port);
+}
 
-    return;
+static void
+wf_extsrc_accept(void *arg, int data, int timeout)
+{
+    STAT_COUNTER(clients, clients, STAT_MAX);
+    struct wf_extsrc_arg *wf_arg;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char name[INET6_ADDRSTRLEN + sizeof("[]:65535")];
+    int fd = *(int *)arg;
+    int cfd;
+    int i;
 
- bad:
-    close(cfd);
-    free(wf_arg);
-    spin_log(LOG_WARNING, "%s: can't serve extsrc client\n", __func__);
+    /*
+     * The listening socket is non-blocking; accept everything that is
+     * waiting (up to a limit), so that many clients (re)connecting at
+     * the same time do not have to wait for each other
+     */
+    for (i = 0; i < EXTSRC_ACCEPTS_PER_WAKEUP; i++) {
+        addrlen = sizeof(addr);
+        cfd = accept(fd, (struct sockaddr *)&addr, &addrlen);
+        if (cfd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                spin_log(LOG_WARNING, "accept: %s\n", strerror(errno));
+            }
+            return;
+        }
+        addr_to_name(&addr, name, sizeof(name));
+
+        if (extsrc_client_count >= EXTSRC_MAX_CLIENTS) {
+            spin_log(LOG_WARNING, "%s: too many extsrc clients, rejecting %s\n",
+                __func__, name);
+            close(cfd);
+            continue;
+        }
+
+        wf_arg = extsrc_conn_create(cfd, 1, name);
+        if (!wf_arg) {
+            spin_log(LOG_WARNING, "malloc: %s", strerror(errno));
+            close(cfd);
+            continue;
+        }
+
+        if (mainloop_register("external-source-tcp", wf_extsrc, (void *) wf_arg, cfd,
+            0, 0) == 1) {
+            spin_log(LOG_WARNING, "%s: can't serve extsrc client %s\n", __func__,
+                name);
+            extsrc_conn_destroy(wf_arg);
+            close(cfd);
+            continue;
+        }
+        mainloop_set_closefunc(cfd, cf_extsrc);
+        extsrc_client_count++;
+        STAT_VALUE(clients, extsrc_client_count);
+        spin_log(LOG_INFO, "extsrc client %s connected\n", name);
+    }
 }
 #endif /* EXTSRC_TCP */
 
@@ -267,7 +888,9 @@ removesocket(void)
 static int
 socket_open_inet(const char *addr)
 {
+#ifndef EXTSRC_TCP
     struct wf_extsrc_arg *wf_arg;
+#endif
     struct addrinfo hints, *res;
     char port[sizeof("65535")];
     int error;
@@ -313,24 +936,26 @@ socket_open_inet(const char *addr)
     freeaddrinfo(res);
 
 #ifdef EXTSRC_TCP
-    if (listen(fd, 2) == -1) {
+    if (listen(fd, EXTSRC_LISTEN_BACKLOG) == -1) {
         spin_log(LOG_ERR, "listen: %s\n", strerror(errno));
         return 1;
     }
-#endif /* EXTSRC_TCP */
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+        spin_log(LOG_ERR, "fcntl: %s\n", strerror(errno));
+        return 1;
+    }
 
+    extsrc_listen_fd = fd;
+    mainloop_register("external-source", wf_extsrc_accept, (void *) &extsrc_listen_fd, fd,
+        0, 1);
+#else
     // XXX is currently never freed
-    wf_arg = malloc(sizeof(struct wf_extsrc_arg));
+    wf_arg = extsrc_conn_create(fd, 0, addr);
     if (!wf_arg) {
         spin_log(LOG_ERR, "malloc: %s", strerror(errno));
         return 1;
     }
-    wf_arg->fd = fd;
 
-#ifdef EXTSRC_TCP
-    mainloop_register("external-source", wf_extsrc_accept, (void *) wf_arg, fd,
-        0, 1);
-#else
     mainloop_register("external-source", wf_extsrc, (void *) wf_arg, fd, 0, 1);
 #endif
 
@@ -381,12 +1006,11 @@ socket_open_unix()
     atexit(removesocket);
 
     // XXX is currently never freed
-    wf_arg = malloc(sizeof(struct wf_extsrc_arg));
+    wf_arg = extsrc_conn_create(fd, 0, extsrc_socket_path);
     if (!wf_arg) {
         spin_log(LOG_ERR, "malloc: %s", strerror(errno));
         return 1;
     }
-    wf_arg->fd = fd;
 
     mainloop_register("external-source", wf_extsrc, (void *) wf_arg, fd, 0, 1);
 
@@ -407,7 +1031,7 @@ init_core2extsrc(node_cache_t *nc, dns_cache_t *dc, trafficfunc th, char *sp, ch
     }
 
     // XXX does it matter what timestamp we use? No idea.
-    flow_list = flow_list_create(time(NULL));
+    flow_list = flow_list_create(spin_clock_now());
 
     if (la) {
         if (socket_open_inet(la)) {
@@ -2,9 +2,15 @@
 #define CORE2EXTSRC_H 1
 #include "dns_cache.h"
 #include "node_cache.h"
+#include "spindata_type.h"
 #include "spinhook.h"
 
 int init_core2extsrc(node_cache_t *, dns_cache_t *, trafficfunc, char *, char *);
 void cleanup_core2extsrc();
 
+/*
+ * Returns a list of the connected extsrc clients and their statistics
+ */
+spin_data extsrc_clients_json(void);
+
 #endif
@@ -240,7 +240,7 @@ void wf_mosquitto(void* arg, int data, int timeout) {
 void broadcast_iplist(int iplist, const char* list_name) {
     spin_data ipt_sd, cmd_sd;
 
-    ipt_sd = spin_data_ipar(get_spin_iplist(iplist)->li_tree);
+    ipt_sd = spin_data_iptrie(get_spin_iplist(iplist)->li_trie);
     cmd_sd = spin_data_create_mqtt_command(list_name, NULL, ipt_sd);
 
     core2pubsub_publish_chan(NULL, cmd_sd, 0);
@@ -2,6 +2,7 @@
 
 #include "dnshooks.h"
 #include "ipl.h"
+#include "spinclock.h"
 #include "spind.h"
 #include "statistics.h"
 
@@ -12,7 +13,7 @@ STAT_MODULE(dns)
 
 void dns_query_hook(dns_pkt_info_t *dns_pkt, int family, uint8_t *src_addr)
 {
-    time_t now = time(NULL);
+    time_t now = spin_clock_now();
     STAT_COUNTER(ctr_query, query, STAT_TOTAL);
     STAT_COUNTER(send, send-dns, STAT_TOTAL);
 
@@ -30,7 +31,7 @@ void dns_query_hook(dns_pkt_info_t *dns_pkt, int family, uint8_t *src_addr)
 
 void dns_answer_hook(dns_pkt_info_t *dns_pkt)
 {
-    time_t now = time(NULL);
+    time_t now = spin_clock_now();
     STAT_COUNTER(ctr_answer, answer, STAT_TOTAL);
 
     STAT_VALUE(ctr_answer, 1);
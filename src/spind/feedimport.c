@@ -0,0 +1,156 @@
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "core2block.h"
+#include "feedimport.h"
+#include "ipfeed.h"
+#include "ipl.h"
+#include "mainloop.h"
+#include "spin_list.h"
+#include "spin_log.h"
+
+/*
+ * The child writes the index of the feed where the list keeps it
+ * (replacing it atomically, the old one stays mapped in spind until
+ * the new one is taken over), fills the ipsets, and sends the result
+ * through a pipe.
+ */
+struct feedimport_result {
+    int     fr_entries;         // -1 on failure
+    int     fr_loaded;          // see c2b_loadfeed()
+};
+
+static struct feedimport {
+    pid_t           fi_pid;     // 0 if no import is running
+    int             fi_fd;      // read end of the pipe from the child
+    feedimport_done fi_done;
+    void *          fi_arg;
+} imports[N_IPLIST];
+
+static void
+feedimport_child(int iplist, const char *textfile, int fd) {
+    struct list_info *lip = get_spin_iplist(iplist);
+    struct feedimport_result result;
+    ipfeed_t *feed;
+
+    result.fr_loaded = 0;
+    result.fr_entries = ipfeed_import(textfile, ipl_feed_filename(lip));
+    if (result.fr_entries >= 0) {
+        feed = ipfeed_open(ipl_feed_filename(lip));
+        if (feed != NULL) {
+            result.fr_loaded = c2b_loadfeed(iplist, feed);
+            ipfeed_close(feed);
+        } else {
+            result.fr_entries = -1;
+        }
+    }
+    if (write(fd, &result, sizeof(result)) != sizeof(result)) {
+        spin_log(LOG_ERR, "Cannot send the result of the feed import: %s\n", strerror(errno));
+    }
+    // this is a copy of spind, whose cleanup must not run here
+    fflush(NULL);
+    _exit(0);
+}
+
+// Reads the result; the child has exited if there is none
+static void
+feedimport_finish(struct feedimport *fi, int iplist) {
+    struct feedimport_result result;
+    feedimport_done done = fi->fi_done;
+    void *arg = fi->fi_arg;
+    ssize_t rv;
+
+    rv = read(fi->fi_fd, &result, sizeof(result));
+    if (rv != sizeof(result)) {
+        spin_log(LOG_ERR, "Feed import of list %d stopped without a result\n", iplist);
+        result.fr_entries = -1;
+        result.fr_loaded = 0;
+    }
+    mainloop_unregister(fi->fi_fd);
+    close(fi->fi_fd);
+    // (this returns at once if SIGCHLD is ignored, see core2pubsub.c)
+    waitpid(fi->fi_pid, NULL, 0);
+    fi->fi_pid = 0;
+    fi->fi_fd = -1;
+
+    // even if a set could not be filled, the index was replaced
+    if (result.fr_entries >= 0) {
+        if (ipl_reopen_feed(get_spin_iplist(iplist)) < 0) {
+            result.fr_entries = -1;
+        }
+        c2b_feedrules(iplist, result.fr_loaded);
+    }
+    spin_log(LOG_INFO, "Feed import of list %d done, %d entries\n", iplist, result.fr_entries);
+    (*done)(iplist, result.fr_entries, arg);
+}
+
+static void
+wf_feedimport(void *arg, int data, int timeout) {
+    int iplist = (int) (long) arg;
+
+    if (data) {
+        feedimport_finish(&imports[iplist], iplist);
+    }
+}
+
+int
+feedimport_start(int iplist, const char *textfile, feedimport_done done, void *arg) {
+    struct feedimport *fi = &imports[iplist];
+    int fds[2];
+    pid_t pid;
+
+    if (fi->fi_pid != 0) {
+        return 1;
+    }
+    if (pipe(fds) != 0) {
+        spin_log(LOG_ERR, "Cannot start feed import: %s\n", strerror(errno));
+        return -1;
+    }
+    // the child flushes what it wrote itself, not what is buffered here
+    fflush(NULL);
+    pid = fork();
+    if (pid < 0) {
+        spin_log(LOG_ERR, "Cannot start feed import: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        feedimport_child(iplist, textfile, fds[1]);
+    }
+    close(fds[1]);
+
+    spin_log(LOG_INFO, "Feed import of list %d from %s started\n", iplist, textfile);
+    fi->fi_pid = pid;
+    fi->fi_fd = fds[0];
+    fi->fi_done = done;
+    fi->fi_arg = arg;
+    mainloop_register("feedimport", wf_feedimport, (void *) (long) iplist, fds[0], 0, 1);
+    return 0;
+}
+
+int
+feedimport_running(int iplist) {
+    return imports[iplist].fi_pid != 0;
+}
+
+void
+cleanup_feedimport() {
+    int i;
+
+    // the sets must not be filled after spind has removed them
+    for (i = 0; i < N_IPLIST; i++) {
+        if (imports[i].fi_pid != 0) {
+            waitpid(imports[i].fi_pid, NULL, 0);
+            close(imports[i].fi_fd);
+            imports[i].fi_pid = 0;
+        }
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef FEEDIMPORT_H
+#define FEEDIMPORT_H 1
+
+/*
+ * Imports the feeds of the lists (see ipfeed.h) in the background
+ *
+ * For the largest feeds, importing the text file, writing the index and
+ * loading the ipsets of the list with "ipset restore" takes seconds,
+ * which spind cannot spend in its mainloop. This is done by a child
+ * process; spind goes on with its work, and the list keeps its old
+ * feed until the child is done. Then spind maps the new index, adds
+ * the firewall rules for the sets if needed, and calls done.
+ */
+
+/*
+ * Called when the import is done, with the number of entries, or -1
+ * if the import failed (the list then keeps its old feed)
+ */
+typedef void (*feedimport_done)(int iplist, int entries, void *arg);
+
+/*
+ * Starts the import of the feed in textfile for the list.
+ * Returns 0 if it was started, 1 if an import for the list is still
+ * running, and -1 on error.
+ */
+int feedimport_start(int iplist, const char *textfile, feedimport_done done, void *arg);
+
+/* Returns 1 if an import for the list is running */
+int feedimport_running(int iplist);
+
+/* Waits for the imports that are still running */
+void cleanup_feedimport();
+
+#endif
@@ -20,13 +20,14 @@
  * File descriptors must be non-zero and unique
  */
 
-#define MAXMNR 10       /* More than this would be excessive */
+#define MAXMNR 32       /* Includes client connections on our sockets */
 static
 struct mnreg {
     int                 mnr_active;     /* Active if 1, can be reused if 0 */
     char *              mnr_name;       /* Name of module for debugging */
     workfunc            mnr_wf;         /* The to-be-called work function */
     void *              mnr_wfarg;      /* Call back argument */
+    closefunc           mnr_cf;         /* Called on errors, if set */
     int                 mnr_fd;         /* File descriptor if non zero */
     int                 mnr_pollnumber; /* Index in poll() list if >= 0 */
     struct timeval      mnr_toval;      /* Periodic timeouts so often */
@@ -63,6 +64,7 @@ static void mnreg_deactivate(struct mnreg *reg) {
     reg->mnr_name = "inactive";
     reg->mnr_wf = NULL;
     reg->mnr_wfarg = NULL;
+    reg->mnr_cf = NULL;
     reg->mnr_fd = -1;
     reg->mnr_pollnumber = -1;
     timerclear(&reg->mnr_toval);
@@ -83,6 +85,7 @@ int mainloop_register(char *name, workfunc wf, void *arg, int fd, int toval, int
     int i;
     int cur_mnr;
     int pollnum = -1;
+    struct timeval now;
 
     spin_log(LOG_DEBUG, "Mainloop registering %s(..., %d, %d)\n", name, fd, toval);
 
@@ -120,18 +123,31 @@ int mainloop_register(char *name, workfunc wf, void *arg, int fd, int toval, int
     mnr[cur_mnr].mnr_name = name;
     mnr[cur_mnr].mnr_wf = wf;
     mnr[cur_mnr].mnr_wfarg = arg;
+    mnr[cur_mnr].mnr_cf = NULL;
     mnr[cur_mnr].mnr_fd = fd;
     /* Convert millisecs to secs and microsecs */
     mnr[cur_mnr].mnr_toval.tv_sec = toval/1000;
     mnr[cur_mnr].mnr_toval.tv_usec = 1000*(toval%1000);
+    /*
+     * Work registered while the mainloop runs (such as connections) must
+     * get its first period now; init_mltime() restarts them all when the
+     * mainloop starts
+     */
+    if (toval) {
+        gettimeofday(&now, 0);
+        timeradd(&now, &mnr[cur_mnr].mnr_toval, &mnr[cur_mnr].mnr_nxttime);
+    } else {
+        timerclear(&mnr[cur_mnr].mnr_nxttime);
+    }
 
     if (fd) {
         /*
          * Look for pollfd struct that is not active and can be used. Note that
-         * mnr and fds are not the same array but the number of fds <= n_mnr
-         * so it's OK to look for n_mnr entries in the fds array.
+         * mnr and fds are not the same array; the number of fds in use is at
+         * most the number of active MNR structs, and cur_mnr < MAXMNR, so
+         * there is always one.
          */
-        for (i = 0; i < n_mnr; i++) {
+        for (i = 0; i < MAXMNR; i++) {
             if (fds[i].fd == -1) {
                 pollnum = i;
                 break;
@@ -144,6 +160,9 @@ int mainloop_register(char *name, workfunc wf, void *arg, int fd, int toval, int
         mnr[cur_mnr].mnr_pollnumber = pollnum;
         fds[pollnum].fd = fd;
         fds[pollnum].events = POLLIN;
+        // the slot may have been given up in this pass, with the events
+        // of the fd it had still to be looked at
+        fds[pollnum].revents = 0;
         if (pollnum + 1 > nfds) {
             nfds = pollnum + 1;
         }
@@ -158,6 +177,73 @@ int mainloop_register(char *name, workfunc wf, void *arg, int fd, int toval, int
     return 0;
 }
 
+/*
+ * Unregister the work function that was registered for the given file
+ * descriptor. The file descriptor itself is not closed.
+ *
+ * Returns 0 on success, 1 if no work function was registered for fd.
+ */
+int mainloop_unregister(int fd) {
+    int i;
+
+    if (fd == 0) {
+        return 1;
+    }
+    for (i = 0; i < n_mnr; i++) {
+        if (mnr[i].mnr_active && mnr[i].mnr_fd == fd) {
+            spin_log(LOG_DEBUG, "Mainloop unregistering %s(%d)\n", mnr[i].mnr_name, fd);
+            mnreg_deactivate(&mnr[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Set the function that is called when poll() reports an error on fd.
+ * Without one, the mainloop closes fd itself; with one, the work is
+ * unregistered and the function is called with the argument of the
+ * work function, and must close fd (and free whatever belongs to it).
+ *
+ * Returns 0 on success, 1 if no work function was registered for fd.
+ */
+int mainloop_set_closefunc(int fd, closefunc cf) {
+    int i;
+
+    if (fd == 0) {
+        return 1;
+    }
+    for (i = 0; i < n_mnr; i++) {
+        if (mnr[i].mnr_active && mnr[i].mnr_fd == fd) {
+            mnr[i].mnr_cf = cf;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Set the poll() events (POLLIN and/or POLLOUT) that the work function of
+ * fd is called for; work is registered for POLLIN. A hangup is always
+ * passed on.
+ *
+ * Returns 0 on success, 1 if no work function was registered for fd.
+ */
+int mainloop_set_events(int fd, short events) {
+    int i;
+
+    if (fd == 0) {
+        return 1;
+    }
+    for (i = 0; i < n_mnr; i++) {
+        if (mnr[i].mnr_active && mnr[i].mnr_fd == fd) {
+            fds[mnr[i].mnr_pollnumber].events = events;
+            return 0;
+        }
+    }
+    return 1;
+}
+
 static void init_mltime() {
     struct timeval tvstart;
     int i;
@@ -230,6 +316,8 @@ void mainloop_run() {
     struct timeval time_now, time_interesting;
     int millitime;
     int argdata, argtmout;
+    closefunc cf;
+    void *cfarg;
     void *memboundary;
     STAT_COUNTER(polltime, polltime, STAT_TOTAL);
     STAT_COUNTER(mem, memextra, STAT_MAX);
@@ -273,14 +361,22 @@ void mainloop_run() {
             if ( pollnum >= 0) {
                 if (fds[pollnum].revents & (POLLERR|POLLNVAL)) {
                     spin_log(LOG_ERR, "Error on fd %d from %s\n", mnr[i].mnr_fd, mnr[i].mnr_name);
-                    // Negate FD to prevent further errors and make MNR struct
-                    // available for reuse.
-                    fds[pollnum].fd *= -1;
-                    close(fds[pollnum].fd);
+                    // Make MNR struct available for reuse, and let the
+                    // owner clean up if it wants to
+                    cf = mnr[i].mnr_cf;
+                    cfarg = mnr[i].mnr_wfarg;
+                    if (cf == NULL) {
+                        close(fds[pollnum].fd);
+                    }
                     mnreg_deactivate(&mnr[i]);
+                    if (cf != NULL) {
+                        (*cf)(cfarg);
+                    }
+                    continue;
                 }
 
-                if (fds[pollnum].revents & POLLIN) {
+                // A hangup is reported as data; the read returns 0
+                if (fds[pollnum].revents & (fds[pollnum].events|POLLHUP)) {
                     argdata = 1;
                 }
             }
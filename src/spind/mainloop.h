@@ -2,9 +2,13 @@
 #define SPIN_MAINLOOP_H
 
 typedef void (*workfunc)(void*, int, int);
+typedef void (*closefunc)(void*);
 
 int init_mainloop();
 int mainloop_register(char *name, workfunc wf, void *arg, int fd, int toval, int mustsucceed);
+int mainloop_unregister(int fd);
+int mainloop_set_closefunc(int fd, closefunc cf);
+int mainloop_set_events(int fd, short events);
 void mainloop_run();
 void mainloop_end();
 #endif
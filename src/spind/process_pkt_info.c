@@ -3,6 +3,7 @@
 #include "ipl.h"
 #include "mainloop.h"
 #include "process_pkt_info.h"
+#include "spinclock.h"
 #include "spind.h"
 #include "spin_log.h"
 #include "statistics.h"
@@ -11,8 +12,7 @@ STAT_MODULE(processpktinfo)
 
 void
 process_pkt_info(node_cache_t* node_cache, flow_list_t* flow_list, trafficfunc traffic_hook, int local_mode, pkt_info_t* pkt_info) {
-    // TODO: remove time() calls, use the single one at caller
-    uint32_t now = time(NULL);
+    uint32_t now = spin_clock_now();
     STAT_COUNTER(ctrsf, sendflow, STAT_TOTAL);
     STAT_COUNTER(ctrlocal, cb-ignore-local, STAT_TOTAL);
     STAT_COUNTER(ctrignore, ignore-ip, STAT_TOTAL);
@@ -6,9 +6,12 @@
 #include <fcntl.h>
 
 #include "core2block.h"
+#include "core2extsrc.h"
 #include "core2pubsub.h"
 #include "ipl.h"
 #include "dots.h"
+#include "feedimport.h"
+#include "spinclock.h"
 #include "spinhook.h"
 #include "spinhook.h"
 #include "spin_log.h"
@@ -43,7 +46,7 @@ int addipnodefunc(void *cb_data, rpc_arg_val_t *args, rpc_arg_val_t *result) {
     nodenum = args[0].rpca_ivalue;
     ipaddr = args[1].rpca_svalue;
 
-    timestamp = time(NULL);
+    timestamp = spin_clock_now();
 
     if (!spin_pton(&ipval, ipaddr)) {
         result->rpca_svalue = "Not a valid IP address";
@@ -262,38 +265,75 @@ static int map_node(int nodenum) {
     return newnodenum;
 }
 
-int read_nodepair_tree(node_cache_t* node_cache, const char *filename) {
-    int count = 0;
-    char line[100];
-    char* rline;
+/*
+ * The blocked nodepairs are kept in NODEPAIRFILE, with a journal of
+ * the changes since (see journal.h)
+ */
+static journal_t *nodepair_journal = NULL;
+
+static void
+nodepair_apply(void *arg, int add, const char *entry) {
+    tree_t *tree = (tree_t *) arg;
     int id[2];
+
+    if (sscanf(entry, "%d %d", &id[0], &id[1]) != 2) {
+        return;
+    }
+    if (add) {
+        tree_add(tree, sizeof(id), (void *) id, 0, NULL, 1);
+    } else {
+        tree_remove(tree, sizeof(id), (void *) id);
+    }
+}
+
+static void
+nodepair_write(void *arg, FILE *out) {
+    tree_entry_t *cur;
+    int *np;
+
+    cur = tree_first(nodepair_tree);
+    while (cur != NULL) {
+        np = (int *) cur->key;
+        fprintf(out, "%d %d\n", np[0], np[1]);
+        cur = tree_next(cur);
+    }
+}
+
+int read_nodepair_tree(node_cache_t* node_cache, const char *filename) {
+    int count;
+    tree_t *stored;
+    tree_entry_t *cur;
+    int *id;
     int node1, node2;
     int spinrpc_blockflow(node_cache_t* node_cache, int node1, int node2, int block);
 
-    FILE* in = fopen(filename, "r");
-    if (in == NULL) {
-        return -1;
-    }
-    unlink(filename); // to prevent overwriting TODO
-    while ((rline = fgets(line, sizeof(line), in)) != NULL) {
-        if (sscanf(rline, "%d %d", &id[0], &id[1]) == 2) {
-            node1 = map_node(id[0]);
-            node2 = map_node(id[1]);
-            spinrpc_blockflow(node_cache, node1, node2, 1);
-            // Do mapping and actual blocking
-            // tree_add(nodepair_tree, sizeof(id), (void *) id, 0, NULL, 1);
-            count++;
-        }
+    stored = tree_create(cmp_2ints);
+    count = journal_replay(filename, nodepair_apply, stored);
+    cur = tree_first(stored);
+    while (cur != NULL) {
+        // Do mapping and actual blocking
+        id = (int *) cur->key;
+        node1 = map_node(id[0]);
+        node2 = map_node(id[1]);
+        spinrpc_blockflow(node_cache, node1, node2, 1);
+        cur = tree_next(cur);
     }
-    fclose(in);
+    tree_destroy(stored);
     return count;
 }
+
 static void
 init_blockflow(node_cache_t* node_cache) {
 
     retrieve_node_info(node_cache);
 
+    // The node numbers have changed; the journal is opened after
+    // blocking the pairs again, and replaced with the new numbers
     read_nodepair_tree(node_cache, NODEPAIRFILE);
+    nodepair_journal = journal_open(NODEPAIRFILE);
+    if (nodepair_journal != NULL) {
+        journal_compact(nodepair_journal, nodepair_write, NULL);
+    }
 
     tree_destroy(nodemap_tree);
     nodemap_tree = NULL;
@@ -304,6 +344,8 @@ cleanup_blockflow() {
     if (nodemap_tree != NULL) {
         tree_destroy(nodemap_tree);
     }
+    journal_close(nodepair_journal);
+    nodepair_journal = NULL;
     if (nodepair_tree != NULL) {
         tree_destroy(nodepair_tree);
     }
@@ -318,14 +360,14 @@ change_node_persistency(node_cache_t* node_cache, int nodenum, int val) {
     if (node != NULL) {
         if (node->persistent == 0) {
             // Is becoming persistent
-            now = time(NULL);
+            now = spin_clock_now();
             node_set_modified(node, now);
             c2b_node_persistent_start(nodenum);
         }
         node->persistent += val;
         if (node->persistent == 0) {
             // Stops being persistent
-            now = time(NULL);
+            now = spin_clock_now();
             node_set_modified(node, now);
             c2b_node_persistent_end(nodenum);
         }
@@ -335,9 +377,23 @@ change_node_persistency(node_cache_t* node_cache, int nodenum, int val) {
 }
 
 static void
-store_nodepairs() {
+store_nodepair(int *node_ar, int add) {
+    char entry[32];
 
-    store_nodepair_tree(nodepair_tree, NODEPAIRFILE);
+    if (nodepair_journal == NULL) {
+        return;
+    }
+    snprintf(entry, sizeof(entry), "%d %d", node_ar[0], node_ar[1]);
+    journal_append(nodepair_journal, add, entry);
+}
+
+/* Worker function to regularly flush the nodepair journal */
+static void
+wf_nodepairs(void *arg, int data, int timeout) {
+
+    if (timeout && nodepair_journal != NULL) {
+        journal_sync(nodepair_journal, nodepair_write, NULL);
+    }
 }
 
 
@@ -365,7 +421,7 @@ spinrpc_blockflow_start(node_cache_t* node_cache, int node1, int node2) {
     // Copy flag is 1, key must be copied
     tree_add(nodepair_tree, sizeof(node_ar), (void *) node_ar, 0, NULL, 1);
     // new pair to block
-    store_nodepairs();
+    store_nodepair(node_ar, 1);
     c2b_blockflow_start(node1, node2);
     /*
      * add device->node block flag if applicable
@@ -388,7 +444,7 @@ spinrpc_blockflow_stop(node_cache_t* node_cache, int node1, int node2) {
     }
     // Remove from tree
     tree_remove_entry(nodepair_tree, leaf);
-    store_nodepairs();
+    store_nodepair(node_ar, 0);
     c2b_blockflow_end(node1, node2);
 
     result = 0;
@@ -487,6 +543,30 @@ int devflowfunc(void *cb_data, rpc_arg_val_t *args, rpc_arg_val_t *result) {
     return 0;
 }
 
+rpc_arg_desc_t devflow_page_args[] = {
+    { "device", RPCAT_STRING },
+    { "limit", RPCAT_INT },
+    { "after", RPCAT_STRING },
+};
+int devflowpagefunc(void *cb_data, rpc_arg_val_t *args, rpc_arg_val_t *result) {
+    node_t *node;
+    node_cache_t* node_cache = (node_cache_t*)cb_data;
+    spin_data page;
+
+    node = node_cache_find_by_mac(node_cache, args[0].rpca_svalue);
+    if (node == NULL) {
+        result->rpca_svalue = "Device not found";
+        return -1;
+    }
+    page = spin_data_flowlist_page(node, args[2].rpca_svalue, args[1].rpca_ivalue);
+    if (page == NULL) {
+        result->rpca_svalue = "Bad value for after";
+        return -1;
+    }
+    result->rpca_cvalue = page;
+    return 0;
+}
+
 rpc_arg_desc_t get_dev_data_args[] = {
     { "node", RPCAT_INT },
 };
@@ -514,6 +594,25 @@ devlistfunc(void *cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
     return 0;
 }
 
+rpc_arg_desc_t devlist_page_args[] = {
+    { "limit", RPCAT_INT },
+    { "after", RPCAT_STRING },
+};
+
+int
+devlistpagefunc(void *cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
+    node_cache_t *node_cache = (node_cache_t *) cb;
+
+    result->rpca_cvalue = spin_data_devicelist_page(node_cache, args[1].rpca_svalue, args[0].rpca_ivalue);
+    return 0;
+}
+
+int
+extsrcclientsfunc(void *cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
+    result->rpca_cvalue = extsrc_clients_json();
+    return 0;
+}
+
 int getblockflowfunc(void *cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
     spin_data ar_sd;
 
@@ -663,6 +762,10 @@ int update_iplist_ip(void* cb, rpc_arg_val_t *args, rpc_arg_val_t *result, int a
         result->rpca_svalue = "Invalid IP address";
         return -1;
     }
+    if (ip.netmask > (ip.family == AF_INET ? 32 : 128)) {
+        result->rpca_svalue = "Invalid netmask";
+        return -1;
+    }
 
     // Update the internal list
     if (add_remove == SF_ADD) {
@@ -703,7 +806,104 @@ int list_iplist_ips(void* cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
     }
     iplist = get_spin_iplist(iplist_id);
 
-    result->rpca_cvalue = spin_data_ipar(iplist->li_tree);
+    result->rpca_cvalue = spin_data_iptrie(iplist->li_trie);
+    return 0;
+}
+
+/*
+ * Feeds: large lists of addresses and networks (threat-intelligence
+ * blocklists), imported from a text file on this machine. They come
+ * on top of the entries of the list, and are replaced as a whole.
+ *
+ * An import takes seconds for the largest feeds, so it runs in the
+ * background (see feedimport.h); load_iplist_feed returns once it has
+ * started, and get_iplist_feed shows how it went.
+ */
+static int feed_failed[N_IPLIST];
+
+static void
+iplist_feed_done(int iplist_id, int entries, void *arg) {
+    feed_failed[iplist_id] = entries < 0;
+    if (entries >= 0) {
+        broadcast_iplist(iplist_id, get_spin_iplist(iplist_id)->li_listname);
+    }
+}
+
+rpc_arg_desc_t iplist_feed_args[] = {
+    { "list", RPCAT_STRING },
+    { "file", RPCAT_STRING },
+};
+int load_iplist_feed(void* cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
+    int iplist_id, rv;
+    char* iplist_name;
+
+    iplist_name = args[0].rpca_svalue;
+    iplist_id = get_spin_iplist_id_by_name(iplist_name);
+    if (iplist_id < 0) {
+        result->rpca_svalue = "Unknown ip list name, should be 'ignore', 'block', or 'allow'";
+        return -1;
+    }
+
+    rv = feedimport_start(iplist_id, args[1].rpca_svalue, iplist_feed_done, NULL);
+    if (rv > 0) {
+        result->rpca_svalue = "A feed import for this list is already running";
+        return -1;
+    }
+    if (rv < 0) {
+        result->rpca_svalue = "Cannot import feed file";
+        return -1;
+    }
+    return 0;
+}
+
+rpc_arg_desc_t iplist_get_feed_args[] = {
+    { "list", RPCAT_STRING },
+};
+int get_iplist_feed(void* cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
+    int iplist_id;
+    struct list_info* iplist;
+    spin_data feed;
+
+    iplist_id = get_spin_iplist_id_by_name(args[0].rpca_svalue);
+    if (iplist_id < 0) {
+        result->rpca_svalue = "Unknown ip list name, should be 'ignore', 'block', or 'allow'";
+        return -1;
+    }
+    iplist = get_spin_iplist(iplist_id);
+
+    feed = cJSON_CreateObject();
+    cJSON_AddNumberToObject(feed, "entries", iplist->li_feed != NULL ? ipfeed_entries(iplist->li_feed) : 0);
+    cJSON_AddBoolToObject(feed, "importing", feedimport_running(iplist_id));
+    cJSON_AddBoolToObject(feed, "failed", feed_failed[iplist_id]);
+    result->rpca_cvalue = feed;
+    return 0;
+}
+
+rpc_arg_desc_t iplist_clear_feed_args[] = {
+    { "list", RPCAT_STRING },
+};
+int clear_iplist_feed(void* cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
+    int iplist_id;
+    char* iplist_name;
+    struct list_info* iplist;
+
+    iplist_name = args[0].rpca_svalue;
+    iplist_id = get_spin_iplist_id_by_name(iplist_name);
+    if (iplist_id < 0) {
+        result->rpca_svalue = "Unknown ip list name, should be 'ignore', 'block', or 'allow'";
+        return -1;
+    }
+    iplist = get_spin_iplist(iplist_id);
+    if (feedimport_running(iplist_id)) {
+        result->rpca_svalue = "A feed import for this list is running";
+        return -1;
+    }
+
+    ipl_clear_feed(iplist);
+    feed_failed[iplist_id] = 0;
+    c2b_syncfeed(iplist_id, NULL);
+
+    broadcast_iplist(iplist_id, iplist_name);
     return 0;
 }
 
@@ -716,13 +916,10 @@ int reset_iplist_ignore(void* cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
     struct list_info* iplist = get_spin_iplist(IPLIST_IGNORE);
     int system_rcode;
 
-    // Remove whole tree, will be recreated
-    tree_destroy(iplist->li_tree);
+    // Remove whole list, will be recreated
+    clean_ipl(iplist);
+    journal_remove(ipl_filename(iplist));
 
-    system_rcode = system("rm /etc/spin/ignore.list");
-    if (system_rcode != 0) {
-        spin_log(LOG_WARNING, "Error removing ignore.list");
-    }
     system_rcode = system("spin_list_ips -o /etc/spin/ignore.list -f");
     if (system_rcode != 0) {
         spin_log(LOG_WARNING, "Error recreating ignore.list");
@@ -800,6 +997,7 @@ init_rpcs(node_cache_t *node_cache) {
     // Make mapping tree while doing init
     nodemap_tree = tree_create(cmp_ints);
     init_blockflow(node_cache);
+    mainloop_register("Nodepair sync", wf_nodepairs, (void *) 0, 0, 2500, 1);
 
     rpc_register("node_add_ip", addipnodefunc, (void *) node_cache, 2, addipnode_args, RPCAT_NONE);
     rpc_register("set_flow_block", blockflowfunc, (void *) node_cache, 3, blockflow_args, RPCAT_NONE);
@@ -808,6 +1006,8 @@ init_rpcs(node_cache_t *node_cache) {
     rpc_register("get_device_data", get_dev_data_func, (void *) node_cache, 1, get_dev_data_args, RPCAT_COMPLEX);
     rpc_register("list_devices", devlistfunc, (void *) node_cache, 0, NULL, RPCAT_COMPLEX);
     rpc_register("list_device_flows", devflowfunc, (void *) node_cache, 1, devflow_args, RPCAT_COMPLEX);
+    rpc_register("list_devices_page", devlistpagefunc, (void *) node_cache, 2, devlist_page_args, RPCAT_COMPLEX);
+    rpc_register("list_device_flows_page", devflowpagefunc, (void *) node_cache, 3, devflow_page_args, RPCAT_COMPLEX);
     rpc_register("set_device_name", set_device_name_func, (void *) node_cache, 2, set_device_name_args, RPCAT_NONE);
     rpc_register("add_iplist_node", add_iplist_node, (void *) node_cache, 2, iplist_addremove_node_args, RPCAT_NONE);
     rpc_register("remove_iplist_node", remove_iplist_node, (void *) node_cache, 2, iplist_addremove_node_args, RPCAT_NONE);
@@ -815,7 +1015,11 @@ init_rpcs(node_cache_t *node_cache) {
     rpc_register("remove_iplist_ip", remove_iplist_ip,  (void *) node_cache, 2, iplist_addremove_ip_args, RPCAT_NONE);
     rpc_register("list_iplist", list_iplist_ips, 0, 1, iplist_list_args, RPCAT_COMPLEX);
     rpc_register("reset_iplist_ignore", reset_iplist_ignore, 0, 0, 0, RPCAT_NONE);
+    rpc_register("load_iplist_feed", load_iplist_feed, 0, 2, iplist_feed_args, RPCAT_NONE);
+    rpc_register("get_iplist_feed", get_iplist_feed, 0, 1, iplist_get_feed_args, RPCAT_COMPLEX);
+    rpc_register("clear_iplist_feed", clear_iplist_feed, 0, 1, iplist_clear_feed_args, RPCAT_NONE);
     rpc_register("dots_signal", rpc_dots_signal, (void *) node_cache, 1, dots_signal_args, RPCAT_NONE);
+    rpc_register("list_extsrc_clients", extsrcclientsfunc, (void *) 0, 0, 0, RPCAT_COMPLEX);
 
     register_internal_functions();
 }
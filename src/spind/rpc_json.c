@@ -1,10 +1,14 @@
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <time.h>
 
 #include "rpc_common.h"
 #include "spinhook.h"
 #include "spin_log.h"
 #include "mainloop.h"
+#include "statistics.h"
 
 static spin_data
 make_answer(spin_data id) {
@@ -209,46 +213,555 @@ call_string_jsonrpc(char *args) {
 
 static int rpc_fd;
 
-// When ubus is not available, we listen in a unix domain socket
-// for JSON RPC calls. This is the callback worker function when a call
-// comes in
+/*
+ * Connections on the JSON RPC socket
+ *
+ * A connection can carry any number of requests. Requests do not need
+ * to be terminated; a request is complete as soon as its top-level JSON
+ * object is. Every response is terminated by a newline.
+ *
+ * After the response, the connection is closed, unless the request
+ * contained "keepalive": true, in which case the next request is
+ * awaited. Idle persistent connections are closed after a while.
+ *
+ * Connections are non-blocking. A response is queued in the output
+ * buffer of the connection, and sent whenever the client is ready for
+ * it; the next request is only looked at once the response has been
+ * sent. A client that stops reading is closed like an idle one.
+ */
+#define RPC_MAX_CONNECTIONS     8
+#define RPC_MAX_REQUEST_SIZE    (1024*1024)
+// (the tests use shorter ones)
+#ifndef RPC_IDLE_TIMEOUT
+#define RPC_IDLE_TIMEOUT        300
+#endif
+#ifndef RPC_IDLE_CHECK
+#define RPC_IDLE_CHECK          30000
+#endif
+
+/*
+ * Streamed responses
+ *
+ * If a call contains "stream": true, and a paged variant of the method
+ * is registered (with the name <method>_page, see spin_data_page()),
+ * the result is not built as a whole. Instead, the pages are fetched
+ * one by one, and the next page is only fetched when the previous one
+ * has been sent, so that only a single page is in memory at any time
+ * and a slow client holds up nothing but its own connection. The
+ * client receives a normal JSON-RPC response with the complete array
+ * as its result.
+ */
+// (the tests use smaller ones)
+#ifndef RPC_STREAM_PAGE_SIZE
+#define RPC_STREAM_PAGE_SIZE    200
+#endif
+
+struct jsonrpc_conn {
+    int     jc_fd;
+    char *  jc_buf;
+    size_t  jc_len;
+    size_t  jc_size;
+    time_t  jc_lastused;
+    // Queued output; jc_outpos bytes of it have been sent
+    char *  jc_out;
+    size_t  jc_outlen;
+    size_t  jc_outpos;
+    size_t  jc_outsize;
+    // Set while a response is being sent
+    int     jc_responding;
+    int     jc_keepalive;
+    // Streamed response: the call of the paged method (NULL if there is
+    // none), and the cursor for the next page
+    spin_data jc_stream;
+    char *  jc_after;
+    int     jc_nitems;
+};
+
+static int n_jsonrpc_conns = 0;
+
+STAT_MODULE(jsonrpc)
+
 static void
-wf_jsonrpc(void *arg, int data, int timeout) {
-    spin_log(LOG_DEBUG, "Got JSON RPC command (data: %d)\n", data);
-    char buf[4096] __attribute__ ((aligned));
+jsonrpc_conn_close(struct jsonrpc_conn *conn) {
+    spin_log(LOG_DEBUG, "Closing domain msg socket %d\n", conn->jc_fd);
+    mainloop_unregister(conn->jc_fd);
+    close(conn->jc_fd);
+    free(conn->jc_buf);
+    free(conn->jc_out);
+    cJSON_Delete(conn->jc_stream);
+    free(conn->jc_after);
+    free(conn);
+    n_jsonrpc_conns--;
+}
+
+// Called by the mainloop when poll() reports an error on the connection
+static void
+cf_jsonrpc_conn(void *arg) {
+    jsonrpc_conn_close((struct jsonrpc_conn *) arg);
+}
+
+/*
+ * Adds data to the output of the connection
+ * Returns 0 on success, -1 if out of memory
+ */
+static int
+jsonrpc_queue(struct jsonrpc_conn *conn, const char *buf, size_t len) {
+    char *newbuf;
+    size_t newsize;
+    STAT_COUNTER(ctr_outsize, response-buffer-size, STAT_MAX);
+
+    if (conn->jc_outsize - conn->jc_outlen < len) {
+        newsize = conn->jc_outsize == 0 ? 4096 : conn->jc_outsize;
+        while (newsize - conn->jc_outlen < len) {
+            newsize *= 2;
+        }
+        newbuf = realloc(conn->jc_out, newsize);
+        if (newbuf == NULL) {
+            spin_log(LOG_ERR, "realloc: %s\n", strerror(errno));
+            return -1;
+        }
+        conn->jc_out = newbuf;
+        conn->jc_outsize = newsize;
+        STAT_VALUE(ctr_outsize, newsize);
+    }
+    memcpy(conn->jc_out + conn->jc_outlen, buf, len);
+    conn->jc_outlen += len;
+    return 0;
+}
+
+static int
+jsonrpc_queue_json(struct jsonrpc_conn *conn, spin_data sd) {
+    char *str;
     int rv;
-    size_t write_result;
-    int msgsock;
+
+    str = cJSON_PrintUnformatted(sd);
+    if (str == NULL) {
+        return -1;
+    }
+    rv = jsonrpc_queue(conn, str, strlen(str));
+    free(str);
+    return rv;
+}
+
+/*
+ * Sends as much of the output as the socket takes
+ * Returns 0 on success (also if not everything was sent), -1 on errors
+ */
+static int
+jsonrpc_flush(struct jsonrpc_conn *conn) {
+    ssize_t rv;
+
+    while (conn->jc_outpos < conn->jc_outlen) {
+        rv = send(conn->jc_fd, conn->jc_out + conn->jc_outpos,
+                  conn->jc_outlen - conn->jc_outpos, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rv < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            spin_log(LOG_WARNING, "JSON RPC write error: %s\n", strerror(errno));
+            return -1;
+        }
+        conn->jc_outpos += rv;
+        conn->jc_lastused = time(NULL);
+    }
+    conn->jc_outpos = 0;
+    conn->jc_outlen = 0;
+    return 0;
+}
+
+static void
+jsonrpc_stream_end(struct jsonrpc_conn *conn) {
+    cJSON_Delete(conn->jc_stream);
+    conn->jc_stream = NULL;
+    free(conn->jc_after);
+    conn->jc_after = NULL;
+}
+
+/*
+ * Fetches the next page of the streamed response and queues its items.
+ * For the first page, call_info is the request, and the start of the
+ * response is queued as well (or an error response, if the method
+ * cannot be streamed).
+ * Returns 0 on success, -1 if the connection must be closed
+ */
+static int
+jsonrpc_stream_page(struct jsonrpc_conn *conn, spin_data call_info) {
+    spin_data pageparams, answer, result, item, next, error, jsonid;
+    char *idstr;
+    int rv = -1;
+
+    pageparams = cJSON_GetObjectItemCaseSensitive(conn->jc_stream, "params");
+    cJSON_ReplaceItemInObjectCaseSensitive(pageparams, "after", cJSON_CreateString(conn->jc_after));
+    answer = rpc_json(conn->jc_stream);
+    result = cJSON_GetObjectItemCaseSensitive(answer, "result");
+    if (result == NULL) {
+        if (call_info == NULL) {
+            spin_log(LOG_ERR, "Error in streamed JSON RPC call, aborting\n");
+            goto out;
+        }
+        // Nothing has been queued yet, so we can still send a proper
+        // error response
+        error = cJSON_GetObjectItemCaseSensitive(answer, "error");
+        error = cJSON_GetObjectItemCaseSensitive(error, "message");
+        result = json_error(call_info, 4, cJSON_IsString(error) ?
+                            error->valuestring : "Streaming not supported for method");
+        rv = jsonrpc_queue_json(conn, result);
+        cJSON_Delete(result);
+        if (rv == 0) {
+            rv = jsonrpc_queue(conn, "\n", 1);
+        }
+        conn->jc_keepalive = 0;
+        jsonrpc_stream_end(conn);
+        goto out;
+    }
+
+    if (call_info != NULL) {
+        jsonid = cJSON_GetObjectItemCaseSensitive(call_info, "id");
+        idstr = jsonid != NULL ? cJSON_PrintUnformatted(jsonid) : NULL;
+        if (jsonrpc_queue(conn, "{\"jsonrpc\":\"2.0\",\"id\":", 22) != 0 ||
+            jsonrpc_queue(conn, idstr ? idstr : "null", strlen(idstr ? idstr : "null")) != 0 ||
+            jsonrpc_queue(conn, ",\"result\":[", 11) != 0) {
+            free(idstr);
+            goto out;
+        }
+        free(idstr);
+    }
+
+    cJSON_ArrayForEach(item, cJSON_GetObjectItemCaseSensitive(result, "items")) {
+        if ((conn->jc_nitems > 0 && jsonrpc_queue(conn, ",", 1) != 0) ||
+            jsonrpc_queue_json(conn, item) != 0) {
+            goto out;
+        }
+        conn->jc_nitems++;
+    }
+
+    next = cJSON_GetObjectItemCaseSensitive(result, "next");
+    if (cJSON_IsString(next)) {
+        free(conn->jc_after);
+        conn->jc_after = strdup(next->valuestring);
+        rv = conn->jc_after != NULL ? 0 : -1;
+    } else {
+        rv = jsonrpc_queue(conn, "]}\n", 3);
+        jsonrpc_stream_end(conn);
+    }
+
+out:
+    cJSON_Delete(answer);
+    return rv;
+}
+
+/*
+ * Starts a streamed response, and queues its first page
+ * Returns 0 on success, -1 if the connection must be closed
+ */
+static int
+jsonrpc_stream_start(struct jsonrpc_conn *conn, spin_data call_info) {
+    spin_data jsonmethod, jsonparams, pageparams, answer;
+    char pagemethod[128];
+    int rv;
+
+    jsonmethod = cJSON_GetObjectItemCaseSensitive(call_info, "method");
+    if (!cJSON_IsString(jsonmethod)) {
+        answer = json_error(call_info, 2, "'method' object must be a string");
+        rv = jsonrpc_queue_json(conn, answer);
+        cJSON_Delete(answer);
+        conn->jc_keepalive = 0;
+        return rv == 0 ? jsonrpc_queue(conn, "\n", 1) : rv;
+    }
+    snprintf(pagemethod, sizeof(pagemethod), "%s_page", jsonmethod->valuestring);
+
+    jsonparams = cJSON_GetObjectItemCaseSensitive(call_info, "params");
+    if (jsonparams != NULL && cJSON_IsObject(jsonparams)) {
+        pageparams = cJSON_Duplicate(jsonparams, 1);
+    } else {
+        pageparams = cJSON_CreateObject();
+    }
+    cJSON_DeleteItemFromObjectCaseSensitive(pageparams, "limit");
+    cJSON_DeleteItemFromObjectCaseSensitive(pageparams, "after");
+    cJSON_AddNumberToObject(pageparams, "limit", RPC_STREAM_PAGE_SIZE);
+    cJSON_AddStringToObject(pageparams, "after", "");
+
+    conn->jc_stream = cJSON_CreateObject();
+    cJSON_AddStringToObject(conn->jc_stream, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(conn->jc_stream, "method", pagemethod);
+    cJSON_AddNumberToObject(conn->jc_stream, "id", 0);
+    cJSON_AddItemToObject(conn->jc_stream, "params", pageparams);
+    conn->jc_after = strdup("");
+    conn->jc_nitems = 0;
+    if (conn->jc_after == NULL) {
+        return -1;
+    }
+
+    return jsonrpc_stream_page(conn, call_info);
+}
+
+/*
+ * Returns the size of the JSON object at the start of buf (after
+ * leading whitespace), 0 if it is not complete yet, or -1 if the data
+ * cannot be a JSON RPC request.
+ */
+static ssize_t
+jsonrpc_frame_size(const char *buf, size_t len) {
+    size_t i;
+    int depth = 0;
+    int in_string = 0;
+    int escaped = 0;
+
+    for (i = 0; i < len; i++) {
+        if (in_string) {
+            if (escaped) {
+                escaped = 0;
+            } else if (buf[i] == '\\') {
+                escaped = 1;
+            } else if (buf[i] == '"') {
+                in_string = 0;
+            }
+            continue;
+        }
+        switch (buf[i]) {
+        case ' ': case '\t': case '\r': case '\n':
+            break;
+        case '"':
+            if (depth == 0) {
+                return -1;
+            }
+            in_string = 1;
+            break;
+        case '{': case '[':
+            depth++;
+            break;
+        case '}': case ']':
+            if (--depth == 0) {
+                return i + 1;
+            }
+            break;
+        default:
+            if (depth == 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Handle a single request: queue the response (or the first part of
+ * it). Returns 0 on success, -1 if the connection must be closed
+ */
+static int
+jsonrpc_handle_request(struct jsonrpc_conn *conn, char *request) {
+    spin_data rpc, json_res;
     char* response = NULL;
+    int rv = 0;
+    STAT_COUNTER(ctr, requests, STAT_TOTAL);
+
+    STAT_VALUE(ctr, 1);
+    spin_log(LOG_DEBUG, "Got data: %s\n", request);
+    rpc = cJSON_Parse(request);
+    conn->jc_responding = 1;
+    conn->jc_keepalive = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(rpc, "keepalive"));
+    if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(rpc, "stream"))) {
+        rv = jsonrpc_stream_start(conn, rpc);
+    } else {
+        json_res = rpc_json(rpc);
+        response = cJSON_PrintUnformatted(json_res);
+        cJSON_Delete(json_res);
+    }
+    cJSON_Delete(rpc);
+    spin_log(LOG_DEBUG, "json rpc called, response: %s\n", response);
+    if (response != NULL) {
+        if (jsonrpc_queue(conn, response, strlen(response)) != 0 ||
+            jsonrpc_queue(conn, "\n", 1) != 0) {
+            rv = -1;
+        }
+        free(response);
+    }
+    return rv;
+}
+
+/*
+ * Sends what is queued, and then the next page of a streamed response,
+ * or handles the next request that has been received; stops when the
+ * client has to read or send more first.
+ * Returns 0 on success, -1 if the connection must be closed
+ */
+static int
+jsonrpc_conn_run(struct jsonrpc_conn *conn) {
+    ssize_t framesize;
+    char *next;
+    char saved;
+    int fetched = 0;
+    int rv;
+
+    while (1) {
+        if (jsonrpc_flush(conn) != 0) {
+            return -1;
+        }
+        // Fetch at most one page per call, so that other work gets its
+        // turn while the client reads it
+        if (conn->jc_outlen > 0 || (conn->jc_stream != NULL && fetched)) {
+            mainloop_set_events(conn->jc_fd, POLLOUT);
+            return 0;
+        }
+        if (conn->jc_stream != NULL) {
+            if (jsonrpc_stream_page(conn, NULL) != 0) {
+                return -1;
+            }
+            fetched = 1;
+            continue;
+        }
+        if (conn->jc_responding) {
+            // The response has been sent
+            if (!conn->jc_keepalive) {
+                return -1;
+            }
+            conn->jc_responding = 0;
+        }
 
-    memset(buf, 0, 4096);
-    if (data) {
-        msgsock = accept(rpc_fd, NULL, NULL);
-        rv = recv(msgsock, buf, sizeof(buf), 0);
-        spin_log(LOG_DEBUG, "Received %d bytes of data\n", rv);
-        // TODO: check for incomplete reads
-        spin_log(LOG_DEBUG, "Got data: rv: %d buf: %s\n", rv, buf);
-        response = call_string_jsonrpc(buf);
-        spin_log(LOG_DEBUG, "json rpc called, response: %s\n", response);
-        if (response != NULL) {
-            write_result = write(msgsock, response, strlen(response));
-            if (write_result != strlen(response)) {
-                spin_log(LOG_WARNING, "incomplete write");
+        framesize = jsonrpc_frame_size(conn->jc_buf, conn->jc_len);
+        if (framesize == 0) {
+            mainloop_set_events(conn->jc_fd, POLLIN);
+            return 0;
+        }
+        if (framesize < 0) {
+            spin_log(LOG_WARNING, "Bad data on JSON RPC connection, closing\n");
+            return -1;
+        }
+        // Temporarily terminate the request, the byte after it is
+        // either part of the next request or unused
+        next = conn->jc_buf + framesize;
+        saved = *next;
+        *next = '\0';
+        rv = jsonrpc_handle_request(conn, conn->jc_buf);
+        *next = saved;
+        conn->jc_len -= framesize;
+        memmove(conn->jc_buf, next, conn->jc_len);
+        if (rv != 0) {
+            return -1;
+        }
+        fetched = 1;
+    }
+}
+
+static void
+wf_jsonrpc_conn(void *arg, int data, int timeout) {
+    struct jsonrpc_conn *conn = (struct jsonrpc_conn *) arg;
+    ssize_t rv;
+    char *newbuf;
+    STAT_COUNTER(ctr_bufsize, request-buffer-size, STAT_MAX);
+
+    if (timeout && !data) {
+        if (time(NULL) - conn->jc_lastused > RPC_IDLE_TIMEOUT) {
+            spin_log(LOG_DEBUG, "Closing idle JSON RPC connection\n");
+            jsonrpc_conn_close(conn);
+        }
+        return;
+    }
+    if (!data) {
+        return;
+    }
+
+    // While a response is being sent, the connection is only waiting
+    // for the client to be ready for more
+    if (!conn->jc_responding) {
+        if (conn->jc_size - conn->jc_len < 1024) {
+            if (conn->jc_size >= RPC_MAX_REQUEST_SIZE) {
+                spin_log(LOG_WARNING, "JSON RPC request too large, closing connection\n");
+                jsonrpc_conn_close(conn);
+                return;
+            }
+            newbuf = realloc(conn->jc_buf, conn->jc_size * 2);
+            if (newbuf == NULL) {
+                spin_log(LOG_ERR, "realloc: %s\n", strerror(errno));
+                jsonrpc_conn_close(conn);
+                return;
             }
-            write_result = write(msgsock, "\n", 1);
-            if (write_result != 1) {
-                spin_log(LOG_WARNING, "incomplete write");
+            conn->jc_buf = newbuf;
+            conn->jc_size *= 2;
+            STAT_VALUE(ctr_bufsize, conn->jc_size);
+        }
+
+        // Leave room for the terminating NUL
+        rv = recv(conn->jc_fd, conn->jc_buf + conn->jc_len,
+                  conn->jc_size - conn->jc_len - 1, MSG_DONTWAIT);
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return;
+        }
+        if (rv <= 0) {
+            if (rv < 0) {
+                spin_log(LOG_WARNING, "JSON RPC read error: %s\n", strerror(errno));
             }
-            free(response);
-            response = NULL;
+            jsonrpc_conn_close(conn);
+            return;
         }
-        spin_log(LOG_DEBUG, "Closing domain msg socket\n");
+        spin_log(LOG_DEBUG, "Received %zd bytes of data\n", rv);
+        conn->jc_len += rv;
+        conn->jc_lastused = time(NULL);
+    }
+
+    if (jsonrpc_conn_run(conn) != 0) {
+        jsonrpc_conn_close(conn);
+    }
+}
+
+// When ubus is not available, we listen in a unix domain socket
+// for JSON RPC calls. This is the callback worker function when a
+// connection comes in
+static void
+wf_jsonrpc(void *arg, int data, int timeout) {
+    struct jsonrpc_conn *conn;
+    int msgsock;
+
+    spin_log(LOG_DEBUG, "Got JSON RPC connection (data: %d)\n", data);
+    if (!data) {
+        return;
+    }
+    msgsock = accept(rpc_fd, NULL, NULL);
+    if (msgsock < 0) {
+        spin_log(LOG_WARNING, "JSON RPC accept: %s\n", strerror(errno));
+        return;
+    }
+    if (n_jsonrpc_conns >= RPC_MAX_CONNECTIONS) {
+        spin_log(LOG_WARNING, "Too many JSON RPC connections, refusing new one\n");
         close(msgsock);
+        return;
     }
-    if (timeout) {
-        // called due to timeout, do nothing
-        spin_log(LOG_DEBUG, "Timeout in RPC call, aborting");
+
+    conn = malloc(sizeof(struct jsonrpc_conn));
+    if (conn == NULL) {
+        spin_log(LOG_ERR, "malloc: %s\n", strerror(errno));
+        close(msgsock);
+        return;
+    }
+    conn->jc_fd = msgsock;
+    conn->jc_size = 4096;
+    conn->jc_len = 0;
+    conn->jc_buf = malloc(conn->jc_size);
+    conn->jc_lastused = time(NULL);
+    conn->jc_out = NULL;
+    conn->jc_outlen = 0;
+    conn->jc_outpos = 0;
+    conn->jc_outsize = 0;
+    conn->jc_responding = 0;
+    conn->jc_keepalive = 0;
+    conn->jc_stream = NULL;
+    conn->jc_after = NULL;
+    conn->jc_nitems = 0;
+    if (conn->jc_buf == NULL ||
+        fcntl(msgsock, F_SETFL, fcntl(msgsock, F_GETFL) | O_NONBLOCK) != 0 ||
+        mainloop_register("jsonrpc-conn", wf_jsonrpc_conn, (void *) conn,
+                          msgsock, RPC_IDLE_CHECK, 0) != 0) {
+        spin_log(LOG_WARNING, "Unable to handle JSON RPC connection\n");
+        close(msgsock);
+        free(conn->jc_buf);
+        free(conn);
+        return;
     }
+    mainloop_set_closefunc(msgsock, cf_jsonrpc_conn);
+    n_jsonrpc_conns++;
 }
 
 
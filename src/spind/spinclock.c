@@ -0,0 +1,108 @@
+
+#include "spinclock.h"
+#include "spin_log.h"
+
+/*
+ * Periodic work in replay mode
+ */
+#define MAXCLOCKTIMERS 8
+
+/*
+ * When the event time jumps ahead (e.g. over a gap in the capture), a timer
+ * runs at most this many times to catch up
+ */
+#define CLOCK_CATCHUP_MAX 64
+
+static struct clock_timer {
+    char *      ct_name;        /* Name of module for debugging */
+    workfunc    ct_wf;          /* The to-be-called work function */
+    void *      ct_wfarg;       /* Call back argument */
+    uint64_t    ct_interval;    /* In microseconds */
+    uint64_t    ct_next;        /* Event time of the next run, 0 if unset */
+} clock_timers[MAXCLOCKTIMERS];
+static int n_clock_timers;
+
+static int replay_mode;
+static uint64_t replay_now;     /* In microseconds */
+
+void
+spin_clock_init(int replay)
+{
+    replay_mode = replay;
+    replay_now = 0;
+    n_clock_timers = 0;
+}
+
+int
+spin_clock_replay(void)
+{
+    return replay_mode;
+}
+
+time_t
+spin_clock_now(void)
+{
+    if (!replay_mode) {
+        return time(NULL);
+    }
+    return replay_now / 1000000;
+}
+
+static void
+clock_timer_run(struct clock_timer *ct)
+{
+    uint64_t missed;
+
+    // The first event starts the timer
+    if (ct->ct_next == 0) {
+        ct->ct_next = replay_now + ct->ct_interval;
+        return;
+    }
+    if (ct->ct_next > replay_now) {
+        return;
+    }
+    missed = (replay_now - ct->ct_next) / ct->ct_interval + 1;
+    if (missed > CLOCK_CATCHUP_MAX) {
+        ct->ct_next += (missed - CLOCK_CATCHUP_MAX) * ct->ct_interval;
+    }
+    while (ct->ct_next <= replay_now) {
+        ct->ct_wf(ct->ct_wfarg, 0, 1);
+        ct->ct_next += ct->ct_interval;
+    }
+}
+
+void
+spin_clock_event(uint64_t timestamp)
+{
+    int i;
+
+    if (!replay_mode || timestamp <= replay_now) {
+        return;
+    }
+    replay_now = timestamp;
+    for (i = 0; i < n_clock_timers; i++) {
+        clock_timer_run(&clock_timers[i]);
+    }
+}
+
+int
+spin_clock_register(char *name, workfunc wf, void *arg, int interval)
+{
+    struct clock_timer *ct;
+
+    if (!replay_mode) {
+        return mainloop_register(name, wf, arg, 0, interval, 1);
+    }
+
+    if (n_clock_timers == MAXCLOCKTIMERS || interval <= 0) {
+        spin_log(LOG_ERR, "Cannot register %s with the replay clock\n", name);
+        return 1;
+    }
+    ct = &clock_timers[n_clock_timers++];
+    ct->ct_name = name;
+    ct->ct_wf = wf;
+    ct->ct_wfarg = arg;
+    ct->ct_interval = (uint64_t)interval * 1000;
+    ct->ct_next = 0;
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef SPINCLOCK_H
+#define SPINCLOCK_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+#include "mainloop.h"
+
+/*
+ * The clock for everything in spind that depends on the time of events:
+ * flow windows, node timestamps and cleanup, DNS TTLs, and the idle
+ * periods of device flows.
+ *
+ * Normally this is simply the wall clock. In replay mode, the clock only
+ * moves with the timestamps of incoming events (see extsrc.h), and the
+ * periodic work registered with spin_clock_register() runs whenever the
+ * event time passes its next deadline, instead of on a mainloop timer.
+ * Replaying the same capture then gives the same results, no matter how
+ * fast it is fed to spind.
+ */
+
+void spin_clock_init(int replay);
+int spin_clock_replay(void);
+
+/*
+ * Current time, in seconds since the epoch. In replay mode, this is the
+ * time of the latest event (0 before the first one).
+ */
+time_t spin_clock_now(void);
+
+/*
+ * To be called for every event, with its timestamp in microseconds since
+ * the epoch (EXTSRC_TIMESTAMP_NONE if unknown). In replay mode, this
+ * advances the clock (it never goes back) and runs any periodic work that
+ * has become due.
+ */
+void spin_clock_event(uint64_t timestamp);
+
+/*
+ * Registers work that should be done every interval milliseconds; in
+ * normal mode, this is a mainloop_register() without a file descriptor.
+ * The work function is called with data 0 and timeout 1.
+ */
+int spin_clock_register(char *name, workfunc wf, void *arg, int interval);
+
+#endif
@@ -12,6 +12,7 @@
 #include "core2pubsub.h"
 #include "dnshooks.h"
 #include "extsrc.h"
+#include "feedimport.h"
 #include "ipl.h"
 #include "mainloop.h"
 #include "nflogroutines.h"
@@ -19,6 +20,7 @@
 #include "rpc_calls.h"
 #include "rpc_json.h"
 #include "spin_config.h"
+#include "spinclock.h"
 #include "spinhook.h"
 #include "spin_log.h"
 #include "statistics.h"
@@ -189,12 +191,12 @@ report_block(int af, int proto, uint8_t *src_addr, uint8_t *dest_addr, unsigned
 }
 
 /* Worker function to regularly synchronize the ip lists
- * (see spin_list.h) to persistent storage
+ * (see spin_list.h) to persistent storage; changes are appended
+ * to a journal right away, this makes them durable in one go
  */
 void wf_ipl(void *arg, int data, int timeout) {
     int i;
     struct list_info *lip;
-    char *fname;
     struct list_info* ipl_list_ar = get_spin_iplists();
 
     if (timeout) {
@@ -202,8 +204,7 @@ void wf_ipl(void *arg, int data, int timeout) {
         for (i=0; i<N_IPLIST; i++) {
             lip = &ipl_list_ar[i];
             if (lip->li_modified) {
-                fname = ipl_filename(lip);
-                store_ip_tree(lip->li_tree, fname);
+                ipl_sync(lip);
                 lip->li_modified = 0;
             }
         }
@@ -280,31 +281,49 @@ void print_help() {
     printf("-o\t\t\tlog to stdout instead of syslog\n");
     printf("-P\t\t\tenable passive mode\n");
     printf("-p <port number>\tPort number of the MQTT server\n");
+    printf("-R\t\t\tuse the replay clock (time of extsrc events; needs -P)\n");
     printf("-v\t\t\tprint the version of spind and exit\n");
 }
 
+// At most this many nodes are looked at per cleanup run; the rest
+// is left for the next runs
+#define NODE_EXPIRE_BUDGET 1000
+
 // Worker function to cleanup cache, gets called regularly
 void node_cache_clean_wf() {
     // should we make this configurable?
     const uint32_t node_cache_retain_seconds = spinconfig_node_cache_retain_time();
-    static int runcounter;
-    uint32_t older_than = time(NULL) - node_cache_retain_seconds;
+    uint32_t now = spin_clock_now();
 
     spinhook_clean(node_cache);
-    runcounter++;
-    if (runcounter > 3) {
-        node_cache_clean(node_cache, older_than);
-        runcounter = 0;
+    // (in replay mode, the clock is 0 until the first event)
+    if (now > node_cache_retain_seconds) {
+        node_cache_expire(node_cache, now - node_cache_retain_seconds, NODE_EXPIRE_BUDGET);
+    }
+}
+
+// At most this many nodes are looked at per eviction run; when most
+// nodes are in use, the next runs go on with the rest
+#define NODE_EVICT_BUDGET 200
+
+// Worker function that keeps the cache within its size
+void node_cache_evict_wf() {
+    int max_nodes = spinconfig_node_cache_max_nodes();
+
+    if (max_nodes > 0) {
+        node_cache_evict(node_cache, max_nodes, NODE_EVICT_BUDGET);
     }
 }
 
 #define CLEAN_TIMEOUT 15000
+#define EVICT_TIMEOUT 1000
 
 void init_cache(enum arp_table_backend backend) {
     dns_cache = dns_cache_create();
     node_cache = node_cache_create(backend);
 
-    mainloop_register("node_cache_clean", node_cache_clean_wf, (void *) 0, 0, CLEAN_TIMEOUT, 1);
+    spin_clock_register("node_cache_clean", node_cache_clean_wf, (void *) 0, CLEAN_TIMEOUT);
+    spin_clock_register("node_cache_evict", node_cache_evict_wf, (void *) 0, EVICT_TIMEOUT);
 }
 
 void cleanup_cache() {
@@ -328,8 +347,9 @@ int main(int argc, char** argv) {
 #endif
     enum arp_table_backend arp_backend = ARP_TABLE_LINUX;
     int passive_mode = 0;
+    int replay_clock = 0;
 
-    while ((c = getopt (argc, argv, "c:Cde:E:f:hj:lm:oPp:v")) != -1) {
+    while ((c = getopt (argc, argv, "c:Cde:E:f:hj:lm:oPp:Rv")) != -1) {
         switch (c) {
         case 'c':
             config_file = optarg;
@@ -390,6 +410,9 @@ int main(int argc, char** argv) {
             }
             mosq_websocket_port = mosq_port + 1;
             break;
+        case 'R':
+            replay_clock = 1;
+            break;
         case 'v':
             print_version();
             exit(0);
@@ -406,6 +429,12 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
+    if (replay_clock && !passive_mode) {
+        fprintf(stderr, "Error: the replay clock can only be used in passive mode\n");
+        print_help();
+        exit(1);
+    }
+
     // Set up logging based on defaults and command line, reinitialize
     // after reading config file
     spin_log_init(use_syslog, log_stdout, log_filename, log_verbosity, "spind");
@@ -452,8 +481,12 @@ int main(int argc, char** argv) {
     if (passive_mode) {
         spin_log(LOG_INFO, "Passive mode enabled\n");
     }
+    if (replay_clock) {
+        spin_log(LOG_INFO, "Replay clock enabled; time follows the extsrc events\n");
+    }
 
     init_mainloop();
+    spin_clock_init(replay_clock);
 
     SPIN_STAT_START();
 
@@ -506,6 +539,7 @@ int main(int argc, char** argv) {
 
     stop:
     cleanup_cache();
+    cleanup_feedimport();
     cleanup_core2block();
 #ifndef PASSIVE_MODE_ONLY
     if (!passive_mode) {
@@ -46,6 +46,24 @@ spin_data_ipar(tree_t *iptree) {
     return arobj;
 }
 
+// IP lists, which may contain networks too
+spin_data
+spin_data_iptrie(iptrie_t *trie) {
+    cJSON *arobj, *strobj;
+    iptrie_node_t* cur;
+    char ip_str[SPIN_PREFIXSTRLEN];
+
+    arobj = cJSON_CreateArray();
+    cur = iptrie_first(trie);
+    while (cur != NULL) {
+        spin_ntop_prefix(ip_str, &cur->prefix, SPIN_PREFIXSTRLEN);
+        strobj = cJSON_CreateString(ip_str);
+        cJSON_AddItemToArray(arobj, strobj);
+        cur = iptrie_next(trie, cur);
+    }
+    return arobj;
+}
+
 spin_data
 spin_data_node(node_t* node) {
     cJSON *nodeobj;
@@ -118,40 +136,136 @@ spin_data_devicelist(node_cache_t *node_cache) {
     return node_ar_obj;
 }
 
+/*
+ * Paged results are objects of the form
+ *   { "items": [ ... ], "next": <cursor> }
+ * where "next" is only present if there are more items; passing its
+ * value as the 'after' argument of the next call returns the next page.
+ */
+static spin_data
+spin_data_page(cJSON *items, const char *next) {
+    cJSON *pageobj;
+
+    pageobj = cJSON_CreateObject();
+    cJSON_AddItemToObject(pageobj, "items", items);
+    if (next != NULL) {
+        cJSON_AddStringToObject(pageobj, "next", next);
+    }
+    return pageobj;
+}
+
+static int
+page_limit(int limit) {
+    if (limit <= 0) {
+        return SPIN_DATA_PAGE_DEFAULT;
+    }
+    if (limit > SPIN_DATA_PAGE_MAX) {
+        return SPIN_DATA_PAGE_MAX;
+    }
+    return limit;
+}
+
+// The cursor for the device list is the MAC address of the last device
+spin_data
+spin_data_devicelist_page(node_cache_t *node_cache, const char *after, int limit) {
+    cJSON *node_ar_obj;
+    const char *next;
+    STAT_COUNTER(ctr, spindata-devicelist-page, STAT_TOTAL);
+
+    STAT_VALUE(ctr, 1);
+    node_ar_obj = cJSON_CreateArray();
+    next = node_callback_devices_page(node_cache, after, page_limit(limit), device_node, (void *) node_ar_obj);
+
+    return spin_data_page(node_ar_obj, next);
+}
+
+static spin_data
+spin_data_devflow(devflow_key_t *flow_key, devflow_t *dfp) {
+    cJSON *flow_obj;
+
+    flow_obj = cJSON_CreateObject();
+    cJSON_AddNumberToObject(flow_obj, "to", flow_key->dst_node_id);
+    cJSON_AddNumberToObject(flow_obj, "dst_port", flow_key->dst_port);
+    cJSON_AddNumberToObject(flow_obj, "icmp_type", flow_key->icmp_type);
+    if (dfp->dvf_blocked) {
+        cJSON_AddNumberToObject(flow_obj, "blocked", 1);
+    } else {
+        cJSON_AddNumberToObject(flow_obj, "packets", dfp->dvf_packets);
+        cJSON_AddNumberToObject(flow_obj, "bytes", dfp->dvf_bytes);
+        cJSON_AddNumberToObject(flow_obj, "lastseen", dfp->dvf_lastseen);
+    }
+    return flow_obj;
+}
+
 spin_data
 spin_data_flowlist(node_t *node) {
-    cJSON *flow_ar_obj, *flow_obj;
-    //int *nodenump;
-    devflow_key_t* flow_key;
-    devflow_t *dfp;
+    cJSON *flow_ar_obj;
     tree_entry_t* cur;
 
     flow_ar_obj = cJSON_CreateArray();
     if (node->device) {
         cur = tree_first(node->device->dv_flowtree);
         while (cur != NULL) {
-            flow_key = (devflow_key_t *) cur->key;
-            dfp = (devflow_t *) cur->data;
-            flow_obj = cJSON_CreateObject();
-            cJSON_AddNumberToObject(flow_obj, "to", flow_key->dst_node_id);
-            cJSON_AddNumberToObject(flow_obj, "dst_port", flow_key->dst_port);
-            cJSON_AddNumberToObject(flow_obj, "icmp_type", flow_key->icmp_type);
-            if (dfp->dvf_blocked) {
-                cJSON_AddNumberToObject(flow_obj, "blocked", 1);
-            } else {
-                cJSON_AddNumberToObject(flow_obj, "packets", dfp->dvf_packets);
-                cJSON_AddNumberToObject(flow_obj, "bytes", dfp->dvf_bytes);
-                cJSON_AddNumberToObject(flow_obj, "lastseen", dfp->dvf_lastseen);
-            }
-
-            cJSON_AddItemToArray(flow_ar_obj, flow_obj);
-
+            cJSON_AddItemToArray(flow_ar_obj,
+                spin_data_devflow((devflow_key_t *) cur->key, (devflow_t *) cur->data));
             cur = tree_next(cur);
         }
     }
     return flow_ar_obj;
 }
 
+/*
+ * The cursor for the flow list is the key of the last flow, written
+ * as "<to>/<dst_port>/<icmp_type>"
+ *
+ * Returns NULL if the cursor cannot be parsed
+ */
+spin_data
+spin_data_flowlist_page(node_t *node, const char *after, int limit) {
+    cJSON *flow_ar_obj;
+    devflow_key_t after_key;
+    tree_entry_t* cur;
+    char next[64];
+    int nfound;
+    STAT_COUNTER(ctr, spindata-flowlist-page, STAT_TOTAL);
+
+    STAT_VALUE(ctr, 1);
+    limit = page_limit(limit);
+
+    memset(&after_key, 0, sizeof(after_key));
+    if (after != NULL && *after != '\0') {
+        if (sscanf(after, "%d/%d/%d", &after_key.dst_node_id,
+                   &after_key.dst_port, &after_key.icmp_type) != 3) {
+            return NULL;
+        }
+    }
+
+    flow_ar_obj = cJSON_CreateArray();
+    if (node->device == NULL) {
+        return spin_data_page(flow_ar_obj, NULL);
+    }
+
+    if (after != NULL && *after != '\0') {
+        cur = tree_find_next(node->device->dv_flowtree, sizeof(after_key), &after_key);
+    } else {
+        cur = tree_first(node->device->dv_flowtree);
+    }
+    nfound = 0;
+    while (cur != NULL) {
+        cJSON_AddItemToArray(flow_ar_obj,
+            spin_data_devflow((devflow_key_t *) cur->key, (devflow_t *) cur->data));
+        nfound++;
+        if (nfound == limit && tree_next(cur) != NULL) {
+            after_key = *(devflow_key_t *) cur->key;
+            snprintf(next, sizeof(next), "%d/%d/%d", after_key.dst_node_id,
+                     after_key.dst_port, after_key.icmp_type);
+            return spin_data_page(flow_ar_obj, next);
+        }
+        cur = tree_next(cur);
+    }
+    return spin_data_page(flow_ar_obj, NULL);
+}
+
 static node_t *lookup_ip(node_cache_t *node_cache, ip_t *ip, pkt_info_t *pkt_info, char *sd) {
     node_t *result;
 
@@ -1,6 +1,7 @@
 #include <assert.h>
 
 #include "core2pubsub.h"
+#include "spinclock.h"
 #include "spind.h"
 #include "spin_log.h"
 #include "statistics.h"
@@ -28,8 +29,6 @@ devflow_t *spinhook_get_devflow(device_t *dev, node_t *node, int dst_port, int i
         dfp->dvf_packets = 0;
         dfp->dvf_bytes = 0;
         dfp->dvf_lastseen = 0;
-        dfp->dvf_idleperiods = 0;
-        dfp->dvf_activelastperiod = 0;
 
         new_flow_key = malloc(sizeof(devflow_key_t));
         new_flow_key->dst_node_id = nodeid;
@@ -40,6 +39,8 @@ devflow_t *spinhook_get_devflow(device_t *dev, node_t *node, int dst_port, int i
         // Own the storage here
         tree_add(dev->dv_flowtree, sizeof(devflow_key_t), new_flow_key, sizeof(devflow_t), dfp, 0);
         dev->dv_nflows++;
+        // a new flow counts as active, also if it has no traffic yet
+        twheel_add(dev->dv_expiry, spin_clock_now(), &find_flow_key);
         // Increase node reference count
         node->references++;
     } else {
@@ -64,7 +65,6 @@ do_traffic(device_t *dev, node_t *node, int cnt, int bytes, uint32_t timestamp,
     dfp->dvf_packets += cnt;
     dfp->dvf_bytes += bytes;
     dfp->dvf_lastseen = timestamp;
-    dfp->dvf_activelastperiod = 1;
 }
 
 // Checks if there is a node with the given mac already, and if so,
@@ -175,56 +175,83 @@ device_flow_remove(node_cache_t *node_cache, tree_t *ftree, tree_entry_t* leaf)
 // (i.e. remote node, dst port, icmp_type combinations)
 #define MIN_DEV_NEIGHBOURS  10
 // Once more than MIN_DEV_NEIGHBOURS flows are stored,
-// we remove them based on idle time. This is
-// MAX_IDLE_PERIODS * CLEAN_TIMEOUT from spind (which is currently
-// 15000 ms). To set it to, say half an hour, this value should be
-// 120.
-#define MAX_IDLE_PERIODS    120
+// we remove the ones that have not been active for this
+// many seconds
+#define MAX_IDLE_TIME       1800
+// An idle flow that is kept because there are only a few is
+// looked at again after this many seconds
+#define IDLE_RECHECK        60
+// At most this many flows of a device are looked at per run
+#define DEVICE_CLEAN_BUDGET 1000
+
+struct device_clean_arg {
+    node_cache_t *node_cache;
+    device_t *dev;
+    uint32_t older_than;
+    int removed;
+};
 
 static void
-device_clean(node_cache_t *node_cache, node_t *node, void *ap) {
-    device_t *dev;
-    tree_entry_t *leaf, *nextleaf;
-    int remnodenum;
+device_flow_expire(uint32_t time, void *data, void *arg) {
+    struct device_clean_arg *ca = (struct device_clean_arg *) arg;
+    device_t *dev = ca->dev;
+    devflow_key_t *flow_key = (devflow_key_t *) data;
+    tree_entry_t *leaf;
     devflow_t *dfp;
-    int removed = 0;
-    STAT_COUNTER(ctr, device-clean, STAT_TOTAL);
 
-    dev = node->device;
-    assert(dev != NULL);
-
-    spin_log(LOG_DEBUG, "Flows(%d) of node %d:\n", dev->dv_nflows, node->id);
-    leaf = tree_first(dev->dv_flowtree);
-    while (leaf != NULL) {
-        nextleaf = tree_next(leaf);
-        remnodenum = * (int *) leaf->key;
-        dfp = (devflow_t *) leaf->data;
-        spin_log(LOG_DEBUG, "to node %d: %d %d %d %d\n", remnodenum,
-            dfp->dvf_packets, dfp->dvf_bytes,
-            dfp->dvf_idleperiods, dfp->dvf_activelastperiod);
+    leaf = tree_find(dev->dv_flowtree, sizeof(devflow_key_t), flow_key);
+    if (leaf == NULL) {
+        // removed or merged in the meantime
+        return;
+    }
+    dfp = (devflow_t *) leaf->data;
+    if (dfp->dvf_lastseen >= ca->older_than) {
+        // active since; look again once that is old enough
+        twheel_add(dev->dv_expiry, dfp->dvf_lastseen, flow_key);
+        return;
+    }
+    if (dev->dv_nflows <= MIN_DEV_NEIGHBOURS) {
+        twheel_add(dev->dv_expiry, ca->older_than + IDLE_RECHECK, flow_key);
+        return;
+    }
+    spin_log(LOG_DEBUG, "Idle flow to %d: %d %d %u\n", flow_key->dst_node_id,
+        dfp->dvf_packets, dfp->dvf_bytes, dfp->dvf_lastseen);
+    device_flow_remove(ca->node_cache, dev->dv_flowtree, leaf);
+    dev->dv_nflows--;
+    ca->removed++;
+}
 
-        if (dfp->dvf_activelastperiod) {
-            dfp->dvf_idleperiods = -1;
-            dfp->dvf_activelastperiod = 0;
-        }
+static void
+device_clean(node_cache_t *node_cache, node_t *node, void *ap) {
+    struct device_clean_arg ca;
+    STAT_COUNTER(ctr, device-clean, STAT_TOTAL);
 
-        dfp->dvf_idleperiods++;
-        if (dev->dv_nflows > MIN_DEV_NEIGHBOURS && dfp->dvf_idleperiods > MAX_IDLE_PERIODS) {
-            device_flow_remove(node_cache, dev->dv_flowtree, leaf);
-            dev->dv_nflows--;
-            removed++;
-        }
+    assert(node->device != NULL);
 
-        leaf = nextleaf;
+    ca.node_cache = node_cache;
+    ca.dev = node->device;
+    ca.older_than = * (uint32_t *) ap;
+    ca.removed = 0;
+    // only the flows that have been idle long enough come out
+    twheel_advance(ca.dev->dv_expiry, ca.older_than - 1, device_flow_expire, &ca, DEVICE_CLEAN_BUDGET);
+    if (ca.removed > 0) {
+        spin_log(LOG_DEBUG, "Removed %d idle flows of node %d, %d left\n", ca.removed, node->id, ca.dev->dv_nflows);
     }
 
-    STAT_VALUE(ctr, removed);
+    STAT_VALUE(ctr, ca.removed);
 }
 
 void
 spinhook_clean(node_cache_t *node_cache) {
+    uint32_t now = spin_clock_now();
+    uint32_t older_than;
 
-    node_callback_devices(node_cache, device_clean, NULL);
+    if (now <= MAX_IDLE_TIME) {
+        // no events yet (in replay mode)
+        return;
+    }
+    older_than = now - MAX_IDLE_TIME;
+    node_callback_devices(node_cache, device_clean, &older_than);
 }
 
 void
@@ -276,8 +303,9 @@ node_merge_flow(node_cache_t *node_cache, node_t *node, void *ap) {
                 destdfp = (devflow_t *) dstleaf->data;
                 destdfp->dvf_packets += dfp->dvf_packets;;
                 destdfp->dvf_bytes += dfp->dvf_bytes;
-                destdfp->dvf_idleperiods = 0;
-                destdfp->dvf_activelastperiod = 1;
+                if (destdfp->dvf_lastseen < dfp->dvf_lastseen) {
+                    destdfp->dvf_lastseen = dfp->dvf_lastseen;
+                }
 
                 free(flow_key);
                 free(dfp);
@@ -291,6 +319,8 @@ node_merge_flow(node_cache_t *node_cache, node_t *node, void *ap) {
                 devflow_key_t* dst_flow_key = flow_key;
                 dst_flow_key->dst_node_id = dstnodenum;
                 tree_add(dev->dv_flowtree, sizeof(int), dst_flow_key, sizeof(devflow_t), dfp, 0);
+                // the entry for the old key is ignored when it comes out
+                twheel_add(dev->dv_expiry, spin_clock_now(), dst_flow_key);
                 spin_log(LOG_DEBUG, "Added new leaf\n");
                 dest_node->references++;
             }
@@ -1,5 +1,6 @@
  
 #include "mainloop.h"
+#include "rpc_common.h"
 #include "spindata.h"
 #include "statistics.h"
 
@@ -7,14 +8,13 @@
 
 void core2pubsub_publish_chan(char *, spin_data, int);
 
-static void
-statpub(stat_p sp) {
-    char tpbuf[100];
+static cJSON *
+statobj_create(stat_p sp) {
     cJSON *statobj, *membobj;
 
     statobj = cJSON_CreateObject();
     if (statobj == 0) {
-        return;
+        return 0;
     }
 
     membobj = cJSON_CreateStringReference(sp->stat_module);
@@ -27,6 +27,19 @@ statpub(stat_p sp) {
     cJSON_AddNumberToObject(statobj, "value", sp->stat_value);
     cJSON_AddNumberToObject(statobj, "count", sp->stat_count);
 
+    return statobj;
+}
+
+static void
+statpub(stat_p sp) {
+    char tpbuf[100];
+    cJSON *statobj;
+
+    statobj = statobj_create(sp);
+    if (statobj == 0) {
+        return;
+    }
+
     sprintf(tpbuf, "SPIN/stat/%s/%s", sp->stat_module, sp->stat_name);
 
     core2pubsub_publish_chan(tpbuf, statobj, 1);
@@ -49,10 +62,31 @@ wf_stat(void * arg, int data, int timeout) {
     }
 }
 
+/*
+ * Returns the current value of all counters, unlike the MQTT channel
+ * which only gets them every 30 seconds; used by e.g. spin-bench
+ */
+static int
+get_stats_func(void *cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
+    cJSON *stats, *statobj;
+    stat_p sp;
+
+    stats = cJSON_CreateArray();
+    for (sp = spin_stat_chain; sp->stat_module; sp = sp->stat_next) {
+        statobj = statobj_create(sp);
+        if (statobj != 0) {
+            cJSON_AddItemToArray(stats, statobj);
+        }
+    }
+    result->rpca_cvalue = stats;
+    return 0;
+}
+
 void
 spin_stat_start() {
 
     mainloop_register("Statistics", wf_stat, (void *) 0, 0, 30000, 1);
+    rpc_register("get_stats", get_stats_func, (void *) 0, 0, 0, RPCAT_COMPLEX);
 }
 
 void
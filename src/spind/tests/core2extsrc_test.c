@@ -0,0 +1,223 @@
+#include "config.h"
+
+#include "core2extsrc.h"
+#include "dnshooks.h"
+#include "extsrc.h"
+#include "extsrc_ring.h"
+#include "mainloop.h"
+#include "process_pkt_info.h"
+#include "spinclock.h"
+#include "spind.h"
+#include "spindata.h"
+
+#include "test_helper.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/*
+ * mainloop_run() can only be run once per process, so the cases run side
+ * by side, and the driver ends the mainloop when they are all done
+ */
+#define TEST_DEADLINE 5
+
+// the rest of spind, which is not part of the test
+void dns_query_hook(dns_pkt_info_t *dns_pkt, int response_size, uint8_t *response) {}
+void dns_answer_hook(dns_pkt_info_t *dns_pkt) {}
+void maybe_sendflow(flow_list_t *flow_list, time_t now) {}
+void process_pkt_info(node_cache_t* node_cache, flow_list_t* flow_list, trafficfunc traffic_hook, int local_mode, pkt_info_t* pkt_info) {}
+void spin_clock_event(uint64_t timestamp) {}
+time_t spin_clock_now(void) { return time(NULL); }
+void spinhook_nodedeleted(node_cache_t *node_cache, node_t *node) {}
+void spinhook_nodesmerged(node_cache_t *node_cache, node_t *dest_node, node_t *src_node) {}
+
+static char socket_path[64];
+static struct timeval start;
+
+#ifdef HAVE_SYS_EVENTFD_H
+static struct extsrc_ring *dead_ring = NULL;
+static struct extsrc_ring *live_ring = NULL;
+static char dead_name[32];
+static char live_name[32];
+static int dead_seen = 0;
+static double dead_gone = 0;
+static int live_left = 0;
+static struct extsrc_ring unsealed_ring;
+
+static double
+elapsed() {
+    struct timeval now, diff;
+
+    gettimeofday(&now, 0);
+    timersub(&now, &start, &diff);
+    return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+// Returns the pid of a process that has exited (and has been reaped)
+static pid_t
+dead_pid() {
+    pid_t pid = fork();
+
+    assert(pid >= 0);
+    if (pid == 0) {
+        _exit(0);
+    }
+    assert(waitpid(pid, NULL, 0) == pid);
+    assert(kill(pid, 0) == -1 && errno == ESRCH);
+    return pid;
+}
+
+// Hands the ring to spind, like spin-pcap-reader does
+static void
+send_ring(struct extsrc_ring *ring) {
+    struct extsrc_ring_setup setup;
+    char data[EXTSRC_MSG_HDR_SIZE + sizeof(setup)];
+    struct sockaddr_un addr;
+    struct msghdr mh;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    int fds[2];
+    int fd;
+
+    setup.version = EXTSRC_RING_VERSION;
+    setup.size = ring->size;
+    extsrc_hdr_write(data, EXTSRC_MSG_TYPE_RING, sizeof(setup));
+    memcpy(data + EXTSRC_MSG_HDR_SIZE, &setup, sizeof(setup));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    memset(&mh, 0, sizeof(mh));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    mh.msg_name = &addr;
+    mh.msg_namelen = sizeof(addr);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    fds[0] = ring->mem_fd;
+    fds[1] = ring->event_fd;
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    assert(fd >= 0);
+    assertf(sendmsg(fd, &mh, 0) == (ssize_t) sizeof(data), "sendmsg to %s", socket_path);
+    close(fd);
+}
+
+// Returns a copy of ring in memory that is not sealed, and that could
+// thus be made smaller while spind reads it
+static void
+unsealed_copy(struct extsrc_ring *ring, struct extsrc_ring *copy, pid_t pid) {
+    struct extsrc_ring_hdr *hdr;
+
+    *copy = *ring;
+    copy->mem_fd = memfd_create("unsealed", MFD_CLOEXEC);
+    assert(copy->mem_fd >= 0);
+    assert(ftruncate(copy->mem_fd, ring->size) == 0);
+    hdr = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, copy->mem_fd, 0);
+    assert(hdr != MAP_FAILED);
+    memcpy(hdr, ring->hdr, ring->size);
+    hdr->producer_pid = pid;
+    munmap(hdr, ring->size);
+    copy->hdr = NULL;
+    copy->event_fd = dup(ring->event_fd);
+    assert(copy->event_fd >= 0);
+}
+
+// Returns 1 if spind has a client with the given name
+static int
+has_client(const char *name) {
+    spin_data clients = extsrc_clients_json();
+    spin_data client, cname;
+    int found = 0;
+
+    cJSON_ArrayForEach(client, clients) {
+        cname = cJSON_GetObjectItemCaseSensitive(client, "name");
+        if (cJSON_IsString(cname) && strcmp(cname->valuestring, name) == 0) {
+            found = 1;
+        }
+    }
+    cJSON_Delete(clients);
+    return found;
+}
+
+// a ring whose producer went away without closing it is torn down by
+// the periodic check; one whose producer is still there is not. A ring
+// in memory that is not sealed is not accepted at all.
+static void
+check_rings() {
+    if (dead_ring == NULL) {
+        dead_ring = extsrc_ring_create(EXTSRC_RING_SLOTS);
+        assert(dead_ring != NULL);
+        dead_ring->hdr->producer_pid = dead_pid();
+        snprintf(dead_name, sizeof(dead_name), "ring (pid %d)", (int) dead_ring->hdr->producer_pid);
+        send_ring(dead_ring);
+
+        live_ring = extsrc_ring_create(EXTSRC_RING_SLOTS);
+        assert(live_ring != NULL);
+        snprintf(live_name, sizeof(live_name), "ring (pid %d)", (int) getpid());
+        send_ring(live_ring);
+
+        // (pid 1 is always there)
+        unsealed_copy(live_ring, &unsealed_ring, 1);
+        send_ring(&unsealed_ring);
+        close(unsealed_ring.mem_fd);
+        close(unsealed_ring.event_fd);
+        return;
+    }
+    if (!dead_seen) {
+        dead_seen = has_client(dead_name);
+    } else if (dead_gone == 0 && !has_client(dead_name)) {
+        dead_gone = elapsed();
+        live_left = has_client(live_name);
+    }
+}
+
+static void
+wf_driver(void *arg, int data, int timeout) {
+    check_rings();
+    if (dead_gone != 0 || elapsed() > TEST_DEADLINE) {
+        mainloop_end();
+    }
+}
+#endif
+
+int main(int argc, char** argv) {
+#ifdef HAVE_SYS_EVENTFD_H
+    snprintf(socket_path, sizeof(socket_path), "/tmp/core2extsrc_test.%d", (int) getpid());
+
+    init_mainloop();
+    assert(init_core2extsrc(NULL, NULL, NULL, socket_path, NULL) == 0);
+    mainloop_register("driver", wf_driver, NULL, 0, 50, 1);
+
+    gettimeofday(&start, 0);
+    mainloop_run();
+
+    assertf(dead_seen, "ring not accepted");
+    assertf(dead_gone != 0, "ring of dead producer still there after %d seconds", TEST_DEADLINE);
+    assertf(live_left, "ring of live producer torn down");
+    assertf(!has_client("ring (pid 1)"), "ring in unsealed memory accepted");
+
+    extsrc_ring_destroy(dead_ring, 1);
+    extsrc_ring_destroy(live_ring, 1);
+    cleanup_core2extsrc();
+#endif
+    return 0;
+}
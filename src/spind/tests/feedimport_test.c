@@ -0,0 +1,148 @@
+#include "config.h"
+
+#include "feedimport.h"
+#include "ipfeed.h"
+#include "ipl.h"
+#include "mainloop.h"
+#include "spin_list.h"
+
+#include "test_helper.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+ * mainloop_run() can only be run once per process, so the cases run side
+ * by side, and the driver ends the mainloop when they are all done.
+ * The driver also measures how long the mainloop was kept from running
+ * it while a large feed was imported.
+ */
+#define TEST_DEADLINE 30
+#define FEED_SIZE 500000
+#define DRIVER_INTERVAL 10
+#define MAX_STALL 0.2
+
+/*
+ * the rest of spind, which is not part of the test; filling the ipsets
+ * (run in the child) takes as long as it does for a feed this size
+ */
+#define LOADFEED_TIME 1
+
+static int feedrules_loaded = -1;
+
+int c2b_loadfeed(int iplist, ipfeed_t *feed) { sleep(LOADFEED_TIME); return 1; }
+void c2b_feedrules(int iplist, int loaded) { feedrules_loaded = loaded; }
+
+static char directory[64];
+static char feed_name[128];
+static char missing_name[128];
+static struct timeval start;
+static int started = 0;
+static double last_tick = 0;
+static double max_stall = 0;
+
+static int feed_entries = -2;
+static int missing_entries = -2;
+
+static double
+elapsed() {
+    struct timeval now, diff;
+
+    gettimeofday(&now, 0);
+    timersub(&now, &start, &diff);
+    return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+static void
+write_feed(const char *name, int size) {
+    FILE *f;
+    int i;
+
+    f = fopen(name, "w");
+    assertf(f != NULL, "cannot create %s", name);
+    fprintf(f, "# test feed\n");
+    for (i = 0; i < size; i++) {
+        fprintf(f, "10.%d.%d.%d\n", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+    }
+    fclose(f);
+}
+
+static void
+feed_done(int iplist, int entries, void *arg) {
+    assert(arg == &feed_entries);
+    feed_entries = entries;
+}
+
+static void
+missing_done(int iplist, int entries, void *arg) {
+    assert(arg == &missing_entries);
+    missing_entries = entries;
+}
+
+// the imports are started from the mainloop, as spind does for an RPC
+static void
+start_imports() {
+    assert(feedimport_start(IPLIST_BLOCK, feed_name, feed_done, &feed_entries) == 0);
+    assert(feedimport_running(IPLIST_BLOCK));
+    assert(feedimport_start(IPLIST_BLOCK, feed_name, feed_done, &feed_entries) == 1);
+    assert(feedimport_start(IPLIST_ALLOW, missing_name, missing_done, &missing_entries) == 0);
+}
+
+static void
+wf_driver(void *arg, int data, int timeout) {
+    double now = elapsed();
+
+    if (!started) {
+        start_imports();
+        started = 1;
+    } else if (now - last_tick > max_stall) {
+        max_stall = now - last_tick;
+    }
+    last_tick = now;
+    if ((feed_entries != -2 && missing_entries != -2) || now > TEST_DEADLINE) {
+        mainloop_end();
+    }
+}
+
+int main(int argc, char** argv) {
+    struct list_info *block, *allow;
+
+    snprintf(directory, sizeof(directory), "/tmp/feedimport_test.%d", (int) getpid());
+    assert(mkdir(directory, 0700) == 0);
+    snprintf(feed_name, sizeof(feed_name), "%s/feed.txt", directory);
+    snprintf(missing_name, sizeof(missing_name), "%s/missing.txt", directory);
+    write_feed(feed_name, FEED_SIZE);
+
+    ipl_set_directory(directory);
+    block = get_spin_iplist(IPLIST_BLOCK);
+    allow = get_spin_iplist(IPLIST_ALLOW);
+    assert(block->li_feed == NULL);
+
+    init_mainloop();
+    mainloop_register("driver", wf_driver, NULL, 0, DRIVER_INTERVAL, 1);
+
+    gettimeofday(&start, 0);
+    mainloop_run();
+
+    // the import itself takes far longer than the mainloop was stalled
+    assert(last_tick > LOADFEED_TIME);
+    assertf(feed_entries == FEED_SIZE, "feed import gave %d entries", feed_entries);
+    assertf(max_stall < MAX_STALL, "mainloop stalled for %.3f seconds", max_stall);
+    assert(!feedimport_running(IPLIST_BLOCK));
+    assert(block->li_feed != NULL);
+    assert(ipfeed_entries(block->li_feed) == FEED_SIZE);
+    assert(feedrules_loaded == 1);
+
+    // a failed import leaves the list without a feed, as it was
+    assert(missing_entries == -1);
+    assert(!feedimport_running(IPLIST_ALLOW));
+    assert(allow->li_feed == NULL);
+
+    ipl_clear_feed(block);
+    unlink(feed_name);
+    assert(rmdir(directory) == 0);
+    cleanup_feedimport();
+    return 0;
+}
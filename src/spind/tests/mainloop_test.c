@@ -0,0 +1,136 @@
+#include "mainloop.h"
+
+#include "test_helper.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+ * mainloop_run() can only be run once per process, so the cases run side
+ * by side, and the driver ends the mainloop when they are all done
+ */
+#define TEST_DEADLINE 5
+
+static struct timeval start;
+static int late_registered = 0;
+static int late_fired = 0;
+static int late_errors = 0;
+static int sv[2];
+static int closed_arg = 0;
+static int closed = 0;
+static int sa[2];
+static int sb[2];
+static int sc[2] = { -1, -1 };
+static int stale_closed = 0;
+static int stale_data = 0;
+
+static double
+elapsed() {
+    struct timeval now, diff;
+
+    gettimeofday(&now, 0);
+    timersub(&now, &start, &diff);
+    return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+// a timer registered while the mainloop was running
+static void
+wf_late(void *arg, int data, int timeout) {
+    assert(timeout && !data);
+    late_fired++;
+}
+
+static void
+wf_data(void *arg, int data, int timeout) {
+    late_errors++;
+}
+
+static void
+cf_data(void *arg) {
+    closed_arg = * (int *) arg;
+    closed++;
+}
+
+static void
+wf_stale_c(void *arg, int data, int timeout) {
+    stale_data += data;
+}
+
+static void
+cf_stale_c(void *arg) {
+    stale_closed++;
+}
+
+/*
+ * Called in the same pass as the bad fd of b; the connection that takes
+ * its place must not get its events
+ */
+static void
+wf_stale_a(void *arg, int data, int timeout) {
+    char c;
+
+    assert(read(sa[0], &c, 1) == 1);
+    assert(mainloop_unregister(sb[0]) == 0);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sc) == 0);
+    mainloop_register("stale_c", wf_stale_c, NULL, sc[0], 0, 1);
+    mainloop_set_closefunc(sc[0], cf_stale_c);
+}
+
+static void
+wf_stale_b(void *arg, int data, int timeout) {
+    assertf(0, "work function called for the bad fd of b");
+}
+
+static void
+wf_driver(void *arg, int data, int timeout) {
+    if (!late_registered) {
+        mainloop_register("late", wf_late, NULL, 0, 50, 1);
+        // the fd goes bad behind the back of the mainloop
+        close(sv[0]);
+        late_registered = 1;
+        return;
+    }
+    if ((late_fired >= 3 && closed) || elapsed() > TEST_DEADLINE) {
+        mainloop_end();
+    }
+}
+
+int main(int argc, char** argv) {
+    static int connection = 42;
+
+    init_mainloop();
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    mainloop_register("data", wf_data, &connection, sv[0], 0, 1);
+    assert(mainloop_set_closefunc(sv[0], cf_data) == 0);
+    assert(mainloop_set_closefunc(sv[1], cf_data) == 1);
+    // both are up in the first pass: a has data, the fd of b is bad
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sa) == 0);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sb) == 0);
+    mainloop_register("stale_a", wf_stale_a, NULL, sa[0], 0, 1);
+    mainloop_register("stale_b", wf_stale_b, NULL, sb[0], 0, 1);
+    assert(write(sa[1], "x", 1) == 1);
+    close(sb[0]);
+    close(sb[1]);
+    mainloop_register("driver", wf_driver, NULL, 0, 20, 1);
+
+    gettimeofday(&start, 0);
+    mainloop_run();
+
+    assertf(late_fired >= 3, "late timer fired %d times", late_fired);
+    assertf(closed == 1, "close function called %d times", closed);
+    assert(closed_arg == 42);
+    assertf(late_errors == 0, "work function called %d times for a bad fd", late_errors);
+    assertf(sc[0] != -1, "stale_a not called");
+    assertf(stale_closed == 0, "new connection closed for the error of the old one");
+    assertf(stale_data == 0, "new connection got the events of the old one");
+    assert(mainloop_unregister(sc[0]) == 0);
+    close(sa[0]);
+    close(sa[1]);
+    close(sc[0]);
+    close(sc[1]);
+    // the registration is gone
+    assert(mainloop_unregister(sv[0]) == 1);
+    close(sv[1]);
+    return 0;
+}
@@ -0,0 +1,241 @@
+#include "mainloop.h"
+#include "rpc_json.h"
+
+#include "test_helper.h"
+
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * Built with a short RPC_IDLE_TIMEOUT and RPC_IDLE_CHECK, and small
+ * pages (RPC_STREAM_PAGE_SIZE) for streamed responses. mainloop_run()
+ * can only be run once per process, so the cases run side by side, and
+ * the driver ends the mainloop when they are all done.
+ */
+#define TEST_DEADLINE 10
+
+static char socket_path[64];
+static struct timeval start;
+static int idle_fd = -1;
+static double idle_dropped = 0;
+
+// a streamed response of many items, to a client that reads slowly
+#define STREAM_ITEMS 5000
+#define STREAM_STALL_TICKS 10
+static int stream_state = 0;
+static int stream_fd = -1;
+static int stream_ticks = 0;
+static int pages_fetched = 0;
+static int pages_while_stalled = 0;
+static char *stream_buf = NULL;
+static size_t stream_len = 0;
+static size_t stream_size = 0;
+
+// from rpc_calls.c, which is not part of the test
+void
+cleanup_rpcs() {
+}
+
+static double
+elapsed() {
+    struct timeval now, diff;
+
+    gettimeofday(&now, 0);
+    timersub(&now, &start, &diff);
+    return diff.tv_sec + diff.tv_usec / 1000000.0;
+}
+
+static int
+client_connect() {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    assertf(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0, "connect to %s", socket_path);
+    return fd;
+}
+
+// Returns 1 if the other side closed the connection
+static int
+client_closed(int fd) {
+    char buf[16];
+    ssize_t rv;
+
+    rv = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+    assertf(rv <= 0, "unexpected data on idle connection");
+    return rv == 0;
+}
+
+static rpc_arg_desc_t items_page_args[] = {
+    { "limit", RPCAT_INT },
+    { "after", RPCAT_STRING },
+};
+
+// items are numbered from 1; the cursor is the last one of the page
+static int
+items_page(void *cb, rpc_arg_val_t *args, rpc_arg_val_t *result) {
+    spin_data page, items;
+    char item[200];
+    char next[16];
+    int first = atoi(args[1].rpca_svalue) + 1;
+    int i;
+
+    assert(args[0].rpca_ivalue == RPC_STREAM_PAGE_SIZE);
+    pages_fetched++;
+    page = cJSON_CreateObject();
+    items = cJSON_AddArrayToObject(page, "items");
+    for (i = first; i < first + RPC_STREAM_PAGE_SIZE && i <= STREAM_ITEMS; i++) {
+        // long enough for the response not to fit in the socket buffers
+        snprintf(item, sizeof(item), "%d %0180d", i, 0);
+        cJSON_AddItemToArray(items, cJSON_CreateString(item));
+    }
+    if (i <= STREAM_ITEMS) {
+        snprintf(next, sizeof(next), "%d", i - 1);
+        cJSON_AddStringToObject(page, "next", next);
+    }
+    result->rpca_cvalue = page;
+    return 0;
+}
+
+static void
+client_send(int fd, const char *request) {
+    assert(send(fd, request, strlen(request), 0) == (ssize_t) strlen(request));
+}
+
+// Reads what is there; returns 1 if the other side closed the connection
+static int
+client_read(int fd) {
+    ssize_t rv;
+
+    while (1) {
+        if (stream_size - stream_len < 65536) {
+            stream_size = stream_size == 0 ? 65536 : 2 * stream_size;
+            stream_buf = realloc(stream_buf, stream_size);
+            assert(stream_buf != NULL);
+        }
+        rv = recv(fd, stream_buf + stream_len, stream_size - stream_len - 1, MSG_DONTWAIT);
+        if (rv < 0) {
+            assert(errno == EAGAIN || errno == EWOULDBLOCK);
+            return 0;
+        }
+        if (rv == 0) {
+            return 1;
+        }
+        stream_len += rv;
+        stream_buf[stream_len] = '\0';
+    }
+}
+
+static void
+check_stream_response() {
+    spin_data response, result, item;
+    int i = 0;
+
+    assert(stream_buf[stream_len - 1] == '\n');
+    response = cJSON_Parse(stream_buf);
+    assertf(response != NULL, "streamed response is not JSON");
+    assert(cJSON_GetObjectItemCaseSensitive(response, "id")->valueint == 1);
+    result = cJSON_GetObjectItemCaseSensitive(response, "result");
+    assert(cJSON_IsArray(result));
+    cJSON_ArrayForEach(item, result) {
+        i++;
+        assertf(atoi(item->valuestring) == i, "item %d is %s", i, item->valuestring);
+    }
+    assertf(i == STREAM_ITEMS, "%d items streamed", i);
+    cJSON_Delete(response);
+}
+
+/*
+ * The client asks for a long streamed response, and does not read for
+ * a while; spind carries on with other work in the meantime, and only
+ * fetches the pages the client is ready for. The connection is kept, and
+ * takes the next request once the response has been read.
+ */
+static void
+check_stream() {
+    switch (stream_state) {
+    case 0:
+        stream_fd = client_connect();
+        client_send(stream_fd, "{\"jsonrpc\": \"2.0\", \"id\": 1, \"method\": \"items\", "
+                    "\"stream\": true, \"keepalive\": true}");
+        stream_state++;
+        break;
+    case 1:
+        // the mainloop keeps running while the client does not read
+        if (++stream_ticks == STREAM_STALL_TICKS) {
+            pages_while_stalled = pages_fetched;
+            stream_state++;
+        }
+        break;
+    case 2:
+        assert(!client_read(stream_fd));
+        if (stream_len > 0 && stream_buf[stream_len - 1] == '\n') {
+            check_stream_response();
+            stream_len = 0;
+            client_send(stream_fd, "{\"jsonrpc\": \"2.0\", \"id\": 2, \"method\": \"list_rpc_methods\"}");
+            stream_state++;
+        }
+        break;
+    case 3:
+        // without keepalive, the connection is closed after the response
+        if (client_read(stream_fd)) {
+            assert(stream_len > 0 && stream_buf[stream_len - 1] == '\n');
+            assert(strstr(stream_buf, "\"id\":2") != NULL);
+            stream_state++;
+        }
+        break;
+    }
+}
+
+// a connection that never sends anything is closed after a while
+static void
+check_idle() {
+    if (idle_fd == -1) {
+        // only accepted once the mainloop runs
+        idle_fd = client_connect();
+    } else if (idle_dropped == 0 && client_closed(idle_fd)) {
+        idle_dropped = elapsed();
+    }
+}
+
+static void
+wf_driver(void *arg, int data, int timeout) {
+    check_idle();
+    check_stream();
+    if ((idle_dropped != 0 && stream_state == 4) || elapsed() > TEST_DEADLINE) {
+        mainloop_end();
+    }
+}
+
+int main(int argc, char** argv) {
+    snprintf(socket_path, sizeof(socket_path), "/tmp/rpc_json_test.%d", (int) getpid());
+
+    init_mainloop();
+    assert(init_json_rpc(socket_path) == 0);
+    rpc_register("items_page", items_page, NULL, 2, items_page_args, RPCAT_COMPLEX);
+    mainloop_register("driver", wf_driver, NULL, 0, 50, 1);
+
+    gettimeofday(&start, 0);
+    mainloop_run();
+    unlink(socket_path);
+
+    assertf(idle_dropped != 0, "idle connection not closed after %d seconds", TEST_DEADLINE);
+    // (time() has a resolution of a second)
+    assertf(idle_dropped > RPC_IDLE_TIMEOUT, "idle connection closed after %.2f seconds", idle_dropped);
+    close(idle_fd);
+
+    assertf(stream_state == 4, "streamed response stopped in state %d", stream_state);
+    assertf(pages_while_stalled < STREAM_ITEMS / RPC_STREAM_PAGE_SIZE / 2,
+            "%d pages fetched for a client that did not read", pages_while_stalled);
+    assert(pages_fetched == STREAM_ITEMS / RPC_STREAM_PAGE_SIZE);
+    close(stream_fd);
+    free(stream_buf);
+    return 0;
+}
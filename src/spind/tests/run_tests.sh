@@ -0,0 +1,22 @@
+#!/bin/bash
+make *_test
+TESTS=`find . -name \*_test`
+for i in ${TESTS}; do
+    echo "run $i"
+    $i >& /dev/null
+    RESULT=$?
+    if [ $RESULT -ne 0 ]; then
+        $i
+        echo "$i failed"
+        exit $RESULT
+    else
+        echo "$i succeeded"
+    fi
+done
+
+mv ../*_test-* ./
+gcov mainloop_test-mainloop.c
+gcov rpc_json_test-rpc_json.c
+gcov core2extsrc_test-core2extsrc.c
+gcov feedimport_test-feedimport.c
+rm *.gcda *.gcno
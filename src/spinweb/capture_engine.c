@@ -0,0 +1,465 @@
+/*
+ * In-process packet capture for spinweb, see capture_engine.h
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture_engine.h"
+
+// Same values tcpdump was called with before
+#define CE_SNAPLEN 1600
+#define CE_LINKTYPE_ETHERNET 1
+
+// The ring: 16 blocks of 64k; blocks are handed to us after at most
+// CE_BLOCK_TIMEOUT milliseconds, even if they are not full
+#define CE_BLOCK_SIZE (1 << 16)
+#define CE_BLOCK_COUNT 16
+#define CE_FRAME_SIZE 2048
+#define CE_BLOCK_TIMEOUT 10
+
+// Captured data that has not been read yet is buffered per subscription;
+// packets that do not fit are dropped
+#define CE_BUFFER_SIZE (256 * 1024)
+
+// Every MAC address takes 8 instructions in the kernel filter, and the
+// jumps to the accept instruction at the end must fit in 8 bits. With
+// more subscribed addresses, the filter accepts everything (the frames
+// are still only delivered to the matching subscriptions).
+#define CE_FILTER_MAX_MACS 30
+
+#define CE_POLL_TIMEOUT 1000
+
+struct pcap_file_header_s {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header_s {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+struct ce_subscription {
+    uint8_t mac[6];
+
+    // Circular buffer of pcap data
+    char* buf;
+    size_t buf_start;
+    size_t buf_len;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    void (*notify)(void* arg);
+    void* notify_arg;
+
+    unsigned long packets;
+    unsigned long dropped;
+
+    struct ce_subscription* next;
+};
+
+static struct {
+    char* interface;
+    int fd;
+    uint8_t* ring;
+    size_t ring_size;
+    int started;
+    // Protects the subscription list and the socket filter
+    pthread_mutex_t mutex;
+    ce_subscription_t* subscriptions;
+} ce = { NULL, -1, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER, NULL };
+
+void
+ce_init(const char* interface) {
+    free(ce.interface);
+    ce.interface = NULL;
+    if (interface != NULL && strlen(interface) > 0) {
+        ce.interface = strdup(interface);
+    }
+}
+
+/*
+ * (Re)builds the kernel filter for the current subscriptions
+ * Must be called with ce.mutex held
+ */
+static void
+ce_update_filter() {
+    struct sock_filter code[CE_FILTER_MAX_MACS * 8 + 2];
+    struct sock_fprog prog;
+    uint8_t macs[CE_FILTER_MAX_MACS][6];
+    ce_subscription_t* sub;
+    int mac_count = 0;
+    int all = 0;
+    int n = 0;
+    int accept, i;
+
+    for (sub = ce.subscriptions; sub != NULL && !all; sub = sub->next) {
+        for (i = 0; i < mac_count; i++) {
+            if (memcmp(macs[i], sub->mac, 6) == 0) {
+                break;
+            }
+        }
+        if (i < mac_count) {
+            continue;
+        }
+        if (mac_count == CE_FILTER_MAX_MACS) {
+            all = 1;
+        } else {
+            memcpy(macs[mac_count++], sub->mac, 6);
+        }
+    }
+
+    if (all) {
+        code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, CE_SNAPLEN);
+    } else {
+        // for every address: if dst == mac or src == mac, accept
+        accept = mac_count * 8 + 1;
+        for (i = 0; i < mac_count; i++) {
+            uint32_t hi = (uint32_t)macs[i][0] << 24 | (uint32_t)macs[i][1] << 16 |
+                          (uint32_t)macs[i][2] << 8 | macs[i][3];
+            uint32_t lo = (uint32_t)macs[i][4] << 8 | macs[i][5];
+
+            code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0);
+            code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, hi, 0, 2);
+            code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4);
+            code[n] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, lo, accept - n - 1, 0);
+            n++;
+            code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 6);
+            code[n++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, hi, 0, 2);
+            code[n++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 10);
+            code[n] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, lo, accept - n - 1, 0);
+            n++;
+        }
+        code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, 0);
+        code[n++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, CE_SNAPLEN);
+    }
+
+    prog.len = n;
+    prog.filter = code;
+    if (setsockopt(ce.fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0) {
+        fprintf(stderr, "Error setting capture filter: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * Appends len bytes to the circular buffer of the subscription
+ * Must be called with sub->mutex held, and only if the data fits
+ */
+static void
+ce_buffer_append(ce_subscription_t* sub, const void* data, size_t len) {
+    size_t pos = (sub->buf_start + sub->buf_len) % CE_BUFFER_SIZE;
+    size_t first = CE_BUFFER_SIZE - pos;
+
+    if (first > len) {
+        first = len;
+    }
+    memcpy(sub->buf + pos, data, first);
+    memcpy(sub->buf, (const char*)data + first, len - first);
+    sub->buf_len += len;
+}
+
+static void
+ce_deliver(ce_subscription_t* sub, struct tpacket3_hdr* hdr, const uint8_t* frame) {
+    struct pcap_record_header_s rec;
+    int was_empty;
+
+    rec.ts_sec = hdr->tp_sec;
+    rec.ts_usec = hdr->tp_nsec / 1000;
+    rec.incl_len = hdr->tp_snaplen;
+    rec.orig_len = hdr->tp_len;
+
+    pthread_mutex_lock(&sub->mutex);
+    if (sub->buf_len + sizeof(rec) + rec.incl_len > CE_BUFFER_SIZE) {
+        sub->dropped++;
+        pthread_mutex_unlock(&sub->mutex);
+        return;
+    }
+    was_empty = (sub->buf_len == 0);
+    ce_buffer_append(sub, &rec, sizeof(rec));
+    ce_buffer_append(sub, frame, rec.incl_len);
+    sub->packets++;
+    pthread_cond_signal(&sub->cond);
+    pthread_mutex_unlock(&sub->mutex);
+
+    if (was_empty && sub->notify != NULL) {
+        sub->notify(sub->notify_arg);
+    }
+}
+
+/*
+ * Hands out all frames in the block to the subscriptions
+ * Must be called with ce.mutex held
+ */
+static void
+ce_process_block(struct tpacket_block_desc* block) {
+    struct tpacket3_hdr* hdr;
+    ce_subscription_t* sub;
+    uint32_t i;
+
+    hdr = (struct tpacket3_hdr*)((uint8_t*)block + block->hdr.bh1.offset_to_first_pkt);
+    for (i = 0; i < block->hdr.bh1.num_pkts; i++) {
+        const uint8_t* frame = (uint8_t*)hdr + hdr->tp_mac;
+
+        if (hdr->tp_snaplen >= ETH_HLEN) {
+            for (sub = ce.subscriptions; sub != NULL; sub = sub->next) {
+                if (memcmp(frame, sub->mac, 6) == 0 || memcmp(frame + 6, sub->mac, 6) == 0) {
+                    ce_deliver(sub, hdr, frame);
+                }
+            }
+        }
+        hdr = (struct tpacket3_hdr*)((uint8_t*)hdr + hdr->tp_next_offset);
+    }
+}
+
+static void*
+ce_capture_thread(void* arg) {
+    struct tpacket_block_desc* block;
+    struct pollfd pfd;
+    unsigned int current = 0;
+    (void)arg;
+
+    pfd.fd = ce.fd;
+    pfd.events = POLLIN | POLLERR;
+    while (1) {
+        block = (struct tpacket_block_desc*)(ce.ring + (size_t)current * CE_BLOCK_SIZE);
+        if ((block->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+            pfd.revents = 0;
+            poll(&pfd, 1, CE_POLL_TIMEOUT);
+            continue;
+        }
+
+        pthread_mutex_lock(&ce.mutex);
+        ce_process_block(block);
+        pthread_mutex_unlock(&ce.mutex);
+
+        __sync_synchronize();
+        block->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        current = (current + 1) % CE_BLOCK_COUNT;
+    }
+    return NULL;
+}
+
+/*
+ * Opens the capture socket and starts the capture thread
+ * Must be called with ce.mutex held
+ * Returns 0 on success
+ */
+static int
+ce_start() {
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+    pthread_t thread;
+    int version = TPACKET_V3;
+
+    if (ce.interface == NULL) {
+        fprintf(stderr, "No capture interface set, not capturing\n");
+        return -1;
+    }
+    ce.fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (ce.fd < 0) {
+        fprintf(stderr, "Error opening capture socket: %s\n", strerror(errno));
+        return -1;
+    }
+    // There are no subscriptions yet, so this rejects everything
+    ce_update_filter();
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = CE_BLOCK_SIZE;
+    req.tp_block_nr = CE_BLOCK_COUNT;
+    req.tp_frame_size = CE_FRAME_SIZE;
+    req.tp_frame_nr = (CE_BLOCK_SIZE / CE_FRAME_SIZE) * CE_BLOCK_COUNT;
+    req.tp_retire_blk_tov = CE_BLOCK_TIMEOUT;
+    if (setsockopt(ce.fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0 ||
+        setsockopt(ce.fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+        fprintf(stderr, "Error setting up capture ring: %s\n", strerror(errno));
+        goto error;
+    }
+    ce.ring_size = (size_t)CE_BLOCK_SIZE * CE_BLOCK_COUNT;
+    ce.ring = mmap(NULL, ce.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, ce.fd, 0);
+    if (ce.ring == MAP_FAILED) {
+        // MAP_LOCKED may not be allowed
+        ce.ring = mmap(NULL, ce.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ce.fd, 0);
+    }
+    if (ce.ring == MAP_FAILED) {
+        fprintf(stderr, "Error mapping capture ring: %s\n", strerror(errno));
+        ce.ring = NULL;
+        goto error;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = if_nametoindex(ce.interface);
+    if (addr.sll_ifindex == 0) {
+        fprintf(stderr, "Unknown capture interface %s\n", ce.interface);
+        goto error;
+    }
+    if (bind(ce.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "Error binding capture socket: %s\n", strerror(errno));
+        goto error;
+    }
+
+    if (pthread_create(&thread, NULL, ce_capture_thread, NULL) != 0) {
+        fprintf(stderr, "Error creating thread: %s\n", strerror(errno));
+        goto error;
+    }
+    pthread_detach(thread);
+    ce.started = 1;
+    return 0;
+
+error:
+    if (ce.ring != NULL) {
+        munmap(ce.ring, ce.ring_size);
+        ce.ring = NULL;
+    }
+    close(ce.fd);
+    ce.fd = -1;
+    return -1;
+}
+
+ce_subscription_t*
+ce_subscribe(const char* mac, void (*notify)(void* arg), void* notify_arg) {
+    struct pcap_file_header_s file_header;
+    ce_subscription_t* sub;
+    unsigned int m[6];
+    int i;
+
+    if (mac == NULL ||
+        sscanf(mac, "%2x:%2x:%2x:%2x:%2x:%2x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) {
+        return NULL;
+    }
+
+    sub = malloc(sizeof(ce_subscription_t));
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->buf = malloc(CE_BUFFER_SIZE);
+    if (sub->buf == NULL) {
+        free(sub);
+        return NULL;
+    }
+    for (i = 0; i < 6; i++) {
+        sub->mac[i] = m[i];
+    }
+    sub->buf_start = 0;
+    sub->buf_len = 0;
+    pthread_mutex_init(&sub->mutex, NULL);
+    pthread_cond_init(&sub->cond, NULL);
+    sub->notify = notify;
+    sub->notify_arg = notify_arg;
+    sub->packets = 0;
+    sub->dropped = 0;
+
+    // Every subscription is a pcap stream of its own
+    file_header.magic = 0xa1b2c3d4;
+    file_header.version_major = 2;
+    file_header.version_minor = 4;
+    file_header.thiszone = 0;
+    file_header.sigfigs = 0;
+    file_header.snaplen = CE_SNAPLEN;
+    file_header.linktype = CE_LINKTYPE_ETHERNET;
+    ce_buffer_append(sub, &file_header, sizeof(file_header));
+
+    pthread_mutex_lock(&ce.mutex);
+    if (!ce.started && ce_start() != 0) {
+        pthread_mutex_unlock(&ce.mutex);
+        pthread_cond_destroy(&sub->cond);
+        pthread_mutex_destroy(&sub->mutex);
+        free(sub->buf);
+        free(sub);
+        return NULL;
+    }
+    sub->next = ce.subscriptions;
+    ce.subscriptions = sub;
+    ce_update_filter();
+    pthread_mutex_unlock(&ce.mutex);
+
+    return sub;
+}
+
+void
+ce_unsubscribe(ce_subscription_t* sub) {
+    ce_subscription_t** cur;
+
+    // Once it is off the list, the capture thread does not touch it
+    pthread_mutex_lock(&ce.mutex);
+    for (cur = &ce.subscriptions; *cur != NULL; cur = &(*cur)->next) {
+        if (*cur == sub) {
+            *cur = sub->next;
+            break;
+        }
+    }
+    ce_update_filter();
+    pthread_mutex_unlock(&ce.mutex);
+
+    if (sub->dropped > 0) {
+        fprintf(stderr, "Capture for %02x:%02x:%02x:%02x:%02x:%02x dropped %lu of %lu packets\n",
+                sub->mac[0], sub->mac[1], sub->mac[2], sub->mac[3], sub->mac[4], sub->mac[5],
+                sub->dropped, sub->dropped + sub->packets);
+    }
+    pthread_cond_destroy(&sub->cond);
+    pthread_mutex_destroy(&sub->mutex);
+    free(sub->buf);
+    free(sub);
+}
+
+ssize_t
+ce_read(ce_subscription_t* sub, char* buf, size_t max, int timeout_ms) {
+    struct timespec deadline;
+    size_t len, first;
+
+    pthread_mutex_lock(&sub->mutex);
+    if (sub->buf_len == 0 && timeout_ms > 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (sub->buf_len == 0) {
+            if (pthread_cond_timedwait(&sub->cond, &sub->mutex, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+
+    len = sub->buf_len;
+    if (len > max) {
+        len = max;
+    }
+    first = CE_BUFFER_SIZE - sub->buf_start;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(buf, sub->buf + sub->buf_start, first);
+    memcpy(buf + first, sub->buf, len - first);
+    sub->buf_start = (sub->buf_start + len) % CE_BUFFER_SIZE;
+    sub->buf_len -= len;
+    pthread_mutex_unlock(&sub->mutex);
+
+    return len;
+}
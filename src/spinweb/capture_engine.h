@@ -0,0 +1,52 @@
+#ifndef SPINWEB_CAPTURE_ENGINE_H
+#define SPINWEB_CAPTURE_ENGINE_H 1
+
+#include <sys/types.h>
+
+/*
+ * In-process packet capture for spinweb
+ *
+ * A single AF_PACKET socket with a TPACKET_V3 memory-mapped ring
+ * captures the traffic for all running captures. The kernel filter on
+ * the socket only accepts frames from or to the MAC addresses that are
+ * currently subscribed, and a capture thread hands out every frame to
+ * the subscriptions for its source and destination address, in pcap
+ * file format (starting with the pcap file header).
+ *
+ * The engine is started when the first subscription is made.
+ */
+
+typedef struct ce_subscription ce_subscription_t;
+
+/*
+ * Sets the network interface to capture on; with NULL or an empty
+ * string, nothing is captured (on all interfaces, frames that pass a
+ * bridge would show up twice). Must be called before the first
+ * subscription.
+ */
+void ce_init(const char* interface);
+
+/*
+ * Starts capturing the traffic from and to the given MAC address
+ * notify (if not NULL) is called from the capture thread with
+ * notify_arg when data becomes available for a subscription that
+ * had none
+ * Returns NULL if the MAC address is invalid or the capture could not
+ * be started
+ */
+ce_subscription_t* ce_subscribe(const char* mac, void (*notify)(void* arg), void* notify_arg);
+
+/*
+ * Stops the capture and releases the subscription; notify will not be
+ * called anymore after this returns
+ */
+void ce_unsubscribe(ce_subscription_t* sub);
+
+/*
+ * Reads up to max bytes of captured pcap data
+ * If there is no data, waits for at most timeout_ms milliseconds
+ * Returns the number of bytes read (0 if there was no data)
+ */
+ssize_t ce_read(ce_subscription_t* sub, char* buf, size_t max, int timeout_ms);
+
+#endif // SPINWEB_CAPTURE_ENGINE_H
@@ -7,8 +7,11 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <cJSON.h>
@@ -24,70 +27,259 @@
  * Helper functions
  */
 
-// Sends the given string to the rpc domain socket
-// returns the response
-// caller must free response data
-// TODO: json errors
-char*
-send_jsonrpc_message_raw(const char* request) {
-    size_t response_size=1024;
-    char* response;// = malloc(response_size);
-    const char* domain_socket_path = "/var/run/spin_rpc.sock";
+/*
+ * spinweb handles every HTTP connection in its own thread, and a single
+ * page can result in several RPC calls. Instead of setting up a new
+ * connection for every call, a small pool of persistent connections to
+ * spind is kept. Requests are sent with "keepalive" set so that spind
+ * keeps the connection open, and responses are terminated by a newline.
+ *
+ * A thread takes a free connection from the pool (waiting for one if
+ * they are all in use), and returns it when the response is complete.
+ */
+#define RPCC_POOL_SIZE 4
+#define RPCC_BUF_SIZE 4096
+
+static const char* domain_socket_path = "/var/run/spin_rpc.sock";
+
+struct rpcc_conn {
+    int     rc_fd;      // -1 if not connected
+    int     rc_inuse;
+    char*   rc_buf;     // response data
+    size_t  rc_len;
+    size_t  rc_size;
+};
+
+static struct rpcc_conn rpcc_pool[RPCC_POOL_SIZE] = {
+    [0 ... RPCC_POOL_SIZE-1] = { -1, 0, NULL, 0, 0 }
+};
+static pthread_mutex_t rpcc_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rpcc_pool_cond = PTHREAD_COND_INITIALIZER;
+
+static struct rpcc_conn*
+rpcc_conn_get() {
+    struct rpcc_conn* conn = NULL;
+    int i;
+
+    pthread_mutex_lock(&rpcc_pool_mutex);
+    while (conn == NULL) {
+        // prefer a connection that is already open
+        for (i = 0; i < RPCC_POOL_SIZE; i++) {
+            if (!rpcc_pool[i].rc_inuse && (conn == NULL || conn->rc_fd < 0)) {
+                conn = &rpcc_pool[i];
+            }
+        }
+        if (conn == NULL) {
+            pthread_cond_wait(&rpcc_pool_cond, &rpcc_pool_mutex);
+        }
+    }
+    conn->rc_inuse = 1;
+    pthread_mutex_unlock(&rpcc_pool_mutex);
+    return conn;
+}
+
+static void
+rpcc_conn_release(struct rpcc_conn* conn) {
+    pthread_mutex_lock(&rpcc_pool_mutex);
+    conn->rc_inuse = 0;
+    pthread_cond_signal(&rpcc_pool_cond);
+    pthread_mutex_unlock(&rpcc_pool_mutex);
+}
+
+static void
+rpcc_conn_close(struct rpcc_conn* conn) {
+    if (conn->rc_fd >= 0) {
+        close(conn->rc_fd);
+        conn->rc_fd = -1;
+    }
+    conn->rc_len = 0;
+}
 
+static int
+rpcc_conn_open(struct rpcc_conn* conn) {
     struct sockaddr_un addr;
     int fd;
-    ssize_t rc;
-    size_t data_read;
-    size_t data_size;
 
-    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1){
-        fprintf(stderr, "Error connecting to domain socket %s: %s\n", domain_socket_path, strerror(errno));
-        return NULL;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        fprintf(stderr, "Error creating domain socket: %s\n", strerror(errno));
+        return -1;
     }
 
     memset(&addr, 0, sizeof(addr));
     addr.sun_family = AF_UNIX;
-    if (*domain_socket_path == '\0') {
-        *addr.sun_path = '\0';
-        strncpy(addr.sun_path+1, domain_socket_path+1, sizeof(addr.sun_path)-2);
-    } else {
-        strncpy(addr.sun_path, domain_socket_path, sizeof(addr.sun_path)-1);
-    }
+    strncpy(addr.sun_path, domain_socket_path, sizeof(addr.sun_path)-1);
 
     if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
         fprintf(stderr, "Error connecting to JSONRPC socket %s: %s\n", domain_socket_path, strerror(errno));
-        return NULL;
+        close(fd);
+        return -1;
     }
+    conn->rc_fd = fd;
+    conn->rc_len = 0;
+    return 0;
+}
+
+static int
+rpcc_conn_write(struct rpcc_conn* conn, const char* data, size_t size) {
+    ssize_t rc;
 
-    data_read = 0;
-    data_size = strlen(request);
-    while (data_read < data_size) {
-        rc = write(fd, request, data_size - data_read);
+    while (size > 0) {
+        rc = send(conn->rc_fd, data, size, MSG_NOSIGNAL);
         if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             fprintf(stderr, "Error while writing: %s\n", strerror(errno));
+            return -1;
+        }
+        data += rc;
+        size -= rc;
+    }
+    return 0;
+}
+
+/*
+ * Reads until a complete (newline-terminated) response has been
+ * received; returns a copy of the response without the newline, or
+ * NULL on error. If spind closed the connection before sending any of
+ * the response, *closed is set to 1.
+ */
+static char*
+rpcc_conn_read(struct rpcc_conn* conn, int* closed) {
+    char* nl;
+    char* newbuf;
+    char* response;
+    size_t response_len;
+    ssize_t rc;
+
+    *closed = 0;
+    if (conn->rc_buf == NULL) {
+        conn->rc_buf = malloc(RPCC_BUF_SIZE);
+        if (conn->rc_buf == NULL) {
             return NULL;
         }
-        data_read += rc;
+        conn->rc_size = RPCC_BUF_SIZE;
+        conn->rc_len = 0;
     }
 
-    data_read = 0;
-    response = malloc(response_size);
+    while ((nl = memchr(conn->rc_buf, '\n', conn->rc_len)) == NULL) {
+        if (conn->rc_len == conn->rc_size) {
+            newbuf = realloc(conn->rc_buf, conn->rc_size * 2);
+            if (newbuf == NULL) {
+                return NULL;
+            }
+            conn->rc_buf = newbuf;
+            conn->rc_size *= 2;
+        }
+        rc = read(conn->rc_fd, conn->rc_buf + conn->rc_len, conn->rc_size - conn->rc_len);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc <= 0) {
+            if (rc < 0) {
+                fprintf(stderr, "Error while reading: %s\n", strerror(errno));
+            } else if (conn->rc_len == 0) {
+                *closed = 1;
+            }
+            return NULL;
+        }
+        conn->rc_len += rc;
+    }
+
+    response_len = nl - conn->rc_buf;
+    response = malloc(response_len + 1);
     if (response == NULL) {
         return NULL;
     }
-    rc = 1;
-    while(rc != 0) {
-        rc = read(fd, response + data_read, response_size - data_read);
-        if (rc < 0) {
-            fprintf(stderr, "Error while reading: %s\n", strerror(errno));
-            free(response);
-            return NULL;
-        } else if (rc > 0) {
-            data_read += rc;
+    memcpy(response, conn->rc_buf, response_len);
+    response[response_len] = '\0';
+
+    // keep anything after the newline (there should not be anything)
+    conn->rc_len -= response_len + 1;
+    memmove(conn->rc_buf, nl + 1, conn->rc_len);
+
+    // don't hold on to the memory of exceptionally large responses
+    if (conn->rc_size > 16 * RPCC_BUF_SIZE && conn->rc_len < RPCC_BUF_SIZE) {
+        newbuf = realloc(conn->rc_buf, RPCC_BUF_SIZE);
+        if (newbuf != NULL) {
+            conn->rc_buf = newbuf;
+            conn->rc_size = RPCC_BUF_SIZE;
+        }
+    }
+    return response;
+}
+
+// Sends the given string to the rpc domain socket
+// returns the response
+// caller must free response data
+// TODO: json errors
+char*
+send_jsonrpc_message_raw(const char* request) {
+    struct rpcc_conn* conn;
+    cJSON* request_json;
+    char* request_str;
+    char* line;
+    char* response = NULL;
+    size_t request_len;
+    int reused;
+    int retry;
+    int attempt;
+
+    // Make sure the request asks for a persistent connection, and is
+    // sent on a single line
+    request_json = cJSON_Parse(request);
+    if (request_json == NULL || !cJSON_IsObject(request_json)) {
+        fprintf(stderr, "Not sending malformed JSONRPC request\n");
+        cJSON_Delete(request_json);
+        return NULL;
+    }
+    cJSON_DeleteItemFromObjectCaseSensitive(request_json, "keepalive");
+    cJSON_AddTrueToObject(request_json, "keepalive");
+    request_str = cJSON_PrintUnformatted(request_json);
+    cJSON_Delete(request_json);
+    if (request_str == NULL) {
+        return NULL;
+    }
+    // with the newline, so that it goes out in a single write
+    request_len = strlen(request_str);
+    line = realloc(request_str, request_len + 2);
+    if (line == NULL) {
+        free(request_str);
+        return NULL;
+    }
+    request_str = line;
+    request_str[request_len++] = '\n';
+    request_str[request_len] = '\0';
+
+    conn = rpcc_conn_get();
+    /*
+     * If an existing connection turns out to have been closed by spind
+     * (for instance because it was idle), try once more on a new one.
+     * That shows as a request that cannot be sent, or as a connection
+     * that is closed without any of the response. On any other error
+     * spind may have run the request, and calls that change state must
+     * not be run twice, so the error goes to the caller.
+     */
+    for (attempt = 0; attempt < 2 && response == NULL; attempt++) {
+        reused = conn->rc_fd >= 0;
+        if (!reused && rpcc_conn_open(conn) != 0) {
+            break;
+        }
+        if (rpcc_conn_write(conn, request_str, request_len) != 0) {
+            retry = 1;
+        } else {
+            response = rpcc_conn_read(conn, &retry);
+        }
+        if (response == NULL) {
+            rpcc_conn_close(conn);
+            if (!reused || !retry) {
+                break;
+            }
         }
     }
-    response[data_read] = '\0';
-    close(fd);
+    rpcc_conn_release(conn);
+
+    free(request_str);
     return response;
 }
 
@@ -8,6 +8,7 @@
 #include "rpc_client.h"
 #include "spin_config.h"
 #include "files.h"
+#include "web_cache.h"
 #include "version.h"
 
 /* Deal with changed libmicrohttpd API */
@@ -18,7 +19,6 @@
 #endif
 
 #define POSTBUFFERSIZE  512
-#define MAXCLIENTS      64
 
 #define TEMPLATE_SRC_PATH SRCDIR "/templates"
 #define TEMPLATE_INSTALL_PATH DATADIR "/spin/spinweb/templates"
@@ -86,38 +86,52 @@ const char* methodnotallowederror =
   "<html><body><title>Error</title></head><body>HTTP Method not allowed for this URL.</body></html>";
 
 /*
- * Tries to find a template file for the given path
- * First checks the 'local' source directory (in case we are
- * running from a source build), then the global directory
+ * The static files and templates are read into memory at startup
+ * (see load_web_caches()). For both, the 'local' source directory is
+ * loaded first (in case we are running from a source build), files from
+ * the global directory are only used if they are not present there.
  */
-FILE* try_template_files(const char* path) {
-    FILE* fp;
-    fp = try_files(TEMPLATE_SRC_PATH, path);
-    if (fp == NULL) {
-        fp = try_files(TEMPLATE_INSTALL_PATH, path);
+static web_cache_t* static_cache = NULL;
+static web_cache_t* template_cache = NULL;
+
+static web_cache_t*
+load_web_cache(const char* src_path, const char* install_path, int compress) {
+    web_cache_t* cache = web_cache_create();
+    int count = 0;
+    int added;
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    added = web_cache_load(cache, src_path, compress);
+    if (added > 0) {
+        count += added;
     }
-    return fp;
+    added = web_cache_load(cache, install_path, compress);
+    if (added > 0) {
+        count += added;
+    }
+    fprintf(stderr, "Loaded %d files (%zu bytes) from %s and %s\n", count, cache->total_size, src_path, install_path);
+    return cache;
 }
 
-/*
- * Tries to find a static file for the given path
- * First checks the 'local' source directory (in case we are
- * running from a source build), then the global directory
- */
-FILE* try_static_files(const char* path) {
-    FILE* fp;
-    fp = try_files(STATIC_SRC_PATH, path);
-    if (fp == NULL) {
-        fp = try_files(STATIC_INSTALL_PATH, path);
-    }
-    return fp;
+static void
+load_web_caches() {
+    static_cache = load_web_cache(STATIC_SRC_PATH, STATIC_INSTALL_PATH, 1);
+    template_cache = load_web_cache(TEMPLATE_SRC_PATH, TEMPLATE_INSTALL_PATH, 0);
 }
 
-void find_static_file(const char* path, web_file_t* web_file) {
-    try_files2(STATIC_SRC_PATH, path, web_file);
-    if (web_file->fp == NULL) {
-        try_files2(STATIC_INSTALL_PATH, path, web_file);
+/*
+ * Tries to find a template for the given url; templates are
+ * served from /spin_api/<template>, so the first 9 characters
+ * of the url are skipped
+ */
+static web_cache_entry_t*
+find_template(const char* url) {
+    if (strlen(url) <= 9) {
+        return NULL;
     }
+    return web_cache_find(template_cache, url + 9);
 }
 
 
@@ -272,45 +286,88 @@ send_redirect_add_slash(struct MHD_Connection *connection,
 }
 
 
+/*
+ * Sends a cached static file
+ * Static files are served with a strong ETag, so that browsers can
+ * revalidate them with If-None-Match; the gzipped variant is sent if
+ * the client accepts it (or if there is no other variant)
+ */
 static int
-send_page_from_file(struct MHD_Connection *connection,
-                    const char *url) {
-    char* page = NULL;
-    long file_size = 0;
-    //FILE* fp = NULL;
+send_page_from_cache(struct MHD_Connection *connection,
+                     web_cache_entry_t* entry) {
+    const char* data = entry->data;
+    size_t size = entry->size;
+    const char* etag = entry->etag;
+    int gzipped = entry->gzip_only;
+    const char* header_value;
     struct MHD_Response* response;
+    unsigned int status_code;
     int ret;
-    web_file_t web_file;
-    web_file.fp = NULL;
-    web_file.gzipped = 0;
-
-    find_static_file(url, &web_file);
-    if (web_file.fp) {
-    //fp = try_static_files(url);
-    //if(fp) {
-        fseek(web_file.fp, 0, SEEK_END);
-        file_size = ftell(web_file.fp);
-        fseek(web_file.fp, 0, SEEK_SET);// needed for next read from beginning of file
 
-        // page will be freed by MHD (MHD_RESPMEM_MUST_FREE)
-        page = malloc(file_size);
-        memset(page, 0, file_size);
-        fread(page, file_size, 1, web_file.fp);
-
-        fclose(web_file.fp);
+    if (entry->gz_data != NULL) {
+        header_value = MHD_lookup_connection_value(connection,
+                                                   MHD_HEADER_KIND,
+                                                   MHD_HTTP_HEADER_ACCEPT_ENCODING);
+        if (header_value != NULL && strstr(header_value, "gzip") != NULL) {
+            data = entry->gz_data;
+            size = entry->gz_size;
+            etag = entry->gz_etag;
+            gzipped = 1;
+        }
+    }
 
-        response = MHD_create_response_from_buffer (file_size,
-                                                    (void*) page,
-                                                    MHD_RESPMEM_MUST_FREE);
+    header_value = MHD_lookup_connection_value(connection,
+                                               MHD_HEADER_KIND,
+                                               MHD_HTTP_HEADER_IF_NONE_MATCH);
+    if (web_cache_etag_matches(header_value, etag)) {
+        response = MHD_create_response_from_buffer(0, (void *) "",
+                                                   MHD_RESPMEM_PERSISTENT);
+        status_code = MHD_HTTP_NOT_MODIFIED;
+    } else {
+        // the cache is never modified, so MHD can use the data directly
+        response = MHD_create_response_from_buffer(size, (void *) data,
+                                                   MHD_RESPMEM_PERSISTENT);
+        status_code = MHD_HTTP_OK;
+    }
+    if (!response) {
+        return MHD_NO;
+    }
 
-        if (web_file.gzipped) {
-            MHD_add_response_header(response, "Content-Encoding", "gzip");
+    MHD_add_response_header(response, MHD_HTTP_HEADER_ETAG, etag);
+    if (entry->content_type != NULL && strcmp(entry->content_type, "text/html") == 0) {
+        // pages always get revalidated, so that updates show up directly
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+    } else {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, "public, max-age=3600");
+    }
+    if (entry->gz_data != NULL) {
+        MHD_add_response_header(response, MHD_HTTP_HEADER_VARY, MHD_HTTP_HEADER_ACCEPT_ENCODING);
+    }
+    if (status_code == MHD_HTTP_OK) {
+        if (entry->content_type != NULL) {
+            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, entry->content_type);
+        }
+        if (gzipped) {
+            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_ENCODING, "gzip");
         }
+    }
 
-        ret = MHD_queue_response(connection,
-                                 MHD_HTTP_OK,
-                                 response);
-        MHD_destroy_response(response);
+    ret = MHD_queue_response(connection,
+                             status_code,
+                             response);
+    MHD_destroy_response(response);
+
+    return ret;
+}
+
+static int
+send_page_from_file(struct MHD_Connection *connection,
+                    const char *url) {
+    web_cache_entry_t* entry;
+
+    entry = web_cache_find(static_cache, url);
+    if (entry) {
+        return send_page_from_cache(connection, entry);
     } else {
         // If the URL does not end with a /, redirect to one
         // If the URL does, send a 404
@@ -321,54 +378,34 @@ send_page_from_file(struct MHD_Connection *connection,
                                          MHD_HTTP_NOT_FOUND);
         } else {
             return send_redirect_add_slash(connection, 302);
-            //MHD_add_response_header (response, "Location", "http://somesite.com/");
-            //return send_page_from_string(connection,
-            //                             notfounderror,
-            //                             MHD_HTTP_NOT_FOUND);
         }
     }
-
-    return ret;
 }
 
 static int
 send_page_from_template(struct MHD_Connection *connection,
-                        FILE* fp,
+                        web_cache_entry_t* template,
                         const char *url,
                         ...) {
-    char* page = NULL;
-    long file_size = 0;
     struct MHD_Response* response;
+    char* page;
     int ret;
 
-    if(fp) {
-        fseek(fp, 0, SEEK_END);
-        file_size = ftell(fp);
-        fseek(fp, 0, SEEK_SET);// needed for next read from beginning of file
-
-        // page will be freed by MHD (MHD_RESPMEM_MUST_FREE)
-        page = malloc(file_size);
-        if (page == NULL) {
-            // TODO: handle oom
-            fprintf(stderr, "out of memory\n");
-        }
-        memset(page, 0, file_size);
-        fread(page, file_size, 1, fp);
-
-        fclose(fp);
-
-        //char* templres = template_render(page, file_size, "FOOBAR", "EXISTATIONASDFASDF", "AAAAA", NULL);
+    if (template) {
         va_list valist;
         va_start(valist, url);
-        char* templres = template_render2(page, file_size, valist);
+        // page will be freed by MHD (MHD_RESPMEM_MUST_FREE)
+        page = template_render2(template->data, template->size, valist);
         va_end(valist);
-        file_size = strlen(templres);
-        free(page);
-        page = templres;
 
-        response = MHD_create_response_from_buffer (file_size,
+        response = MHD_create_response_from_buffer (strlen(page),
                                                     (void*) page,
                                                     MHD_RESPMEM_MUST_FREE);
+        // rendered pages depend on the current state, do not cache them
+        MHD_add_response_header(response, MHD_HTTP_HEADER_CACHE_CONTROL, "no-cache");
+        if (template->content_type != NULL) {
+            MHD_add_response_header(response, MHD_HTTP_HEADER_CONTENT_TYPE, template->content_type);
+        }
         ret = MHD_queue_response(connection,
                                  MHD_HTTP_OK,
                                  response);
@@ -521,9 +558,9 @@ answer_to_connection(void *cls,
             spin_data device = rpcc_get_device_by_mac(device_mac);
             char* device_name = rpcc_get_device_name(device);
             char* device_ips = rpcc_get_device_ips_as_string(device);
-            FILE* template_fp = try_template_files(url+9);
+            web_cache_entry_t* template = find_template(url);
 
-            int result = send_page_from_template(connection, template_fp, url + 9, device_name, device_mac, device_ips, NULL);
+            int result = send_page_from_template(connection, template, url + 9, device_name, device_mac, device_ips, NULL);
 
             free(device_name);
             free(device_ips);
@@ -536,8 +573,8 @@ answer_to_connection(void *cls,
             // get 1 from 'dev' parameter in query
             // need to get 2 and 3 from our tcpdump manager code
             const char* device_param = MHD_lookup_connection_value (connection, MHD_GET_ARGUMENT_KIND, "device");
-            FILE* template_fp = try_template_files(url+9);
-            return send_page_from_template(connection, template_fp, url + 9, device_param, "B", NULL);
+            web_cache_entry_t* template = find_template(url);
+            return send_page_from_template(connection, template, url + 9, device_param, "B", NULL);
         } else if (strncmp(url, TEMPLATE_URL_TCPDUMP_STATUS, strlen(TEMPLATE_URL_TCPDUMP_STATUS) + 1) == 0) {
             // Template args:
             // device mac, running, bytes_sent
@@ -548,17 +585,17 @@ answer_to_connection(void *cls,
             char bytes_string[100];
             int bytes_sent = tc_get_bytes_sent_for(device_mac);
             snprintf(bytes_string, 100, "%d", bytes_sent);
-            FILE* template_fp = try_template_files(url+9);
-            return send_page_from_template(connection, template_fp, url + 9, device_mac, running, bytes_string, NULL);
+            web_cache_entry_t* template = find_template(url);
+            return send_page_from_template(connection, template, url + 9, device_mac, running, bytes_string, NULL);
         //} else if (strncmp(url, "/spin_api/", 10) == 0) {
             // strip the 'spin_api' part from the url
             //return send_page_from_file(connection, url);
         //    return send_page_from_template(connection, url + 9, "GENERAL", NULL);
         }
         // Try any template file
-        FILE* template_fp = try_template_files(url+9);
-        if (template_fp != NULL) {
-            return send_page_from_template(connection, template_fp, url + 9, "GENERAL", NULL);
+        web_cache_entry_t* template = find_template(url);
+        if (template != NULL) {
+            return send_page_from_template(connection, template, url + 9, "GENERAL", NULL);
         }
 
         // Try any static file
@@ -608,9 +645,21 @@ answer_to_connection(void *cls,
 
 #define MAX_DAEMONS 10
 
+/*
+ * With spinweb_threads set to 0, every connection gets its own thread
+ * (the original behaviour). Otherwise, MHD uses an epoll-based event
+ * loop with a pool of that many threads; long-running responses (such as
+ * the tcpdump streams) must then not block, and suspend their
+ * connection while there is no data (see traffic_capture.c).
+ */
 int
 start_daemon(char* address, int port, char* tls_cert_pem, char* tls_key_pem, struct MHD_Daemon* daemons[], int daemon_count) {
     struct sockaddr_in addr1;
+    struct MHD_OptionItem options[8];
+    unsigned int daemon_flags;
+    int threads = spinconfig_spinweb_threads();
+    int n = 0;
+
     addr1.sin_family = AF_INET;
     addr1.sin_port = htons(port);
     if (inet_aton(address, &addr1.sin_addr) == 0) {
@@ -618,39 +667,52 @@ start_daemon(char* address, int port, char* tls_cert_pem, char* tls_key_pem, str
         return 1;
     }
 
-    unsigned int daemon_flags = MHD_USE_THREAD_PER_CONNECTION
+    if (threads > 0) {
 #if MHD_VERSION >= 0x00095300
-        | MHD_USE_INTERNAL_POLLING_THREAD;
+        daemon_flags = MHD_USE_EPOLL_INTERNAL_THREAD | MHD_ALLOW_SUSPEND_RESUME;
 #else
-        | MHD_USE_SELECT_INTERNALLY;
+        daemon_flags = MHD_USE_SELECT_INTERNALLY | MHD_USE_SUSPEND_RESUME;
 #endif
+    } else {
+        daemon_flags = MHD_USE_THREAD_PER_CONNECTION
+#if MHD_VERSION >= 0x00095300
+            | MHD_USE_INTERNAL_POLLING_THREAD;
+#else
+            | MHD_USE_SELECT_INTERNALLY;
+#endif
+    }
+
+    options[n++] = (struct MHD_OptionItem) { MHD_OPTION_NOTIFY_COMPLETED, (intptr_t) &request_completed, NULL };
+    options[n++] = (struct MHD_OptionItem) { MHD_OPTION_SOCK_ADDR, 0, &addr1 };
+    options[n++] = (struct MHD_OptionItem) { MHD_OPTION_CONNECTION_LIMIT, spinconfig_spinweb_max_connections(), NULL };
+    options[n++] = (struct MHD_OptionItem) { MHD_OPTION_CONNECTION_TIMEOUT, spinconfig_spinweb_connection_timeout(), NULL };
+    if (threads > 1) {
+        options[n++] = (struct MHD_OptionItem) { MHD_OPTION_THREAD_POOL_SIZE, threads, NULL };
+    }
     if (tls_key_pem != NULL && tls_cert_pem != NULL) {
         fprintf(stderr, "Enable TLS mode (MHD_USE_SSL)\n");
         daemon_flags = daemon_flags | MHD_USE_SSL;
-
-        daemons[daemon_count] = MHD_start_daemon(daemon_flags,
-                                  port, NULL, NULL,
-                                  &answer_to_connection, NULL,
-                                  MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
-                                  MHD_OPTION_SOCK_ADDR, &addr1,
-                                  MHD_OPTION_HTTPS_MEM_KEY, tls_key_pem,
-                                  MHD_OPTION_HTTPS_MEM_CERT, tls_cert_pem,
-                                  MHD_OPTION_END);
-    } else {
-        daemons[daemon_count] = MHD_start_daemon(daemon_flags,
-                                  port, NULL, NULL,
-                                  &answer_to_connection, NULL,
-                                  MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
-                                  MHD_OPTION_SOCK_ADDR, &addr1,
-                                  MHD_OPTION_END);
+        options[n++] = (struct MHD_OptionItem) { MHD_OPTION_HTTPS_MEM_KEY, 0, tls_key_pem };
+        options[n++] = (struct MHD_OptionItem) { MHD_OPTION_HTTPS_MEM_CERT, 0, tls_cert_pem };
     }
+    options[n++] = (struct MHD_OptionItem) { MHD_OPTION_END, 0, NULL };
+
+    daemons[daemon_count] = MHD_start_daemon(daemon_flags,
+                              port, NULL, NULL,
+                              &answer_to_connection, NULL,
+                              MHD_OPTION_ARRAY, options,
+                              MHD_OPTION_END);
 
     if (NULL == daemons[daemon_count]) {
         fprintf (stderr,
                  "failed to start daemon: %s\n", strerror(errno));
         return 1;
     }
-    fprintf(stderr, "spinweb listening on %s port %d\n", address, port);
+    if (threads > 0) {
+        fprintf(stderr, "spinweb listening on %s port %d (%d threads)\n", address, port, threads);
+    } else {
+        fprintf(stderr, "spinweb listening on %s port %d\n", address, port);
+    }
     return 0;
 }
 
@@ -784,6 +846,9 @@ main(int argc, char** argv) {
         }
     }
 
+    load_web_caches();
+    tc_init(spinconfig_spinweb_threads() > 0, spinconfig_spinweb_capture_interface());
+
     if (start_daemons(interfaces, port_number, tls_cert_pem, tls_key_pem, daemons, &daemon_count) != 0) {
         free(tls_cert_pem);
         free(tls_key_pem);
@@ -1,8 +1,9 @@
 /*
  * This module of the SPIN web api handles traffic captures;
- * - manage tcpdump sessions (perhaps change that to direct pcap soonish)
+ * - manage capture sessions (the packets themselves are captured by
+ *   the capture engine, see capture_engine.c)
  * - handle 'direct' (old style) tcpdump requests for clients with MHD
- * - TODO: handle mqtt (new style) tcpdump requests
+ * - handle mqtt (new style) capture requests
  */
 
 #include <errno.h>
@@ -19,6 +20,8 @@
 #include <sys/un.h>
 #include <unistd.h>
 
+#include "capture_engine.h"
+
 typedef struct capture_process {
     // Set to 1 to stop at next iteration
     int stop;
@@ -26,8 +29,8 @@ typedef struct capture_process {
     int stopped;
     // Number of bytes captured
     int byte_count;
-    // The actual process
-    FILE* process;
+    // The subscription to the capture engine
+    ce_subscription_t* subscription;
     // The MAC address that is being captured
     char* mac;
 
@@ -36,6 +39,12 @@ typedef struct capture_process {
     struct mosquitto* mqtt_client;
     char* mqtt_channel;
 
+    // In the case of direct (old-style) captures, the connection the
+    // data is sent on, and whether it has been suspended because
+    // there is no captured data for it at the moment
+    struct MHD_Connection* connection;
+    int suspended;
+
     /* Make it a doubly linked list for easier maintenance */
     struct capture_process* prev;
     struct capture_process* next;
@@ -43,6 +52,20 @@ typedef struct capture_process {
 
 capture_process_t* cp_global = NULL;
 
+/*
+ * When spinweb does not use a thread per connection, the direct capture
+ * callback must not block waiting for packets. Instead, it suspends the
+ * connection when there is no data, and the capture engine notifies us
+ * when there is (see tc_capture_notify()); stopping a capture resumes
+ * the connection as well.
+ */
+static int tc_use_suspend = 0;
+static pthread_mutex_t tc_suspend_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// How long blocking reads wait for data before checking whether the
+// capture has been stopped (in milliseconds)
+#define TC_READ_TIMEOUT 250
+
 int
 tc_captures_running() {
     capture_process_t* cp = cp_global;
@@ -88,6 +111,37 @@ int tc_get_bytes_sent_for(const char* device_mac) {
     return -1;
 }
 
+/*
+ * Resumes the connection of a suspended direct capture
+ * Must be called with tc_suspend_mutex held
+ */
+static void
+tc_resume(capture_process_t* cp) {
+    if (cp->suspended) {
+        cp->suspended = 0;
+        MHD_resume_connection(cp->connection);
+    }
+}
+
+/* Marks the capture to be stopped */
+static void
+tc_stop(capture_process_t* cp) {
+    pthread_mutex_lock(&tc_suspend_mutex);
+    cp->stop = 1;
+    tc_resume(cp);
+    pthread_mutex_unlock(&tc_suspend_mutex);
+}
+
+/*
+ * Called by the capture engine when there is new data for a capture
+ */
+static void
+tc_capture_notify(void* cp_v) {
+    pthread_mutex_lock(&tc_suspend_mutex);
+    tc_resume((capture_process_t*)cp_v);
+    pthread_mutex_unlock(&tc_suspend_mutex);
+}
+
 /**
  * Stops capturing packets for the given mac address
  */
@@ -95,7 +149,7 @@ void
 tc_stop_capture_for(const char* device_mac) {
     capture_process_t* cp = get_capture_running_for(device_mac);
     if (cp != NULL) {
-        cp->stop = 1;
+        tc_stop(cp);
     }
 }
 
@@ -105,7 +159,7 @@ tc_stop_capture_for(const char* device_mac) {
 void tc_stop_all_captures() {
     capture_process_t* cp = cp_global;
     while (cp != NULL) {
-        cp->stop = 1;
+        tc_stop(cp);
         cp = cp->next;
     }
 }
@@ -114,7 +168,7 @@ void tc_stop_all_captures() {
 capture_process_t* capture_process_create(const char* device_mac) {
     capture_process_t* cp = malloc(sizeof(capture_process_t));
     cp->byte_count = 0;
-    cp->process = NULL;
+    cp->subscription = NULL;
     cp->stop = 0;
     cp->stopped = 0;
     cp->prev = NULL;
@@ -122,13 +176,15 @@ capture_process_t* capture_process_create(const char* device_mac) {
     cp->mac = strdup(device_mac);
     cp->mqtt_client = NULL;
     cp->mqtt_channel = NULL;
+    cp->connection = NULL;
+    cp->suspended = 0;
     return cp;
 }
 
 void capture_process_stop(capture_process_t* cp) {
-    if (cp->process != NULL) {
-        pclose(cp->process);
-        cp->process = NULL;
+    if (cp->subscription != NULL) {
+        ce_unsubscribe(cp->subscription);
+        cp->subscription = NULL;
     }
     cp->stopped = 1;
 }
@@ -136,9 +192,6 @@ void capture_process_stop(capture_process_t* cp) {
 static void capture_process_destroy(void* cp_v) {
     capture_process_t* cp = (capture_process_t*)cp_v;
     capture_process_stop(cp);
-    if (cp->process != NULL) {
-        pclose(cp->process);
-    }
     if (cp->mac != NULL) {
         free(cp->mac);
     }
@@ -156,6 +209,8 @@ static void capture_process_destroy(void* cp_v) {
 capture_process_t* ct_add_capture_process(const char* device_mac) {
     capture_process_t* new = capture_process_create(device_mac);
     capture_process_t* last;
+
+    pthread_mutex_lock(&tc_suspend_mutex);
     if (cp_global == NULL) {
         cp_global = new;
     } else {
@@ -166,15 +221,19 @@ capture_process_t* ct_add_capture_process(const char* device_mac) {
         last->next = new;
         new->prev = last;
     }
+    pthread_mutex_unlock(&tc_suspend_mutex);
     return new;
 }
 
 /* Destroys a capture process data structure and removes it from the global list */
 void ct_remove_capture_process(void* cp_v) {
     capture_process_t* cp = (capture_process_t*) cp_v;
-    capture_process_t* next = cp->next;
-    capture_process_t* prev = cp->prev;
+    capture_process_t* next;
+    capture_process_t* prev;
 
+    pthread_mutex_lock(&tc_suspend_mutex);
+    next = cp->next;
+    prev = cp->prev;
     if (prev == NULL) {
         cp_global = next;
     } else {
@@ -184,64 +243,66 @@ void ct_remove_capture_process(void* cp_v) {
     if (next != NULL) {
         next->prev = prev;
     }
+    pthread_mutex_unlock(&tc_suspend_mutex);
     capture_process_destroy(cp);
 }
 
-#include <fcntl.h>
-
 ssize_t
-read_data_from_capture_process(capture_process_t* cp, char* buf, size_t max) {
-    ssize_t result = read(fileno(cp->process), buf, max);
-    return result;
+read_data_from_capture_process(capture_process_t* cp, char* buf, size_t max, int timeout_ms) {
+    return ce_read(cp->subscription, buf, max, timeout_ms);
 }
 
 ssize_t direct_capture_callback(void* ld_v, uint64_t pos, char* buf, size_t max) {
     capture_process_t* ld = (capture_process_t*)ld_v;
+    ssize_t bread;
     (void)pos;
-    (void)buf;
-    (void)max;
-
-    //int read;
 
     if (ld->stopped) {
         return MHD_CONTENT_READER_END_OF_STREAM;
-    } else {
-        /* This should go elsewhere */
-        char cmdline[256];
-        snprintf(cmdline, 255, "tcpdump --immediate-mode -s 1600 -w - ether host %s 2>/dev/null", ld->mac);
-        if (ld->process == NULL) {
-            ld->process = popen(cmdline, "r");
-        }
-
-        if (ld->process == NULL) {
+    }
+    if (ld->subscription == NULL) {
+        ld->subscription = ce_subscribe(ld->mac, tc_capture_notify, ld);
+        if (ld->subscription == NULL) {
             // error!
             return MHD_CONTENT_READER_END_WITH_ERROR;
         }
-        /* up to here */
+    }
 
-        // TODO: maybe do one last read if stopped?
-        if (ld->stop) {
-            capture_process_stop(ld);
-            return MHD_CONTENT_READER_END_OF_STREAM;
-        } else {
-            // We know the first 24 bytes will be available immediately, so
-            // start with that
-            size_t to_read = max;
-            if (ld->byte_count == 0) {
-                to_read = 24;
-            }
-            //size_t bread = fread(buf, 1, to_read, ld->process);
-            ssize_t bread = read_data_from_capture_process(ld, buf, to_read);
-            if (bread == -1 && errno == EAGAIN) {
-                return 0;
-            } else if (bread > 0) {
-                ld->byte_count += bread;
-                return bread;
-            } else {
-                return MHD_CONTENT_READER_END_OF_STREAM;
-            }
+    // TODO: maybe do one last read if stopped?
+    if (ld->stop) {
+        capture_process_stop(ld);
+        return MHD_CONTENT_READER_END_OF_STREAM;
+    }
+
+    if (tc_use_suspend && ld->connection != NULL) {
+        // Don't wait; if there is no data, suspend the connection
+        // until the capture engine tells us there is (checked under
+        // the mutex, so that the notification cannot get lost)
+        pthread_mutex_lock(&tc_suspend_mutex);
+        bread = read_data_from_capture_process(ld, buf, max, 0);
+        if (bread == 0 && !ld->stop) {
+            ld->suspended = 1;
+            MHD_suspend_connection(ld->connection);
         }
+        pthread_mutex_unlock(&tc_suspend_mutex);
+    } else {
+        do {
+            bread = read_data_from_capture_process(ld, buf, max, TC_READ_TIMEOUT);
+        } while (bread == 0 && !ld->stop);
     }
+    ld->byte_count += bread;
+    return bread;
+}
+
+/*
+ * Must be called before the daemons are started; use_suspend is 1 if
+ * the daemons do not use a thread per connection, interface is the
+ * network interface to capture on
+ */
+void
+tc_init(int use_suspend, const char* interface) {
+    tc_use_suspend = use_suspend;
+    ce_init(interface);
 }
 
 /*
@@ -264,28 +325,20 @@ void* process_mqtt_capture(void* cp_v) {
     memset(hexline, 0, MAX_READ*2+1);
 
     while (cp->stop == 0) {
-        //size_t bread = fread(buf, 1, MAX_READ, cp->process);
         ssize_t bread;
         if (cp->byte_count == 0) {
-            bread = read_data_from_capture_process(cp, buf, 24);
+            // send the pcap file header on its own
+            bread = read_data_from_capture_process(cp, buf, 24, TC_READ_TIMEOUT);
         } else {
-            bread = read_data_from_capture_process(cp, buf, MAX_READ);
+            bread = read_data_from_capture_process(cp, buf, MAX_READ, TC_READ_TIMEOUT);
         }
+        // if there is no data just now, keep looping, unless the
+        // capture was stopped in the meantime
         if (bread > 0) {
             cp->byte_count += bread;
             bytes_to_hex(hexline, buf, bread);
-            int mres = mosquitto_publish(cp->mqtt_client, NULL, cp->mqtt_channel, bread*2, hexline, 0, 0);
-            //int mres = mosquitto_loop(cp->mqtt_client, 1, 1);
-        } else if (bread == -1 && errno == EAGAIN) {
-            // no data just now, keep looping, unless process stopped in the meantime
-            if (cp->stop != 0) {
-                break;
-            }
-        } else {
-            break;
+            mosquitto_publish(cp->mqtt_client, NULL, cp->mqtt_channel, bread*2, hexline, 0, 0);
         }
-
-        //sleep(1);
     }
     capture_process_stop(cp);
     ct_remove_capture_process(cp);
@@ -345,21 +398,13 @@ tc_start_mqtt_capture_for(const char* device_mac) {
         return -2;
     }
 
-    char cmdline[256];
-    snprintf(cmdline, 255, "tcpdump --immediate-mode -s 1600 -w - ether host %s 2>/dev/null", device_mac);
-    if (cp->process == NULL) {
-        cp->process = popen(cmdline, "r");
-    }
-
-    if (cp->process == NULL) {
+    cp->subscription = ce_subscribe(device_mac, NULL, NULL);
+    if (cp->subscription == NULL) {
         // error!
         ct_remove_capture_process(cp);
         return -3;
     }
 
-    int d = fileno(cp->process);
-    fcntl(d, F_SETFL, O_NONBLOCK);
-
     // make a thread to read and send its data
     if(pthread_create(&capture_thread, NULL, process_mqtt_capture, cp)) {
         fprintf(stderr, "Error creating thread: %s\n", strerror(errno));
@@ -380,6 +425,7 @@ tc_answer_direct_capture_request(struct MHD_Connection *connection,
     int ret;
     const char* device_mac = MHD_lookup_connection_value (connection, MHD_GET_ARGUMENT_KIND, "device");
     capture_process_t* ld = ct_add_capture_process(device_mac);
+    ld->connection = connection;
 
     response = MHD_create_response_from_callback(-1,
                                                  64,
@@ -1,3 +1,4 @@
+void tc_init(int use_suspend, const char* interface);
 int tc_answer_direct_capture_request(struct MHD_Connection* connection, const char* url);
 int tc_answer_mqtt_capture_request(struct MHD_Connection* connection, const char* url);
 void tc_stop_all_captures();
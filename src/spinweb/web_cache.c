@@ -0,0 +1,409 @@
+#include "config.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+
+#include "util.h"
+#include "web_cache.h"
+
+#define WEB_CACHE_PATH_SIZE 256
+// files smaller than this are not worth compressing
+#define WEB_CACHE_COMPRESS_MIN 256
+
+static const struct {
+    const char* extension;
+    const char* content_type;
+} content_types[] = {
+    { ".html", "text/html" },
+    { ".htm", "text/html" },
+    { ".css", "text/css" },
+    { ".js", "application/javascript" },
+    { ".json", "application/json" },
+    { ".map", "application/json" },
+    { ".txt", "text/plain" },
+    { ".svg", "image/svg+xml" },
+    { ".png", "image/png" },
+    { ".jpg", "image/jpeg" },
+    { ".jpeg", "image/jpeg" },
+    { ".gif", "image/gif" },
+    { ".ico", "image/x-icon" },
+    { ".woff", "font/woff" },
+    { ".woff2", "font/woff2" },
+    { ".ttf", "font/ttf" },
+    { NULL, NULL }
+};
+
+/*
+ * Returns the content type for the given file name, based on its
+ * extension, or NULL if it is not known
+ */
+static const char*
+content_type_for(const char* name) {
+    size_t name_len = strlen(name);
+    int i;
+
+    for (i = 0; content_types[i].extension != NULL; i++) {
+        size_t ext_len = strlen(content_types[i].extension);
+        if (name_len > ext_len &&
+            strcasecmp(name + name_len - ext_len, content_types[i].extension) == 0) {
+            return content_types[i].content_type;
+        }
+    }
+    return NULL;
+}
+
+static int
+content_type_compressible(const char* content_type) {
+    if (content_type == NULL) {
+        return 0;
+    }
+    return strncmp(content_type, "text/", 5) == 0 ||
+           strcmp(content_type, "application/javascript") == 0 ||
+           strcmp(content_type, "application/json") == 0 ||
+           strcmp(content_type, "image/svg+xml") == 0;
+}
+
+/*
+ * 64-bit FNV-1a hash of the data, used for the entity tags
+ */
+static uint64_t
+fnv1a64(const char* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/*
+ * Reads the entire file; the result is NUL-terminated
+ * Returns NULL on error
+ */
+static char*
+read_whole_file(const char* path, size_t* size) {
+    struct stat st;
+    FILE* fp;
+    char* data;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+    if (fstat(fileno(fp), &st) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    data = malloc(st.st_size + 1);
+    if (data == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+    if (st.st_size > 0 && fread(data, st.st_size, 1, fp) != 1) {
+        free(data);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+    data[st.st_size] = '\0';
+    *size = st.st_size;
+    return data;
+}
+
+#ifdef HAVE_LIBZ
+/*
+ * Returns a gzip-compressed copy of the data, or NULL if that is
+ * not smaller than the original
+ */
+static char*
+gzip_data(const char* data, size_t size, size_t* gz_size) {
+    z_stream zs;
+    char* out;
+    size_t out_size;
+
+    memset(&zs, 0, sizeof(zs));
+    // 15 + 16: maximum window, with a gzip header and trailer
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    out_size = deflateBound(&zs, size);
+    out = malloc(out_size);
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef*)data;
+    zs.avail_in = size;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = out_size;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= size) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    *gz_size = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+#endif
+
+web_cache_t*
+web_cache_create(void) {
+    web_cache_t* cache = malloc(sizeof(web_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->entries = tree_create(cmp_strs);
+    cache->roots = 0;
+    cache->total_size = 0;
+    return cache;
+}
+
+void
+web_cache_destroy(web_cache_t* cache) {
+    tree_entry_t* cur;
+
+    cur = tree_first(cache->entries);
+    while (cur != NULL) {
+        web_cache_entry_t* entry = (web_cache_entry_t*)cur->data;
+        free(entry->data);
+        free(entry->gz_data);
+        cur = tree_next(cur);
+    }
+    tree_destroy(cache->entries);
+    free(cache);
+}
+
+/*
+ * Adds one file to the cache; name is the path relative to the base
+ * directory (starting with a /)
+ * Returns 1 if a new entry was created, 0 otherwise
+ */
+static int
+web_cache_add_file(web_cache_t* cache, const char* name, const char* path) {
+    char key[WEB_CACHE_PATH_SIZE];
+    size_t name_len = strlen(name);
+    int gzipped = 0;
+    tree_entry_t* existing;
+    web_cache_entry_t* entry;
+    web_cache_entry_t new_entry;
+    char* data;
+    size_t size;
+
+    if (name_len >= WEB_CACHE_PATH_SIZE) {
+        return 0;
+    }
+    strcpy(key, name);
+    if (name_len > 3 && strcmp(key + name_len - 3, ".gz") == 0) {
+        key[name_len - 3] = '\0';
+        gzipped = 1;
+    }
+
+    existing = tree_find(cache->entries, strlen(key) + 1, key);
+    if (existing != NULL && ((web_cache_entry_t*)existing->data)->root != cache->roots - 1) {
+        // overridden by a directory that was loaded earlier
+        return 0;
+    }
+
+    data = read_whole_file(path, &size);
+    if (data == NULL) {
+        fprintf(stderr, "Error reading %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    cache->total_size += size;
+
+    if (existing == NULL) {
+        memset(&new_entry, 0, sizeof(new_entry));
+        new_entry.data = data;
+        new_entry.size = size;
+        new_entry.gzip_only = gzipped;
+        new_entry.content_type = content_type_for(key);
+        new_entry.root = cache->roots - 1;
+        tree_add(cache->entries, strlen(key) + 1, key, sizeof(new_entry), &new_entry, 1);
+        return 1;
+    }
+
+    // both <name> and <name>.gz exist; combine them
+    entry = (web_cache_entry_t*)existing->data;
+    if (gzipped) {
+        entry->gz_data = data;
+        entry->gz_size = size;
+    } else {
+        entry->gz_data = entry->data;
+        entry->gz_size = entry->size;
+        entry->data = data;
+        entry->size = size;
+        entry->gzip_only = 0;
+    }
+    return 0;
+}
+
+static int
+web_cache_load_dir(web_cache_t* cache, const char* base_path, const char* rel_path) {
+    char path[WEB_CACHE_PATH_SIZE];
+    char name[WEB_CACHE_PATH_SIZE];
+    struct dirent* dentry;
+    struct stat st;
+    DIR* dir;
+    int count = 0;
+
+    snprintf(path, sizeof(path), "%s%s", base_path, rel_path);
+    dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((dentry = readdir(dir)) != NULL) {
+        // skip ., .. and hidden files
+        if (dentry->d_name[0] == '.') {
+            continue;
+        }
+        if (snprintf(name, sizeof(name), "%s/%s", rel_path, dentry->d_name) >= (int)sizeof(name) ||
+            snprintf(path, sizeof(path), "%s%s", base_path, name) >= (int)sizeof(path)) {
+            fprintf(stderr, "Path too long, not serving %s%s\n", base_path, name);
+            continue;
+        }
+        if (stat(path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            int sub_count = web_cache_load_dir(cache, base_path, name);
+            if (sub_count > 0) {
+                count += sub_count;
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            count += web_cache_add_file(cache, name, path);
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+int
+web_cache_load(web_cache_t* cache, const char* base_path, int compress) {
+    tree_entry_t* cur;
+    int root = cache->roots++;
+    int count;
+
+    count = web_cache_load_dir(cache, base_path, "");
+    if (count < 0) {
+        return -1;
+    }
+
+    // Now that all files of this directory are known, compute the
+    // entity tags and missing gzip variants
+    cur = tree_first(cache->entries);
+    while (cur != NULL) {
+        web_cache_entry_t* entry = (web_cache_entry_t*)cur->data;
+        if (entry->root == root) {
+#ifdef HAVE_LIBZ
+            if (compress && !entry->gzip_only && entry->gz_data == NULL &&
+                entry->size >= WEB_CACHE_COMPRESS_MIN &&
+                content_type_compressible(entry->content_type)) {
+                entry->gz_data = gzip_data(entry->data, entry->size, &entry->gz_size);
+                if (entry->gz_data != NULL) {
+                    cache->total_size += entry->gz_size;
+                }
+            }
+#else
+            (void)content_type_compressible;
+#endif
+            snprintf(entry->etag, WEB_CACHE_ETAG_SIZE, "\"%016llx\"",
+                     (unsigned long long)fnv1a64(entry->data, entry->size));
+            if (entry->gz_data != NULL) {
+                snprintf(entry->gz_etag, WEB_CACHE_ETAG_SIZE, "\"%016llx-gz\"",
+                         (unsigned long long)fnv1a64(entry->gz_data, entry->gz_size));
+            }
+        }
+        cur = tree_next(cur);
+    }
+    return count;
+}
+
+static web_cache_entry_t*
+web_cache_get(web_cache_t* cache, const char* key) {
+    tree_entry_t* t_entry = tree_find(cache->entries, strlen(key) + 1, key);
+    if (t_entry == NULL) {
+        return NULL;
+    }
+    return (web_cache_entry_t*)t_entry->data;
+}
+
+web_cache_entry_t*
+web_cache_find(web_cache_t* cache, const char* path) {
+    char key[WEB_CACHE_PATH_SIZE];
+    web_cache_entry_t* entry;
+    size_t path_len = strlen(path);
+
+    if (path_len == 0 || path_len + 11 > WEB_CACHE_PATH_SIZE) {
+        return NULL;
+    }
+
+    entry = web_cache_get(cache, path);
+    if (entry != NULL) {
+        return entry;
+    }
+
+    snprintf(key, sizeof(key), "%s.html", path);
+    entry = web_cache_get(cache, key);
+    if (entry != NULL) {
+        return entry;
+    }
+
+    if (path[path_len - 1] == '/') {
+        snprintf(key, sizeof(key), "%sindex.html", path);
+        return web_cache_get(cache, key);
+    }
+    return NULL;
+}
+
+int
+web_cache_etag_matches(const char* if_none_match, const char* etag) {
+    const char* p = if_none_match;
+    size_t etag_len = strlen(etag);
+
+    if (p == NULL) {
+        return 0;
+    }
+    while (*p != '\0') {
+        const char* end;
+        size_t len;
+
+        while (*p == ' ' || *p == '\t' || *p == ',') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        end = strchr(p, ',');
+        if (end == NULL) {
+            end = p + strlen(p);
+        }
+        len = end - p;
+        while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t')) {
+            len--;
+        }
+        if (len == 1 && *p == '*') {
+            return 1;
+        }
+        // If-None-Match uses the weak comparison function
+        if (len > 2 && strncmp(p, "W/", 2) == 0) {
+            p += 2;
+            len -= 2;
+        }
+        if (len == etag_len && strncmp(p, etag, len) == 0) {
+            return 1;
+        }
+        p = end;
+    }
+    return 0;
+}
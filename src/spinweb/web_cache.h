@@ -0,0 +1,77 @@
+#ifndef SPINWEB_WEB_CACHE_H
+#define SPINWEB_WEB_CACHE_H 1
+
+#include <stddef.h>
+
+#include "tree.h"
+
+/*
+ * In-memory cache of the files spinweb serves (static/ and templates/)
+ *
+ * The directories are read once at startup; after that, requests
+ * for these files are answered from memory without any disk I/O.
+ * Responses can point directly into the cached data (they are
+ * created with MHD_RESPMEM_PERSISTENT), so entries are never changed
+ * or freed while the daemons are running.
+ */
+
+#define WEB_CACHE_ETAG_SIZE 24
+
+typedef struct {
+    // file contents (always NUL-terminated, the terminator is not
+    // included in size)
+    char* data;
+    size_t size;
+    // gzip-compressed variant of the contents, NULL if there is none
+    char* gz_data;
+    size_t gz_size;
+    // set if only a gzipped version of the file exists (<file>.gz
+    // on disk); data then holds the compressed contents and gz_data
+    // is NULL
+    int gzip_only;
+    // strong entity tags (including the quotes) for both variants
+    char etag[WEB_CACHE_ETAG_SIZE];
+    char gz_etag[WEB_CACHE_ETAG_SIZE];
+    const char* content_type;
+    // index of the directory the file was loaded from
+    int root;
+} web_cache_entry_t;
+
+typedef struct {
+    // url path -> web_cache_entry_t
+    tree_t* entries;
+    int roots;
+    size_t total_size;
+} web_cache_t;
+
+web_cache_t* web_cache_create(void);
+void web_cache_destroy(web_cache_t* cache);
+
+/*
+ * Adds all regular files below base_path to the cache, keyed by their
+ * path relative to base_path (starting with a /).
+ * Files that are already in the cache (from an earlier call) are not
+ * replaced, so the directories should be loaded in order of precedence.
+ * A file <name>.gz is stored as the gzipped variant of <name>.
+ * If compress is non-zero, and spinweb was built with zlib, a gzip
+ * variant is computed for text files that do not have one.
+ *
+ * Returns the number of files that were added, or -1 if base_path
+ * could not be read.
+ */
+int web_cache_load(web_cache_t* cache, const char* base_path, int compress);
+
+/*
+ * Finds the entry for the given url path; like try_files(), this
+ * tries the path itself, the path with '.html', and (if the path
+ * ends with /) the path with 'index.html', in that order.
+ * Returns NULL if none of them is in the cache.
+ */
+web_cache_entry_t* web_cache_find(web_cache_t* cache, const char* path);
+
+/*
+ * Returns 1 if the given If-None-Match header value matches etag
+ */
+int web_cache_etag_matches(const char* if_none_match, const char* etag);
+
+#endif // SPINWEB_WEB_CACHE_H
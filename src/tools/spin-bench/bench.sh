@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Runs the standard spin-bench scenarios, each against a fresh spind in
+# passive mode, and prints their reports.
+#
+# Usage: bench.sh [scenario ...]
+#
+# SPIND and SPIN_BENCH are the programs to use; SPIND_ARGS are passed on to
+# spind, e.g. "-m host -p port" for the MQTT broker that spind connects to,
+# or "-c file" for its configuration. BENCH_TIME is the duration of every
+# scenario in seconds.
+
+SPIND=${SPIND:-spind}
+SPIN_BENCH=${SPIN_BENCH:-spin-bench}
+BENCH_TIME=${BENCH_TIME:-30}
+
+# name and spin-bench options of every scenario
+scenario() {
+	case "$1" in
+	flows)	echo "-n 50 -H 1000 -D 0 -r 20000" ;;
+	dns)	echo "-n 50 -H 1000 -D 0.5 -r 20000" ;;
+	churn)	echo "-n 50 -H 1000 -D 0.2 -c 0.5 -r 10000" ;;
+	cdn)	echo "-n 50 -H 5000 -D 0.3 -C 20 -r 10000" ;;
+	mixed)	echo "-n 200 -H 10000 -D 0.1 -c 0.05 -C 500 -r 20000" ;;
+	*)	return 1 ;;
+	esac
+}
+
+if [ $# -eq 0 ]; then
+	set -- flows dns churn cdn mixed
+fi
+for name in "$@"; do
+	if ! scenario "$name" >/dev/null; then
+		echo "unknown scenario: $name" >&2
+		exit 1
+	fi
+done
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+
+status=0
+for name in "$@"; do
+	$SPIND -o -P -e "$dir/extsrc.sock" -j "$dir/rpc.sock" $SPIND_ARGS \
+	    >"$dir/spind.log" 2>&1 &
+	pid=$!
+
+	# the RPC socket comes last, once spind is connected to MQTT
+	i=0
+	while [ ! -S "$dir/rpc.sock" ]; do
+		if ! kill -0 $pid 2>/dev/null || [ $i -ge 120 ]; then
+			echo "spind did not start; its output was:" >&2
+			cat "$dir/spind.log" >&2
+			kill $pid 2>/dev/null
+			exit 1
+		fi
+		sleep 0.5
+		i=$((i + 1))
+	done
+
+	$SPIN_BENCH -N "$name" -p $pid -t "$BENCH_TIME" \
+	    -e "$dir/extsrc.sock" -j "$dir/rpc.sock" $(scenario "$name") ||
+	    status=1
+	echo
+
+	kill $pid
+	wait $pid
+	rm -f "$dir/extsrc.sock" "$dir/rpc.sock"
+done
+
+exit $status
@@ -0,0 +1,734 @@
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "socket.h"
+#include "workload.h"
+
+/* spind/lib includes */
+#include "extsrc.h"
+#include "jsmn.h"
+
+/* JSON_RPC_SOCKET_PATH in spind */
+#define RPC_SOCKET_PATH		"/var/run/spin_rpc.sock"
+
+/* how often spind is asked how far it has come, in ms */
+#define POLL_INTERVAL		10
+/* how often messages are sent when the rate is limited, in ms */
+#define TICK			1
+/* messages per flush when the rate is not limited */
+#define BURST			1000
+
+/*
+ * Latency is measured without changing spind: the sender records how many
+ * messages it had sent at what time (a checkpoint), and a poller thread
+ * records how many messages spind had processed at what time (a sample),
+ * according to the counters of list_extsrc_clients. The latency of the
+ * messages of a checkpoint is the time until the first sample in which all
+ * of them were processed, so its resolution is the polling interval.
+ */
+struct point {
+	double		 t;
+	unsigned long	 n;
+};
+
+struct series {
+	struct point	*points;
+	size_t		 count;
+	size_t		 size;
+};
+
+struct rpc {
+	int		 fd;
+	char		*buf;
+	size_t		 len;
+	size_t		 size;
+	int		 id;
+};
+
+struct stat_entry {
+	char		 module[32];
+	char		 name[32];
+	int		 type;
+	long		 value;
+	long		 count;
+};
+
+struct stats {
+	struct stat_entry *entries;
+	int		 count;
+};
+
+static int vflag;	/* verbose */
+
+static struct series checkpoints;
+static struct series samples;
+static unsigned long processed_base;
+static unsigned long processed_last;	/* updated by the poller */
+static int stop_polling;
+
+static void
+usage(const char *error)
+{
+	extern char *__progname;
+
+	if (error)
+		fprintf(stderr, "%s\n", error);
+	fprintf(stderr, "Usage: %s [-mv] [-C cdn-pool] [-c churn] [-D dns]\n",
+	    __progname);
+	fprintf(stderr, "\t[-e extsrc-socket-path] [-E extsrc-host] "
+	    "[-H remote-hosts]\n");
+	fprintf(stderr, "\t[-j rpc-socket-path] [-N name] [-n devices] "
+	    "[-p spind-pid]\n");
+	fprintf(stderr, "\t[-r rate] [-S seed] [-t seconds] "
+	    "[-w drain-timeout]\n");
+	exit(1);
+}
+
+static void
+verbose(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (vflag) {
+		va_start(ap, fmt);
+		vwarnx(fmt, ap);
+		va_end(ap);
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sleep_until(double t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t;
+	ts.tv_nsec = (t - ts.tv_sec) * 1e9;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	    EINTR)
+		;
+}
+
+/* the time of an event for extsrc, in microseconds since the epoch */
+static uint64_t
+timestamp(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+series_add(struct series *s, double t, unsigned long n)
+{
+	struct point *points;
+
+	if (s->count == s->size) {
+		s->size = s->size ? 2 * s->size : 1024;
+		points = reallocarray(s->points, s->size, sizeof(*points));
+		if (points == NULL)
+			err(1, "reallocarray");
+		s->points = points;
+	}
+	s->points[s->count].t = t;
+	s->points[s->count].n = n;
+	s->count++;
+}
+
+static double
+parse_number(const char *s, double min, double max, const char *error)
+{
+	char *end;
+	double d;
+
+	errno = 0;
+	d = strtod(s, &end);
+	if (errno || *s == '\0' || *end != '\0' || d < min || d > max)
+		usage(error);
+	return d;
+}
+
+/*
+ * JSON-RPC over spind's unix socket, keeping the connection open
+ */
+static struct rpc *
+rpc_open(const char *path)
+{
+	struct sockaddr_un s_un;
+	struct rpc *rpc;
+
+	if ((rpc = calloc(1, sizeof(*rpc))) == NULL)
+		err(1, "calloc");
+	rpc->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (rpc->fd == -1)
+		err(1, "socket");
+
+	memset(&s_un, 0, sizeof(s_un));
+	s_un.sun_family = AF_UNIX;
+	if (snprintf(s_un.sun_path, sizeof(s_un.sun_path), "%s",
+	    path) >= (ssize_t)sizeof(s_un.sun_path))
+		errx(1, "%s: socket path too long", path);
+	if (connect(rpc->fd, (struct sockaddr *)&s_un, sizeof(s_un)) == -1)
+		err(1, "connect: %s", path);
+	return rpc;
+}
+
+static void
+rpc_close(struct rpc *rpc)
+{
+	close(rpc->fd);
+	free(rpc->buf);
+	free(rpc);
+}
+
+/*
+ * Calls a method without parameters; returns the response, which stays
+ * valid until the next call. Exits if spind goes away.
+ */
+static char *
+rpc_call(struct rpc *rpc, const char *method)
+{
+	char request[128];
+	char *nl, *buf;
+	size_t len;
+	ssize_t n;
+
+	len = snprintf(request, sizeof(request), "{\"jsonrpc\": \"2.0\", "
+	    "\"id\": %d, \"method\": \"%s\", \"keepalive\": true}",
+	    ++rpc->id, method);
+	if (write(rpc->fd, request, len) != (ssize_t)len)
+		err(1, "write to JSON-RPC socket");
+
+	/* drop the previous response */
+	rpc->len = 0;
+	for (;;) {
+		if (rpc->len > 0 &&
+		    (nl = memchr(rpc->buf, '\n', rpc->len)) != NULL) {
+			*nl = '\0';
+			return rpc->buf;
+		}
+		if (rpc->size - rpc->len < 4096) {
+			rpc->size = rpc->size ? 2 * rpc->size : 65536;
+			if ((buf = realloc(rpc->buf, rpc->size)) == NULL)
+				err(1, "realloc");
+			rpc->buf = buf;
+		}
+		n = read(rpc->fd, rpc->buf + rpc->len, rpc->size - rpc->len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1)
+			err(1, "read from JSON-RPC socket");
+		if (n == 0)
+			errx(1, "spind closed the JSON-RPC connection");
+		rpc->len += n;
+	}
+}
+
+static jsmntok_t *
+json_parse(const char *js, int *ntokens)
+{
+	jsmn_parser parser;
+	jsmntok_t *tokens;
+	int n;
+
+	jsmn_init(&parser);
+	n = jsmn_parse(&parser, js, strlen(js), NULL, 0);
+	if (n < 1)
+		errx(1, "invalid JSON-RPC response: %s", js);
+	if ((tokens = calloc(n, sizeof(*tokens))) == NULL)
+		err(1, "calloc");
+	jsmn_init(&parser);
+	jsmn_parse(&parser, js, strlen(js), tokens, n);
+	*ntokens = n;
+	return tokens;
+}
+
+static int
+json_eq(const char *js, const jsmntok_t *tok, const char *s)
+{
+	return tok->type == JSMN_STRING &&
+	    (int)strlen(s) == tok->end - tok->start &&
+	    strncmp(js + tok->start, s, tok->end - tok->start) == 0;
+}
+
+static void
+json_copy(char *dst, size_t size, const char *js, const jsmntok_t *tok)
+{
+	snprintf(dst, size, "%.*s", tok->end - tok->start, js + tok->start);
+}
+
+/*
+ * Returns the index of the elements of the "result" array, and sets
+ * *nelements; -1 if there is no such array
+ */
+static int
+json_result(const char *js, const jsmntok_t *tokens, int n, int *nelements)
+{
+	int i;
+
+	for (i = 1; i < n - 1; i++) {
+		if (json_eq(js, &tokens[i], "result") &&
+		    tokens[i + 1].type == JSMN_ARRAY) {
+			*nelements = tokens[i + 1].size;
+			return i + 2;
+		}
+	}
+	return -1;
+}
+
+/*
+ * The number of messages that spind has handled, from the response of
+ * list_extsrc_clients
+ */
+static unsigned long
+processed_count(const char *js)
+{
+	jsmntok_t *tokens;
+	unsigned long count = 0;
+	int i, n;
+
+	tokens = json_parse(js, &n);
+	for (i = 1; i < n - 1; i++) {
+		if ((json_eq(js, &tokens[i], "messages") ||
+		    json_eq(js, &tokens[i], "malformed")) &&
+		    tokens[i + 1].type == JSMN_PRIMITIVE)
+			count += strtoul(js + tokens[i + 1].start, NULL, 10);
+	}
+	free(tokens);
+	return count;
+}
+
+static unsigned long
+processed(struct rpc *rpc)
+{
+	return processed_count(rpc_call(rpc, "list_extsrc_clients"));
+}
+
+/*
+ * All statistics counters of spind (get_stats); every element of the
+ * result is an object without nested values
+ */
+static void
+stats_get(struct rpc *rpc, struct stats *stats)
+{
+	struct stat_entry *e;
+	const jsmntok_t *obj, *key, *val;
+	jsmntok_t *tokens;
+	const char *js;
+	int i, j, n, first, count;
+
+	js = rpc_call(rpc, "get_stats");
+	tokens = json_parse(js, &n);
+	first = json_result(js, tokens, n, &count);
+	if (first == -1)
+		errx(1, "get_stats failed (is spind built with statistics?)");
+
+	stats->count = 0;
+	if ((stats->entries = calloc(count, sizeof(*e))) == NULL && count > 0)
+		err(1, "calloc");
+	for (i = 0, obj = &tokens[first]; i < count;
+	    i++, obj += 1 + 2 * obj->size) {
+		if (obj->type != JSMN_OBJECT)
+			errx(1, "unexpected get_stats response: %s", js);
+		e = &stats->entries[stats->count++];
+		for (j = 0; j < obj->size; j++) {
+			key = obj + 1 + 2 * j;
+			val = key + 1;
+			if (json_eq(js, key, "module"))
+				json_copy(e->module, sizeof(e->module), js, val);
+			else if (json_eq(js, key, "name"))
+				json_copy(e->name, sizeof(e->name), js, val);
+			else if (json_eq(js, key, "type"))
+				e->type = strtol(js + val->start, NULL, 10);
+			else if (json_eq(js, key, "value"))
+				e->value = strtol(js + val->start, NULL, 10);
+			else if (json_eq(js, key, "count"))
+				e->count = strtol(js + val->start, NULL, 10);
+		}
+	}
+	free(tokens);
+}
+
+static const struct stat_entry *
+stats_find(const struct stats *stats, const struct stat_entry *e)
+{
+	int i;
+
+	for (i = 0; i < stats->count; i++) {
+		if (strcmp(stats->entries[i].module, e->module) == 0 &&
+		    strcmp(stats->entries[i].name, e->name) == 0)
+			return &stats->entries[i];
+	}
+	return NULL;
+}
+
+/*
+ * Reads a field of /proc/<pid>/status, in kB; -1 if it is not available
+ */
+static long
+proc_status(pid_t pid, const char *field)
+{
+	char path[64], line[256];
+	size_t len = strlen(field);
+	long kb = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%ld/status", (long)pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		warn("%s", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strncmp(line, field, len) == 0 && line[len] == ':') {
+			kb = strtol(line + len + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+static void *
+poller(void *arg)
+{
+	struct rpc *rpc = arg;
+	unsigned long n;
+	double next = now();
+
+	while (!__atomic_load_n(&stop_polling, __ATOMIC_RELAXED)) {
+		n = processed(rpc) - processed_base;
+		series_add(&samples, now(), n);
+		__atomic_store_n(&processed_last, n, __ATOMIC_RELAXED);
+		next += POLL_INTERVAL / 1000.0;
+		sleep_until(next);
+	}
+	return NULL;
+}
+
+struct latency {
+	double		 t;
+	unsigned long	 weight;
+};
+
+static int
+latency_cmp(const void *a, const void *b)
+{
+	const struct latency *la = a, *lb = b;
+
+	return (la->t > lb->t) - (la->t < lb->t);
+}
+
+static void
+report_latency(void)
+{
+	static const double percentiles[] = { 50, 90, 99, 100 };
+	struct latency *lat;
+	struct point *c, *s;
+	unsigned long prev = 0, total = 0, cum = 0;
+	size_t i, j, n = 0;
+
+	lat = calloc(checkpoints.count ? checkpoints.count : 1, sizeof(*lat));
+	if (lat == NULL)
+		err(1, "calloc");
+
+	/* both series are in order, so a single pass does */
+	for (i = 0, j = 0; i < checkpoints.count; i++) {
+		c = &checkpoints.points[i];
+		while (j < samples.count && (samples.points[j].n < c->n ||
+		    samples.points[j].t < c->t))
+			j++;
+		if (j == samples.count)
+			break;
+		s = &samples.points[j];
+		lat[n].t = s->t - c->t;
+		lat[n].weight = c->n - prev;
+		total += lat[n].weight;
+		prev = c->n;
+		n++;
+	}
+	if (total == 0) {
+		printf("latency: no messages were processed\n");
+		free(lat);
+		return;
+	}
+
+	qsort(lat, n, sizeof(*lat), latency_cmp);
+	printf("latency (ms):");
+	for (i = 0, j = 0; i < sizeof(percentiles) / sizeof(percentiles[0]);
+	    i++) {
+		while (j < n - 1 &&
+		    100.0 * (cum + lat[j].weight) / total < percentiles[i])
+			cum += lat[j++].weight;
+		if (percentiles[i] == 100)
+			printf(" max %.1f", 1000 * lat[n - 1].t);
+		else
+			printf(" p%.0f %.1f", percentiles[i], 1000 * lat[j].t);
+	}
+	printf(" (resolution %d)\n", POLL_INTERVAL);
+	free(lat);
+}
+
+static void
+report_stats(const struct stats *before, const struct stats *after)
+{
+	const struct stat_entry *e, *old;
+	int i;
+
+	printf("counters:\n");
+	for (i = 0; i < after->count; i++) {
+		e = &after->entries[i];
+		old = stats_find(before, e);
+		if (old && old->count == e->count)
+			continue;
+		if (e->type == 1) {
+			/* STAT_MAX */
+			printf("  %s/%s: max %ld\n", e->module, e->name,
+			    e->value);
+		} else {
+			printf("  %s/%s: %ld (%ld updates)\n", e->module,
+			    e->name, e->value - (old ? old->value : 0),
+			    e->count - (old ? old->count : 0));
+		}
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct workload_params params;
+	struct workload *w;
+	struct extsrc_msg *msg;
+	struct stats stats_before, stats_after;
+	struct rpc *rpc;
+	pthread_t thread;
+	const char *extsrc_path = NULL, *extsrc_host = NULL;
+	const char *rpc_path = RPC_SOCKET_PATH;
+	const char *name = "bench";
+	double rate = 10000, duration = 10, drain_timeout = 30;
+	double start, end, done, elapsed, target, next;
+	unsigned long sent = 0, count;
+	long rss_before = -1, rss_after = -1, hwm = -1;
+	pid_t pid = 0;
+	uint64_t ts;
+	int ch, fd, i, mflag = 0, reported = 0;
+
+	memset(&params, 0, sizeof(params));
+	params.devices = 50;
+	params.remotes = 1000;
+	params.dns = 0.1;
+	params.seed = 1;
+
+	while ((ch = getopt(argc, argv, "C:c:D:e:E:hH:j:mN:n:p:r:S:t:vw:")) !=
+	    -1) {
+		switch (ch) {
+		case 'C':
+			params.cdn = parse_number(optarg, 0, 1 << 17,
+			    "incorrect CDN pool size");
+			break;
+		case 'c':
+			params.churn = parse_number(optarg, 0, 1,
+			    "churn must be between 0 and 1");
+			break;
+		case 'D':
+			params.dns = parse_number(optarg, 0, 1,
+			    "DNS fraction must be between 0 and 1");
+			break;
+		case 'e':
+			extsrc_path = optarg;
+			break;
+		case 'E':
+			extsrc_host = optarg;
+			break;
+		case 'h':
+			usage(NULL);
+			break;
+		case 'H':
+			params.remotes = parse_number(optarg, 1, 1 << 17,
+			    "incorrect number of remote hosts");
+			break;
+		case 'j':
+			rpc_path = optarg;
+			break;
+		case 'm':
+			mflag = 1;
+			break;
+		case 'N':
+			name = optarg;
+			break;
+		case 'n':
+			params.devices = parse_number(optarg, 1, 1 << 24,
+			    "incorrect number of devices");
+			break;
+		case 'p':
+			pid = parse_number(optarg, 1, 1 << 30,
+			    "incorrect pid");
+			break;
+		case 'r':
+			rate = parse_number(optarg, 0, 1e9, "incorrect rate");
+			break;
+		case 'S':
+			params.seed = parse_number(optarg, 0, 4294967295.0,
+			    "incorrect seed");
+			break;
+		case 't':
+			duration = parse_number(optarg, 0.1, 86400,
+			    "incorrect duration");
+			break;
+		case 'v':
+			vflag = 1;
+			break;
+		case 'w':
+			drain_timeout = parse_number(optarg, 0, 86400,
+			    "incorrect drain timeout");
+			break;
+		default:
+			usage(NULL);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		usage(NULL);
+	if (extsrc_path && extsrc_host)
+		usage("cannot specify both an extsrc host and socket path");
+	if (mflag && extsrc_host)
+		usage("a shared memory ring requires the extsrc socket path");
+
+	signal(SIGPIPE, SIG_IGN);
+
+	w = workload_create(&params);
+	rpc = rpc_open(rpc_path);
+	fd = socket_open(extsrc_path, extsrc_host);
+	if (mflag && socket_open_ring(fd) == -1)
+		errx(1, "could not set up the shared memory ring");
+
+	stats_get(rpc, &stats_before);
+	processed_base = processed(rpc);
+	if (pid)
+		rss_before = proc_status(pid, "VmRSS");
+
+	/* spind should know the devices before their traffic comes in */
+	ts = timestamp();
+	for (i = 0; i < params.devices; i++) {
+		msg = workload_device(w, i, ts);
+		socket_writemsg(fd, msg);
+		extsrc_msg_free(msg);
+	}
+	socket_flush(fd);
+	start = now();
+	while ((count = processed(rpc) - processed_base) <
+	    (unsigned long)params.devices) {
+		if (now() - start > drain_timeout)
+			errx(1, "spind processed %lu of %d device updates; is "
+			    "it listening on this extsrc socket?", count,
+			    params.devices);
+		usleep(POLL_INTERVAL * 1000);
+	}
+	processed_base += count;
+	verbose("%d devices known to spind", params.devices);
+
+	if ((errno = pthread_create(&thread, NULL, poller, rpc)) != 0)
+		err(1, "pthread_create");
+
+	start = next = now();
+	while ((elapsed = now() - start) < duration) {
+		target = rate > 0 ? rate * elapsed : sent + BURST;
+		ts = timestamp();
+		while (sent < target) {
+			msg = workload_next(w, ts);
+			socket_writemsg(fd, msg);
+			extsrc_msg_free(msg);
+			sent++;
+		}
+		socket_flush(fd);
+		series_add(&checkpoints, now(), sent);
+
+		if ((int)elapsed > reported) {
+			reported = elapsed;
+			verbose("%d s: %lu sent, %lu processed", reported,
+			    sent, __atomic_load_n(&processed_last,
+			    __ATOMIC_RELAXED));
+		}
+		if (rate > 0) {
+			next += TICK / 1000.0;
+			sleep_until(next);
+		}
+	}
+	end = now();
+
+	/* wait until spind has caught up */
+	while ((count = __atomic_load_n(&processed_last, __ATOMIC_RELAXED)) <
+	    sent && now() - end < drain_timeout)
+		usleep(POLL_INTERVAL * 1000);
+	__atomic_store_n(&stop_polling, 1, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	done = samples.count ? samples.points[samples.count - 1].t : end;
+	for (i = 0; i < (int)samples.count; i++) {
+		if (samples.points[i].n >= sent) {
+			done = samples.points[i].t;
+			break;
+		}
+	}
+
+	stats_get(rpc, &stats_after);
+	if (pid) {
+		rss_after = proc_status(pid, "VmRSS");
+		hwm = proc_status(pid, "VmHWM");
+	}
+
+	printf("scenario: %s\n", name);
+	printf("devices: %d, remote hosts: %lu\n", params.devices,
+	    workload_hosts(w));
+	printf("sent: %lu messages in %.2f s (%.0f/s)\n", sent, end - start,
+	    sent / (end - start));
+	printf("processed: %lu messages in %.2f s (%.0f/s)\n", count,
+	    done - start, count / (done - start));
+	if (count < sent)
+		printf("unprocessed: %lu messages after %.0f s\n",
+		    sent - count, drain_timeout);
+	else
+		printf("drain: %.2f s\n", done > end ? done - end : 0);
+	report_latency();
+	if (rss_before >= 0 && rss_after >= 0)
+		printf("rss (kB): before %ld, after %ld, growth %ld, "
+		    "peak %ld\n", rss_before, rss_after,
+		    rss_after - rss_before, hwm);
+	report_stats(&stats_before, &stats_after);
+
+	socket_close(fd);
+	rpc_close(rpc);
+	workload_destroy(w);
+	free(stats_before.entries);
+	free(stats_after.entries);
+	free(checkpoints.points);
+	free(samples.points);
+
+	return count < sent;
+}
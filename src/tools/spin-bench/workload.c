@@ -0,0 +1,232 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extsrc.h"
+#include "pkt_info.h"
+#include "util.h"
+#include "workload.h"
+
+/* the first address of the ranges in the description in workload.h */
+#define DEVICE_NET	0x0a000001	/* 10.0.0.1 */
+#define REMOTE_NET	0xc6120000	/* 198.18.0.0 */
+#define FRESH_NET	0x64400000	/* 100.64.0.0 */
+#define MAX_DEVICES	(1 << 24)
+#define MAX_REMOTES	(1 << 17)
+#define MAX_FRESH	(1 << 22)
+
+#define DNS_TTL		300
+
+struct workload {
+	struct workload_params	 params;
+	uint64_t		 state;		/* of the random generator */
+	unsigned long		 fresh;		/* hosts introduced by churn */
+	uint32_t		 pending;	/* device + 1 that looked up a
+						   fresh host, to connect to it */
+	struct extsrc_msg	*answer;	/* to follow a query */
+};
+
+/*
+ * xorshift64*; the workload must be the same on every system for a seed
+ */
+static uint64_t
+next_random(struct workload *w)
+{
+	w->state ^= w->state >> 12;
+	w->state ^= w->state << 25;
+	w->state ^= w->state >> 27;
+	return w->state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t
+uniform(struct workload *w, uint32_t n)
+{
+	return (next_random(w) >> 32) % n;
+}
+
+static int
+chance(struct workload *w, double p)
+{
+	return (next_random(w) >> 11) * (1.0 / (1ULL << 53)) < p;
+}
+
+static void
+set_ipv4(uint8_t *addr, uint32_t a)
+{
+	memset(addr, 0, 12);
+	addr[12] = a >> 24;
+	addr[13] = a >> 16;
+	addr[14] = a >> 8;
+	addr[15] = a;
+}
+
+/*
+ * The address of remote host k; with a CDN pool, it is one of the pool
+ */
+static void
+remote_addr(struct workload *w, uint32_t k, uint8_t *addr)
+{
+	if (w->params.cdn)
+		k = uniform(w, w->params.cdn);
+	set_ipv4(addr, REMOTE_NET + k);
+}
+
+/*
+ * Converts a name to the wire format that dns_pkt_info_t uses
+ */
+static void
+set_dname(char *dname, size_t size, const char *name)
+{
+	const char *label, *dot;
+	size_t len, pos = 0;
+
+	for (label = name; *label != '\0'; label = dot + 1) {
+		dot = strchr(label, '.');
+		if (dot == NULL)
+			dot = label + strlen(label);
+		len = dot - label;
+		if (len == 0 || len > 63 || pos + len + 2 > size)
+			errx(1, "%s: invalid name", name);
+		dname[pos++] = len;
+		memcpy(dname + pos, label, len);
+		pos += len;
+		if (*dot == '\0')
+			break;
+	}
+	dname[pos] = '\0';
+}
+
+struct workload *
+workload_create(const struct workload_params *params)
+{
+	struct workload *w;
+
+	if (params->devices < 1 || params->devices > MAX_DEVICES)
+		errx(1, "number of devices must be between 1 and %d",
+		    MAX_DEVICES);
+	if (params->remotes < 1 || params->remotes > MAX_REMOTES)
+		errx(1, "number of remote hosts must be between 1 and %d",
+		    MAX_REMOTES);
+	if (params->cdn < 0 || params->cdn > params->remotes)
+		errx(1, "CDN pool cannot be larger than the number of "
+		    "remote hosts");
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		err(1, "calloc");
+	w->params = *params;
+	w->state = params->seed * 0x9e3779b97f4a7c15ULL + 1;
+	return w;
+}
+
+void
+workload_destroy(struct workload *w)
+{
+	if (w->answer)
+		extsrc_msg_free(w->answer);
+	free(w);
+}
+
+struct extsrc_msg *
+workload_device(struct workload *w, int i, uint64_t ts)
+{
+	struct extsrc_arp_table_update up;
+	uint32_t n = i + 1;
+
+	memset(&up, 0, sizeof(up));
+	snprintf(up.mac, sizeof(up.mac), "02:5b:00:%02x:%02x:%02x",
+	    (n >> 16) & 0xff, (n >> 8) & 0xff, n & 0xff);
+	up.ip.family = AF_INET;
+	up.ip.netmask = 32;
+	set_ipv4(up.ip.addr, DEVICE_NET + i);
+	return extsrc_msg_create_arp_table_update(&up, ts);
+}
+
+/*
+ * A lookup by a device: the query is returned, the answer is kept for the
+ * next call
+ */
+static struct extsrc_msg *
+lookup(struct workload *w, uint32_t device, uint64_t ts)
+{
+	dns_pkt_info_t dns_pkt;
+	uint8_t src_addr[16];
+	char name[64];
+	struct extsrc_msg *query;
+	uint32_t k;
+
+	memset(&dns_pkt, 0, sizeof(dns_pkt));
+	dns_pkt.family = AF_INET;
+	dns_pkt.ttl = DNS_TTL;
+	if (w->params.churn > 0 && chance(w, w->params.churn)) {
+		w->fresh++;
+		w->pending = device + 1;
+		snprintf(name, sizeof(name), "n%lu.churn.example", w->fresh);
+		set_ipv4(dns_pkt.ip, FRESH_NET + w->fresh % MAX_FRESH);
+	} else {
+		k = uniform(w, w->params.remotes);
+		snprintf(name, sizeof(name), "h%u.bench.example", k);
+		remote_addr(w, k, dns_pkt.ip);
+	}
+	set_dname(dns_pkt.dname, sizeof(dns_pkt.dname), name);
+
+	set_ipv4(src_addr, DEVICE_NET + device);
+	query = extsrc_msg_create_dns_query(&dns_pkt, AF_INET, src_addr, ts);
+	w->answer = extsrc_msg_create_dns_answer(&dns_pkt, ts);
+	return query;
+}
+
+static struct extsrc_msg *
+flow(struct workload *w, uint32_t device, uint64_t ts)
+{
+	pkt_info_t pkt;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.family = AF_INET;
+	set_ipv4(pkt.src_addr, DEVICE_NET + device);
+	if (w->pending) {
+		/* connect to the host that was just looked up */
+		w->pending = 0;
+		set_ipv4(pkt.dest_addr, FRESH_NET + w->fresh % MAX_FRESH);
+	} else {
+		remote_addr(w, uniform(w, w->params.remotes), pkt.dest_addr);
+	}
+	pkt.protocol = uniform(w, 4) == 0 ? IPPROTO_UDP : IPPROTO_TCP;
+	pkt.src_port = 1024 + uniform(w, 64512);
+	pkt.dest_port = 443;
+	pkt.packet_count = 1 + uniform(w, 16);
+	pkt.payload_size = pkt.packet_count * (40 + uniform(w, 1460));
+	return extsrc_msg_create_pkt_info(&pkt, ts);
+}
+
+struct extsrc_msg *
+workload_next(struct workload *w, uint64_t ts)
+{
+	struct extsrc_msg *msg;
+	uint32_t device;
+
+	if (w->answer) {
+		msg = w->answer;
+		w->answer = NULL;
+		return msg;
+	}
+
+	if (w->pending)
+		return flow(w, w->pending - 1, ts);
+
+	device = uniform(w, w->params.devices);
+	if (w->params.dns > 0 && chance(w, w->params.dns))
+		return lookup(w, device, ts);
+	return flow(w, device, ts);
+}
+
+unsigned long
+workload_hosts(struct workload *w)
+{
+	return (w->params.cdn ? w->params.cdn : w->params.remotes) + w->fresh;
+}
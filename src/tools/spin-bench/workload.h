@@ -0,0 +1,45 @@
+#include <stdint.h>
+
+/*
+ * Synthetic traffic for spind, as a spin-pcap-reader on a busy home network
+ * would report it: a number of local devices talk to a population of remote
+ * hosts, and look up the names of those hosts now and then.
+ *
+ * Devices get addresses from 10.0.0.0/8, remote hosts from 198.18.0.0/15
+ * (the range set aside for benchmarks). With churn, part of the lookups are
+ * for names that have not been seen before; these new hosts get addresses
+ * from 100.64.0.0/10, and the next flow goes to them. With a CDN pool, the
+ * remote hosts share a small set of addresses, and every lookup of a name
+ * may return another address of the pool, which makes spind merge nodes.
+ */
+
+struct extsrc_msg;
+struct workload;
+
+struct workload_params {
+	int		 devices;	/* local devices */
+	int		 remotes;	/* remote hosts */
+	double		 dns;		/* fraction of events that are lookups */
+	double		 churn;		/* fraction of lookups for new names */
+	int		 cdn;		/* size of the shared pool, 0 for none */
+	unsigned int	 seed;
+};
+
+struct workload *workload_create(const struct workload_params *);
+void workload_destroy(struct workload *);
+
+/*
+ * Returns the ARP table update for device i, to be sent before the traffic
+ */
+struct extsrc_msg *workload_device(struct workload *, int i, uint64_t ts);
+
+/*
+ * Returns the next message: a flow, or the query or answer of a lookup.
+ * Free it with extsrc_msg_free().
+ */
+struct extsrc_msg *workload_next(struct workload *, uint64_t ts);
+
+/*
+ * The number of remote hosts that the workload has introduced so far
+ */
+unsigned long workload_hosts(struct workload *);
@@ -5,7 +5,6 @@
 
 /* spind/lib includes */
 #include "extsrc.h"
-#include "socket.h"
 #include "util.h"
 
 #include "arpupdate.h"
@@ -15,19 +14,21 @@
 /* #define ARPUPDATE_DEBUG */
 
 static void
-send_arp_table_update_to_spind(int fd, struct extsrc_arp_table_update *up)
+send_arp_table_update_to_spind(void (*output)(struct extsrc_msg *),
+    struct extsrc_arp_table_update *up, uint64_t timestamp)
 {
 	struct extsrc_msg *msg;
 
-	msg = extsrc_msg_create_arp_table_update(up);
+	msg = extsrc_msg_create_arp_table_update(up, timestamp);
 
-	socket_writemsg(fd, msg->data, msg->length);
+	output(msg);
 
 	extsrc_msg_free(msg);
 }
 
 void
-arp_update(int fd, const uint8_t *mac, const uint8_t *ip, uint8_t family)
+arp_update(void (*output)(struct extsrc_msg *), const uint8_t *mac,
+    const uint8_t *ip, uint8_t family, uint64_t timestamp)
 {
 	struct extsrc_arp_table_update up;
 	char ipstr[INET6_ADDRSTRLEN];
@@ -37,7 +38,7 @@ arp_update(int fd, const uint8_t *mac, const uint8_t *ip, uint8_t family)
 	ipt_from_uint8t(&up.ip, ipstr, sizeof(ipstr), ip, family);
 	macstr_from_uint8t(mac, up.mac, sizeof(up.mac));
 
-	send_arp_table_update_to_spind(fd, &up);
+	send_arp_table_update_to_spind(output, &up, timestamp);
 
 #ifdef ARPUPDATE_DEBUG
 	warnx("MAC: %s, IP: %s", up.mac, ipstr);
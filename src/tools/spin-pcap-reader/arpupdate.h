@@ -1,4 +1,10 @@
 #include <stdint.h>
 
-void arp_update(int fd, const uint8_t *mac, const uint8_t *ip, uint8_t family);
+struct extsrc_msg;
+
+/*
+ * Creates an ARP table update, and hands it to output()
+ */
+void arp_update(void (*output)(struct extsrc_msg *), const uint8_t *mac,
+    const uint8_t *ip, uint8_t family, uint64_t timestamp);
 
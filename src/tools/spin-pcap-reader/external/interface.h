@@ -32,8 +32,8 @@
 
 extern int snaplen;
 /* global pointers to beginning and end of current packet (during printing) */
-extern const u_char *packetp;
-extern const u_char *snapend;
+extern __thread const u_char *packetp;
+extern __thread const u_char *snapend;
 
 /*
  * True if  "l" bytes of "var" were captured.
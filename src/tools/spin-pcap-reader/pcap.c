@@ -45,8 +45,11 @@
 #include <endian.h>
 #include <err.h>
 #include <errno.h>
+#include <getopt.h>
 #include <pcap.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -58,8 +61,12 @@
 #include "external/extract.h" /* must come after interface.h */
 
 #include "arpupdate.h"
+#include "pcapfile.h"
+#include "pipeline.h"
+#include "reasm.h"
 #include "sleep.h"
 #include "socket.h"
+#include "tpacket.h"
 
 /* spind/lib includes */
 #include "dns.h"
@@ -94,18 +101,49 @@ extern char *malloc_options;
 int Rflag;	/* replay as fast as possible rather than at recorded speed */
 int vflag;	/* verbose */
 
-const u_char *packetp;
-const u_char *snapend;
+static double speed = 1.0;	/* replay speed multiplier (--speed) */
+static int progress_flag;	/* report progress (--progress) */
+
+/* maximum number of reader threads (-t) */
+#define MAX_THREADS	16
+
+/* long options without a short equivalent */
+enum {
+	OPT_PROGRESS = 256,
+	OPT_SPEED
+};
+
+__thread const u_char *packetp;
+__thread const u_char *snapend;
 
 static pcap_t *pd;
 
-static struct handle_dns_ctx *handle_dns_ctx;
+/* set if the packets are dissected by a pipeline of threads (-d) */
+static struct pipeline *pipeline;
 
-static int fd;
+static volatile sig_atomic_t stop;
+
+static struct handle_dns_ctx *handle_dns_ctx;
 
 static node_cache_t *node_cache;
 
-static flow_list_t *flow_list;
+static const char *extsrc_socket_path;
+static const char *extsrc_host;
+static int use_ring;
+
+/*
+ * Every reader thread has its own connection to spind, and collects its own
+ * flows; spind merges them.
+ */
+static __thread int fd;
+
+static __thread flow_list_t *flow_list;
+
+/* capture time of the current packet, in microseconds since the epoch */
+static __thread uint64_t capture_ts;
+
+/* IPv4 fragments and DNS over TCP */
+static __thread struct reasm *reasm;
 
 static void
 sig_handler(int sig)
@@ -115,7 +153,9 @@ sig_handler(int sig)
 	switch (sig) {
 	case SIGINT:
 	case SIGTERM:
-		pcap_breakloop(pd);
+		stop = 1;
+		if (pd)
+			pcap_breakloop(pd);
 		break;
 
 	default:
@@ -132,9 +172,11 @@ usage(const char *error)
 
 	if (error)
 		fprintf(stderr, "%s\n", error);
-	fprintf(stderr, "Usage: %s [-Rv] [-e extsrc-socket-path] [-E extsrc-host]\n",
+	fprintf(stderr, "Usage: %s [-AmRv] [-B ring-size] [-d dissectors]\n",
 	    __progname);
-	fprintf(stderr, "\t[-f filter] [-i interface] [-r file] [-s snaplen]\n");
+	fprintf(stderr, "\t[-e extsrc-socket-path] [-E extsrc-host] [-f filter]\n");
+	fprintf(stderr, "\t[-i interface] [-r file] [-s snaplen] [-t threads]\n");
+	fprintf(stderr, "\t[--progress] [--speed multiplier]\n");
 	exit(1);
 }
 
@@ -150,14 +192,62 @@ verbose(const char *fmt, ...)
 	}
 }
 
+/*
+ * Reports how far reading a file has come, at most once per second unless
+ * it is the final report. If the size of the file is unknown (0), only the
+ * packet rate is reported.
+ */
+static void
+progress(uint64_t packets, size_t offset, size_t size, int final)
+{
+	static struct timespec start, last;
+	struct timespec now;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (start.tv_sec == 0 && start.tv_nsec == 0) {
+		start = last = now;
+		return;
+	}
+	if (!final && now.tv_sec - last.tv_sec < 1)
+		return;
+	last = now;
+
+	elapsed = (now.tv_sec - start.tv_sec) +
+	    (now.tv_nsec - start.tv_nsec) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	if (size)
+		warnx("%s%.1f%%: %llu packets, %.0f packets/s, %.1f MB/s",
+		    final ? "done, " : "", 100.0 * offset / size,
+		    (unsigned long long)packets, packets / elapsed,
+		    offset / elapsed / 1e6);
+	else
+		warnx("%s%llu packets, %.0f packets/s", final ? "done, " : "",
+		    (unsigned long long)packets, packets / elapsed);
+}
+
+/*
+ * Sends a message to spind, or to the merger if this is a dissector thread
+ */
+static void
+output_msg(struct extsrc_msg *msg)
+{
+	if (pipeline)
+		pipeline_output(msg);
+	else
+		socket_writemsg(fd, msg);
+}
+
 static void
 write_pkt_info_to_socket(pkt_info_t *pkt)
 {
 	struct extsrc_msg *msg;
 
-	msg = extsrc_msg_create_pkt_info(pkt);
+	msg = extsrc_msg_create_pkt_info(pkt, capture_ts);
 
-	socket_writemsg(fd, msg->data, msg->length);
+	socket_writemsg(fd, msg);
 
 	extsrc_msg_free(msg);
 }
@@ -185,7 +275,7 @@ send_flows(flow_list_t *flows)
 		cur = tree_next(cur);
 	}
 
-	flow_list_clear(flows, time(NULL));
+	flow_list_clear(flows, capture_ts / 1000000);
 }
 
 static void
@@ -193,9 +283,10 @@ dns_query_hook(dns_pkt_info_t *dns_pkt, int family, uint8_t *src_addr)
 {
 	struct extsrc_msg *msg;
 
-	msg = extsrc_msg_create_dns_query(dns_pkt, family, src_addr);
+	msg = extsrc_msg_create_dns_query(dns_pkt, family, src_addr,
+	    capture_ts);
 
-	socket_writemsg(fd, msg->data, msg->length);
+	output_msg(msg);
 
 	extsrc_msg_free(msg);
 }
@@ -205,9 +296,9 @@ dns_answer_hook(dns_pkt_info_t *dns_pkt)
 {
 	struct extsrc_msg *msg;
 
-	msg = extsrc_msg_create_dns_answer(dns_pkt);
+	msg = extsrc_msg_create_dns_answer(dns_pkt, capture_ts);
 
-	socket_writemsg(fd, msg->data, msg->length);
+	output_msg(msg);
 
 	extsrc_msg_free(msg);
 }
@@ -227,8 +318,8 @@ handle_icmp6(const u_char *bp, const struct ether_header *ep)
 
 		TCHECK(p->nd_na_target);
 
-		arp_update(fd, ep->ether_shost, p->nd_na_target.s6_addr,
-		    AF_INET6);
+		arp_update(output_msg, ep->ether_shost, p->nd_na_target.s6_addr,
+		    AF_INET6, capture_ts);
 		break;
 
 	default:
@@ -252,6 +343,18 @@ handle_dns(const u_char *cp, u_int len, int family, uint8_t *src_addr,
 	}
 }
 
+/*
+ * Called for every DNS message in a TCP stream
+ */
+static void
+handle_dns_tcp(const u_char *msg, u_int len, void *arg)
+{
+	pkt_info_t *pkt_info = arg;
+
+	handle_dns(msg, len, pkt_info->family, pkt_info->src_addr,
+	    pkt_info->src_port, pkt_info->dest_port);
+}
+
 static void
 handle_l4(const struct ether_header *ep, const u_char *l4, u_int len,
     pkt_info_t *pkt_info, int truncated)
@@ -259,7 +362,7 @@ handle_l4(const struct ether_header *ep, const u_char *l4, u_int len,
 	const struct tcphdr *tp = NULL;
 	const struct udphdr *up = NULL;
 	const u_char *cp;
-	u_int cplen;
+	u_int cplen, th_off;
 #ifdef unusedfornow
 	int tcp_initiated = 0;
 #endif
@@ -305,14 +408,24 @@ handle_l4(const struct ether_header *ep, const u_char *l4, u_int len,
 			if (up) {
 				cp = (const u_char *)(up + 1);
 				cplen = len - sizeof(struct udphdr);
+				TCHECK(*cp);
+				handle_dns(cp, cplen, pkt_info->family,
+				    pkt_info->src_addr, pkt_info->src_port,
+				    pkt_info->dest_port);
 			} else {
-				cp = (const u_char *)(tp + 1);
-				cplen = len - sizeof(struct tcphdr);
+				/* messages may span segments */
+				th_off = tp->th_off * 4;
+				if (th_off < sizeof(struct tcphdr) ||
+				    th_off > len) {
+					verbose("Bad TCP header length: %d",
+					    th_off);
+					return;
+				}
+				reasm_tcp(reasm, pkt_info, ntohl(tp->th_seq),
+				    tp->th_flags, (const u_char *)tp + th_off,
+				    len - th_off, capture_ts, handle_dns_tcp,
+				    pkt_info);
 			}
-			TCHECK(*cp);
-			handle_dns(cp, cplen, pkt_info->family,
-			    pkt_info->src_addr, pkt_info->src_port,
-			    pkt_info->dest_port);
 		}
 	}
 
@@ -326,7 +439,9 @@ static void
 handle_ip(const u_char *p, u_int caplen, const struct ether_header *ep)
 {
 	const struct ip *ip;
-	u_int hlen, len;
+	const u_char *saved_snapend = NULL;
+	const u_char *dgram;
+	u_int hlen, len, dlen, nfrags = 1;
 	pkt_info_t pkt_info;
 	int truncated = 0;
 
@@ -355,6 +470,24 @@ handle_ip(const u_char *p, u_int caplen, const struct ether_header *ep)
 	}
 	len -= hlen;
 
+	if (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) {
+		if (truncated) {
+			verbose("Truncated IP fragment");
+			return;
+		}
+		dgram = reasm_ipv4(reasm, (const u_char *)ip, hlen, len,
+		    capture_ts, &dlen, &nfrags);
+		if (!dgram)
+			return;
+
+		/* continue with the whole datagram */
+		saved_snapend = snapend;
+		snapend = dgram + dlen;
+		ip = (const struct ip *)dgram;
+		hlen = ip->ip_hl * 4;
+		len = dlen - hlen;
+	}
+
 	pkt_info.protocol = ip->ip_p;
 	memset(pkt_info.src_addr, 0, 12);
 	memcpy(pkt_info.src_addr + 12, &ip->ip_src, sizeof(ip->ip_src));
@@ -362,10 +495,13 @@ handle_ip(const u_char *p, u_int caplen, const struct ether_header *ep)
 	memcpy(pkt_info.dest_addr + 12, &ip->ip_dst, sizeof(ip->ip_dst));
 
 	pkt_info.payload_size = len;
-	pkt_info.packet_count = 1;
+	pkt_info.packet_count = nfrags;
 
 	handle_l4(ep, (const u_char *)ip + hlen, len, &pkt_info, truncated);
 
+	if (saved_snapend)
+		snapend = saved_snapend;
+
 	return;
 
  trunc:
@@ -438,7 +574,7 @@ handle_arp(const u_char *bp, u_int length)
 	op = EXTRACT_16BITS(&ap->arp_op);
 	switch (op) {
 	case ARPOP_REPLY:
-		arp_update(fd, ap->arp_sha, ap->arp_spa, AF_INET);
+		arp_update(output_msg, ap->arp_sha, ap->arp_spa, AF_INET, capture_ts);
 		break;
 
 	default:
@@ -447,18 +583,40 @@ handle_arp(const u_char *bp, u_int length)
 }
 
 /*
- * Callback for libpcap. Handles a packet.
+ * Unless replaying as fast as possible, sleeps until it is time for the
+ * packet
  */
 static void
-callback(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
+pace(const struct pcap_pkthdr *h)
+{
+#ifdef HAVE_BPF_TIMEVAL
+	struct timeval tvts;
+#endif
+
+	if (Rflag)
+		return;
+
+	/* don't hold back messages while sleeping */
+	socket_flush(fd);
+#ifdef HAVE_BPF_TIMEVAL
+	tvts.tv_sec = h->ts.tv_sec;
+	tvts.tv_usec = h->ts.tv_usec;
+	maybe_sleep(&tvts, speed);
+#else
+	maybe_sleep(&h->ts, speed);
+#endif
+}
+
+/*
+ * Handles a packet: collects its flow, and sends DNS and ARP information
+ */
+static void
+dissect(const struct pcap_pkthdr *h, const u_char *sp)
 {
 	const u_char *p;
 	const struct ether_header *ep;
 	u_short ether_type;
 	u_int caplen = h->caplen;
-#ifdef HAVE_BPF_TIMEVAL
-	struct timeval tvts;
-#endif
 
 	if (h->caplen != h->len) {
 		verbose("caplen %d != len %d, ", h->caplen, h->len);
@@ -467,6 +625,8 @@ callback(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 	packetp = sp;
 	snapend = sp + h->caplen;
 
+	capture_ts = (uint64_t)h->ts.tv_sec * 1000000 + h->ts.tv_usec;
+
 	p = sp;
 
 	if ((snapend - p) < sizeof(struct ether_header)) {
@@ -480,17 +640,6 @@ callback(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
 	p = sp + 14; /* Move past Ethernet header */
 	caplen -= 14;
 
-	// XXX find a better place for this piece of code
-	if (!Rflag) {
-#ifdef HAVE_BPF_TIMEVAL
-		tvts.tv_sec = h->ts.tv_sec;
-		tvts.tv_usec = h->ts.tv_usec;
-		maybe_sleep(&tvts);
-#else
-		maybe_sleep(&h->ts);
-#endif
-}
-
 recurse:
 	switch (ether_type) {
 	case ETHERTYPE_IP:
@@ -522,28 +671,307 @@ recurse:
 		break;
 	}
 
-	if (flow_list_should_send(flow_list, time(NULL))) {
-		send_flows(flow_list);
-	}
-
 	return;
 
  trunc:
 	verbose("TRUNCATED");
 }
 
+/*
+ * Callback for libpcap. Handles a packet.
+ */
+static void
+callback(u_char *user, const struct pcap_pkthdr *h, const u_char *sp)
+{
+	pace(h);
+
+	/* flows are aggregated per second of capture time */
+	capture_ts = (uint64_t)h->ts.tv_sec * 1000000 + h->ts.tv_usec;
+	if (flow_list_should_send(flow_list, h->ts.tv_sec))
+		send_flows(flow_list);
+
+	dissect(h, sp);
+}
+
+/*
+ * Callback for libpcap if there is a pipeline: hands the packet to a
+ * dissector thread
+ */
+static void
+pipeline_callback(u_char *user, const struct pcap_pkthdr *h,
+    const u_char *sp)
+{
+	pace(h);
+	pipeline_packet(pipeline, h, sp);
+}
+
+static pcap_handler handler = callback;
+
+static void
+reasm_report(void)
+{
+	const struct reasm_stats *st = reasm_stats(reasm);
+
+	verbose("reassembly: %lu datagrams, %lu evicted; %lu DNS messages "
+	    "over TCP, %lu streams evicted, %lu with missing segments",
+	    st->datagrams, st->datagrams_evicted, st->messages,
+	    st->streams_evicted, st->streams_broken);
+}
+
+static void
+dissector_start(void)
+{
+	flow_list = flow_list_create(0);
+	reasm = reasm_create();
+}
+
+static flow_list_t *
+dissector_rotate(uint64_t timestamp)
+{
+	flow_list_t *flows = flow_list;
+
+	flow_list = flow_list_create(timestamp / 1000000);
+	return flows;
+}
+
+static void
+dissector_finish(void)
+{
+	flow_list_destroy(flow_list);
+	reasm_report();
+	reasm_destroy(reasm);
+}
+
+static void
+merger_start(void)
+{
+	fd = socket_open(extsrc_socket_path, extsrc_host);
+	if (use_ring && socket_open_ring(fd) == -1)
+		errx(1, "could not set up the shared memory ring");
+}
+
+static void
+merger_output(struct extsrc_msg *msg)
+{
+	socket_writemsg(fd, msg);
+}
+
+static void
+merger_send_flows(flow_list_t *flows, uint64_t timestamp)
+{
+	capture_ts = timestamp;
+	send_flows(flows);
+}
+
+static void
+merger_flush(void)
+{
+	socket_flush(fd);
+}
+
+static void
+merger_finish(void)
+{
+	socket_close(fd);
+}
+
+static const struct pipeline_ops pipeline_ops = {
+	.dissector_start = dissector_start,
+	.dissect = dissect,
+	.rotate = dissector_rotate,
+	.dissector_finish = dissector_finish,
+	.merger_start = merger_start,
+	.output = merger_output,
+	.send_flows = merger_send_flows,
+	.flush = merger_flush,
+	.merger_finish = merger_finish,
+};
+
+/*
+ * Sets up the connection to spind and the flows for the current thread. In
+ * a pipeline, the dissectors and the merger take care of that instead.
+ */
+static void
+reader_start(void)
+{
+	if (pipeline)
+		return;
+
+	fd = socket_open(extsrc_socket_path, extsrc_host);
+	if (use_ring && socket_open_ring(fd) == -1)
+		errx(1, "could not set up the shared memory ring");
+
+	flow_list = flow_list_create(0);
+	reasm = reasm_create();
+}
+
+static void
+reader_finish(void)
+{
+	if (pipeline) {
+		pipeline_destroy(pipeline);
+		pipeline = NULL;
+		return;
+	}
+
+	/* the flows of the last second */
+	if (!flow_list_empty(flow_list))
+		send_flows(flow_list);
+
+	socket_close(fd);
+	flow_list_destroy(flow_list);
+	reasm_report();
+	reasm_destroy(reasm);
+}
+
+/*
+ * Reads a file that has been mapped into memory. The filter is run here,
+ * as there is no kernel (or libpcap) in between.
+ */
+static void
+pcapfile_run(struct pcapfile *pf, const char *filter)
+{
+	struct bpf_program fp;
+	struct pcap_pkthdr h;
+	const u_char *data;
+	pcap_t *dead;
+	uint64_t packets = 0;
+	int use_filter = *filter != '\0';
+
+	dead = pcap_open_dead(DLT_EN10MB, 65535);
+	if (!dead)
+		errx(1, "pcap_open_dead");
+	if (pcap_compile(dead, &fp, filter, 1, 0) == -1)
+		errx(1, "could not compile filter: %s", pcap_geterr(dead));
+
+	if (progress_flag)
+		progress(0, 0, pcapfile_size(pf), 0);
+
+	while (!stop && pcapfile_next(pf, &h, &data)) {
+		if (use_filter && pcap_offline_filter(&fp, &h, data) == 0)
+			continue;
+		handler(NULL, &h, data);
+
+		/* send the messages in batches, like pcap_dispatch() does */
+		if (++packets % 4096 == 0) {
+			socket_flush(fd);
+			if (progress_flag)
+				progress(packets, pcapfile_offset(pf),
+				    pcapfile_size(pf), 0);
+		}
+	}
+	socket_flush(fd);
+	if (progress_flag)
+		progress(packets, pcapfile_offset(pf), pcapfile_size(pf), 1);
+
+	pcap_freecode(&fp);
+	pcap_close(dead);
+}
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+struct tpacket_reader {
+	pthread_t thread;
+	struct tpacket *tp;
+	int id;
+};
+
+static void *
+tpacket_reader(void *arg)
+{
+	struct tpacket_reader *reader = arg;
+	unsigned int packets, drops;
+
+	reader_start();
+	while (!stop) {
+		if (tpacket_dispatch(reader->tp, 1000, handler, NULL) == -1)
+			err(1, "tpacket_dispatch");
+		/* a block has been processed */
+		socket_flush(fd);
+	}
+	reader_finish();
+
+	tpacket_stats(reader->tp, &packets, &drops);
+	verbose("thread %d: %u packets received, %u dropped by the kernel",
+	    reader->id, packets, drops);
+
+	return NULL;
+}
+
+/*
+ * Captures on the device with AF_PACKET sockets, one per thread. The
+ * current thread is the first reader.
+ */
+static void
+tpacket_run(const char *device, const char *filter, int snaplen,
+    size_t ring_size, int nthreads)
+{
+	struct tpacket_reader *readers;
+	struct bpf_program fp;
+	pcap_t *dead;
+	int fanout = 0;
+	int error;
+	int i;
+
+	/* compile the filter for the kernel */
+	dead = pcap_open_dead(DLT_EN10MB, snaplen);
+	if (!dead)
+		errx(1, "pcap_open_dead");
+	if (pcap_compile(dead, &fp, filter, 1, 0) == -1)
+		errx(1, "could not compile filter: %s", pcap_geterr(dead));
+
+	if (nthreads > 1)
+		fanout = getpid() % 0xffff + 1;
+
+	if ((readers = calloc(nthreads, sizeof(*readers))) == NULL)
+		err(1, "calloc");
+	/* the fanout group is complete before anything is read */
+	for (i = 0; i < nthreads; i++) {
+		readers[i].tp = tpacket_open(device, &fp, ring_size, fanout);
+		readers[i].id = i;
+	}
+	pcap_freecode(&fp);
+	pcap_close(dead);
+
+	for (i = 1; i < nthreads; i++) {
+		error = pthread_create(&readers[i].thread, NULL, tpacket_reader,
+		    &readers[i]);
+		if (error) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+	tpacket_reader(&readers[0]);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(readers[i].thread, NULL);
+
+	for (i = 0; i < nthreads; i++)
+		tpacket_close(readers[i].tp);
+	free(readers);
+}
+#endif /* HAVE_LINUX_IF_PACKET_H */
+
 int
 main(int argc, char *argv[])
 {
+	static const struct option longopts[] = {
+		{ "progress",	no_argument,		NULL,	OPT_PROGRESS },
+		{ "speed",	required_argument,	NULL,	OPT_SPEED },
+		{ NULL,		0,			NULL,	0 }
+	};
 	int ch;
-	char *extsrc_host = NULL;
-	char *extsrc_socket_path = NULL;
 	char *device = NULL;
 	char *file = NULL;
 	char *pcap_errbuf;
 	char *filter = "";
 	int snaplen = 1232;
+	int Aflag = 0;
+	size_t ring_size = TPACKET_RING_SIZE;
+	int nthreads = 1;
+	int ndissectors = 0;
+	int n;
+	uint64_t packets = 0;
 	struct bpf_program fp;
+	struct pcapfile *pf;
 
 #ifdef __OpenBSD__
 	/* Configure malloc on OpenBSD; enables security auditing options */
@@ -552,10 +980,24 @@ main(int argc, char *argv[])
 
 	node_cache = node_cache_create(ARP_TABLE_VIRTUAL);
 
-	flow_list = flow_list_create(time(NULL));
-
-	while ((ch = getopt(argc, argv, "e:E:f:hi:Rr:s:v")) != -1) {
+	while ((ch = getopt_long(argc, argv, "AB:d:e:E:f:hi:mRr:s:t:v", longopts,
+	    NULL)) != -1) {
 		switch(ch) {
+		case 'A':
+			Aflag = 1;
+			break;
+		case 'B':
+			if (sscanf(optarg, "%zu", &ring_size) != 1 ||
+			    ring_size == 0 || ring_size > 4096)
+				usage("incorrect ring size");
+			ring_size *= 1024 * 1024;
+			break;
+		case 'd':
+			if (sscanf(optarg, "%d", &ndissectors) != 1 ||
+			    ndissectors < 1 ||
+			    ndissectors > PIPELINE_MAX_DISSECTORS)
+				usage("incorrect number of dissector threads");
+			break;
 		case 'e':
 			extsrc_socket_path = optarg;
 			break;
@@ -570,6 +1012,9 @@ main(int argc, char *argv[])
 		case 'i':
 			device = optarg;
 			break;
+		case 'm':
+			use_ring = 1;
+			break;
 		case 'R':
 			Rflag = 1;
 			break;
@@ -580,9 +1025,21 @@ main(int argc, char *argv[])
 			if (sscanf(optarg, "%d", &snaplen) != 1 || snaplen < 0)
 				usage("incorrect snaplen");
 			break;
+		case 't':
+			if (sscanf(optarg, "%d", &nthreads) != 1 ||
+			    nthreads < 1 || nthreads > MAX_THREADS)
+				usage("incorrect number of threads");
+			break;
 		case 'v':
 			vflag = 1;
 			break;
+		case OPT_PROGRESS:
+			progress_flag = 1;
+			break;
+		case OPT_SPEED:
+			if (sscanf(optarg, "%lf", &speed) != 1 || !(speed > 0))
+				usage("incorrect speed");
+			break;
 		default:
 			usage(NULL);
 		}
@@ -596,8 +1053,65 @@ main(int argc, char *argv[])
 		usage("cannot specify both an extsrc host and socket path");
 	if (!extsrc_host && !extsrc_socket_path)
 		extsrc_socket_path = EXTSRC_SOCKET_PATH;
+	if (use_ring && extsrc_host)
+		usage("a shared memory ring requires the extsrc socket path");
+	if (Aflag && file)
+		usage("AF_PACKET capture requires an interface");
+	if (nthreads > 1 && !Aflag)
+		usage("multiple threads require AF_PACKET capture");
+	if (nthreads > 1 && ndissectors)
+		usage("cannot specify both reader and dissector threads");
+	if (speed != 1.0 && (Rflag || !file))
+		usage("--speed only applies when replaying a file at recorded speed");
+	if (progress_flag && !file)
+		usage("--progress only applies when reading a file");
 
-	fd = socket_open(extsrc_socket_path, extsrc_host);
+	handle_dns_ctx = handle_dns_init(&dns_query_hook, &dns_answer_hook);
+	if (!handle_dns_ctx)
+		errx(1, "handle_dns_init");
+
+	(void)signal(SIGTERM, sig_handler);
+	(void)signal(SIGINT, sig_handler);
+
+	if (ndissectors) {
+		pipeline = pipeline_create(ndissectors, &pipeline_ops);
+		handler = pipeline_callback;
+	}
+
+	if (Aflag) {
+#ifdef HAVE_LINUX_IF_PACKET_H
+		Rflag = 1;
+		tpacket_run(device, filter, snaplen, ring_size, nthreads);
+		node_cache_destroy(node_cache);
+		return 0;
+#else
+		usage("AF_PACKET capture is not supported on this system");
+#endif /* HAVE_LINUX_IF_PACKET_H */
+	}
+
+	reader_start();
+
+	/* read regular files directly from memory; libpcap does the rest */
+	if (file && strcmp(file, "-") != 0) {
+#ifdef HAVE_PLEDGE
+		if (pledge("stdio rpath", NULL) == -1)
+			err(1, "pledge");
+#endif /* HAVE_PLEDGE */
+
+		pf = pcapfile_open(file);
+		if (pf) {
+#ifdef HAVE_PLEDGE
+			if (pledge("stdio", NULL) == -1)
+				err(1, "pledge");
+#endif /* HAVE_PLEDGE */
+
+			pcapfile_run(pf, filter);
+			pcapfile_close(pf);
+			reader_finish();
+			node_cache_destroy(node_cache);
+			return 0;
+		}
+	}
 
 	if ((pcap_errbuf = malloc(PCAP_ERRBUF_SIZE)) == NULL)
 		err(1, "malloc");
@@ -643,15 +1157,27 @@ main(int argc, char *argv[])
 		err(1, "pledge");
 #endif /* HAVE_PLEDGE */
 
-	handle_dns_ctx = handle_dns_init(&dns_query_hook, &dns_answer_hook);
-	if (!handle_dns_ctx)
-		errx(1, "handle_dns_init");
-
-	(void)signal(SIGTERM, sig_handler);
-	(void)signal(SIGINT, sig_handler);
-
-	if (pcap_loop(pd, -1, callback, NULL) == -1)
-		errx(1, "pcap_loop: %s", pcap_geterr(pd));
+	/*
+	 * Messages to spind are sent in batches; flush them whenever
+	 * pcap_dispatch() returns, i.e. after every buffer of packets (or
+	 * timeout) when capturing on an interface.
+	 */
+	if (progress_flag)
+		progress(0, 0, 0, 0);
+	for (;;) {
+		n = pcap_dispatch(pd, -1, handler, NULL);
+		socket_flush(fd);
+		if (n == -1)
+			errx(1, "pcap_dispatch: %s", pcap_geterr(pd));
+		/* stopped by a signal, or at the end of the file */
+		if (n == -2 || (file && n == 0))
+			break;
+		packets += n;
+		if (progress_flag)
+			progress(packets, 0, 0, 0);
+	}
+	if (progress_flag)
+		progress(packets, 0, 0, 1);
 
 	/*
 	 * Done, clean up.
@@ -659,9 +1185,8 @@ main(int argc, char *argv[])
 	if (pd)
 		pcap_close(pd);
 
-	close(fd);
+	reader_finish();
 	node_cache_destroy(node_cache);
-	flow_list_destroy(flow_list);
 
 	return 0;
 }
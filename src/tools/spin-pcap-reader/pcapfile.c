@@ -0,0 +1,355 @@
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pcapfile.h"
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_HDR_LEN		24
+#define PCAP_REC_HDR_LEN	16
+
+#define PCAPNG_SHB		0x0a0d0d0a
+#define PCAPNG_BYTE_ORDER_MAGIC	0x1a2b3c4d
+#define PCAPNG_IDB		1
+#define PCAPNG_PB		2	/* obsolete Packet Block */
+#define PCAPNG_SPB		3
+#define PCAPNG_EPB		6
+#define PCAPNG_OPT_ENDOFOPT	0
+#define PCAPNG_OPT_IF_TSRESOL	9
+
+#define LINKTYPE_ETHERNET	1
+
+struct pcapfile_if {
+	uint16_t linktype;
+	uint64_t units;		/* timestamp units per second */
+};
+
+struct pcapfile {
+	const char *name;
+	const u_char *map;
+	size_t size;
+	size_t off;
+	int ng;			/* pcapng rather than classic pcap */
+	int swapped;		/* byte order differs from ours */
+
+	/* classic pcap */
+	int nsec;
+
+	/* pcapng: the interfaces of the current section */
+	struct pcapfile_if *ifs;
+	size_t n_ifs;
+	size_t max_ifs;
+	struct timeval last_ts;	/* for Simple Packet Blocks */
+	int warned_linktype;
+};
+
+static uint16_t
+get16(struct pcapfile *pf, const u_char *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return pf->swapped ? __builtin_bswap16(v) : v;
+}
+
+static uint32_t
+get32(struct pcapfile *pf, const u_char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return pf->swapped ? __builtin_bswap32(v) : v;
+}
+
+static int
+corrupt(struct pcapfile *pf, const char *what)
+{
+	warnx("%s: %s at offset %zu; stopping", pf->name, what, pf->off);
+	pf->off = pf->size;
+	return 0;
+}
+
+struct pcapfile *
+pcapfile_open(const char *file)
+{
+	struct pcapfile *pf;
+	struct stat st;
+	uint32_t magic;
+	void *map;
+	int fd;
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+		err(1, "%s", file);
+	if (fstat(fd, &st) == -1)
+		err(1, "%s", file);
+	if (!S_ISREG(st.st_mode) || (uintmax_t)st.st_size > SIZE_MAX) {
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof(magic))
+		errx(1, "%s: not a pcap or pcapng file", file);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("mmap: %s", file);
+		return NULL;
+	}
+	(void)madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	if ((pf = calloc(1, sizeof(*pf))) == NULL)
+		err(1, "calloc");
+	pf->name = file;
+	pf->map = map;
+	pf->size = st.st_size;
+
+	memcpy(&magic, map, sizeof(magic));
+	if (magic == PCAPNG_SHB) {
+		/* the byte order is set by every section header */
+		pf->ng = 1;
+		return pf;
+	}
+
+	if (magic == __builtin_bswap32(PCAP_MAGIC) ||
+	    magic == __builtin_bswap32(PCAP_MAGIC_NSEC)) {
+		pf->swapped = 1;
+		magic = __builtin_bswap32(magic);
+	}
+	if (magic != PCAP_MAGIC && magic != PCAP_MAGIC_NSEC)
+		errx(1, "%s: not a pcap or pcapng file", file);
+	if (pf->size < PCAP_HDR_LEN)
+		errx(1, "%s: truncated file header", file);
+	pf->nsec = magic == PCAP_MAGIC_NSEC;
+	if ((get32(pf, pf->map + 20) & 0xffff) != LINKTYPE_ETHERNET)
+		errx(1, "the device is not an Ethernet device");
+	pf->off = PCAP_HDR_LEN;
+
+	return pf;
+}
+
+static int
+pcapfile_next_pcap(struct pcapfile *pf, struct pcap_pkthdr *h,
+    const u_char **data)
+{
+	const u_char *p;
+	uint32_t frac;
+
+	if (pf->off == pf->size)
+		return 0;
+	if (pf->size - pf->off < PCAP_REC_HDR_LEN)
+		return corrupt(pf, "truncated record");
+
+	p = pf->map + pf->off;
+	h->ts.tv_sec = get32(pf, p);
+	frac = get32(pf, p + 4);
+	h->ts.tv_usec = pf->nsec ? frac / 1000 : frac;
+	h->caplen = get32(pf, p + 8);
+	h->len = get32(pf, p + 12);
+	if (h->caplen > pf->size - pf->off - PCAP_REC_HDR_LEN)
+		return corrupt(pf, "truncated record");
+
+	*data = p + PCAP_REC_HDR_LEN;
+	pf->off += PCAP_REC_HDR_LEN + h->caplen;
+	return 1;
+}
+
+/*
+ * Adds an interface from an Interface Description Block
+ */
+static int
+pcapfile_add_if(struct pcapfile *pf, const u_char *body, uint32_t len)
+{
+	struct pcapfile_if *pif;
+	const u_char *opt;
+	uint16_t code, optlen;
+	uint8_t res;
+	int i;
+
+	if (len < 8)
+		return -1;
+	if (pf->n_ifs == pf->max_ifs) {
+		/* the block length limits the number of interfaces anyway */
+		pf->max_ifs = pf->max_ifs ? 2 * pf->max_ifs : 4;
+		pf->ifs = realloc(pf->ifs, pf->max_ifs * sizeof(*pf->ifs));
+		if (pf->ifs == NULL)
+			err(1, "realloc");
+	}
+	pif = &pf->ifs[pf->n_ifs++];
+	pif->linktype = get16(pf, body);
+	pif->units = 1000000;
+
+	/* options: code (2), length (2), value padded to 4 bytes */
+	opt = body + 8;
+	while (opt + 4 <= body + len) {
+		code = get16(pf, opt);
+		optlen = get16(pf, opt + 2);
+		if (code == PCAPNG_OPT_ENDOFOPT)
+			break;
+		if (optlen > body + len - opt - 4)
+			return -1;
+		if (code == PCAPNG_OPT_IF_TSRESOL && optlen >= 1) {
+			/* a power of 2 if the high bit is set, else of 10 */
+			res = opt[4];
+			if (res & 0x80) {
+				if ((res & 0x7f) > 63)
+					return -1;
+				pif->units = (uint64_t)1 << (res & 0x7f);
+			} else {
+				if (res > 19)
+					return -1;
+				for (pif->units = 1, i = 0; i < res; i++)
+					pif->units *= 10;
+			}
+		}
+		opt += 4 + ((optlen + 3) & ~3);
+	}
+	return 0;
+}
+
+static void
+pcapfile_ts(struct pcapfile_if *pif, uint64_t ts, struct timeval *tv)
+{
+	uint64_t frac = ts % pif->units;
+
+	tv->tv_sec = ts / pif->units;
+	if (pif->units >= 1000000 && pif->units % 1000000 == 0)
+		tv->tv_usec = frac / (pif->units / 1000000);
+	else
+		tv->tv_usec = (double)frac * 1000000 / pif->units;
+}
+
+static int
+pcapfile_next_pcapng(struct pcapfile *pf, struct pcap_pkthdr *h,
+    const u_char **data)
+{
+	const u_char *p, *body;
+	uint32_t type, blen, len, bom, ifid;
+	uint64_t ts;
+
+	for (;;) {
+		if (pf->off == pf->size)
+			return 0;
+		if (pf->size - pf->off < 12)
+			return corrupt(pf, "truncated block");
+
+		p = pf->map + pf->off;
+		type = get32(pf, p);
+		if (type == PCAPNG_SHB) {
+			/* a new section, possibly in another byte order */
+			memcpy(&bom, p + 8, sizeof(bom));
+			if (bom == PCAPNG_BYTE_ORDER_MAGIC)
+				pf->swapped = 0;
+			else if (bom == __builtin_bswap32(PCAPNG_BYTE_ORDER_MAGIC))
+				pf->swapped = 1;
+			else
+				return corrupt(pf, "bad byte-order magic");
+			pf->n_ifs = 0;
+		}
+		blen = get32(pf, p + 4);
+		if (blen < 12 || blen % 4 != 0 || blen > pf->size - pf->off)
+			return corrupt(pf, "bad block length");
+
+		body = p + 8;
+		len = blen - 12;
+		ts = 0;
+		switch (type) {
+		case PCAPNG_IDB:
+			if (pcapfile_add_if(pf, body, len) == -1)
+				return corrupt(pf, "bad interface description");
+			pf->off += blen;
+			continue;
+
+		case PCAPNG_EPB:
+		case PCAPNG_PB:
+			if (len < 20)
+				return corrupt(pf, "bad packet block");
+			if (type == PCAPNG_EPB)
+				ifid = get32(pf, body);
+			else
+				ifid = get16(pf, body);
+			ts = (uint64_t)get32(pf, body + 4) << 32 |
+			    get32(pf, body + 8);
+			h->caplen = get32(pf, body + 12);
+			h->len = get32(pf, body + 16);
+			if (h->caplen > len - 20)
+				return corrupt(pf, "bad packet block");
+			*data = body + 20;
+			break;
+
+		case PCAPNG_SPB:
+			if (len < 4)
+				return corrupt(pf, "bad packet block");
+			ifid = 0;
+			h->len = get32(pf, body);
+			h->caplen = h->len < len - 4 ? h->len : len - 4;
+			*data = body + 4;
+			break;
+
+		default:
+			/* statistics, name resolution, comments, ... */
+			pf->off += blen;
+			continue;
+		}
+
+		if (ifid >= pf->n_ifs)
+			return corrupt(pf, "packet of an unknown interface");
+		pf->off += blen;
+		if (pf->ifs[ifid].linktype != LINKTYPE_ETHERNET) {
+			if (!pf->warned_linktype) {
+				warnx("%s: skipping packets of non-Ethernet "
+				    "interfaces", pf->name);
+				pf->warned_linktype = 1;
+			}
+			continue;
+		}
+
+		if (type == PCAPNG_SPB) {
+			/* no timestamp; use the one of the previous packet */
+			h->ts = pf->last_ts;
+		} else {
+			pcapfile_ts(&pf->ifs[ifid], ts, &h->ts);
+			pf->last_ts = h->ts;
+		}
+		return 1;
+	}
+}
+
+int
+pcapfile_next(struct pcapfile *pf, struct pcap_pkthdr *h,
+    const u_char **data)
+{
+	if (pf->ng)
+		return pcapfile_next_pcapng(pf, h, data);
+	return pcapfile_next_pcap(pf, h, data);
+}
+
+size_t
+pcapfile_offset(struct pcapfile *pf)
+{
+	return pf->off;
+}
+
+size_t
+pcapfile_size(struct pcapfile *pf)
+{
+	return pf->size;
+}
+
+void
+pcapfile_close(struct pcapfile *pf)
+{
+	munmap((void *)pf->map, pf->size);
+	free(pf->ifs);
+	free(pf);
+}
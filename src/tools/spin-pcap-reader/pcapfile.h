@@ -0,0 +1,36 @@
+#include <stddef.h>
+
+#include <pcap.h>
+
+/*
+ * Reader for capture files that maps the file into memory, and parses the
+ * records in place: classic pcap files (with microsecond or nanosecond
+ * timestamps, in either byte order) and pcapng files (any number of
+ * sections and interfaces, with their timestamp resolutions).
+ *
+ * Only packets of Ethernet interfaces are returned; others are skipped.
+ */
+
+struct pcapfile;
+
+/*
+ * Maps the file. Returns NULL if the file cannot be mapped (e.g. if it is
+ * a pipe, or too large for the address space), so that the caller can fall
+ * back to libpcap; exits if it is not a capture file.
+ */
+struct pcapfile *pcapfile_open(const char *file);
+
+/*
+ * Points *data to the next packet, and fills in its header; the
+ * timestamp is converted to microseconds.
+ * Returns 1 if there is a packet, 0 at the end of the file (or at the
+ * first corrupt record, with a warning).
+ */
+int pcapfile_next(struct pcapfile *pf, struct pcap_pkthdr *h,
+    const u_char **data);
+
+/* Current position in the file, and its total size, in bytes */
+size_t pcapfile_offset(struct pcapfile *pf);
+size_t pcapfile_size(struct pcapfile *pf);
+
+void pcapfile_close(struct pcapfile *pf);
@@ -0,0 +1,552 @@
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <net/if.h>
+#ifdef HAVE_NET_ETHERTYPES_H
+#include <net/ethertypes.h>
+#endif // HAVE_NET_ETHERTYPES_H
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* spind/lib includes */
+#include "extsrc.h"
+#include "tree.h"
+
+#include "pipeline.h"
+
+/*
+ * Size of the queue of packets of every dissector, and of the queue of its
+ * messages to the merger, in bytes
+ */
+#define PIPELINE_IN_SIZE	(4 * 1024 * 1024)
+#define PIPELINE_OUT_SIZE	(1024 * 1024)
+
+/* longer packets are cut, so that a packet always fits in the queue */
+#define PIPELINE_MAX_CAPLEN	(PIPELINE_IN_SIZE / 4)
+
+/* Linux compat */
+#ifndef ETHERTYPE_QINQ
+#define ETHERTYPE_QINQ		0x88A8
+#endif /* ETHERTYPE_QINQ */
+
+/*
+ * A queue with a single producer and a single consumer: variable-length
+ * records in a ring of bytes. Records are 8-byte aligned and never wrap; if
+ * a record does not fit at the end of the ring, the rest of the ring is
+ * skipped with a REC_PAD record.
+ */
+enum {
+	REC_PAD,
+	REC_PACKET,	/* struct pcap_pkthdr, followed by the packet */
+	REC_TICK,	/* uint64_t timestamp: the start of a second */
+	REC_MSG,	/* the data of an extsrc message */
+	REC_FLOWS,	/* struct flows_rec */
+	REC_END,
+};
+
+struct rec {
+	uint32_t type;
+	uint32_t len;	/* of the data after this header */
+};
+
+#define REC_SIZE(len)	((sizeof(struct rec) + (len) + 7) & ~(size_t)7)
+
+struct queue {
+	uint8_t *buf;
+	size_t size;
+	/* positions since the start; head and tail in their own cache lines */
+	size_t head __attribute__((aligned(64)));
+	size_t tail __attribute__((aligned(64)));
+};
+
+struct flows_rec {
+	flow_list_t *flows;
+	uint64_t timestamp;
+};
+
+struct dissector {
+	pthread_t thread;
+	struct pipeline *p;
+	struct queue in;	/* packets from the reader */
+	struct queue out;	/* results for the merger */
+
+	/* used by the merger */
+	flow_list_t *held;	/* flows of this dissector for the next batch */
+	uint64_t held_ts;
+	int ended;
+};
+
+struct pipeline {
+	const struct pipeline_ops *ops;
+	int ndissectors;
+	struct dissector *dissectors;
+	pthread_t merger;
+	flow_list_t *merged;
+	uint32_t last_sec;	/* capture time of the last packet */
+	uint64_t last_ts;
+};
+
+static __thread struct dissector *current;
+
+/*
+ * Waits a little for the other side of a queue; yields at first, and then
+ * sleeps longer and longer, so that idle threads do not keep a core busy
+ */
+static void
+backoff(unsigned int *n)
+{
+	if (*n < 128) {
+		sched_yield();
+	} else {
+		usleep(*n < 1128 ? *n - 127 : 1000);
+	}
+	(*n)++;
+}
+
+static void
+queue_init(struct queue *q, size_t size)
+{
+	if ((q->buf = malloc(size)) == NULL)
+		err(1, "malloc");
+	q->size = size;
+	q->head = 0;
+	q->tail = 0;
+}
+
+/*
+ * Returns room for a record with len bytes of data, waiting until there is
+ * enough space. The record is not visible until queue_commit().
+ */
+static void *
+queue_reserve(struct queue *q, size_t len)
+{
+	size_t need = REC_SIZE(len);
+	size_t tail = q->tail;
+	size_t end = q->size - tail % q->size;
+	struct rec *r;
+	unsigned int n = 0;
+
+	/* skip the end of the ring if the record does not fit there */
+	if (end < need)
+		need += end;
+	while (q->size - (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+	    < need)
+		backoff(&n);
+
+	if (end < REC_SIZE(len)) {
+		r = (struct rec *)(q->buf + tail % q->size);
+		r->type = REC_PAD;
+		r->len = end - sizeof(*r);
+		tail += end;
+		__atomic_store_n(&q->tail, tail, __ATOMIC_RELEASE);
+	}
+	return q->buf + tail % q->size + sizeof(struct rec);
+}
+
+static void
+queue_commit(struct queue *q, uint32_t type, size_t len)
+{
+	struct rec *r = (struct rec *)(q->buf + q->tail % q->size);
+
+	r->type = type;
+	r->len = len;
+	__atomic_store_n(&q->tail, q->tail + REC_SIZE(len), __ATOMIC_RELEASE);
+}
+
+static void
+queue_put(struct queue *q, uint32_t type, const void *data, size_t len)
+{
+	memcpy(queue_reserve(q, len), data, len);
+	queue_commit(q, type, len);
+}
+
+/*
+ * Returns the next record, or NULL if there is none. It stays valid until
+ * queue_release().
+ */
+static struct rec *
+queue_peek(struct queue *q)
+{
+	struct rec *r;
+
+	for (;;) {
+		if (q->head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+			return NULL;
+		r = (struct rec *)(q->buf + q->head % q->size);
+		if (r->type != REC_PAD)
+			return r;
+		__atomic_store_n(&q->head, q->head + REC_SIZE(r->len),
+		    __ATOMIC_RELEASE);
+	}
+}
+
+static struct rec *
+queue_wait(struct queue *q)
+{
+	struct rec *r;
+	unsigned int n = 0;
+
+	while ((r = queue_peek(q)) == NULL)
+		backoff(&n);
+	return r;
+}
+
+static void
+queue_release(struct queue *q, struct rec *r)
+{
+	__atomic_store_n(&q->head, q->head + REC_SIZE(r->len),
+	    __ATOMIC_RELEASE);
+}
+
+static uint32_t
+fmix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static uint32_t
+addr_hash(const u_char *p, size_t len)
+{
+	uint32_t h = 0, w;
+	size_t i;
+
+	for (i = 0; i < len; i += 4) {
+		memcpy(&w, p + i, sizeof(w));
+		h = fmix32(h ^ w);
+	}
+	return h;
+}
+
+/*
+ * Hash of the addresses, protocol and ports of an Ethernet frame, which is
+ * the same for both directions. Fragments are hashed without the ports, as
+ * only the first one has them; non-IP packets hash to 0.
+ */
+static uint32_t
+flow_hash(const u_char *p, u_int caplen)
+{
+	uint16_t ether_type, off;
+	uint32_t h;
+	u_int hlen;
+	uint8_t proto;
+	const u_char *l4 = NULL;
+
+	if (caplen < 14)
+		return 0;
+	ether_type = p[12] << 8 | p[13];
+	p += 14;
+	caplen -= 14;
+	while ((ether_type == ETHERTYPE_VLAN || ether_type == ETHERTYPE_QINQ) &&
+	    caplen >= 4) {
+		ether_type = p[2] << 8 | p[3];
+		p += 4;
+		caplen -= 4;
+	}
+
+	switch (ether_type) {
+	case ETHERTYPE_IP:
+		if (caplen < 20)
+			return 0;
+		hlen = (p[0] & 0x0f) * 4;
+		proto = p[9];
+		off = p[6] << 8 | p[7];
+		h = addr_hash(p + 12, 4) ^ addr_hash(p + 16, 4);
+		/* ports only if this is not a fragment (MF or offset set) */
+		if ((off & 0x3fff) == 0 && hlen >= 20 && caplen >= hlen + 4)
+			l4 = p + hlen;
+		break;
+
+	case ETHERTYPE_IPV6:
+		if (caplen < 40)
+			return 0;
+		proto = p[6];
+		h = addr_hash(p + 8, 16) ^ addr_hash(p + 24, 16);
+		if (caplen >= 44)
+			l4 = p + 40;
+		break;
+
+	default:
+		return 0;
+	}
+
+	if (l4 && (proto == IPPROTO_TCP || proto == IPPROTO_UDP))
+		h ^= (uint32_t)((l4[0] << 8 | l4[1]) ^ (l4[2] << 8 | l4[3])) << 8;
+	return fmix32(h ^ proto);
+}
+
+static void
+dissector_push_flows(struct dissector *d, uint64_t timestamp)
+{
+	struct flows_rec fr;
+
+	fr.flows = d->p->ops->rotate(timestamp);
+	fr.timestamp = timestamp;
+	queue_put(&d->out, REC_FLOWS, &fr, sizeof(fr));
+}
+
+static void *
+dissector_run(void *arg)
+{
+	struct dissector *d = arg;
+	const struct pipeline_ops *ops = d->p->ops;
+	struct pcap_pkthdr h;
+	struct rec *r;
+	uint64_t timestamp;
+
+	current = d;
+	ops->dissector_start();
+
+	for (;;) {
+		r = queue_wait(&d->in);
+		switch (r->type) {
+		case REC_PACKET:
+			/* the packet is used in place */
+			memcpy(&h, r + 1, sizeof(h));
+			ops->dissect(&h, (const u_char *)(r + 1) + sizeof(h));
+			break;
+
+		case REC_TICK:
+			memcpy(&timestamp, r + 1, sizeof(timestamp));
+			dissector_push_flows(d, timestamp);
+			break;
+
+		case REC_END:
+			memcpy(&timestamp, r + 1, sizeof(timestamp));
+			dissector_push_flows(d, timestamp);
+			queue_reserve(&d->out, 0);
+			queue_commit(&d->out, REC_END, 0);
+			queue_release(&d->in, r);
+			ops->dissector_finish();
+			return NULL;
+		}
+		queue_release(&d->in, r);
+	}
+}
+
+void
+pipeline_output(struct extsrc_msg *msg)
+{
+	queue_put(&current->out, REC_MSG, msg->data, msg->length);
+}
+
+/*
+ * Adds the flows of one dissector to the combined flows
+ */
+static void
+merge_flows(flow_list_t *dst, flow_list_t *src)
+{
+	tree_entry_t *cur;
+	pkt_info_t pkt_info;
+	flow_data_t *flow_data;
+
+	for (cur = tree_first(src->flows); cur != NULL; cur = tree_next(cur)) {
+		memcpy(&pkt_info, cur->key, 38);
+		flow_data = (flow_data_t *)cur->data;
+		pkt_info.payload_size = flow_data->payload_size;
+		pkt_info.packet_count = flow_data->packet_count;
+		flow_list_add_pktinfo(dst, &pkt_info);
+	}
+}
+
+/*
+ * Handles the records of a dissector, up to its next flow list. Returns the
+ * number of records handled.
+ */
+static int
+merger_drain(struct pipeline *p, struct dissector *d)
+{
+	struct extsrc_msg msg;
+	struct flows_rec fr;
+	struct rec *r;
+	int n = 0;
+
+	while (!d->held && !d->ended && (r = queue_peek(&d->out)) != NULL) {
+		switch (r->type) {
+		case REC_MSG:
+			msg.data = (char *)(r + 1);
+			msg.length = r->len;
+			p->ops->output(&msg);
+			break;
+
+		case REC_FLOWS:
+			memcpy(&fr, r + 1, sizeof(fr));
+			d->held = fr.flows;
+			d->held_ts = fr.timestamp;
+			break;
+
+		case REC_END:
+			d->ended = 1;
+			break;
+		}
+		queue_release(&d->out, r);
+		n++;
+	}
+	return n;
+}
+
+static void *
+merger_run(void *arg)
+{
+	struct pipeline *p = arg;
+	struct dissector *d;
+	unsigned int wait = 0;
+	int complete, ended, n, i;
+	uint64_t timestamp = 0;
+
+	p->ops->merger_start();
+
+	for (;;) {
+		n = 0;
+		for (i = 0; i < p->ndissectors; i++)
+			n += merger_drain(p, &p->dissectors[i]);
+
+		/*
+		 * All dissectors hand over their flows at the same point of
+		 * the capture; send them once all of them have done so
+		 */
+		complete = 1;
+		ended = 1;
+		for (i = 0; i < p->ndissectors; i++) {
+			d = &p->dissectors[i];
+			if (d->ended)
+				continue;
+			ended = 0;
+			if (!d->held)
+				complete = 0;
+		}
+		if (ended)
+			break;
+		if (complete) {
+			for (i = 0; i < p->ndissectors; i++) {
+				d = &p->dissectors[i];
+				if (!d->held)
+					continue;
+				merge_flows(p->merged, d->held);
+				timestamp = d->held_ts;
+				flow_list_destroy(d->held);
+				d->held = NULL;
+			}
+			if (!flow_list_empty(p->merged))
+				p->ops->send_flows(p->merged, timestamp);
+			n++;
+		}
+
+		if (n > 0) {
+			wait = 0;
+		} else {
+			/* idle: do not hold back what has been collected */
+			if (wait == 0)
+				p->ops->flush();
+			backoff(&wait);
+		}
+	}
+
+	p->ops->merger_finish();
+	return NULL;
+}
+
+struct pipeline *
+pipeline_create(int ndissectors, const struct pipeline_ops *ops)
+{
+	struct pipeline *p;
+	struct dissector *d;
+	int error;
+	int i;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		err(1, "calloc");
+	p->ops = ops;
+	p->ndissectors = ndissectors;
+	p->merged = flow_list_create(0);
+	if ((p->dissectors = calloc(ndissectors, sizeof(*d))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < ndissectors; i++) {
+		d = &p->dissectors[i];
+		d->p = p;
+		queue_init(&d->in, PIPELINE_IN_SIZE);
+		queue_init(&d->out, PIPELINE_OUT_SIZE);
+		error = pthread_create(&d->thread, NULL, dissector_run, d);
+		if (error) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+	error = pthread_create(&p->merger, NULL, merger_run, p);
+	if (error) {
+		errno = error;
+		err(1, "pthread_create");
+	}
+
+	return p;
+}
+
+void
+pipeline_packet(struct pipeline *p, const struct pcap_pkthdr *h,
+    const u_char *data)
+{
+	struct pcap_pkthdr hdr = *h;
+	struct dissector *d;
+	uint64_t timestamp;
+	u_char *buf;
+	int i;
+
+	timestamp = (uint64_t)h->ts.tv_sec * 1000000 + h->ts.tv_usec;
+
+	/* the flows are collected per second of capture time */
+	if (p->last_sec != 0 && (uint32_t)h->ts.tv_sec > p->last_sec) {
+		for (i = 0; i < p->ndissectors; i++)
+			queue_put(&p->dissectors[i].in, REC_TICK, &timestamp,
+			    sizeof(timestamp));
+	}
+	if ((uint32_t)h->ts.tv_sec > p->last_sec)
+		p->last_sec = h->ts.tv_sec;
+	p->last_ts = timestamp;
+
+	if (hdr.caplen > PIPELINE_MAX_CAPLEN)
+		hdr.caplen = PIPELINE_MAX_CAPLEN;
+
+	d = &p->dissectors[flow_hash(data, hdr.caplen) % p->ndissectors];
+	buf = queue_reserve(&d->in, sizeof(hdr) + hdr.caplen);
+	memcpy(buf, &hdr, sizeof(hdr));
+	memcpy(buf + sizeof(hdr), data, hdr.caplen);
+	queue_commit(&d->in, REC_PACKET, sizeof(hdr) + hdr.caplen);
+}
+
+void
+pipeline_destroy(struct pipeline *p)
+{
+	struct dissector *d;
+	int i;
+
+	for (i = 0; i < p->ndissectors; i++)
+		queue_put(&p->dissectors[i].in, REC_END, &p->last_ts,
+		    sizeof(p->last_ts));
+	for (i = 0; i < p->ndissectors; i++)
+		pthread_join(p->dissectors[i].thread, NULL);
+	pthread_join(p->merger, NULL);
+
+	for (i = 0; i < p->ndissectors; i++) {
+		d = &p->dissectors[i];
+		free(d->in.buf);
+		free(d->out.buf);
+	}
+	flow_list_destroy(p->merged);
+	free(p->dissectors);
+	free(p);
+}
@@ -0,0 +1,66 @@
+#include <stdint.h>
+
+#include <pcap.h>
+
+#include "node_cache.h"
+
+/*
+ * Multi-threaded dissection: the thread that reads the packets hands them
+ * to a number of dissector threads, and a merger thread collects their
+ * results and talks to spind.
+ *
+ * Packets are divided over the dissectors by a hash of their addresses,
+ * protocol and ports that is the same for both directions, so all packets
+ * of a flow (and all fragments of a datagram) are handled by the same
+ * dissector. Every dissector keeps the flows of the current second of
+ * capture time in a private flow list. When a packet of the next second is
+ * read, all dissectors hand their flow list to the merger, which combines
+ * them and sends them as one batch. Other messages (DNS, ARP) are passed on
+ * to the merger as they are created.
+ */
+
+struct extsrc_msg;
+struct pipeline;
+
+/* maximum number of dissector threads */
+#define PIPELINE_MAX_DISSECTORS	16
+
+struct pipeline_ops {
+	/* called in every dissector thread */
+	void		 (*dissector_start)(void);
+	void		 (*dissect)(const struct pcap_pkthdr *, const u_char *);
+	/* returns the flows so far, and starts a new flow list at timestamp */
+	flow_list_t	*(*rotate)(uint64_t timestamp);
+	void		 (*dissector_finish)(void);
+
+	/* called in the merger thread */
+	void		 (*merger_start)(void);
+	void		 (*output)(struct extsrc_msg *);
+	void		 (*send_flows)(flow_list_t *, uint64_t timestamp);
+	void		 (*flush)(void);
+	void		 (*merger_finish)(void);
+};
+
+/*
+ * Starts the dissector and merger threads. Exits on errors.
+ */
+struct pipeline *pipeline_create(int ndissectors,
+    const struct pipeline_ops *ops);
+
+/*
+ * Hands a packet to its dissector; called by the reading thread. Waits
+ * while the queue of the dissector is full.
+ */
+void pipeline_packet(struct pipeline *p, const struct pcap_pkthdr *h,
+    const u_char *data);
+
+/*
+ * Passes a message to the merger; called by a dissector thread.
+ */
+void pipeline_output(struct extsrc_msg *msg);
+
+/*
+ * Lets the dissectors finish the packets that have been queued, waits for
+ * all threads to finish, and frees the pipeline.
+ */
+void pipeline_destroy(struct pipeline *p);
@@ -0,0 +1,441 @@
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#define __FAVOR_BSD /* Who doesn't? */
+#include <netinet/tcp.h>
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reasm.h"
+
+#define REASM_TIMEOUT_USEC	((uint64_t)REASM_TIMEOUT * 1000000)
+
+/* fragment offsets are in units of 8 bytes */
+#define FRAG_UNITS		(65536 / 8)
+
+/* a DNS message with its length prefix */
+#define DNS_TCP_MAX		(2 + 65535)
+
+struct frag_dgram {
+	int used;
+	struct in_addr src, dst;
+	uint16_t id;
+	uint8_t proto;
+	uint64_t first_seen;
+
+	u_char hdr[60];		/* header of the first fragment */
+	u_int hlen;		/* 0 until the first fragment is seen */
+	u_char *data;
+	u_int size;		/* allocated */
+	u_int total;		/* payload length, 0 until the last fragment */
+	u_int nfrags;
+	uint8_t have[FRAG_UNITS / 8];
+};
+
+struct tcp_stream {
+	int used;
+	uint8_t family;
+	uint8_t src_addr[16], dest_addr[16];
+	uint16_t src_port, dest_port;
+	uint64_t last_seen;
+
+	int synced;		/* next_seq is known */
+	int broken;		/* data is missing; ignore the rest */
+	uint32_t next_seq;
+	u_char *buf;
+	u_int len;
+	u_int size;		/* allocated */
+};
+
+struct reasm {
+	struct frag_dgram dgrams[REASM_MAX_DATAGRAMS];
+	size_t frag_bytes;
+	u_char *out;		/* the last reassembled datagram */
+
+	struct tcp_stream streams[REASM_MAX_STREAMS];
+	size_t tcp_bytes;
+
+	uint64_t last_expire;
+	struct reasm_stats stats;
+};
+
+struct reasm *
+reasm_create(void)
+{
+	struct reasm *r;
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		err(1, "calloc");
+	if ((r->out = malloc(60 + 65535)) == NULL)
+		err(1, "malloc");
+	return r;
+}
+
+static void
+dgram_free(struct reasm *r, struct frag_dgram *d)
+{
+	r->frag_bytes -= d->size;
+	free(d->data);
+	memset(d, 0, sizeof(*d));
+}
+
+static void
+stream_free(struct reasm *r, struct tcp_stream *s)
+{
+	r->tcp_bytes -= s->size;
+	free(s->buf);
+	memset(s, 0, sizeof(*s));
+}
+
+void
+reasm_destroy(struct reasm *r)
+{
+	int i;
+
+	for (i = 0; i < REASM_MAX_DATAGRAMS; i++)
+		dgram_free(r, &r->dgrams[i]);
+	for (i = 0; i < REASM_MAX_STREAMS; i++)
+		stream_free(r, &r->streams[i]);
+	free(r->out);
+	free(r);
+}
+
+const struct reasm_stats *
+reasm_stats(struct reasm *r)
+{
+	return &r->stats;
+}
+
+/*
+ * Evicts what has timed out; at most once per second
+ */
+static void
+reasm_expire(struct reasm *r, uint64_t now)
+{
+	int i;
+
+	if (now < r->last_expire + 1000000)
+		return;
+	r->last_expire = now;
+
+	for (i = 0; i < REASM_MAX_DATAGRAMS; i++) {
+		if (r->dgrams[i].used &&
+		    now > r->dgrams[i].first_seen + REASM_TIMEOUT_USEC) {
+			dgram_free(r, &r->dgrams[i]);
+			r->stats.datagrams_evicted++;
+		}
+	}
+	for (i = 0; i < REASM_MAX_STREAMS; i++) {
+		if (r->streams[i].used &&
+		    now > r->streams[i].last_seen + REASM_TIMEOUT_USEC) {
+			stream_free(r, &r->streams[i]);
+			r->stats.streams_evicted++;
+		}
+	}
+}
+
+/*
+ * Evicts the oldest datagram
+ */
+static void
+dgram_evict(struct reasm *r)
+{
+	struct frag_dgram *oldest = NULL;
+	int i;
+
+	for (i = 0; i < REASM_MAX_DATAGRAMS; i++) {
+		if (r->dgrams[i].used && (!oldest ||
+		    r->dgrams[i].first_seen < oldest->first_seen))
+			oldest = &r->dgrams[i];
+	}
+	if (oldest) {
+		dgram_free(r, oldest);
+		r->stats.datagrams_evicted++;
+	}
+}
+
+static struct frag_dgram *
+dgram_lookup(struct reasm *r, const struct ip *ip, uint64_t now)
+{
+	struct frag_dgram *d, *free_slot = NULL;
+	int i;
+
+	for (i = 0; i < REASM_MAX_DATAGRAMS; i++) {
+		d = &r->dgrams[i];
+		if (!d->used) {
+			if (!free_slot)
+				free_slot = d;
+			continue;
+		}
+		if (d->id == ip->ip_id && d->proto == ip->ip_p &&
+		    d->src.s_addr == ip->ip_src.s_addr &&
+		    d->dst.s_addr == ip->ip_dst.s_addr)
+			return d;
+	}
+
+	if (!free_slot) {
+		dgram_evict(r);
+		return dgram_lookup(r, ip, now);
+	}
+	d = free_slot;
+	d->used = 1;
+	d->src = ip->ip_src;
+	d->dst = ip->ip_dst;
+	d->id = ip->ip_id;
+	d->proto = ip->ip_p;
+	d->first_seen = now;
+	return d;
+}
+
+/*
+ * Returns 1 if all of the first n units have been seen
+ */
+static int
+dgram_complete(struct frag_dgram *d, u_int n)
+{
+	u_int i;
+
+	for (i = 0; i < n / 8; i++) {
+		if (d->have[i] != 0xff)
+			return 0;
+	}
+	for (i = n & ~7U; i < n; i++) {
+		if (!(d->have[i / 8] & (1 << (i % 8))))
+			return 0;
+	}
+	return 1;
+}
+
+const u_char *
+reasm_ipv4(struct reasm *r, const u_char *p, u_int hlen, u_int len,
+    uint64_t now, u_int *lenp, u_int *nfragsp)
+{
+	const struct ip *ip = (const struct ip *)p;
+	struct frag_dgram *d;
+	struct ip *out;
+	uint64_t first_seen;
+	u_int off, end, u, size;
+
+	reasm_expire(r, now);
+
+	off = (ntohs(ip->ip_off) & IP_OFFMASK) * 8;
+	end = off + len;
+	if (end > 65535 - hlen || hlen > sizeof(d->hdr))
+		return NULL;
+	/* all but the last fragment are a multiple of 8 bytes */
+	if ((ntohs(ip->ip_off) & IP_MF) && len % 8 != 0)
+		return NULL;
+
+	d = dgram_lookup(r, ip, now);
+
+	if (end > d->size) {
+		/* grow in steps, but never past the largest datagram */
+		size = end < 2048 ? 2048 : end + end / 2;
+		if (size > 65535)
+			size = 65535;
+		/* make room, but not by evicting this one */
+		first_seen = d->first_seen;
+		d->first_seen = UINT64_MAX;
+		while (r->frag_bytes + size - d->size > REASM_MAX_FRAG_BYTES)
+			dgram_evict(r);
+		d->first_seen = first_seen;
+		if ((d->data = realloc(d->data, size)) == NULL)
+			err(1, "realloc");
+		r->frag_bytes += size - d->size;
+		d->size = size;
+	}
+
+	/* overlapping fragments: the last one wins */
+	memcpy(d->data + off, p + hlen, len);
+	for (u = off / 8; u < (end + 7) / 8; u++)
+		d->have[u / 8] |= 1 << (u % 8);
+	d->nfrags++;
+	if (off == 0) {
+		memcpy(d->hdr, p, hlen);
+		d->hlen = hlen;
+	}
+	if (!(ntohs(ip->ip_off) & IP_MF))
+		d->total = end;
+
+	if (d->total == 0 || d->hlen == 0 ||
+	    !dgram_complete(d, (d->total + 7) / 8))
+		return NULL;
+
+	memcpy(r->out, d->hdr, d->hlen);
+	memcpy(r->out + d->hlen, d->data, d->total);
+	out = (struct ip *)r->out;
+	out->ip_len = htons(d->hlen + d->total);
+	out->ip_off = 0;
+	*lenp = d->hlen + d->total;
+	*nfragsp = d->nfrags;
+
+	dgram_free(r, d);
+	r->stats.datagrams++;
+	return r->out;
+}
+
+/*
+ * Evicts the stream that has been quiet for the longest time
+ */
+static void
+stream_evict(struct reasm *r)
+{
+	struct tcp_stream *oldest = NULL;
+	int i;
+
+	for (i = 0; i < REASM_MAX_STREAMS; i++) {
+		if (r->streams[i].used && (!oldest ||
+		    r->streams[i].last_seen < oldest->last_seen))
+			oldest = &r->streams[i];
+	}
+	if (oldest) {
+		stream_free(r, oldest);
+		r->stats.streams_evicted++;
+	}
+}
+
+static struct tcp_stream *
+stream_lookup(struct reasm *r, const pkt_info_t *pkt_info, int create)
+{
+	struct tcp_stream *s, *free_slot = NULL;
+	int i;
+
+	for (i = 0; i < REASM_MAX_STREAMS; i++) {
+		s = &r->streams[i];
+		if (!s->used) {
+			if (!free_slot)
+				free_slot = s;
+			continue;
+		}
+		if (s->family == pkt_info->family &&
+		    s->src_port == pkt_info->src_port &&
+		    s->dest_port == pkt_info->dest_port &&
+		    memcmp(s->src_addr, pkt_info->src_addr, 16) == 0 &&
+		    memcmp(s->dest_addr, pkt_info->dest_addr, 16) == 0)
+			return s;
+	}
+	if (!create)
+		return NULL;
+
+	if (!free_slot) {
+		stream_evict(r);
+		return stream_lookup(r, pkt_info, create);
+	}
+	s = free_slot;
+	s->used = 1;
+	s->family = pkt_info->family;
+	memcpy(s->src_addr, pkt_info->src_addr, 16);
+	memcpy(s->dest_addr, pkt_info->dest_addr, 16);
+	s->src_port = pkt_info->src_port;
+	s->dest_port = pkt_info->dest_port;
+	return s;
+}
+
+/*
+ * Appends data to the buffer of a stream; returns -1 if there is no room
+ */
+static int
+stream_append(struct reasm *r, struct tcp_stream *s, const u_char *data,
+    u_int len)
+{
+	uint64_t last_seen;
+	u_int size;
+
+	if (s->len + len > DNS_TCP_MAX)
+		return -1;
+	if (s->len + len > s->size) {
+		size = s->len + len < 512 ? 512 : 2 * (s->len + len);
+		if (size > DNS_TCP_MAX)
+			size = DNS_TCP_MAX;
+		/* make room, but not by evicting this one */
+		last_seen = s->last_seen;
+		s->last_seen = UINT64_MAX;
+		while (r->tcp_bytes + size - s->size > REASM_MAX_TCP_BYTES)
+			stream_evict(r);
+		s->last_seen = last_seen;
+		if ((s->buf = realloc(s->buf, size)) == NULL)
+			err(1, "realloc");
+		r->tcp_bytes += size - s->size;
+		s->size = size;
+	}
+	memcpy(s->buf + s->len, data, len);
+	s->len += len;
+	return 0;
+}
+
+void
+reasm_tcp(struct reasm *r, const pkt_info_t *pkt_info, uint32_t seq,
+    uint8_t flags, const u_char *data, u_int len, uint64_t now,
+    reasm_msg_cb cb, void *arg)
+{
+	struct tcp_stream *s;
+	int32_t diff;
+	u_int n, msglen;
+
+	reasm_expire(r, now);
+
+	s = stream_lookup(r, pkt_info, (flags & TH_SYN) || len > 0);
+	if (!s)
+		return;
+	s->last_seen = now;
+
+	if (flags & TH_SYN) {
+		/* a new connection with the same addresses and ports */
+		s->synced = 1;
+		s->broken = 0;
+		s->len = 0;
+		s->next_seq = seq + 1;
+		return;
+	}
+	if (!s->synced) {
+		/* the start was not captured; hope for a message boundary */
+		s->synced = 1;
+		s->next_seq = seq;
+	}
+
+	if (!s->broken && len > 0) {
+		diff = (int32_t)(seq - s->next_seq);
+		if (diff > 0) {
+			/* a segment was lost */
+			s->broken = 1;
+			s->len = 0;
+			r->stats.streams_broken++;
+		} else if ((u_int)-diff < len) {
+			/* skip what has been seen already */
+			data += -diff;
+			len -= -diff;
+			if (stream_append(r, s, data, len) == -1) {
+				s->broken = 1;
+				s->len = 0;
+				r->stats.streams_broken++;
+			} else {
+				s->next_seq += len;
+			}
+		}
+	}
+
+	/* hand over the complete messages */
+	n = 0;
+	while (!s->broken && s->len - n >= 2) {
+		msglen = s->buf[n] << 8 | s->buf[n + 1];
+		if (s->len - n - 2 < msglen)
+			break;
+		cb(s->buf + n + 2, msglen, arg);
+		r->stats.messages++;
+		n += 2 + msglen;
+	}
+	if (n > 0) {
+		memmove(s->buf, s->buf + n, s->len - n);
+		s->len -= n;
+	}
+
+	if (flags & (TH_FIN | TH_RST))
+		stream_free(r, s);
+}
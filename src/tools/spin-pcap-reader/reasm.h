@@ -0,0 +1,63 @@
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include "pkt_info.h"
+
+/*
+ * Reassembly of IPv4 fragments, and of DNS messages in TCP streams, so that
+ * large DNS answers and DNS over TCP can be parsed.
+ *
+ * The memory that is used is bounded: there is a maximum number of
+ * datagrams and streams that are followed, and of the bytes that are held
+ * for them. When a limit is reached, the oldest datagram or stream is
+ * evicted; so is anything that has not seen a packet for REASM_TIMEOUT
+ * seconds (of capture time).
+ *
+ * A reassembler is not thread-safe; every thread should have its own.
+ */
+
+#define REASM_TIMEOUT		30
+
+#define REASM_MAX_DATAGRAMS	64
+#define REASM_MAX_FRAG_BYTES	(1024 * 1024)
+
+#define REASM_MAX_STREAMS	64
+#define REASM_MAX_TCP_BYTES	(1024 * 1024)
+
+struct reasm;
+
+struct reasm_stats {
+	unsigned long datagrams;	/* reassembled */
+	unsigned long datagrams_evicted;
+	unsigned long messages;		/* DNS messages from TCP streams */
+	unsigned long streams_evicted;
+	unsigned long streams_broken;	/* segments were missing */
+};
+
+typedef void (*reasm_msg_cb)(const u_char *msg, u_int len, void *arg);
+
+struct reasm *reasm_create(void);
+void reasm_destroy(struct reasm *r);
+
+/*
+ * Adds an IPv4 fragment: its header of hlen bytes, followed by len bytes
+ * of payload. Once all fragments of the datagram have been seen, returns the
+ * datagram (with the header of the first fragment, in which the length and
+ * fragment offset are updated), and sets *lenp to its length and *nfragsp
+ * to the number of fragments; the datagram stays valid until the next call.
+ * Returns NULL otherwise.
+ */
+const u_char *reasm_ipv4(struct reasm *r, const u_char *ip, u_int hlen,
+    u_int len, uint64_t now, u_int *lenp, u_int *nfragsp);
+
+/*
+ * Adds a TCP segment of a DNS connection, in the direction given by
+ * pkt_info (family, addresses and ports). Calls cb for every DNS message
+ * (without its length prefix) that is complete.
+ */
+void reasm_tcp(struct reasm *r, const pkt_info_t *pkt_info, uint32_t seq,
+    uint8_t flags, const u_char *data, u_int len, uint64_t now,
+    reasm_msg_cb cb, void *arg);
+
+const struct reasm_stats *reasm_stats(struct reasm *r);
@@ -21,8 +21,11 @@ monotime(struct timeval *tv)
 	TIMESPEC_TO_TIMEVAL(tv, &ts);
 }
 
+/*
+ * Sleeps so that packets are replayed at the recorded speed, times speed
+ */
 void
-maybe_sleep(const struct timeval *cur_pcap)
+maybe_sleep(const struct timeval *cur_pcap, double speed)
 {
 	static struct timeval last_pcap = { 0, 0 };
 	static struct timeval last_wall = { 0, 0 };
@@ -30,6 +33,7 @@ maybe_sleep(const struct timeval *cur_pcap)
 	struct timeval diff_pcap;
 	struct timeval diff_wall;
 	struct timeval to_sleep;
+	double usec;
 
 	monotime(&cur_wall);
 
@@ -37,6 +41,13 @@ maybe_sleep(const struct timeval *cur_pcap)
 		timersub(cur_pcap, &last_pcap, &diff_pcap);
 		timersub(&cur_wall, &last_wall, &diff_wall);
 
+		if (speed != 1.0 && diff_pcap.tv_sec >= 0) {
+			usec = (diff_pcap.tv_sec * 1000000.0 +
+			    diff_pcap.tv_usec) / speed;
+			diff_pcap.tv_sec = usec / 1000000;
+			diff_pcap.tv_usec = usec - diff_pcap.tv_sec * 1000000.0;
+		}
+
 		if (timercmp(&diff_wall, &diff_pcap, <)) {
 			timersub(&diff_pcap, &diff_wall, &to_sleep);
 
@@ -1 +1 @@
-void maybe_sleep(const struct timeval *);
+void maybe_sleep(const struct timeval *, double);
@@ -1,13 +1,20 @@
+#include "config.h"
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include <err.h>
+#include <errno.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "extsrc.h"
+#include "extsrc_ring.h"
 #include "socket.h"
 
 /*
@@ -99,27 +106,206 @@ socket_open(const char *path, const char *host)
 	return socket_open_unix(path == NULL ? EXTSRC_SOCKET_PATH : path);
 }
 
-void
-socket_writemsg(int fd, char *msg, size_t msg_len)
+/*
+ * Messages are not sent right away, but collected in a batch that is sent
+ * when it is full, or when socket_flush() is called.
+ *
+ * All state is per thread: every reader thread has its own connection to
+ * spind (and ring).
+ */
+static __thread struct extsrc_batch batch;
+static __thread int batch_initialized = 0;
+
+#ifdef HAVE_SYS_EVENTFD_H
+/*
+ * If set, messages are put in this shared memory ring instead; only messages
+ * that do not fit in a slot still go through the socket.
+ */
+static __thread struct extsrc_ring *ring = NULL;
+
+/*
+ * How long to wait for spind when the ring is full, in steps of
+ * RING_FULL_SLEEP microseconds, before dropping the message
+ */
+#define RING_FULL_SLEEP 100
+#define RING_FULL_TRIES 10000
+
+/*
+ * Returns 0 if the message was handled (put in the ring or dropped), -1 if
+ * it should be sent through the socket
+ */
+static int
+ring_writemsg(struct extsrc_msg *msg)
+{
+	static __thread unsigned long fail = 0;
+	static __thread int stalled = 0;
+	int i;
+
+	/* once spind did not keep up, do not wait for every message */
+	for (i = 0; i < (stalled ? 1 : RING_FULL_TRIES); i++) {
+		if (extsrc_ring_put(ring, msg) == 0) {
+			stalled = 0;
+			return 0;
+		}
+		if (errno == EMSGSIZE)
+			return -1;
+		/* full; make sure spind is working on it */
+		if (i == 0)
+			extsrc_ring_wakeup(ring);
+		usleep(RING_FULL_SLEEP);
+	}
+
+	stalled = 1;
+	__atomic_store_n(&ring->hdr->dropped, ++fail, __ATOMIC_RELAXED);
+	warnx("shared memory ring full; %lu messages dropped", fail);
+	return 0;
+}
+#endif
+
+int
+socket_open_ring(int fd)
 {
-	static unsigned long ok = 0;
-	static unsigned long fail = 0;
-
-	if (send(fd, msg, msg_len, 0) == -1) {
-		if (errno == ENOBUFS) {
-			/*
-			 * XXX perhaps distinguish between the case where we
-			 * read a PCAP and the case where we're listening to an
-			 * interface? In the former case we could perhaps wait,
-			 * e.g. using poll().
-			 */
-			++fail;
-			warnx("send returned ENOBUFS; %lu/%lu fail/ok", fail,
-			    ok);
-		} else {
+#ifdef HAVE_SYS_EVENTFD_H
+	struct extsrc_ring_setup setup;
+	char data[EXTSRC_MSG_HDR_SIZE + sizeof(setup)];
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	int fds[2];
+
+	ring = extsrc_ring_create(EXTSRC_RING_SLOTS);
+	if (ring == NULL) {
+		warn("extsrc_ring_create");
+		return -1;
+	}
+
+	setup.version = EXTSRC_RING_VERSION;
+	setup.size = ring->size;
+	extsrc_hdr_write(data, EXTSRC_MSG_TYPE_RING, sizeof(setup));
+	memcpy(data + EXTSRC_MSG_HDR_SIZE, &setup, sizeof(setup));
+
+	/* Pass the memory fd and the eventfd to spind */
+	memset(&mh, 0, sizeof(mh));
+	memset(&control, 0, sizeof(control));
+	iov.iov_base = data;
+	iov.iov_len = sizeof(data);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control.buf;
+	mh.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	fds[0] = ring->mem_fd;
+	fds[1] = ring->event_fd;
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(fd, &mh, 0) == -1) {
+		warn("sendmsg");
+		extsrc_ring_destroy(ring, 1);
+		ring = NULL;
+		return -1;
+	}
+	return 0;
+#else
+	errno = ENOTSUP;
+	warn("shared memory ring");
+	return -1;
+#endif
+}
+
+static void
+socket_send(int fd, char *msg, size_t msg_len)
+{
+	static __thread unsigned long ok = 0;
+	static __thread unsigned long fail = 0;
+	ssize_t n;
+
+	while (msg_len > 0) {
+		n = send(fd, msg, msg_len, 0);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				/*
+				 * XXX perhaps distinguish between the case
+				 * where we read a PCAP and the case where
+				 * we're listening to an interface? In the
+				 * former case we could perhaps wait, e.g.
+				 * using poll().
+				 */
+				++fail;
+				warnx("send returned ENOBUFS; %lu/%lu fail/ok",
+				    fail, ok);
+				return;
+			}
 			err(1, "send");
 		}
+		/* stream sockets may accept only part of the data */
+		msg += n;
+		msg_len -= n;
+	}
+	++ok;
+}
+
+void
+socket_flush(int fd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	if (ring)
+		extsrc_ring_wakeup(ring);
+#endif
+
+	if (!batch_initialized || batch.count == 0)
+		return;
+
+	if (batch.count == 1) {
+		/* no need to wrap a single message */
+		socket_send(fd, batch.data + EXTSRC_MSG_HDR_SIZE,
+		    batch.length - EXTSRC_MSG_HDR_SIZE);
 	} else {
-		++ok;
+		socket_send(fd, batch.data, batch.length);
 	}
+	extsrc_batch_init(&batch);
+}
+
+void
+socket_writemsg(int fd, struct extsrc_msg *msg)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	if (ring && ring_writemsg(msg) == 0)
+		return;
+#endif
+
+	if (!batch_initialized) {
+		extsrc_batch_init(&batch);
+		batch_initialized = 1;
+	}
+
+	if (extsrc_batch_add(&batch, msg) == 0)
+		return;
+
+	socket_flush(fd);
+	if (extsrc_batch_add(&batch, msg) != 0) {
+		/* does not fit in an empty batch either */
+		socket_send(fd, msg->data, msg->length);
+	}
+}
+
+void
+socket_close(int fd)
+{
+	socket_flush(fd);
+#ifdef HAVE_SYS_EVENTFD_H
+	if (ring) {
+		extsrc_ring_destroy(ring, 1);
+		ring = NULL;
+	}
+#endif
+	close(fd);
 }
@@ -1,5 +1,10 @@
 #include <stdint.h>
 
+struct extsrc_msg;
+
 int socket_open(const char *, const char *);
-void socket_writemsg(int, char *, size_t);
+int socket_open_ring(int);
+void socket_writemsg(int, struct extsrc_msg *);
+void socket_flush(int);
+void socket_close(int);
 
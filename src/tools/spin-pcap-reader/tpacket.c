@@ -0,0 +1,213 @@
+#include "config.h"
+
+#ifdef HAVE_LINUX_IF_PACKET_H
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+
+#include <err.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tpacket.h"
+
+/*
+ * The frame size is not used with TPACKET_V3 (packets are packed into the
+ * blocks), but the kernel still checks it
+ */
+#define TPACKET_FRAME_SIZE	2048
+
+/*
+ * Hand a block to userland after this many milliseconds, even if it is not
+ * full, so that nothing is held back for long when it is quiet
+ */
+#define TPACKET_BLOCK_TIMEOUT	100
+
+struct tpacket {
+	int fd;
+	uint8_t *map;
+	size_t map_size;
+	unsigned int block_size;
+	unsigned int block_count;
+	unsigned int cur;	/* block to be processed next */
+};
+
+struct tpacket *
+tpacket_open(const char *device, struct bpf_program *fp, size_t ring_size,
+    int fanout)
+{
+	struct tpacket *tp;
+	struct tpacket_req3 req;
+	struct sock_fprog prog;
+	struct sockaddr_ll sll;
+	struct packet_mreq mreq;
+	struct ifreq ifr;
+	unsigned int ifindex;
+	int version = TPACKET_V3;
+	int arg;
+
+	ifindex = if_nametoindex(device);
+	if (ifindex == 0)
+		err(1, "%s", device);
+
+	if ((tp = calloc(1, sizeof(*tp))) == NULL)
+		err(1, "calloc");
+
+	/* protocol 0: nothing is received until the socket is bound */
+	tp->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (tp->fd == -1)
+		err(1, "socket");
+
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", device);
+	if (ioctl(tp->fd, SIOCGIFHWADDR, &ifr) == -1)
+		err(1, "SIOCGIFHWADDR: %s", device);
+	if (ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER)
+		errx(1, "the device is not an Ethernet device");
+
+	/* struct bpf_insn and struct sock_filter are the same */
+	prog.len = fp->bf_len;
+	prog.filter = (struct sock_filter *)fp->bf_insns;
+	if (setsockopt(tp->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+	    sizeof(prog)) == -1)
+		err(1, "SO_ATTACH_FILTER");
+
+	if (setsockopt(tp->fd, SOL_PACKET, PACKET_VERSION, &version,
+	    sizeof(version)) == -1)
+		err(1, "PACKET_VERSION");
+
+	tp->block_size = TPACKET_BLOCK_SIZE;
+	tp->block_count = ring_size / TPACKET_BLOCK_SIZE;
+	if (tp->block_count == 0)
+		tp->block_count = 1;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = tp->block_size;
+	req.tp_block_nr = tp->block_count;
+	req.tp_frame_size = TPACKET_FRAME_SIZE;
+	req.tp_frame_nr = (tp->block_size / TPACKET_FRAME_SIZE) *
+	    tp->block_count;
+	req.tp_retire_blk_tov = TPACKET_BLOCK_TIMEOUT;
+	req.tp_feature_req_word = 0;
+	if (setsockopt(tp->fd, SOL_PACKET, PACKET_RX_RING, &req,
+	    sizeof(req)) == -1)
+		err(1, "PACKET_RX_RING");
+
+	tp->map_size = (size_t)tp->block_size * tp->block_count;
+	tp->map = mmap(NULL, tp->map_size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_LOCKED, tp->fd, 0);
+	if (tp->map == MAP_FAILED) {
+		/* MAP_LOCKED may fail because of RLIMIT_MEMLOCK */
+		tp->map = mmap(NULL, tp->map_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, tp->fd, 0);
+		if (tp->map == MAP_FAILED)
+			err(1, "mmap");
+	}
+
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(tp->fd, (struct sockaddr *)&sll, sizeof(sll)) == -1)
+		err(1, "bind: %s", device);
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.mr_ifindex = ifindex;
+	mreq.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(tp->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+	    sizeof(mreq)) == -1)
+		err(1, "PACKET_ADD_MEMBERSHIP");
+
+	if (fanout) {
+		/* fragments are reassembled first, so they hash alike */
+		arg = (fanout & 0xffff) |
+		    ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+		if (setsockopt(tp->fd, SOL_PACKET, PACKET_FANOUT, &arg,
+		    sizeof(arg)) == -1)
+			err(1, "PACKET_FANOUT");
+	}
+
+	return tp;
+}
+
+int
+tpacket_dispatch(struct tpacket *tp, int timeout, pcap_handler callback,
+    u_char *user)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *ph;
+	struct pcap_pkthdr h;
+	struct pollfd pfd;
+	unsigned int i, n;
+
+	bd = (struct tpacket_block_desc *)(tp->map +
+	    (size_t)tp->cur * tp->block_size);
+
+	if (!(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+	    TP_STATUS_USER)) {
+		pfd.fd = tp->fd;
+		pfd.events = POLLIN | POLLERR;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, timeout) == -1)
+			return errno == EINTR ? 0 : -1;
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+		    __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			return 0;
+	}
+
+	n = bd->hdr.bh1.num_pkts;
+	ph = (struct tpacket3_hdr *)((uint8_t *)bd +
+	    bd->hdr.bh1.offset_to_first_pkt);
+	for (i = 0; i < n; i++) {
+		h.ts.tv_sec = ph->tp_sec;
+		h.ts.tv_usec = ph->tp_nsec / 1000;
+		h.caplen = ph->tp_snaplen;
+		h.len = ph->tp_len;
+		callback(user, &h, (uint8_t *)ph + ph->tp_mac);
+		ph = (struct tpacket3_hdr *)((uint8_t *)ph +
+		    ph->tp_next_offset);
+	}
+
+	/* give the block back to the kernel */
+	__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+	    __ATOMIC_RELEASE);
+	tp->cur = (tp->cur + 1) % tp->block_count;
+
+	return n;
+}
+
+void
+tpacket_stats(struct tpacket *tp, unsigned int *packets, unsigned int *drops)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	/* the kernel resets the counters when they are read */
+	if (getsockopt(tp->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == -1)
+		err(1, "PACKET_STATISTICS");
+	*packets = st.tp_packets;
+	*drops = st.tp_drops;
+}
+
+void
+tpacket_close(struct tpacket *tp)
+{
+	munmap(tp->map, tp->map_size);
+	close(tp->fd);
+	free(tp);
+}
+
+#endif /* HAVE_LINUX_IF_PACKET_H */
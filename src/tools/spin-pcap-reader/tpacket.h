@@ -0,0 +1,46 @@
+#include <stddef.h>
+
+#include <pcap.h>
+
+/*
+ * Native Linux capture: an AF_PACKET socket with a TPACKET_V3 ring that is
+ * shared with the kernel. The kernel fills whole blocks of packets, which
+ * are handed to the pcap callback in one go, without any system call per
+ * packet. Only available if HAVE_LINUX_IF_PACKET_H is defined.
+ */
+
+struct tpacket;
+
+/* Default size of the ring, and the size of its blocks */
+#define TPACKET_RING_SIZE	(8 * 1024 * 1024)
+#define TPACKET_BLOCK_SIZE	(256 * 1024)
+
+/*
+ * Opens an Ethernet device in promiscuous mode, with a ring of ring_size
+ * bytes. The filter (compiled for DLT_EN10MB) runs in the kernel, and also
+ * cuts the packets to the snaplen it was compiled with.
+ *
+ * If fanout is not 0, the socket joins the PACKET_FANOUT group with that
+ * id. The packets are then divided over all sockets in the group by their
+ * flow hash, so all packets of a flow end up in the same socket.
+ *
+ * Exits on errors.
+ */
+struct tpacket *tpacket_open(const char *device, struct bpf_program *fp,
+    size_t ring_size, int fanout);
+
+/*
+ * Waits up to timeout milliseconds for a block of packets, and calls the
+ * callback for every packet in it, like pcap_dispatch() does.
+ * Returns the number of packets, or -1 on errors.
+ */
+int tpacket_dispatch(struct tpacket *tp, int timeout, pcap_handler callback,
+    u_char *user);
+
+/*
+ * Number of packets received and dropped since the previous call
+ */
+void tpacket_stats(struct tpacket *tp, unsigned int *packets,
+    unsigned int *drops);
+
+void tpacket_close(struct tpacket *tp);